@@ -0,0 +1,455 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/utsname.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "server/videox/helper.h"
+#include "server/videox/decoder.h"
+#include "server/videox/jpeg.h"
+#include "server/videox/tsf.hpp"
+#include "debug/capture.hpp"
+
+extern "C" {
+#include <libavutil/avutil.h>
+#include <libavutil/frame.h>
+#include <libswscale/swscale.h>
+}
+
+// Replays a capture through the parts of the video pipeline that dominate our CPU usage, and prints
+// numbers that can be compared across releases, and across machines (eg Raspberry Pi vs x86).
+//
+// To make a capture from an old raw/ directory of NALU dumps:
+//   bench convert raw dump/cam.cap
+//
+// Then:
+//   bench remux dump/cam.cap     Remux to fragmented MP4 in memory (MB/s of input)
+//   bench decode dump/cam.cap    Decode (frames/s)
+//   bench rgba dump/cam.cap      Cost of converting decoded frames to RGBA (ms/frame)
+//   bench jpeg dump/cam.cap      Latency of compressing a decoded frame to JPEG (ms/frame)
+//   bench all dump/cam.cap       All of the above
+//
+// The capture is memory mapped and touched once before timing starts, so disk speed doesn't affect the results.
+// Every mode does one warm-up pass, then Runs timed passes, and we report the median, with the min and the max.
+// Decoding is single threaded by default, so that results don't depend on the number of cores.
+//
+// use build_bench to compile this file
+
+using namespace tsf::literals;
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+	int  Runs        = 5;
+	int  MaxFrames   = 0; // 0 = all frames
+	int  Threads     = 1;
+	bool Hardware    = false;
+	int  JPEGQuality = 75;
+};
+
+// Timing samples of one mode, in whatever unit the mode reports
+struct Samples {
+	std::vector<double> Values;
+
+	double Median() const {
+		auto v = Values;
+		std::sort(v.begin(), v.end());
+		return v.empty() ? 0 : v[v.size() / 2];
+	}
+	double Min() const {
+		return Values.empty() ? 0 : *std::min_element(Values.begin(), Values.end());
+	}
+	double Max() const {
+		return Values.empty() ? 0 : *std::max_element(Values.begin(), Values.end());
+	}
+};
+
+static double SecondsSince(Clock::time_point start) {
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static std::string TakeErr(char* err) {
+	std::string s = err;
+	free(err);
+	return s;
+}
+
+static void PrintResult(const char* mode, const Samples& s, const char* unit, const std::string& extra) {
+	tsf::print("%-7s median %10.2f %-8s min %10.2f  max %10.2f  %v\n"_tsf, mode, s.Median(), unit, s.Min(), s.Max(), extra);
+}
+
+static void PrintMachine(const capture::Reader& cap, const Options& opt) {
+	struct utsname u;
+	uname(&u);
+	std::string cpu = "unknown";
+	FILE*       f   = fopen("/proc/cpuinfo", "r");
+	if (f) {
+		char line[512];
+		while (fgets(line, sizeof(line), f)) {
+			// "model name" on x86, "Model" on Raspberry Pi
+			if (strncmp(line, "model name", 10) == 0 || strncmp(line, "Model", 5) == 0) {
+				const char* colon = strchr(line, ':');
+				if (colon) {
+					cpu = colon + 2;
+					cpu.erase(cpu.find_last_not_of("\r\n") + 1);
+				}
+			}
+		}
+		fclose(f);
+	}
+	size_t frames = opt.MaxFrames != 0 ? std::min(cap.Frames.size(), (size_t) opt.MaxFrames) : cap.Frames.size();
+	tsf::print("machine: %v %v, %v, %v cores\n"_tsf, u.sysname, u.machine, cpu, std::thread::hardware_concurrency());
+	tsf::print("ffmpeg:  %v\n"_tsf, av_version_info());
+	tsf::print("capture: %v frames, %.1f MB, codec %v\n"_tsf, frames, cap.Bytes / 1e6, cap.Codec == VideoCodecH265 ? "H265" : "H264");
+	tsf::print("options: runs %v, threads %v, hardware %v\n\n"_tsf, opt.Runs, opt.Threads, opt.Hardware ? "yes" : "no");
+}
+
+static std::vector<capture::Frame> SelectFrames(const capture::Reader& cap, const Options& opt) {
+	auto frames = cap.Frames;
+	if (opt.MaxFrames != 0 && frames.size() > (size_t) opt.MaxFrames)
+		frames.resize(opt.MaxFrames);
+	return frames;
+}
+
+// Split annex-b access units into EncoderNALUs, which point into the capture.
+// firstNALU[i] is the index of the first NALU of frame i, and the final element is the total number of NALUs.
+static std::vector<EncoderNALU> SplitNALUs(const std::vector<capture::Frame>& frames, std::vector<size_t>& firstNALU, size_t& bytes) {
+	std::vector<EncoderNALU> nalus;
+	bytes        = 0;
+	int64_t base = frames.empty() ? 0 : frames[0].PTS;
+	firstNALU.clear();
+	for (const auto& f : frames) {
+		firstNALU.push_back(nalus.size());
+		const uint8_t* p     = f.Data;
+		const uint8_t* end   = f.Data + f.Size;
+		const uint8_t* start = nullptr;
+		for (; p + 3 <= end; p++) {
+			if (p[0] == 0 && p[1] == 0 && p[2] == 1) {
+				if (start)
+					nalus.push_back({start, (size_t) (p - start), 3, f.PTS - base, f.PTS - base});
+				start = p;
+				p += 2;
+			}
+		}
+		if (start)
+			nalus.push_back({start, (size_t) (end - start), 3, f.PTS - base, f.PTS - base});
+		bytes += f.Size;
+	}
+	firstNALU.push_back(nalus.size());
+	return nalus;
+}
+
+static std::string BenchRemux(const capture::Reader& cap, const Options& opt) {
+	size_t              bytes  = 0;
+	std::vector<size_t> firstNALU;
+	auto                frames = SelectFrames(cap, opt);
+	auto                nalus  = SplitNALUs(frames, firstNALU, bytes);
+	if (nalus.empty())
+		return "No NALUs in capture";
+
+	// Same batch size as RawBuffer.SaveToMP4Writer
+	const size_t batch    = 30;
+	Samples      mbps;
+	size_t       outBytes = 0;
+	for (int run = -1; run < opt.Runs; run++) {
+		auto  start = Clock::now();
+		char* err   = nullptr;
+		void* enc   = MakeMemoryEncoder(&err, "mp4", (int) cap.Codec);
+		if (err != nullptr)
+			return TakeErr(err);
+		outBytes = 0;
+		for (size_t i = 0; i < frames.size() && err == nullptr; i += batch) {
+			size_t first = firstNALU[i];
+			size_t last  = firstNALU[std::min(i + batch, frames.size())];
+			if (last != first)
+				Encoder_WritePackets(&err, enc, &nalus[first], last - first);
+			size_t size = 0;
+			Encoder_Output(enc, &size);
+			outBytes += size;
+			Encoder_ClearOutput(enc);
+		}
+		if (err == nullptr)
+			Encoder_WriteTrailer(&err, enc);
+		Encoder_Close(enc);
+		if (err != nullptr)
+			return TakeErr(err);
+		if (run >= 0)
+			mbps.Values.push_back(bytes / 1e6 / SecondsSince(start));
+	}
+	PrintResult("remux", mbps, "MB/s", tsf::fmt("(%v NALUs in, %.1f MB out)"_tsf, nalus.size(), outBytes / 1e6));
+	return "";
+}
+
+// Hooks for the modes that run on top of decoding. Called for every decoded frame, and returns the time spent in the hook.
+typedef double (*FrameHook)(AVFrame* frame, void* context);
+
+struct DecodeResult {
+	int         Frames    = 0;
+	double      Seconds   = 0;
+	double      HookTotal = 0; // Seconds spent inside the FrameHook
+	std::string Backend;
+};
+
+static std::string DecodeAll(const std::vector<capture::Frame>& frames, uint32_t codec, const Options& opt, FrameHook hook, void* hookContext, DecodeResult& result) {
+	DecoderOptions dopt = {};
+	dopt.Codec          = (int) codec;
+	dopt.AllowHardware  = opt.Hardware ? 1 : 0;
+	dopt.ThreadCount    = opt.Threads;
+
+	char* err     = nullptr;
+	void* decoder = MakeDecoder(&err, &dopt);
+	if (err != nullptr)
+		return TakeErr(err);
+	result         = DecodeResult();
+	result.Backend = Decoder_BackendName(decoder);
+
+	auto     start   = Clock::now();
+	AVFrame* frame   = nullptr;
+	auto     receive = [&]() {
+		while (Decoder_ReceiveFrame(decoder, &frame) == 0) {
+			result.Frames++;
+			if (hook)
+				result.HookTotal += hook(frame, hookContext);
+		}
+	};
+	for (const auto& f : frames) {
+		// If the decoder is full, then it has a frame for us, and the packet must be sent again
+		while (Decoder_SendPacket(decoder, f.Data, f.Size) == AVERROR(EAGAIN))
+			receive();
+		receive();
+	}
+	// Flush the frames that the decoder is holding back
+	Decoder_SendPacket(decoder, nullptr, 0);
+	receive();
+	result.Seconds = SecondsSince(start);
+	Decoder_Close(decoder);
+	if (result.Frames == 0)
+		return "Decoder produced no frames";
+	return "";
+}
+
+static std::string BenchDecode(const capture::Reader& cap, const Options& opt) {
+	auto         frames = SelectFrames(cap, opt);
+	Samples      fps;
+	DecodeResult r;
+	for (int run = -1; run < opt.Runs; run++) {
+		auto err = DecodeAll(frames, cap.Codec, opt, nullptr, nullptr, r);
+		if (err != "")
+			return err;
+		if (run >= 0)
+			fps.Values.push_back(r.Frames / r.Seconds);
+	}
+	PrintResult("decode", fps, "frames/s", tsf::fmt("(%v frames, %v backend)"_tsf, r.Frames, r.Backend));
+	return "";
+}
+
+// Same conversion as frameScaler in h264decoder.go
+struct RGBAContext {
+	SwsContext* Sws    = nullptr;
+	AVFrame*    RGBA   = nullptr;
+	int         SrcW   = 0;
+	int         SrcH   = 0;
+	int         SrcFmt = -1;
+
+	~RGBAContext() {
+		sws_freeContext(Sws);
+		av_frame_free(&RGBA);
+	}
+};
+
+static double RGBAHook(AVFrame* frame, void* context) {
+	auto c     = (RGBAContext*) context;
+	auto start = Clock::now();
+	if (c->Sws == nullptr || c->SrcW != frame->width || c->SrcH != frame->height || c->SrcFmt != frame->format) {
+		sws_freeContext(c->Sws);
+		av_frame_free(&c->RGBA);
+		c->RGBA              = av_frame_alloc();
+		c->RGBA->format      = AV_PIX_FMT_RGBA;
+		c->RGBA->width       = frame->width;
+		c->RGBA->height      = frame->height;
+		c->RGBA->color_range = AVCOL_RANGE_JPEG;
+		av_frame_get_buffer(c->RGBA, 1);
+		c->Sws    = sws_getContext(frame->width, frame->height, (AVPixelFormat) frame->format, frame->width, frame->height, AV_PIX_FMT_RGBA, SWS_BILINEAR, nullptr, nullptr, nullptr);
+		c->SrcW   = frame->width;
+		c->SrcH   = frame->height;
+		c->SrcFmt = frame->format;
+	}
+	sws_scale(c->Sws, frame->data, frame->linesize, 0, frame->height, c->RGBA->data, c->RGBA->linesize);
+	return SecondsSince(start);
+}
+
+static std::string BenchRGBA(const capture::Reader& cap, const Options& opt) {
+	auto         frames = SelectFrames(cap, opt);
+	Samples      ms;
+	DecodeResult r;
+	int          width = 0, height = 0;
+	for (int run = -1; run < opt.Runs; run++) {
+		RGBAContext ctx;
+		auto        err = DecodeAll(frames, cap.Codec, opt, RGBAHook, &ctx, r);
+		if (err != "")
+			return err;
+		width  = ctx.SrcW;
+		height = ctx.SrcH;
+		if (run >= 0)
+			ms.Values.push_back(r.HookTotal * 1000 / r.Frames);
+	}
+	double mpix = (double) width * height / 1e6;
+	PrintResult("rgba", ms, "ms/frame", tsf::fmt("(%vx%v, %.0f MPix/s)"_tsf, width, height, mpix / (ms.Median() / 1000)));
+	return "";
+}
+
+struct JPEGContext {
+	int                 Quality = 75;
+	std::vector<double> Latency; // Seconds, per frame
+	size_t              Bytes   = 0;
+	int                 Skipped = 0; // Frames that are not YUV 4:2:0 (eg NV12 from a hardware decoder)
+};
+
+static double JPEGHook(AVFrame* frame, void* context) {
+	auto c = (JPEGContext*) context;
+	if (frame->format != AV_PIX_FMT_YUV420P && frame->format != AV_PIX_FMT_YUVJ420P) {
+		c->Skipped++;
+		return 0;
+	}
+	YUV420Planes img;
+	img.Y        = frame->data[0];
+	img.U        = frame->data[1];
+	img.V        = frame->data[2];
+	img.StrideY  = frame->linesize[0];
+	img.StrideUV = frame->linesize[1];
+	img.Width    = frame->width;
+	img.Height   = frame->height;
+
+	auto   start = Clock::now();
+	char*  err   = nullptr;
+	void*  jpeg  = nullptr;
+	size_t size  = 0;
+	CompressYUV420JPEG(&err, &img, c->Quality, nullptr, &jpeg, &size);
+	double t = SecondsSince(start);
+	if (err != nullptr) {
+		free(err);
+		c->Skipped++;
+		return 0;
+	}
+	FreeJPEG(jpeg);
+	c->Latency.push_back(t);
+	c->Bytes += size;
+	return t;
+}
+
+static std::string BenchJPEG(const capture::Reader& cap, const Options& opt) {
+	auto         frames = SelectFrames(cap, opt);
+	Samples      ms;
+	DecodeResult r;
+	JPEGContext  last;
+	for (int run = -1; run < opt.Runs; run++) {
+		JPEGContext ctx;
+		ctx.Quality = opt.JPEGQuality;
+		auto err    = DecodeAll(frames, cap.Codec, opt, JPEGHook, &ctx, r);
+		if (err != "")
+			return err;
+		if (ctx.Latency.empty())
+			return "No YUV 4:2:0 frames to compress (try without --hw)";
+		if (run >= 0)
+			ms.Values.push_back(r.HookTotal * 1000 / ctx.Latency.size());
+		last = std::move(ctx);
+	}
+	std::sort(last.Latency.begin(), last.Latency.end());
+	double p99 = last.Latency[std::min(last.Latency.size() - 1, last.Latency.size() * 99 / 100)] * 1000;
+	PrintResult("jpeg", ms, "ms/frame", tsf::fmt("(p99 %.2f ms, %.0f KB/frame, quality %v, %v skipped)"_tsf, p99, last.Bytes / 1024.0 / last.Latency.size(), opt.JPEGQuality, last.Skipped));
+	return "";
+}
+
+static void Usage() {
+	tsf::print("bench convert <raw dir> <capture>\n"_tsf);
+	tsf::print("bench <remux|decode|rgba|jpeg|all> <capture> [--runs N] [--frames N] [--threads N] [--hw] [--quality Q]\n"_tsf);
+}
+
+int main(int argc, char** argv) {
+	if (argc < 3) {
+		Usage();
+		return 1;
+	}
+	std::string mode = argv[1];
+
+	if (mode == "convert") {
+		if (argc != 4) {
+			Usage();
+			return 1;
+		}
+		auto err = capture::ConvertRawDir(argv[2], argv[3]);
+		if (err != "") {
+			tsf::print(stderr, "%v\n"_tsf, err);
+			return 1;
+		}
+		return 0;
+	}
+
+	Options opt;
+	for (int i = 3; i < argc; i++) {
+		std::string a       = argv[i];
+		bool        hasNext = i + 1 < argc;
+		if (a == "--runs" && hasNext)
+			opt.Runs = std::max(1, atoi(argv[++i]));
+		else if (a == "--frames" && hasNext)
+			opt.MaxFrames = std::max(0, atoi(argv[++i]));
+		else if (a == "--threads" && hasNext)
+			opt.Threads = std::max(0, atoi(argv[++i]));
+		else if (a == "--quality" && hasNext)
+			opt.JPEGQuality = atoi(argv[++i]);
+		else if (a == "--hw")
+			opt.Hardware = true;
+		else {
+			Usage();
+			return 1;
+		}
+	}
+
+	capture::Reader cap;
+	auto            err = cap.Open(argv[2]);
+	if (err == "" && cap.Frames.empty())
+		err = "Capture is empty";
+	if (err != "") {
+		tsf::print(stderr, "%v\n"_tsf, err);
+		return 1;
+	}
+
+	// Fault in the whole mapping, so that the first timed pass doesn't pay for disk reads
+	volatile uint8_t sum = 0;
+	for (const auto& f : cap.Frames) {
+		for (size_t i = 0; i < f.Size; i += 4096)
+			sum += f.Data[i];
+	}
+
+	PrintMachine(cap, opt);
+	typedef std::string (*BenchFunc)(const capture::Reader& cap, const Options& opt);
+	struct {
+		const char* Name;
+		BenchFunc   Func;
+	} benches[] = {
+	    {"remux", BenchRemux},
+	    {"decode", BenchDecode},
+	    {"rgba", BenchRGBA},
+	    {"jpeg", BenchJPEG},
+	};
+	bool found = false;
+	for (const auto& b : benches) {
+		if (mode != "all" && mode != b.Name)
+			continue;
+		found = true;
+		err   = b.Func(cap, opt);
+		if (err != "") {
+			tsf::print(stderr, "%v: %v\n"_tsf, b.Name, err);
+			return 1;
+		}
+	}
+	if (!found) {
+		Usage();
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,415 @@
+#pragma once
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// A capture is a single file that holds a recorded video stream, as a sequence of annex-b access units.
+// It replaces directories of raw/*.raw NALU dumps, which are slow to load (one file per NALU, with a filename
+// that must be parsed), and impossible to share between machines without reproducing the directory layout.
+//
+// Layout (all integers are little endian):
+//
+//   CaptureHeader
+//   CaptureRecord, payload, padding
+//   CaptureRecord, payload, padding
+//   ...
+//   CaptureRecord (FlagIndex), IndexEntry[]   (version 2)
+//   CaptureTrailer                            (version 2)
+//
+// The payload is an annex-b access unit (every NALU has a 3 byte 00 00 01 prefix), which is exactly what
+// the decoder and the ingest sinks consume. Each record is padded out to 8 bytes, so that the next
+// CaptureRecord is aligned, and can be read straight out of the mmap'ed file, even on ARM.
+// Records are appended, so a capture that was cut short is still readable up to the last complete record.
+//
+// When a Writer is closed, it appends an index of the keyframes, followed by a fixed size trailer that points
+// at the index. This lets a StreamReader seek to any PTS without reading the whole file. If the trailer is
+// missing (version 1, or a capture that was cut short), the readers rebuild the index by skipping from
+// record to record.
+namespace capture {
+
+static const char     Magic[8]        = {'c', 'y', 'c', 'c', 'a', 'p', 0, 0};
+static const char     TrailerMagic[8] = {'c', 'y', 'c', 'i', 'n', 'd', 'e', 'x'};
+static const uint32_t Version         = 2;
+static const uint32_t MinVersion      = 1;
+
+enum Flags : uint32_t {
+	FlagKeyframe = 1, // Access unit contains an IDR (H264) or an IRAP picture (H265)
+	FlagIndex    = 2, // Not an access unit. The payload is IndexEntry[], and this is the final record.
+};
+
+struct CaptureHeader {
+	char     Magic[8];
+	uint32_t Version;
+	uint32_t Codec; // VideoCodec (see server/videox/nalu.h)
+	uint64_t Reserved;
+};
+
+struct CaptureRecord {
+	int64_t  PTS;  // Nanoseconds
+	uint32_t Size; // Size of the payload that follows, excluding padding
+	uint32_t Flags;
+};
+
+struct IndexEntry {
+	int64_t  PTS;    // PTS of a keyframe
+	uint64_t Offset; // File offset of the keyframe's CaptureRecord
+};
+
+struct CaptureTrailer {
+	uint64_t IndexOffset; // File offset of the FlagIndex CaptureRecord
+	char     Magic[8];    // TrailerMagic
+};
+
+static_assert(sizeof(CaptureHeader) == 24, "CaptureHeader must be packed");
+static_assert(sizeof(CaptureRecord) == 16, "CaptureRecord must be packed");
+static_assert(sizeof(IndexEntry) == 16, "IndexEntry must be packed");
+static_assert(sizeof(CaptureTrailer) == 16, "CaptureTrailer must be packed");
+
+inline size_t PaddedSize(size_t size) {
+	return (size + 7) & ~(size_t) 7;
+}
+
+// A single access unit. Data points into the mmap'ed file, or into the StreamReader's buffer.
+struct Frame {
+	int64_t        PTS;
+	const uint8_t* Data;
+	size_t         Size;
+	bool           Keyframe;
+};
+
+// Memory maps a capture, and indexes its records.
+// This is for benchmarks, which want the whole capture in memory. Use StreamReader to walk through long captures.
+class Reader {
+public:
+	uint32_t           Codec = 0;
+	std::vector<Frame> Frames;
+	size_t             Bytes = 0; // Total size of all payloads
+
+	~Reader() {
+		Close();
+	}
+
+	// Returns an empty string on success
+	std::string Open(const std::string& filename) {
+		Close();
+		int fd = open(filename.c_str(), O_RDONLY);
+		if (fd == -1)
+			return "Failed to open " + filename + ": " + strerror(errno);
+		struct stat st;
+		if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(CaptureHeader)) {
+			close(fd);
+			return "Not a capture file: " + filename;
+		}
+		MapSize = (size_t) st.st_size;
+		Map     = (const uint8_t*) mmap(nullptr, MapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (Map == MAP_FAILED) {
+			Map = nullptr;
+			return "Failed to mmap " + filename + ": " + strerror(errno);
+		}
+		madvise((void*) Map, MapSize, MADV_SEQUENTIAL);
+
+		auto header = (const CaptureHeader*) Map;
+		if (memcmp(header->Magic, Magic, sizeof(Magic)) != 0)
+			return "Not a capture file: " + filename;
+		if (header->Version < MinVersion || header->Version > Version)
+			return "Unsupported capture version " + std::to_string(header->Version);
+		Codec = header->Codec;
+
+		size_t pos = sizeof(CaptureHeader);
+		while (pos + sizeof(CaptureRecord) <= MapSize) {
+			auto rec = (const CaptureRecord*) (Map + pos);
+			pos += sizeof(CaptureRecord);
+			if (pos + rec->Size > MapSize || (rec->Flags & FlagIndex) != 0)
+				break; // truncated final record, or the index
+			Frames.push_back({rec->PTS, Map + pos, rec->Size, (rec->Flags & FlagKeyframe) != 0});
+			Bytes += rec->Size;
+			pos += PaddedSize(rec->Size);
+		}
+		return "";
+	}
+
+	void Close() {
+		if (Map)
+			munmap((void*) Map, MapSize);
+		Map     = nullptr;
+		MapSize = 0;
+		Frames.clear();
+		Bytes = 0;
+	}
+
+private:
+	const uint8_t* Map     = nullptr;
+	size_t         MapSize = 0;
+};
+
+class Writer {
+public:
+	~Writer() {
+		Close();
+	}
+
+	// Returns an empty string on success
+	std::string Open(const std::string& filename, uint32_t codec) {
+		Close();
+		File = fopen(filename.c_str(), "wb");
+		if (File == nullptr)
+			return "Failed to create " + filename + ": " + strerror(errno);
+		CaptureHeader header = {};
+		memcpy(header.Magic, Magic, sizeof(Magic));
+		header.Version = Version;
+		header.Codec   = codec;
+		if (fwrite(&header, sizeof(header), 1, File) != 1)
+			return "Failed to write " + filename;
+		Offset = sizeof(header);
+		return "";
+	}
+
+	// Append an annex-b access unit
+	bool Write(int64_t pts, bool keyframe, const void* data, size_t size) {
+		if (keyframe)
+			Keyframes.push_back({pts, Offset});
+		return WriteRecord(pts, keyframe ? (uint32_t) FlagKeyframe : 0, data, size);
+	}
+
+	// Write the keyframe index and the trailer, and close the file.
+	// Returns false if any buffered writes failed.
+	bool Close() {
+		if (File == nullptr)
+			return true;
+		CaptureTrailer trailer = {Offset, {}};
+		memcpy(trailer.Magic, TrailerMagic, sizeof(TrailerMagic));
+		bool ok = WriteRecord(0, FlagIndex, Keyframes.data(), Keyframes.size() * sizeof(IndexEntry)) &&
+		          fwrite(&trailer, sizeof(trailer), 1, File) == 1;
+		ok   = fclose(File) == 0 && ok;
+		File = nullptr;
+		Keyframes.clear();
+		return ok;
+	}
+
+private:
+	FILE*                   File   = nullptr;
+	uint64_t                Offset = 0; // Offset of the next CaptureRecord
+	std::vector<IndexEntry> Keyframes;
+
+	bool WriteRecord(int64_t pts, uint32_t flags, const void* data, size_t size) {
+		static const uint8_t zeros[8] = {0};
+		CaptureRecord        rec      = {pts, (uint32_t) size, flags};
+		Offset += sizeof(rec) + PaddedSize(size);
+		return fwrite(&rec, sizeof(rec), 1, File) == 1 &&
+		       fwrite(data, 1, size, File) == size &&
+		       fwrite(zeros, 1, PaddedSize(size) - size, File) == PaddedSize(size) - size;
+	}
+};
+
+// Reads a capture one access unit at a time, through a single reused buffer, so memory use doesn't grow
+// with the length of the capture. Seek() jumps to the keyframe at or before any PTS.
+class StreamReader {
+public:
+	uint32_t                Codec = 0;
+	std::vector<IndexEntry> Keyframes; // In file order, which is also PTS order
+
+	~StreamReader() {
+		Close();
+	}
+
+	// Returns an empty string on success
+	std::string Open(const std::string& filename) {
+		Close();
+		File = fopen(filename.c_str(), "rb");
+		if (File == nullptr)
+			return "Failed to open " + filename + ": " + strerror(errno);
+		CaptureHeader header;
+		if (fread(&header, sizeof(header), 1, File) != 1 || memcmp(header.Magic, Magic, sizeof(Magic)) != 0)
+			return "Not a capture file: " + filename;
+		if (header.Version < MinVersion || header.Version > Version)
+			return "Unsupported capture version " + std::to_string(header.Version);
+		Codec = header.Codec;
+
+		struct stat st;
+		if (fstat(fileno(File), &st) != 0)
+			return "Failed to stat " + filename + ": " + strerror(errno);
+		End = (uint64_t) st.st_size;
+		if (!LoadIndex())
+			ScanIndex();
+		Pos = sizeof(CaptureHeader);
+		fseeko(File, (off_t) Pos, SEEK_SET);
+		return "";
+	}
+
+	// Position the reader at the last keyframe whose PTS is <= pts, or at the first keyframe if there is none.
+	// Returns false if the capture has no keyframes.
+	bool Seek(int64_t pts) {
+		if (Keyframes.empty())
+			return false;
+		auto it = std::upper_bound(Keyframes.begin(), Keyframes.end(), pts, [](int64_t p, const IndexEntry& e) { return p < e.PTS; });
+		if (it != Keyframes.begin())
+			it--;
+		Pos = it->Offset;
+		return fseeko(File, (off_t) Pos, SEEK_SET) == 0;
+	}
+
+	// Read the next access unit. f.Data is valid until the next call to Next or Seek.
+	// Returns false at the end of the capture, or at a truncated final record.
+	bool Next(Frame& f) {
+		CaptureRecord rec;
+		if (File == nullptr || Pos + sizeof(rec) > End || fread(&rec, sizeof(rec), 1, File) != 1)
+			return false;
+		if ((rec.Flags & FlagIndex) != 0 || Pos + sizeof(rec) + rec.Size > End)
+			return false;
+		// resize() keeps our capacity, so after the first big keyframe, this doesn't allocate
+		Buf.resize(PaddedSize(rec.Size));
+		// The final record of a capture that was cut short may be missing its padding
+		if (fread(&Buf[0], 1, Buf.size(), File) != Buf.size() && !feof(File))
+			return false;
+		Pos += sizeof(rec) + PaddedSize(rec.Size);
+		f.PTS      = rec.PTS;
+		f.Data     = (const uint8_t*) Buf.data();
+		f.Size     = rec.Size;
+		f.Keyframe = (rec.Flags & FlagKeyframe) != 0;
+		return true;
+	}
+
+	void Close() {
+		if (File)
+			fclose(File);
+		File = nullptr;
+		Keyframes.clear();
+		Codec = 0;
+		Pos   = 0;
+		End   = 0;
+	}
+
+private:
+	FILE*       File = nullptr;
+	uint64_t    Pos  = 0; // Offset of the next CaptureRecord
+	uint64_t    End  = 0; // Offset of the index, or the file size if there is no index
+	std::string Buf;
+
+	// Read the index that Writer::Close appends. Returns false if it's missing or damaged.
+	bool LoadIndex() {
+		CaptureTrailer trailer;
+		CaptureRecord  rec;
+		if (End < sizeof(CaptureHeader) + sizeof(rec) + sizeof(trailer))
+			return false;
+		if (fseeko(File, (off_t) (End - sizeof(trailer)), SEEK_SET) != 0 || fread(&trailer, sizeof(trailer), 1, File) != 1)
+			return false;
+		if (memcmp(trailer.Magic, TrailerMagic, sizeof(TrailerMagic)) != 0 || trailer.IndexOffset > End - sizeof(trailer) - sizeof(rec))
+			return false;
+		if (fseeko(File, (off_t) trailer.IndexOffset, SEEK_SET) != 0 || fread(&rec, sizeof(rec), 1, File) != 1)
+			return false;
+		if (rec.Flags != FlagIndex || rec.Size % sizeof(IndexEntry) != 0 || trailer.IndexOffset + sizeof(rec) + PaddedSize(rec.Size) + sizeof(trailer) != End)
+			return false;
+		Keyframes.resize(rec.Size / sizeof(IndexEntry));
+		if (!Keyframes.empty() && fread(Keyframes.data(), sizeof(IndexEntry), Keyframes.size(), File) != Keyframes.size()) {
+			Keyframes.clear();
+			return false;
+		}
+		End = trailer.IndexOffset;
+		return true;
+	}
+
+	// Find the keyframes by hopping over the payloads
+	void ScanIndex() {
+		Keyframes.clear();
+		uint64_t      pos = sizeof(CaptureHeader);
+		CaptureRecord rec;
+		while (pos + sizeof(rec) <= End && fseeko(File, (off_t) pos, SEEK_SET) == 0 && fread(&rec, sizeof(rec), 1, File) == 1) {
+			if ((rec.Flags & FlagIndex) != 0 || pos + sizeof(rec) + rec.Size > End)
+				break;
+			if ((rec.Flags & FlagKeyframe) != 0)
+				Keyframes.push_back({rec.PTS, pos});
+			pos += sizeof(rec) + PaddedSize(rec.Size);
+		}
+	}
+};
+
+// Read the whole of a small file
+inline bool ReadFile(const std::string& filename, std::string& out) {
+	FILE* f = fopen(filename.c_str(), "rb");
+	if (f == nullptr)
+		return false;
+	struct stat st;
+	bool        ok = fstat(fileno(f), &st) == 0;
+	if (ok) {
+		out.resize((size_t) st.st_size);
+		ok = fread(&out[0], 1, out.size(), f) == out.size();
+	}
+	fclose(f);
+	return ok;
+}
+
+// Convert a directory of raw/*.raw NALU dumps (see RawBuffer.DumpBin) into a capture.
+// The dumps are always H264. Returns an empty string on success.
+inline std::string ConvertRawDir(const std::string& dir, const std::string& filename) {
+	// 026-002.002599955555.raw is NALU 2 of packet 26, with PTS 2599955555
+	struct RawFile {
+		int         Packet;
+		int         NALU;
+		int64_t     PTS;
+		std::string Path;
+	};
+	std::vector<RawFile> files;
+	std::error_code      ec;
+	for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+		if (entry.path().extension() != ".raw")
+			continue;
+		RawFile     f;
+		std::string name = entry.path().filename().string();
+		if (sscanf(name.c_str(), "%d-%d.%lld.raw", &f.Packet, &f.NALU, (long long*) &f.PTS) != 3)
+			continue;
+		f.Path = entry.path().string();
+		files.push_back(std::move(f));
+	}
+	if (ec)
+		return "Failed to read " + dir + ": " + ec.message();
+	if (files.empty())
+		return "No .raw files found in " + dir;
+	std::sort(files.begin(), files.end(), [](const RawFile& a, const RawFile& b) {
+		return a.Packet != b.Packet ? a.Packet < b.Packet : a.NALU < b.NALU;
+	});
+
+	Writer      w;
+	std::string err = w.Open(filename, 0);
+	if (err != "")
+		return err;
+
+	std::string au;
+	std::string nalu;
+	bool        key = false;
+	int64_t     pts = 0;
+	for (size_t i = 0; i < files.size(); i++) {
+		if (!ReadFile(files[i].Path, nalu))
+			return "Failed to read " + files[i].Path;
+		if (!nalu.empty()) {
+			if (au.empty())
+				pts = files[i].PTS;
+			// The dumps have no annex-b prefix
+			au.append("\x00\x00\x01", 3);
+			au += nalu;
+			if ((nalu[0] & 31) == 5)
+				key = true;
+		}
+		if ((i + 1 == files.size() || files[i + 1].Packet != files[i].Packet) && !au.empty()) {
+			if (!w.Write(pts, key, au.data(), au.size()))
+				return "Failed to write " + filename;
+			au.clear();
+			key = false;
+		}
+	}
+	if (!w.Close())
+		return "Failed to write " + filename;
+	return "";
+}
+
+} // namespace capture
@@ -5,7 +5,7 @@
 #include <algorithm>
 #include "server/videox/helper.h"
 #include "server/videox/tsf.hpp"
-#include "debug/glob.hpp"
+#include "debug/capture.hpp"
 
 // build ffmpeg:
 // sudo apt install libx264-dev
@@ -16,90 +16,81 @@
 //
 // use build_encode to compile this file
 // You must first build ffmpeg from source
-
-//func ParseBinFilename(filename string) (packetNumber int, naluNumber int, timeNS int64) {
-//	// filename example:
-//	// 026-002.002599955555.raw
-//	major := strings.Split(filename, ".")
-//	a, b, _ := strings.Cut(major[0], "-")
-//	packetNumber, _ = strconv.Atoi(a)
-//	naluNumber, _ = strconv.Atoi(b)
-//	timeNS, _ = strconv.ParseInt(major[1], 10, 64)
-//	return
-//}
+//
+// Usage: enc <capture> [output.mp4] [--from seconds]
+// The capture is streamed, one access unit at a time, so memory use doesn't depend on its length.
+// Use 'bench convert' to turn an old raw/*.raw directory into a capture.
 
 using namespace std;
 
-struct Packet {
-	vector<std::string> NALUs;
-	int64_t             PTS;
-};
+// Split an annex-b access unit into NALUs, which point into the frame
+static void SplitNALUs(const capture::Frame& f, int64_t dts, int64_t pts, vector<EncoderNALU>& nalus) {
+	nalus.clear();
+	const uint8_t* p     = f.Data;
+	const uint8_t* end   = f.Data + f.Size;
+	const uint8_t* start = nullptr;
+	for (; p + 3 <= end; p++) {
+		if (p[0] == 0 && p[1] == 0 && p[2] == 1) {
+			if (start)
+				nalus.push_back({start, (size_t) (p - start), 3, dts, pts});
+			start = p;
+			p += 2;
+		}
+	}
+	if (start)
+		nalus.push_back({start, (size_t) (end - start), 3, dts, pts});
+}
 
 int main(int argc, char** argv) {
-	tsf::print("Hello!\n");
+	if (argc < 2) {
+		tsf::print("enc <capture> [output.mp4] [--from seconds]\n");
+		return 1;
+	}
+	string output = "dump/test.mp4";
+	double from   = -1;
+	for (int i = 2; i < argc; i++) {
+		string a = argv[i];
+		if (a == "--from" && i + 1 < argc)
+			from = atof(argv[++i]);
+		else
+			output = a;
+	}
 
-	auto files = glob::glob("/home/ben/dev/cyclops/raw/*.raw");
-	sort(files.begin(), files.end());
+	capture::StreamReader cap;
+	auto                  capErr = cap.Open(argv[1]);
+	if (capErr != "") {
+		tsf::print("%v\n", capErr);
+		return 1;
+	}
 
 	char* err     = nullptr;
-	void* encoder = MakeEncoder(&err, "mp4", "dump/test.mp4", 2048, 1536);
+	void* encoder = MakeEncoder(&err, "mp4", (int) cap.Codec, output.c_str());
 	if (err != nullptr) {
 		tsf::print("Failed: %v\n", err);
 		free(err);
 		return 1;
 	}
-	int            lastSeq = -1;
-	Packet         packet;
-	vector<Packet> packets;
-	for (auto path : files) {
-		// 026-002.002599955555.raw
-		auto    filename = path.filename().string();
-		size_t  idash    = filename.find('-');
-		size_t  idot1    = filename.find('.');
-		size_t  idot2    = filename.find('.', idot1);
-		int     seq      = atoi(filename.substr(0, idash).c_str());
-		int     seqx     = atoi(filename.substr(idash + 1, idot1 - idash - 1).c_str());
-		int64_t pts      = atoll(filename.substr(idot1 + 1, idot2 - idot1 - 1).c_str());
-		//tsf::print("%v %v %v %v\n", filename, seq, seqx, pts);
-		if (lastSeq != seq) {
-			if (lastSeq != -1) {
-				packets.push_back(packet);
-			}
-			packet     = Packet();
-			packet.PTS = pts;
-		}
-		FILE* f = fopen(path.c_str(), "rb");
-		assert(f);
-		char        buf[4096];
-		std::string nalu;
-		while (true) {
-			size_t n = fread(buf, 1, sizeof(buf), f);
-			if (n == -1) {
-				tsf::print("Error reading file\n");
-				break;
-			} else if (n == 0) {
-				break;
-			}
-			nalu.append((const char*) buf, n);
-		}
-		packet.NALUs.push_back(nalu);
-		fclose(f);
-		lastSeq = seq;
+
+	// Start at the keyframe at or before 'from', measured from the first keyframe of the capture
+	if (from >= 0 && !cap.Keyframes.empty() && !cap.Seek(cap.Keyframes[0].PTS + (int64_t) (from * 1e9))) {
+		tsf::print("Seek failed\n");
+		Encoder_Close(encoder);
+		return 1;
 	}
-	packets.push_back(packet);
 
-	for (auto packet : packets) {
-		int64_t dts = packet.PTS;
-		int64_t pts = packet.PTS + 1000;
-		for (auto nalu : packet.NALUs) {
-			Encoder_WritePacket(&err, encoder, dts, pts, 0, nalu.data(), nalu.length());
-			dts += 10000;
-			pts += 10000;
-			if (err != nullptr) {
-				tsf::print("WritePacket error: %v\n", err);
-				free(err);
-			}
+	capture::Frame      frame;
+	vector<EncoderNALU> nalus;
+	size_t              nFrames = 0;
+	while (cap.Next(frame)) {
+		// Every NALU of the access unit has the same DTS, so they're joined into a single sample
+		SplitNALUs(frame, frame.PTS, frame.PTS + 1000, nalus);
+		Encoder_WritePackets(&err, encoder, nalus.data(), nalus.size());
+		if (err != nullptr) {
+			tsf::print("WritePackets error: %v\n", err);
+			free(err);
+			err = nullptr;
 		}
+		nFrames++;
 	}
 
 	Encoder_WriteTrailer(&err, encoder);
@@ -109,6 +100,7 @@ int main(int argc, char** argv) {
 	}
 
 	Encoder_Close(encoder);
+	tsf::print("Wrote %v frames to %v\n", nFrames, output);
 
 	return 0;
 }
@@ -1,6 +1,6 @@
 module github.com/bmharper/cyclops
 
-go 1.18
+go 1.21
 
 //replace github.com/aler9/gortsplib => ../gortsplib
 
@@ -0,0 +1,157 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include "accessUnitRing.h"
+
+struct AccessUnitRecord {
+	size_t  Offset; // In the arena
+	size_t  Size;
+	int64_t PTS;
+	bool    Keyframe;
+};
+
+// Access units live inside a single preallocated arena, and the oldest are evicted to make space,
+// in the same way as videox.PacketRing.
+struct AccessUnitRing {
+	std::mutex                   Lock;
+	std::vector<uint8_t>         Arena;
+	size_t                       Head  = 0; // Where the next access unit will be written
+	size_t                       Bytes = 0; // Sum of AccessUnitRecord.Size
+	std::deque<AccessUnitRecord> Units;
+	std::deque<uint64_t>         Keyframes;  // Sequence numbers of the access units that are keyframes
+	uint64_t                     Pushed = 0; // Total number of access units ever added
+	uint64_t                     Popped = 0; // Total number of access units ever evicted
+};
+
+static void PopFront(AccessUnitRing* r) {
+	r->Bytes -= r->Units.front().Size;
+	r->Units.pop_front();
+	r->Popped++;
+	while (!r->Keyframes.empty() && r->Keyframes.front() < r->Popped)
+		r->Keyframes.pop_front();
+	if (r->Units.empty())
+		r->Head = 0;
+}
+
+// Find a contiguous region of size bytes, without evicting anything
+static bool FindSpace(AccessUnitRing* r, size_t size, size_t& offset) {
+	if (r->Units.empty()) {
+		offset = 0;
+		return true;
+	}
+	size_t tail = r->Units.front().Offset;
+	if (r->Head > tail) {
+		// Used region is [tail, head). Try after head, then wrap around to the start.
+		if (r->Arena.size() - r->Head >= size) {
+			offset = r->Head;
+			return true;
+		}
+		if (tail >= size) {
+			offset = 0;
+			return true;
+		}
+		return false;
+	}
+	// Used region has wrapped around, so the only free space is [head, tail)
+	if (tail - r->Head >= size) {
+		offset = r->Head;
+		return true;
+	}
+	return false;
+}
+
+// Index of the first access unit to extract: the newest keyframe whose PTS is at most maxPTS, or 0 if there is none.
+// You must be holding Lock.
+static size_t FindStart(AccessUnitRing* r, int64_t maxPTS) {
+	auto it = std::upper_bound(r->Keyframes.begin(), r->Keyframes.end(), maxPTS, [r](int64_t pts, uint64_t seq) {
+		return pts < r->Units[seq - r->Popped].PTS;
+	});
+	if (it == r->Keyframes.begin())
+		return 0;
+	return (size_t) (*(it - 1) - r->Popped);
+}
+
+extern "C" {
+
+void* MakeAccessUnitRing(size_t arenaBytes) {
+	auto r = new AccessUnitRing();
+	r->Arena.resize(arenaBytes);
+	return r;
+}
+
+void AccessUnitRing_Close(void* ring) {
+	delete (AccessUnitRing*) ring;
+}
+
+// Add an access unit, evicting old ones if necessary. This is an IngestSinkFunc (see rtsp/ingest.h).
+// An access unit that is larger than the entire arena is discarded.
+void AccessUnitRing_OnAccessUnit(void* ring, const uint8_t* accessUnit, size_t size, int64_t pts, int keyframe) {
+	auto                        r = (AccessUnitRing*) ring;
+	std::lock_guard<std::mutex> lock(r->Lock);
+	if (size > r->Arena.size())
+		return;
+	size_t offset = 0;
+	while (!FindSpace(r, size, offset))
+		PopFront(r);
+	memcpy(r->Arena.data() + offset, accessUnit, size);
+	r->Units.push_back({offset, size, pts, keyframe != 0});
+	if (keyframe)
+		r->Keyframes.push_back(r->Pushed);
+	r->Pushed++;
+	r->Head = offset + size;
+	r->Bytes += size;
+}
+
+size_t AccessUnitRing_Len(void* ring) {
+	auto                        r = (AccessUnitRing*) ring;
+	std::lock_guard<std::mutex> lock(r->Lock);
+	return r->Units.size();
+}
+
+size_t AccessUnitRing_Bytes(void* ring) {
+	auto                        r = (AccessUnitRing*) ring;
+	std::lock_guard<std::mutex> lock(r->Lock);
+	return r->Bytes;
+}
+
+// Copy out the access units from <newest - duration> until the newest, starting at a keyframe.
+// If there is no keyframe that old, we start at the oldest access unit.
+// If drain is non-zero, then the ring is emptied.
+// Returns 0 if the ring is empty. Otherwise, the caller must free() *data and *units.
+int AccessUnitRing_Extract(void* ring, int64_t duration, int drain, uint8_t** data, size_t* dataSize, AccessUnitInfo** units, size_t* nUnits) {
+	auto                        r = (AccessUnitRing*) ring;
+	std::lock_guard<std::mutex> lock(r->Lock);
+	if (r->Units.empty())
+		return 0;
+
+	size_t start = FindStart(r, r->Units.back().PTS - duration);
+	size_t n     = r->Units.size() - start;
+	size_t total = 0;
+	for (size_t i = start; i < r->Units.size(); i++)
+		total += r->Units[i].Size;
+
+	auto   buf  = (uint8_t*) malloc(std::max(total, (size_t) 1));
+	auto   info = (AccessUnitInfo*) malloc(n * sizeof(AccessUnitInfo));
+	size_t pos  = 0;
+	for (size_t i = 0; i < n; i++) {
+		const auto& u = r->Units[start + i];
+		memcpy(buf + pos, r->Arena.data() + u.Offset, u.Size);
+		info[i] = {pos, u.Size, u.PTS, u.Keyframe ? 1 : 0};
+		pos += u.Size;
+	}
+
+	if (drain) {
+		while (!r->Units.empty())
+			PopFront(r);
+	}
+
+	*data     = buf;
+	*dataSize = total;
+	*units    = info;
+	*nUnits   = n;
+	return 1;
+}
+}
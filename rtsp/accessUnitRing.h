@@ -0,0 +1,27 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// One access unit inside the buffer returned by AccessUnitRing_Extract
+typedef struct AccessUnitInfo {
+	size_t  Offset; // Into the data buffer
+	size_t  Size;
+	int64_t PTS; // Nanoseconds
+	int     Keyframe;
+} AccessUnitInfo;
+
+// An AccessUnitRing is the C++ counterpart of videox.PacketRing, so that access units from the ingest
+// engine can be buffered without going through the Go heap. All functions are thread safe.
+void*  MakeAccessUnitRing(size_t arenaBytes);
+void   AccessUnitRing_Close(void* ring);
+void   AccessUnitRing_OnAccessUnit(void* ring, const uint8_t* accessUnit, size_t size, int64_t pts, int keyframe);
+size_t AccessUnitRing_Len(void* ring);
+size_t AccessUnitRing_Bytes(void* ring);
+int    AccessUnitRing_Extract(void* ring, int64_t duration, int drain, uint8_t** data, size_t* dataSize, AccessUnitInfo** units, size_t* nUnits);
+
+#ifdef __cplusplus
+}
+#endif
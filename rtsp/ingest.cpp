@@ -0,0 +1,583 @@
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "liveMedia.hh"
+#include "BasicUsageEnvironment.hh"
+#include "ingest.h"
+#include "tsf.hpp"
+
+using namespace tsf::literals;
+
+typedef std::chrono::steady_clock Clock;
+
+// NALUs larger than this are truncated by live555, and we discard the access unit that contains them
+static const unsigned ReceiveBufferSize = 2 * 1024 * 1024;
+
+// If a stream makes no progress (connecting or receiving packets) for this long, we assume it's dead, and reconnect
+static const auto StallTimeout = std::chrono::seconds(10);
+
+// Delay before we try to reconnect a failed stream
+static const auto ReconnectDelay = std::chrono::seconds(5);
+
+// How often the watchdog checks on all streams
+static const int64_t WatchdogIntervalUS = 1000 * 1000;
+
+static const uint8_t NALUPrefix[3] = {0, 0, 1};
+
+struct Ingest;
+struct IngestStream;
+
+// The parts of a NALU that AccessUnitSink cares about
+enum NALURole {
+	NALURoleOther,
+	NALURoleVPS,
+	NALURoleSPS,
+	NALURolePPS,
+	NALURoleKeyframe,
+};
+
+static NALURole ClassifyNALU(int codec, uint8_t header) {
+	if (codec == IngestCodecH265) {
+		int t = (header >> 1) & 0x3f;
+		if (t >= 16 && t <= 23) // BLA, IDR, CRA, and reserved IRAP types
+			return NALURoleKeyframe;
+		switch (t) {
+		case 32: return NALURoleVPS;
+		case 33: return NALURoleSPS;
+		case 34: return NALURolePPS;
+		}
+		return NALURoleOther;
+	}
+	switch (header & 31) {
+	case 5: return NALURoleKeyframe;
+	case 7: return NALURoleSPS;
+	case 8: return NALURolePPS;
+	}
+	return NALURoleOther;
+}
+
+struct SinkEntry {
+	IngestSinkFunc Func;
+	void*          Context;
+	bool           WaitForKeyframe; // Discard access units until the next keyframe, so that the sink never sees a broken GOP
+};
+
+// RTSPClient, with a pointer back to the stream that owns it
+class IngestClient : public RTSPClient {
+public:
+	IngestStream* Stream;
+
+	IngestClient(UsageEnvironment& env, const char* url, IngestStream* stream) : RTSPClient(env, url, 0, "cyclops", 0, -1), Stream(stream) {}
+};
+
+// Receives NALUs from live555 (which has already undone the RTP packetization), and joins them into access units
+class AccessUnitSink : public MediaSink {
+public:
+	AccessUnitSink(UsageEnvironment& env, IngestStream* stream, MediaSubsession& subsession);
+	~AccessUnitSink() override;
+
+private:
+	IngestStream*    Stream;
+	MediaSubsession& Subsession;
+	uint8_t*         Buffer; // Receive buffer for a single NALU
+
+	// The access unit that we're busy building up. These buffers are reused, so they stop allocating once they've grown.
+	std::string AU;
+	std::string Scratch; // Used when we need to insert parameter sets in front of a keyframe
+	bool        AUStarted = false;
+	bool        AUBroken  = false; // One of the NALUs was truncated
+	bool        AUKey     = false;
+	bool        AUHasVPS  = false;
+	bool        AUHasSPS  = false;
+	bool        AUHasPPS  = false;
+	int64_t     AUPTS     = 0;
+
+	static void AfterGettingFrame(void* clientData, unsigned frameSize, unsigned numTruncatedBytes, struct timeval presentationTime, unsigned durationInMicroseconds);
+	void        OnNALU(unsigned size, unsigned truncated, struct timeval presentationTime);
+	void        Flush();
+	Boolean     continuePlaying() override;
+};
+
+// A single RTSP stream. All of this is owned by the event loop thread, except for the atomics.
+struct IngestStream {
+	Ingest*                Parent  = nullptr;
+	int                    ID      = 0;
+	std::string            URL;
+	IngestClient*          Client  = nullptr;
+	MediaSession*          Session = nullptr;
+	MediaSubsession*       Video   = nullptr; // The H264 or H265 subsession
+	std::string            VPS;               // From the SDP, with annex-b prefix (H265 only)
+	std::string            SPS;               // From the SDP, with annex-b prefix
+	std::string            PPS;               // From the SDP, with annex-b prefix
+	std::string            LastError;         // Guarded by Ingest::StreamsLock
+	Clock::time_point      LastProgress;      // Last time we received a response or a packet
+	Clock::time_point      RetryAt;           // When to reconnect, if State is IngestStateFailed
+	std::vector<SinkEntry> Sinks;
+
+	std::atomic<int>      State{IngestStateConnecting};
+	std::atomic<int>      Codec{IngestCodecH264};
+	std::atomic<uint64_t> AccessUnits{0};
+	std::atomic<uint64_t> Bytes{0};
+	std::atomic<uint64_t> Truncated{0};
+	std::atomic<uint64_t> Reconnects{0};
+};
+
+struct Ingest {
+	TaskScheduler*    Scheduler      = nullptr;
+	UsageEnvironment* Env            = nullptr;
+	EventTriggerId    CommandTrigger = 0;
+	TaskToken         Watchdog       = nullptr;
+	volatile char     StopLoop       = 0;
+	std::thread       Thread;
+
+	// Other threads talk to the event loop by posting commands, because live555 is not thread safe
+	std::mutex                         CommandsLock;
+	std::vector<std::function<void()>> Commands;
+
+	std::mutex                             StreamsLock; // Only the event loop thread modifies Streams, but other threads read it
+	std::unordered_map<int, IngestStream*> Streams;
+	std::atomic<int>                       NextID{1};
+};
+
+static void Connect(IngestStream* s);
+
+// Run fn on the event loop thread
+static void Post(Ingest* ingest, std::function<void()> fn) {
+	{
+		std::lock_guard<std::mutex> lock(ingest->CommandsLock);
+		ingest->Commands.push_back(std::move(fn));
+	}
+	ingest->Scheduler->triggerEvent(ingest->CommandTrigger, ingest);
+}
+
+// Run fn on the event loop thread, and wait for it to finish.
+// Must not be called from the event loop thread.
+static void RunSync(Ingest* ingest, std::function<void()> fn) {
+	std::mutex              lock;
+	std::condition_variable cv;
+	bool                    done = false;
+	Post(ingest, [&]() {
+		fn();
+		std::lock_guard<std::mutex> g(lock);
+		done = true;
+		cv.notify_one();
+	});
+	std::unique_lock<std::mutex> g(lock);
+	cv.wait(g, [&] { return done; });
+}
+
+static void RunCommands(void* clientData) {
+	auto                               ingest = (Ingest*) clientData;
+	std::vector<std::function<void()>> commands;
+	{
+		std::lock_guard<std::mutex> lock(ingest->CommandsLock);
+		std::swap(commands, ingest->Commands);
+	}
+	for (auto& c : commands)
+		c();
+}
+
+static IngestStream* FindStream(Ingest* ingest, int id) {
+	auto it = ingest->Streams.find(id);
+	return it == ingest->Streams.end() ? nullptr : it->second;
+}
+
+// Close everything that live555 owns for this stream
+static void Teardown(IngestStream* s) {
+	if (s->Video && s->Video->sink) {
+		Medium::close(s->Video->sink);
+		s->Video->sink = nullptr;
+	}
+	if (s->Client && s->Session)
+		s->Client->sendTeardownCommand(*s->Session, nullptr);
+	if (s->Client) {
+		Medium::close(s->Client);
+		s->Client = nullptr;
+	}
+	if (s->Session) {
+		Medium::close(s->Session);
+		s->Session = nullptr;
+	}
+	s->Video = nullptr;
+}
+
+static void Fail(IngestStream* s, const std::string& msg) {
+	Teardown(s);
+	s->State   = IngestStateFailed;
+	s->RetryAt = Clock::now() + ReconnectDelay;
+	// The first frames after we reconnect will reference frames from this connection, which the sinks can't decode
+	for (auto& sink : s->Sinks)
+		sink.WaitForKeyframe = true;
+	std::lock_guard<std::mutex> lock(s->Parent->StreamsLock);
+	s->LastError = msg;
+}
+
+static std::string ResultStr(const char* resultString) {
+	return resultString ? resultString : "";
+}
+
+// Decode the base64 NALUs of an sprop attribute, and store each one in the VPS, SPS or PPS of s
+static void ReadSProp(IngestStream* s, const char* sprop) {
+	if (sprop == nullptr)
+		return;
+	unsigned     n       = 0;
+	SPropRecord* records = parseSPropParameterSets(sprop, n);
+	for (unsigned i = 0; i < n; i++) {
+		if (records[i].sPropLength == 0)
+			continue;
+		std::string* dst = nullptr;
+		switch (ClassifyNALU(s->Codec, records[i].sPropBytes[0])) {
+		case NALURoleVPS: dst = &s->VPS; break;
+		case NALURoleSPS: dst = &s->SPS; break;
+		case NALURolePPS: dst = &s->PPS; break;
+		default: break;
+		}
+		if (dst) {
+			dst->assign((const char*) NALUPrefix, sizeof(NALUPrefix));
+			dst->append((const char*) records[i].sPropBytes, records[i].sPropLength);
+		}
+	}
+	delete[] records;
+}
+
+static void ReadParameterSets(IngestStream* s) {
+	s->VPS.clear();
+	s->SPS.clear();
+	s->PPS.clear();
+	if (s->Codec == IngestCodecH265) {
+		// RFC 7798 has a separate attribute for each type of parameter set
+		ReadSProp(s, s->Video->fmtp_spropvps());
+		ReadSProp(s, s->Video->fmtp_spropsps());
+		ReadSProp(s, s->Video->fmtp_sproppps());
+	} else {
+		ReadSProp(s, s->Video->fmtp_spropparametersets());
+	}
+}
+
+static void OnPlaybackEnded(void* clientData) {
+	Fail((IngestStream*) clientData, "Stream ended");
+}
+
+static void OnBye(void* clientData) {
+	Fail((IngestStream*) clientData, "Server sent RTCP BYE");
+}
+
+static void OnPlay(RTSPClient* client, int resultCode, char* resultString) {
+	auto s = ((IngestClient*) client)->Stream;
+	auto r = ResultStr(resultString);
+	delete[] resultString;
+	if (resultCode != 0)
+		return Fail(s, tsf::fmt("PLAY failed: %v"_tsf, r));
+	s->State        = IngestStatePlaying;
+	s->LastProgress = Clock::now();
+}
+
+static void OnSetup(RTSPClient* client, int resultCode, char* resultString) {
+	auto s = ((IngestClient*) client)->Stream;
+	auto r = ResultStr(resultString);
+	delete[] resultString;
+	if (resultCode != 0)
+		return Fail(s, tsf::fmt("SETUP failed: %v"_tsf, r));
+	s->LastProgress = Clock::now();
+
+	auto& env      = client->envir();
+	s->Video->sink = new AccessUnitSink(env, s, *s->Video);
+	s->Video->sink->startPlaying(*s->Video->readSource(), OnPlaybackEnded, s);
+	if (s->Video->rtcpInstance())
+		s->Video->rtcpInstance()->setByeHandler(OnBye, s);
+	client->sendPlayCommand(*s->Session, OnPlay);
+}
+
+static void OnDescribe(RTSPClient* client, int resultCode, char* resultString) {
+	auto s   = ((IngestClient*) client)->Stream;
+	auto sdp = ResultStr(resultString);
+	delete[] resultString;
+	if (resultCode != 0)
+		return Fail(s, tsf::fmt("DESCRIBE failed: %v"_tsf, sdp));
+	s->LastProgress = Clock::now();
+
+	auto& env  = client->envir();
+	s->Session = MediaSession::createNew(env, sdp.c_str());
+	if (s->Session == nullptr)
+		return Fail(s, tsf::fmt("Invalid SDP: %v"_tsf, env.getResultMsg()));
+
+	MediaSubsessionIterator iter(*s->Session);
+	while (auto sub = iter.next()) {
+		if (strcmp(sub->mediumName(), "video") != 0)
+			continue;
+		if (strcmp(sub->codecName(), "H264") == 0) {
+			s->Codec = IngestCodecH264;
+			s->Video = sub;
+			break;
+		} else if (strcmp(sub->codecName(), "H265") == 0) {
+			s->Codec = IngestCodecH265;
+			s->Video = sub;
+			break;
+		}
+	}
+	if (s->Video == nullptr)
+		return Fail(s, "No H264 or H265 track found");
+	if (!s->Video->initiate())
+		return Fail(s, tsf::fmt("Failed to initiate %v track: %v"_tsf, s->Video->codecName(), env.getResultMsg()));
+	ReadParameterSets(s);
+
+	// RTP over TCP, so that we don't lose packets under load. This matters more than latency for an NVR.
+	client->sendSetupCommand(*s->Video, OnSetup, False, True);
+}
+
+static void Connect(IngestStream* s) {
+	s->State        = IngestStateConnecting;
+	s->LastProgress = Clock::now();
+	s->Client       = new IngestClient(*s->Parent->Env, s->URL.c_str(), s);
+	s->Client->sendDescribeCommand(OnDescribe);
+}
+
+static void RunWatchdog(void* clientData) {
+	auto ingest = (Ingest*) clientData;
+	auto now    = Clock::now();
+	for (auto& it : ingest->Streams) {
+		auto s = it.second;
+		switch (s->State.load()) {
+		case IngestStateConnecting:
+		case IngestStatePlaying:
+			if (now - s->LastProgress > StallTimeout)
+				Fail(s, s->State == IngestStatePlaying ? "Timed out waiting for packets" : "Timed out connecting");
+			break;
+		case IngestStateFailed:
+			if (now >= s->RetryAt) {
+				s->Reconnects++;
+				Connect(s);
+			}
+			break;
+		}
+	}
+	ingest->Watchdog = ingest->Scheduler->scheduleDelayedTask(WatchdogIntervalUS, RunWatchdog, ingest);
+}
+
+AccessUnitSink::AccessUnitSink(UsageEnvironment& env, IngestStream* stream, MediaSubsession& subsession) : MediaSink(env), Stream(stream), Subsession(subsession) {
+	Buffer = new uint8_t[ReceiveBufferSize];
+}
+
+AccessUnitSink::~AccessUnitSink() {
+	delete[] Buffer;
+}
+
+Boolean AccessUnitSink::continuePlaying() {
+	if (fSource == nullptr)
+		return False;
+	fSource->getNextFrame(Buffer, ReceiveBufferSize, AfterGettingFrame, this, onSourceClosure, this);
+	return True;
+}
+
+void AccessUnitSink::AfterGettingFrame(void* clientData, unsigned frameSize, unsigned numTruncatedBytes, struct timeval presentationTime, unsigned durationInMicroseconds) {
+	auto sink = (AccessUnitSink*) clientData;
+	sink->OnNALU(frameSize, numTruncatedBytes, presentationTime);
+}
+
+void AccessUnitSink::OnNALU(unsigned size, unsigned truncated, struct timeval presentationTime) {
+	Stream->LastProgress = Clock::now();
+	int64_t pts          = (int64_t) presentationTime.tv_sec * 1000000000 + (int64_t) presentationTime.tv_usec * 1000;
+
+	// All the NALUs of an access unit share a timestamp, so a new timestamp means a new access unit,
+	// even if we missed the RTP marker bit.
+	if (AUStarted && pts != AUPTS)
+		Flush();
+	if (!AUStarted) {
+		AUStarted = true;
+		AUPTS     = pts;
+	}
+
+	if (truncated != 0) {
+		Stream->Truncated++;
+		AUBroken = true;
+	} else if (size != 0) {
+		switch (ClassifyNALU(Stream->Codec, Buffer[0])) {
+		case NALURoleKeyframe: AUKey = true; break;
+		case NALURoleVPS: AUHasVPS = true; break;
+		case NALURoleSPS: AUHasSPS = true; break;
+		case NALURolePPS: AUHasPPS = true; break;
+		case NALURoleOther: break;
+		}
+		AU.append((const char*) NALUPrefix, sizeof(NALUPrefix));
+		AU.append((const char*) Buffer, size);
+	}
+
+	// The marker bit is set on the final packet of an access unit
+	auto rtp = Subsession.rtpSource();
+	if (rtp && rtp->curPacketMarkerBit())
+		Flush();
+
+	continuePlaying();
+}
+
+// Send the access unit to all the sinks
+void AccessUnitSink::Flush() {
+	auto s = Stream;
+	if (AUBroken) {
+		// Everything until the next keyframe depends on this frame, so none of it is decodable
+		for (auto& sink : s->Sinks)
+			sink.WaitForKeyframe = true;
+	} else if (!AU.empty()) {
+		const std::string* au      = &AU;
+		bool               needVPS = s->Codec == IngestCodecH265 && !AUHasVPS && !s->VPS.empty();
+		if (AUKey && (needVPS || !AUHasSPS || !AUHasPPS) && !s->SPS.empty() && !s->PPS.empty()) {
+			// Make every keyframe self contained, which is what the ring buffer and the recorder need
+			Scratch.clear();
+			if (needVPS)
+				Scratch += s->VPS;
+			if (!AUHasSPS)
+				Scratch += s->SPS;
+			if (!AUHasPPS)
+				Scratch += s->PPS;
+			Scratch += AU;
+			au = &Scratch;
+		}
+		for (auto& sink : s->Sinks) {
+			if (sink.WaitForKeyframe) {
+				if (!AUKey)
+					continue;
+				sink.WaitForKeyframe = false;
+			}
+			sink.Func(sink.Context, (const uint8_t*) au->data(), au->size(), AUPTS, AUKey ? 1 : 0);
+		}
+		s->AccessUnits++;
+		s->Bytes += au->size();
+	}
+	AU.clear();
+	AUStarted = false;
+	AUBroken  = false;
+	AUKey     = false;
+	AUHasVPS  = false;
+	AUHasSPS  = false;
+	AUHasPPS  = false;
+}
+
+extern "C" {
+
+void* MakeIngest(char** err) {
+	auto ingest            = new Ingest();
+	ingest->Scheduler      = BasicTaskScheduler::createNew();
+	ingest->Env            = BasicUsageEnvironment::createNew(*ingest->Scheduler);
+	ingest->CommandTrigger = ingest->Scheduler->createEventTrigger(RunCommands);
+	if (ingest->CommandTrigger == 0) {
+		*err = strdup("Failed to create live555 event trigger");
+		ingest->Env->reclaim();
+		delete ingest->Scheduler;
+		delete ingest;
+		return nullptr;
+	}
+	ingest->Watchdog = ingest->Scheduler->scheduleDelayedTask(WatchdogIntervalUS, RunWatchdog, ingest);
+	ingest->Thread   = std::thread([ingest]() { ingest->Scheduler->doEventLoop(&ingest->StopLoop); });
+	return ingest;
+}
+
+void Ingest_Close(void* _ingest) {
+	auto ingest = (Ingest*) _ingest;
+	RunSync(ingest, [ingest]() {
+		std::unordered_map<int, IngestStream*> streams;
+		{
+			std::lock_guard<std::mutex> lock(ingest->StreamsLock);
+			std::swap(streams, ingest->Streams);
+		}
+		for (auto& it : streams) {
+			Teardown(it.second);
+			delete it.second;
+		}
+		ingest->Scheduler->unscheduleDelayedTask(ingest->Watchdog);
+		ingest->StopLoop = 1;
+	});
+	ingest->Thread.join();
+	ingest->Scheduler->deleteEventTrigger(ingest->CommandTrigger);
+	ingest->Env->reclaim();
+	delete ingest->Scheduler;
+	delete ingest;
+}
+
+int Ingest_AddStream(void* _ingest, const char* url) {
+	auto        ingest = (Ingest*) _ingest;
+	int         id     = ingest->NextID++;
+	std::string u      = url;
+	Post(ingest, [ingest, id, u]() {
+		auto s    = new IngestStream();
+		s->Parent = ingest;
+		s->ID     = id;
+		s->URL    = u;
+		{
+			std::lock_guard<std::mutex> lock(ingest->StreamsLock);
+			ingest->Streams[id] = s;
+		}
+		Connect(s);
+	});
+	return id;
+}
+
+void Ingest_RemoveStream(void* _ingest, int stream) {
+	auto ingest = (Ingest*) _ingest;
+	RunSync(ingest, [ingest, stream]() {
+		auto s = FindStream(ingest, stream);
+		if (s == nullptr)
+			return;
+		Teardown(s);
+		{
+			std::lock_guard<std::mutex> lock(ingest->StreamsLock);
+			ingest->Streams.erase(stream);
+		}
+		delete s;
+	});
+}
+
+void Ingest_AddSink(void* _ingest, int stream, IngestSinkFunc func, void* context) {
+	auto ingest = (Ingest*) _ingest;
+	Post(ingest, [ingest, stream, func, context]() {
+		if (auto s = FindStream(ingest, stream))
+			s->Sinks.push_back({func, context, true});
+	});
+}
+
+void Ingest_RemoveSink(void* _ingest, int stream, IngestSinkFunc func, void* context) {
+	auto ingest = (Ingest*) _ingest;
+	RunSync(ingest, [ingest, stream, func, context]() {
+		auto s = FindStream(ingest, stream);
+		if (s == nullptr)
+			return;
+		for (size_t i = 0; i < s->Sinks.size(); i++) {
+			if (s->Sinks[i].Func == func && s->Sinks[i].Context == context) {
+				s->Sinks.erase(s->Sinks.begin() + i);
+				break;
+			}
+		}
+	});
+}
+
+int Ingest_Stats(void* _ingest, int stream, IngestStats* stats) {
+	auto                        ingest = (Ingest*) _ingest;
+	std::lock_guard<std::mutex> lock(ingest->StreamsLock);
+	auto                        s = FindStream(ingest, stream);
+	if (s == nullptr)
+		return 0;
+	stats->State       = s->State;
+	stats->Codec       = s->Codec;
+	stats->AccessUnits = s->AccessUnits;
+	stats->Bytes       = s->Bytes;
+	stats->Truncated   = s->Truncated;
+	stats->Reconnects  = s->Reconnects;
+	return 1;
+}
+
+char* Ingest_LastError(void* _ingest, int stream) {
+	auto                        ingest = (Ingest*) _ingest;
+	std::lock_guard<std::mutex> lock(ingest->StreamsLock);
+	auto                        s = FindStream(ingest, stream);
+	if (s == nullptr || s->LastError.empty())
+		return nullptr;
+	return strdup(s->LastError.c_str());
+}
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// A native RTSP ingest engine, built on live555, which hands complete access units to C sinks, so that
+// video can flow from the network into the recorder, the decoder, and an AccessUnitRing without passing
+// through the Go heap.
+// NOTE: This engine is standalone. The server does not use it: cameras are still ingested by gortsplib
+// (see camera.Stream), there is no cgo binding for this API, and nothing in server/ links cyclopsingest.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A sink receives complete H264 or H265 access units (all the NALUs of one frame, each with a 3 byte annex-b prefix).
+// The parameter sets from the SDP (VPS, SPS, PPS) are inserted in front of any keyframe that arrives without them.
+// pts is in nanoseconds. keyframe is 1 if the access unit contains an IDR (H264) or an IRAP picture (H265).
+// Sinks are called on the ingest thread, and the data is only valid for the duration of the call,
+// so a sink must copy what it needs, and must never block.
+// Recorder_OnAccessUnit, Decoder_OnAccessUnit and AccessUnitRing_OnAccessUnit all have this signature.
+typedef void (*IngestSinkFunc)(void* context, const uint8_t* accessUnit, size_t size, int64_t pts, int keyframe);
+
+enum IngestState {
+	IngestStateConnecting = 0, // Busy with DESCRIBE/SETUP/PLAY
+	IngestStatePlaying    = 1, // Receiving packets
+	IngestStateFailed     = 2, // Waiting to reconnect
+};
+
+// These values are the same as VideoCodec in server/videox/nalu.h
+enum IngestCodec {
+	IngestCodecH264 = 0,
+	IngestCodecH265 = 1,
+};
+
+typedef struct IngestStats {
+	int      State;       // IngestState
+	int      Codec;       // IngestCodec. Only valid once State has reached IngestStatePlaying.
+	uint64_t AccessUnits; // Number of access units sent to the sinks
+	uint64_t Bytes;       // Total size of those access units
+	uint64_t Truncated;   // Number of NALUs that were too large for our receive buffer, and were discarded
+	uint64_t Reconnects;  // Number of times we have lost the connection and reconnected
+} IngestStats;
+
+// Start an ingest engine. A single thread runs the event loop for all streams.
+void* MakeIngest(char** err);
+
+// Stop the event loop, disconnect all streams, and destroy the engine.
+void Ingest_Close(void* ingest);
+
+// Start receiving an RTSP stream. Only the first H264 or H265 track is used.
+// Returns an ID for the stream. Connection happens asynchronously, and on failure we keep retrying.
+int Ingest_AddStream(void* ingest, const char* url);
+
+// Disconnect a stream. When this returns, its sinks will not be called again.
+// Must not be called from inside a sink.
+void Ingest_RemoveStream(void* ingest, int stream);
+
+// Add a sink to a stream. The sink will start receiving at the next keyframe.
+void Ingest_AddSink(void* ingest, int stream, IngestSinkFunc func, void* context);
+
+// Remove a sink. When this returns, the sink will not be called again.
+// Must not be called from inside a sink.
+void Ingest_RemoveSink(void* ingest, int stream, IngestSinkFunc func, void* context);
+
+// Returns 0 if there is no such stream
+int Ingest_Stats(void* ingest, int stream, IngestStats* stats);
+
+// Returns the most recent connection error of a stream, or NULL if there is none.
+// The caller must free() the result.
+char* Ingest_LastError(void* ingest, int stream);
+
+#ifdef __cplusplus
+}
+#endif
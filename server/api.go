@@ -48,10 +48,12 @@ func (s *Server) SetupHTTP() {
 	//www.Handle(s.Log, router, "GET", "/", s.httpIndex)
 	protected("v", "GET", "/api/system/info", s.httpSystemGetInfo)
 	protected("a", "POST", "/api/system/restart", s.httpSystemRestart)
+	protected("v", "GET", "/api/system/metrics", s.httpSystemMetrics)
 	protected("v", "GET", "/api/camera/info/:cameraID", s.httpCamGetInfo)
 	protected("v", "GET", "/api/camera/latestImage/:cameraID", s.httpCamGetLatestImage)
 	protected("v", "GET", "/api/camera/recentVideo/:cameraID", s.httpCamGetRecentVideo)
 	protected("v", "GET", "/api/ws/camera/stream/:resolution/:cameraID", s.httpCamStreamVideo)
+	protected("v", "GET", "/api/camera/hls/:resolution/:cameraID/:file", s.httpCamHLS)
 	protected("a", "POST", "/api/config/addCamera", s.httpConfigAddCamera)
 	protected("a", "POST", "/api/config/setVariable/:key", s.httpConfigSetVariable)
 	unprotected("POST", "/api/config/scanNetworkForCameras", s.httpConfigScanNetworkForCameras)
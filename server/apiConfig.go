@@ -16,12 +16,11 @@ func (s *Server) httpConfigAddCamera(w http.ResponseWriter, r *http.Request, par
 	www.ReadJSON(w, r, &cam, 1024*1024)
 	cam.ID = 0
 
-	camera, err := camera.NewCamera(s.Log, cam, s.RingBufferSize)
+	camera, err := camera.NewCamera(s.Log, cam, s.RingBufferSize, s.decodeScheduler)
 	www.Check(err)
 
-	// Make sure we can talk to the camera
-	err = camera.Start()
-	if err != nil {
+	// Make sure we can talk to the camera, before we add it to the DB
+	if err := camera.Probe(); err != nil {
 		camera.Close()
 		www.Check(err)
 	}
@@ -33,6 +32,14 @@ func (s *Server) httpConfigAddCamera(w http.ResponseWriter, r *http.Request, par
 		camera.Close()
 		www.Check(res.Error)
 	}
+	camera.ID = cam.ID
+
+	// Start it the same way as the cameras that we load at startup
+	if err := s.startCamera(camera); err != nil {
+		camera.Close()
+		s.configDB.DB.Delete(&cam)
+		www.Check(err)
+	}
 
 	// Add to live system
 	s.AddCamera(camera)
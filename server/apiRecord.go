@@ -6,6 +6,7 @@ import (
 
 	"github.com/bmharper/cyclops/server/camera"
 	"github.com/bmharper/cyclops/server/configdb"
+	"github.com/bmharper/cyclops/server/eventdb"
 	"github.com/bmharper/cyclops/server/www"
 	"github.com/julienschmidt/httprouter"
 )
@@ -45,9 +46,14 @@ outer:
 		return
 	}
 
-	s.permanentEvents.Save(raw)
+	// User recordings are never rejected by the export queue, and jump ahead of motion recordings
+	err = s.permanentEvents.Export(raw, eventdb.PriorityUser, func(err error) {
+		if err != nil {
+			// TODO: show error to user
+			s.Log.Errorf("Failed to save recording: %v", err)
+		}
+	})
 	if err != nil {
-		// TODO: show error to user
 		s.Log.Errorf("Failed to save recording: %v", err)
 		return
 	}
@@ -4,6 +4,7 @@ import (
 	"net/http"
 
 	"github.com/bmharper/cyclops/server/configdb"
+	"github.com/bmharper/cyclops/server/metrics"
 	"github.com/bmharper/cyclops/server/www"
 	"github.com/julienschmidt/httprouter"
 )
@@ -36,3 +37,20 @@ func (s *Server) httpSystemRestart(w http.ResponseWriter, r *http.Request, param
 		s.Shutdown(true)
 	}()
 }
+
+// Latency and throughput of every stage of the video pipeline, in the Prometheus text format
+func (s *Server) httpSystemMetrics(w http.ResponseWriter, r *http.Request, params httprouter.Params, user *configdb.User) {
+	e := metrics.Exposition{}
+	for _, cam := range s.Cameras() {
+		cam.WriteMetrics(&e)
+	}
+	s.decodeScheduler.WriteMetrics(&e)
+	if s.recentEvents != nil {
+		e.Gauge("cyclops_export_backlog", "Recordings that are queued or busy being exported", metrics.Labels{"db": "recent"}, float64(s.recentEvents.ExportBacklog()))
+	}
+	if s.permanentEvents != nil {
+		e.Gauge("cyclops_export_backlog", "Recordings that are queued or busy being exported", metrics.Labels{"db": "permanent"}, float64(s.permanentEvents.ExportBacklog()))
+	}
+	w.Header().Set("Content-Type", "text/plain; version=0.0.4")
+	e.WriteTo(w)
+}
@@ -34,9 +34,10 @@ func (s *Server) getCameraFromIDOrPanic(idStr string) *camera.Camera {
 }
 
 type streamInfoJSON struct {
-	FPS    int `json:"fps"`
-	Width  int `json:"width"`
-	Height int `json:"height"`
+	FPS     int    `json:"fps"`
+	Width   int    `json:"width"`
+	Height  int    `json:"height"`
+	Decoder string `json:"decoder,omitempty"` // H264 decoder backend, if this stream is being decoded
 }
 
 // See CameraInfo in www
@@ -68,6 +69,7 @@ func toCamInfoJSON(c *camera.Camera) *camInfoJSON {
 		Low:  toStreamInfoJSON(c.LowStream),
 		High: toStreamInfoJSON(c.HighStream),
 	}
+	r.Low.Decoder = c.LowDecoder.DecoderBackend()
 	return r
 }
 
@@ -83,8 +85,11 @@ func (s *Server) httpCamGetLatestImage(w http.ResponseWriter, r *http.Request, p
 
 	www.CacheNever(w)
 
+	// Optional maximum width, eg for a dashboard of thumbnails
+	maxWidth, _ := strconv.Atoi(r.URL.Query().Get("width"))
+
 	contentType := "image/jpeg"
-	img := cam.LatestImage(contentType)
+	img := cam.LatestImage(contentType, maxWidth)
 	if img == nil {
 		www.PanicBadRequestf("No image available yet")
 	}
@@ -105,13 +110,14 @@ func (s *Server) httpCamGetRecentVideo(w http.ResponseWriter, r *http.Request, p
 
 	www.CacheNever(w)
 
-	contentType := "video/mp4"
-	fn := s.TempFiles.Get()
 	raw, err := cam.ExtractHighRes(camera.ExtractMethodClone, duration)
 	www.Check(err)
-	www.Check(raw.SaveToMP4(fn))
 
-	www.SendTempFile(w, fn, contentType)
+	// Stream fragmented MP4 straight out of the ring buffer, without a temp file
+	w.Header().Set("Content-Type", "video/mp4")
+	if err := raw.SaveToMP4Writer(w); err != nil {
+		s.Log.Errorf("httpCamGetRecentVideo failed: %v", err)
+	}
 }
 
 func (s *Server) httpCamStreamVideo(w http.ResponseWriter, r *http.Request, params httprouter.Params, user *configdb.User) {
@@ -140,3 +146,37 @@ func (s *Server) httpCamStreamVideo(w http.ResponseWriter, r *http.Request, para
 	streamer := camera.NewVideoWebSocketStreamer(s.Log)
 	streamer.Run(c, stream, backlog)
 }
+
+// Serve the HLS playlist (index.m3u8) or a segment of a live stream.
+// The packager starts on the first request, so the first playlist request may take a few seconds.
+// LL-HLS blocking playlist reload is supported, with the _HLS_msn query parameter.
+// Example: ffplay http://localhost:8080/api/camera/hls/low/1/index.m3u8
+func (s *Server) httpCamHLS(w http.ResponseWriter, r *http.Request, params httprouter.Params, user *configdb.User) {
+	cam := s.getCameraFromIDOrPanic(params.ByName("cameraID"))
+	hls := cam.GetHLS(parseResolutionOrPanic(params.ByName("resolution")))
+	file := params.ByName("file")
+
+	if file == "index.m3u8" {
+		minSeq := int64(-1)
+		if msn, err := strconv.ParseInt(r.URL.Query().Get("_HLS_msn"), 10, 64); err == nil {
+			minSeq = msn
+		}
+		playlist := hls.Playlist(minSeq, 10*time.Second)
+		if playlist == nil {
+			www.PanicServerError("Stream is not available yet")
+		}
+		www.CacheNever(w)
+		w.Header().Set("Content-Type", "application/vnd.apple.mpegurl")
+		w.Write(playlist)
+		return
+	}
+
+	segment := hls.Segment(file)
+	if segment == nil {
+		www.PanicNotFound()
+	}
+	// Segment names are never reused, so caches (eg a CDN) can hold onto them
+	www.CacheImmutable(w)
+	w.Header().Set("Content-Type", "video/mp2t")
+	w.Write(segment.Data)
+}
@@ -2,9 +2,9 @@ package camera
 
 import (
 	"fmt"
+	"sync"
 	"time"
 
-	"github.com/bmharper/cimg/v2"
 	"github.com/bmharper/cyclops/server/configdb"
 	"github.com/bmharper/cyclops/server/log"
 	"github.com/bmharper/cyclops/server/videox"
@@ -17,6 +17,12 @@ const (
 	ResolutionLow
 )
 
+// When motion is detected, we save this much high res video from before the event, and this much after
+const (
+	MotionPreRoll  = 5 * time.Second
+	MotionPostRoll = 10 * time.Second
+)
+
 // Camera represents a single physical camera, with two streams (high and low res)
 type Camera struct {
 	ID         int64 // Same as ID in database
@@ -27,11 +33,29 @@ type Camera struct {
 	HighDumper *VideoDumpReader
 	LowDecoder *VideoDecodeReader
 	LowDumper  *VideoDumpReader
+	LowFrames  *FrameCache           // JPEGs of LowDecoder's latest frame, shared by all viewers
+	Recorder   *VideoRecorder        // nil unless continuous recording is enabled
+	Motion     *MotionDetector       // Runs on the low res stream, so that we don't need to decode the high res stream to find events
+	Stats      *videox.PipelineStats // Timings of decoding, JPEG compression, and recording (see WriteMetrics)
+	LowHLS     *HLSPackager          // HLS segments of the low res stream, while somebody is watching
+	LumaMotion *LumaMotionDetector   // Confirms Motion's events, by looking at the decoded pixels of the low res stream
+	HighHLS    *HLSPackager          // HLS segments of the high res stream, while somebody is watching
+
+	// If not nil, this is called with the high res video around every motion event.
+	// It runs on its own goroutine. Must be set before Start().
+	OnMotionRecording func(cam *Camera, raw *videox.RawBuffer)
+
 	lowResURL  string
 	highResURL string
+	probed     bool  // True if Probe() has been called
+	probeErr   error // Result of Probe()
+
+	lastRecordingLock sync.Mutex
+	lastRecording     time.Time // When onMotion last started a recording
 }
 
-func NewCamera(log log.Log, cam configdb.Camera, ringBufferSizeBytes int) (*Camera, error) {
+// scheduler runs the low res decoder. If it is nil, the decoder runs on the stream's goroutine.
+func NewCamera(log log.Log, cam configdb.Camera, ringBufferSizeBytes int, scheduler *DecodeScheduler) (*Camera, error) {
 	baseURL := "rtsp://" + cam.Username + ":" + cam.Password + "@" + cam.Host
 	if cam.Port == 0 {
 		baseURL += ":554"
@@ -49,12 +73,25 @@ func NewCamera(log log.Log, cam configdb.Camera, ringBufferSizeBytes int) (*Came
 	}
 
 	highDumper := NewVideoDumpReader(ringBufferSizeBytes)
-	lowDumper := NewVideoDumpReader(1024 * 1024) // just enough so that we always have at least 1 IDR in memory
-	lowDecoder := NewVideoDecodeReader()
+	lowDumper := NewVideoDumpReader(1024 * 1024)       // just enough so that we always have at least 1 IDR in memory
+	lowDecoder := NewVideoDecodeReader(DecodeModeLazy) // We only need the decoded frames when somebody asks for LatestImage, or to confirm motion
+	threadType, err := videox.ParseDecoderThreadType(cam.DecodeThreadType)
+	if err != nil {
+		return nil, err
+	}
+	exclusions, err := ParseExclusionRects(cam.MotionExclusions)
+	if err != nil {
+		return nil, err
+	}
+	stats := videox.PipelineStatsFor(cam.Name)
+	lowDecoder.DecoderOptions.Threads = cam.DecodeThreads
+	lowDecoder.DecoderOptions.Stats = stats
+	lowDecoder.DecoderOptions.ThreadType = threadType
+	lowDecoder.Scheduler = scheduler
 	high := NewStream(log, cam.Name, "high")
 	low := NewStream(log, cam.Name, "low")
 
-	return &Camera{
+	c := &Camera{
 		Name:       cam.Name,
 		Log:        log,
 		LowStream:  low,
@@ -62,16 +99,69 @@ func NewCamera(log log.Log, cam configdb.Camera, ringBufferSizeBytes int) (*Came
 		HighDumper: highDumper,
 		LowDecoder: lowDecoder,
 		LowDumper:  lowDumper,
+		LowFrames:  NewFrameCache(lowDecoder, 85),
+		Motion:     NewMotionDetector(),
+		Stats:      stats,
+		LowHLS:     NewHLSPackager(),
+		HighHLS:    NewHLSPackager(),
+		LumaMotion: NewLumaMotionDetector(),
 		lowResURL:  lowResURL,
 		highResURL: highResURL,
-	}, nil
+	}
+	// The compressed stream is a cheap but noisy pre-filter, so the pixels have the final say
+	c.Motion.OnMotion = c.LumaMotion.Confirm
+	c.LumaMotion.OnMotion = c.onMotion
+	c.LumaMotion.Exclusions = exclusions
+	c.LumaMotion.Stats = stats
+	c.LowFrames.Stats = stats
+	return c, nil
+}
+
+// Connect to both streams and read their SDP, which populates Stream.Info() if the camera sends
+// sprop-parameter-sets. Start() calls this if you haven't already, or if it failed. See also ProbeCameras.
+func (c *Camera) Probe() error {
+	c.probed = true
+	c.probeErr = nil
+	if err := c.HighStream.Describe(c.highResURL); err != nil {
+		c.probeErr = err
+	} else if err := c.LowStream.Describe(c.lowResURL); err != nil {
+		c.HighStream.Client.Close()
+		c.probeErr = err
+	}
+	return c.probeErr
+}
+
+// Probe many cameras at once, with at most maxConcurrent RTSP handshakes in flight.
+// With dozens of cameras this is much faster than starting them one by one, because each
+// handshake is mostly waiting on the network. Returns the error of each camera.
+func ProbeCameras(cameras []*Camera, maxConcurrent int) []error {
+	errs := make([]error, len(cameras))
+	sem := make(chan bool, max(maxConcurrent, 1))
+	wg := sync.WaitGroup{}
+	for i, c := range cameras {
+		wg.Add(1)
+		sem <- true
+		go func(i int, c *Camera) {
+			defer wg.Done()
+			errs[i] = c.Probe()
+			<-sem
+		}(i, c)
+	}
+	wg.Wait()
+	return errs
 }
 
 func (c *Camera) Start() error {
-	if err := c.HighStream.Listen(c.highResURL); err != nil {
+	// A failed probe is retried, so that a network blip during ProbeCameras doesn't leave the camera dead
+	if !c.probed || c.probeErr != nil {
+		if err := c.Probe(); err != nil {
+			return err
+		}
+	}
+	if err := c.HighStream.Play(); err != nil {
 		return err
 	}
-	if err := c.LowStream.Listen(c.lowResURL); err != nil {
+	if err := c.LowStream.Play(); err != nil {
 		return err
 	}
 	if err := c.HighStream.ConnectSinkAndRun(c.HighDumper); err != nil {
@@ -83,10 +173,35 @@ func (c *Camera) Start() error {
 	if err := c.LowStream.ConnectSinkAndRun(c.LowDumper); err != nil {
 		return err
 	}
+	if err := c.LowStream.ConnectSinkAndRun(c.Motion); err != nil {
+		return err
+	}
+	if err := c.LowStream.ConnectSinkAndRun(c.LowHLS); err != nil {
+		return err
+	}
+	if err := c.HighStream.ConnectSinkAndRun(c.HighHLS); err != nil {
+		return err
+	}
+	if err := c.LumaMotion.Start(c.LowStream.Log, c.LowDecoder); err != nil {
+		return err
+	}
+	return nil
+}
+
+// Start writing the high res stream continuously to files inside root.
+// This must be called after Start().
+func (c *Camera) StartContinuousRecording(root string, segmentDuration time.Duration) error {
+	recorder := NewVideoRecorder(root, segmentDuration)
+	recorder.Stats = c.Stats
+	if err := c.HighStream.ConnectSinkAndRun(recorder); err != nil {
+		return err
+	}
+	c.Recorder = recorder
 	return nil
 }
 
 func (c *Camera) Close() {
+	c.LumaMotion.Close()
 	if c.LowStream != nil {
 		c.LowStream.Close()
 		c.LowStream = nil
@@ -97,22 +212,11 @@ func (c *Camera) Close() {
 	}
 }
 
-func (c *Camera) LatestImage(contentType string) []byte {
-	img := c.LowDecoder.LastImage()
-	if img == nil {
-		return nil
-	}
-	img2, err := cimg.FromImage(img, true)
-	if err != nil {
-		c.Log.Errorf("Failed to wrap decoded image into cimg: %v", err)
-		return nil
-	}
-	buf, err := cimg.Compress(img2, cimg.MakeCompressParams(cimg.Sampling(cimg.Sampling420), 85, cimg.Flags(0)))
-	if err != nil {
-		c.Log.Errorf("Failed to compress image: %v", err)
-		return nil
-	}
-	return buf
+// Returns a JPEG of the most recent low res frame, or nil if there is none yet.
+// If maxWidth is not zero, the image is downscaled (see FrameCache.LatestJPEG).
+// The returned slice is shared, so it must not be modified.
+func (c *Camera) LatestImage(contentType string, maxWidth int) []byte {
+	return c.LowFrames.LatestJPEG(maxWidth)
 }
 
 // Extract from <now - duration> until <now>.
@@ -121,6 +225,44 @@ func (c *Camera) ExtractHighRes(method ExtractMethod, duration time.Duration) (*
 	return c.HighDumper.ExtractRawBuffer(method, duration)
 }
 
+// Extract the high res video around a motion event, once the post-roll has been recorded
+func (c *Camera) onMotion(pts time.Duration) {
+	handler := c.OnMotionRecording
+	if handler == nil {
+		return
+	}
+	// A recording that is still busy with its post-roll already covers this event
+	c.lastRecordingLock.Lock()
+	recent := time.Since(c.lastRecording) < MotionPostRoll
+	if !recent {
+		c.lastRecording = time.Now()
+	}
+	c.lastRecordingLock.Unlock()
+	if recent {
+		return
+	}
+	go func() {
+		time.Sleep(MotionPostRoll)
+		raw, err := c.ExtractHighRes(ExtractMethodClone, MotionPreRoll+MotionPostRoll)
+		if err != nil {
+			c.Log.Errorf("Failed to extract motion recording from %v: %v", c.Name, err)
+			return
+		}
+		handler(c, raw)
+	}()
+}
+
+// Get the HLS packager of either the high or low resolution stream
+func (c *Camera) GetHLS(resolution Resolution) *HLSPackager {
+	switch resolution {
+	case ResolutionLow:
+		return c.LowHLS
+	case ResolutionHigh:
+		return c.HighHLS
+	}
+	return nil
+}
+
 // Get either the high or low resolution stream
 func (c *Camera) GetStream(resolution Resolution) *Stream {
 	switch resolution {
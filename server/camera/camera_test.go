@@ -0,0 +1,52 @@
+package camera
+
+import (
+	"net"
+	"testing"
+	"time"
+
+	"github.com/bmharper/cyclops/server/configdb"
+	"github.com/bmharper/cyclops/server/log"
+	"github.com/stretchr/testify/require"
+)
+
+// A probe that fails during startup must not stop a later Start() from trying again
+func TestStartRetriesFailedProbe(t *testing.T) {
+	// Find a free port, and close it, so that the first probe is refused
+	l, err := net.Listen("tcp", "127.0.0.1:0")
+	require.NoError(t, err)
+	port := l.Addr().(*net.TCPAddr).Port
+	l.Close()
+
+	cam, err := NewCamera(log.NewTestingLog(t), configdb.Camera{
+		Model: string(CameraModelHikVision),
+		Name:  "test",
+		Host:  "127.0.0.1",
+		Port:  port,
+	}, 1024*1024, nil)
+	require.NoError(t, err)
+	errs := ProbeCameras([]*Camera{cam}, 1)
+	require.Error(t, errs[0])
+
+	// The camera comes back. We're not an RTSP server, so Start still fails, but it must connect to us.
+	l, err = net.Listen("tcp", l.Addr().String())
+	require.NoError(t, err)
+	defer l.Close()
+	accepted := make(chan bool, 10)
+	go func() {
+		for {
+			conn, err := l.Accept()
+			if err != nil {
+				return
+			}
+			accepted <- true
+			conn.Close()
+		}
+	}()
+	require.Error(t, cam.Start())
+	select {
+	case <-accepted:
+	case <-time.After(5 * time.Second):
+		require.Fail(t, "Start did not probe the camera again")
+	}
+}
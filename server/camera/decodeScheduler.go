@@ -0,0 +1,294 @@
+package camera
+
+import (
+	"runtime"
+	"sync"
+	"sync/atomic"
+	"syscall"
+	"time"
+	"unsafe"
+
+	"github.com/bmharper/cyclops/server/log"
+	"github.com/bmharper/cyclops/server/metrics"
+	"github.com/bmharper/cyclops/server/videox"
+)
+
+// DecodeScheduler runs the H264 decodes of many VideoDecodeReaders on a fixed number of worker threads,
+// so that a busy system degrades one camera at a time, instead of every stream stuttering together.
+// Each reader has its own queue, and the jobs of one reader always run in order, on one worker at a time.
+// Readers that somebody is watching (see VideoDecodeReader.LastImage) are served before the others.
+// When all workers are busy and work is piling up, we skip the non-reference frames of readers that
+// nobody is watching. Nothing depends on those frames, so the decoder's output stays intact.
+// If a reader's queue overflows anyway, we drop its frames until the next IDR.
+type DecodeScheduler struct {
+	Log           log.Log
+	MaxQueue      int           // Jobs that a reader may have queued before we drop its frames until the next IDR
+	WatchedPeriod time.Duration // A reader counts as watched for this long after somebody asks for its latest frame
+
+	Shed    atomic.Uint64     // Non-reference frames skipped, because we were saturated
+	Dropped atomic.Uint64     // NALUs dropped, because a reader's queue overflowed
+	Wait    metrics.Histogram // Time from queueing a job until a worker starts it
+
+	lock    sync.Mutex
+	cond    *sync.Cond
+	workers int
+	busy    int // Number of workers running jobs
+	queued  int // Number of jobs in all queues
+	queues  []*decodeQueue
+	next    int // Round robin position in queues
+	closed  bool
+	wg      sync.WaitGroup
+}
+
+type decodeQueue struct {
+	reader  *VideoDecodeReader
+	jobs    []decodeJob
+	running bool // True while a worker is running our jobs
+	waitIDR bool // Our queue overflowed, so we're dropping frames until the next IDR
+}
+
+type decodeJob struct {
+	nalu   videox.NALU
+	flush  chan bool // If not nil, then instead of decoding nalu, we decode the reader's pending NALUs, and close flush
+	queued time.Time
+}
+
+// Start a scheduler with the given number of worker threads. Worker i is pinned to core i (modulo the number of cores).
+func NewDecodeScheduler(logger log.Log, workers int) *DecodeScheduler {
+	s := &DecodeScheduler{
+		Log:           log.NewPrefixLogger(logger, "DecodeScheduler"),
+		MaxQueue:      60,
+		WatchedPeriod: 10 * time.Second,
+		workers:       max(workers, 1),
+	}
+	s.cond = sync.NewCond(&s.lock)
+	for i := 0; i < s.workers; i++ {
+		s.wg.Add(1)
+		go s.worker(i)
+	}
+	s.Log.Infof("Started %v decode workers", s.workers)
+	return s
+}
+
+// Stop the workers. Queued jobs are discarded.
+func (s *DecodeScheduler) Close() {
+	s.lock.Lock()
+	s.closed = true
+	s.cond.Broadcast()
+	s.lock.Unlock()
+	s.wg.Wait()
+
+	s.lock.Lock()
+	for _, q := range s.queues {
+		q.discard()
+	}
+	s.queues = nil
+	s.queued = 0
+	s.lock.Unlock()
+}
+
+// Returns true if every worker is busy, and there is more work waiting
+func (s *DecodeScheduler) Saturated() bool {
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	return s.saturatedNoLock()
+}
+
+func (s *DecodeScheduler) saturatedNoLock() bool {
+	return s.busy == s.workers && s.queued > s.workers
+}
+
+// Returns the number of jobs waiting for a worker
+func (s *DecodeScheduler) Queued() int {
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	return s.queued
+}
+
+func (s *DecodeScheduler) WriteMetrics(e *metrics.Exposition) {
+	e.Gauge("cyclops_decode_queued", "Decode jobs waiting for a worker", nil, float64(s.Queued()))
+	e.Counter("cyclops_decode_shed_total", "Non-reference frames skipped because the decoders were saturated", nil, float64(s.Shed.Load()))
+	e.Counter("cyclops_decode_dropped_total", "NALUs dropped because a camera's decode queue overflowed", nil, float64(s.Dropped.Load()))
+	e.Histogram("cyclops_decode_wait_seconds", "Time that a decode job waits for a worker", nil, s.Wait.Snapshot())
+}
+
+func (s *DecodeScheduler) add(r *VideoDecodeReader) {
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	s.queues = append(s.queues, &decodeQueue{reader: r})
+}
+
+// If a worker is busy with r's jobs, it finishes them, but r.Decoder is nil by then, so that's cheap.
+func (s *DecodeScheduler) remove(r *VideoDecodeReader) {
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	for i, q := range s.queues {
+		if q.reader == r {
+			s.queued -= len(q.jobs)
+			q.discard()
+			s.queues = append(s.queues[:i], s.queues[i+1:]...)
+			return
+		}
+	}
+}
+
+// You must be holding lock
+func (s *DecodeScheduler) find(r *VideoDecodeReader) *decodeQueue {
+	for _, q := range s.queues {
+		if q.reader == r {
+			return q
+		}
+	}
+	return nil
+}
+
+// Queue a NALU for decoding. Returns false if the NALU was skipped or dropped.
+func (s *DecodeScheduler) decode(r *VideoDecodeReader, nalu videox.NALU) bool {
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	q := s.find(r)
+	if q == nil || s.closed {
+		return false
+	}
+
+	kind := nalu.Kind(r.Codec)
+	visual := kind.IsVisual()
+	if q.waitIDR {
+		if kind != videox.NALUKindKeyframe {
+			if visual {
+				s.Dropped.Add(1)
+				return false
+			}
+		} else {
+			q.waitIDR = false
+		}
+	}
+	if visual && nalu.IsNonReference(r.Codec) && s.saturatedNoLock() && !r.watched() {
+		s.Shed.Add(1)
+		return false
+	}
+	if len(q.jobs) >= s.MaxQueue {
+		// Drop every queued frame, because the frames that follow would be decoded from a broken reference.
+		// Parameter sets are kept, because the next keyframe needs them.
+		keep := q.jobs[:0]
+		for _, j := range q.jobs {
+			if j.flush != nil || !j.nalu.Kind(r.Codec).IsVisual() {
+				keep = append(keep, j)
+			}
+		}
+		s.Dropped.Add(uint64(len(q.jobs) - len(keep)))
+		s.queued -= len(q.jobs) - len(keep)
+		q.jobs = keep
+		if kind != videox.NALUKindKeyframe {
+			q.waitIDR = true
+			if visual {
+				s.Dropped.Add(1)
+				return false
+			}
+		}
+	}
+	s.push(q, decodeJob{nalu: nalu, queued: time.Now()})
+	return true
+}
+
+// Decode r's pending NALUs (DecodeModeLazy) on a worker, and wait for that to finish.
+// Returns false if we're closed, or r is not one of ours, in which case the caller should do it itself.
+func (s *DecodeScheduler) flush(r *VideoDecodeReader) bool {
+	done := make(chan bool)
+	s.lock.Lock()
+	q := s.find(r)
+	if q == nil || s.closed {
+		s.lock.Unlock()
+		return false
+	}
+	s.push(q, decodeJob{flush: done, queued: time.Now()})
+	s.lock.Unlock()
+	<-done
+	return true
+}
+
+// You must be holding lock
+func (s *DecodeScheduler) push(q *decodeQueue, job decodeJob) {
+	q.jobs = append(q.jobs, job)
+	s.queued++
+	s.cond.Signal()
+}
+
+// Pick the next queue to run. Watched readers go first, and within each class we go round robin.
+// You must be holding lock.
+func (s *DecodeScheduler) pick() *decodeQueue {
+	n := len(s.queues)
+	for pass := 0; pass < 2; pass++ {
+		for i := 0; i < n; i++ {
+			idx := (s.next + i) % n
+			q := s.queues[idx]
+			if q.running || len(q.jobs) == 0 || (pass == 0 && !q.reader.watched()) {
+				continue
+			}
+			s.next = (idx + 1) % n
+			return q
+		}
+	}
+	return nil
+}
+
+func (s *DecodeScheduler) worker(i int) {
+	defer s.wg.Done()
+	// The decoder's state is hot in this core's cache, so stay on it
+	runtime.LockOSThread()
+	if err := pinThreadToCore(i % runtime.NumCPU()); err != nil {
+		s.Log.Warnf("Failed to pin decode worker %v to a core: %v", i, err)
+	}
+
+	s.lock.Lock()
+	for {
+		if s.closed {
+			break
+		}
+		q := s.pick()
+		if q == nil {
+			s.cond.Wait()
+			continue
+		}
+		jobs := q.jobs
+		q.jobs = nil
+		q.running = true
+		s.queued -= len(jobs)
+		s.busy++
+		s.lock.Unlock()
+
+		for _, j := range jobs {
+			s.Wait.Since(j.queued)
+		}
+		q.reader.runJobs(jobs)
+
+		s.lock.Lock()
+		s.busy--
+		q.running = false
+	}
+	s.lock.Unlock()
+}
+
+// Release anybody waiting on a flush. You must be holding lock.
+func (q *decodeQueue) discard() {
+	for _, j := range q.jobs {
+		if j.flush != nil {
+			close(j.flush)
+		}
+	}
+	q.jobs = nil
+}
+
+// Pin the calling OS thread to the given core (Linux)
+func pinThreadToCore(core int) error {
+	var mask [16]uint64 // up to 1024 cores, which is the size of glibc's cpu_set_t
+	if core >= len(mask)*64 {
+		return nil
+	}
+	mask[core/64] |= 1 << (core % 64)
+	_, _, errno := syscall.RawSyscall(syscall.SYS_SCHED_SETAFFINITY, 0, unsafe.Sizeof(mask), uintptr(unsafe.Pointer(&mask[0])))
+	if errno != 0 {
+		return errno
+	}
+	return nil
+}
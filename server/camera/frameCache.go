@@ -0,0 +1,96 @@
+package camera
+
+import (
+	"image"
+	"sync"
+	"time"
+
+	"github.com/bmharper/cyclops/server/videox"
+)
+
+// Maximum number of distinct image sizes that FrameCache will hold
+const frameCacheMaxSizes = 4
+
+// FrameCache holds JPEG encodings of the latest decoded frame, so that any number of viewers can
+// poll for the latest image, but we compress at most once per decoded frame (per size).
+// Nothing is decoded or compressed until somebody asks for it (a viewer, or LumaMotionDetector confirming an event).
+type FrameCache struct {
+	Decoder *VideoDecodeReader
+	Quality int                   // JPEG quality
+	Stats   *videox.PipelineStats // May be nil
+
+	lock    sync.Mutex
+	entries []*frameCacheEntry
+}
+
+type frameCacheEntry struct {
+	halvings int   // Number of times the frame was halved in size (0 = full resolution)
+	seq      int64 // Sequence number of the frame that jpeg was compressed from (Frame.Seq, as passed to WithLastImage)
+	jpeg     []byte
+	lastUsed time.Time
+}
+
+func NewFrameCache(decoder *VideoDecodeReader, quality int) *FrameCache {
+	return &FrameCache{
+		Decoder: decoder,
+		Quality: quality,
+	}
+}
+
+// Returns a JPEG of the latest frame, or nil if no frame has been decoded yet.
+// If maxWidth is not zero, the frame is halved in size until its width is at most maxWidth
+// (but never below maxWidth/2), which keeps the number of cached sizes small.
+// The returned slice is shared with other callers, so it must not be modified.
+func (f *FrameCache) LatestJPEG(maxWidth int) []byte {
+	f.lock.Lock()
+	defer f.lock.Unlock()
+
+	var jpeg []byte
+	f.Decoder.WithLastImage(func(img *image.YCbCr, seq int64) {
+		if img == nil {
+			return
+		}
+		halvings := 0
+		for w := img.Rect.Dx(); maxWidth > 0 && w > maxWidth && w > 1; w /= 2 {
+			halvings++
+		}
+		entry := f.entry(halvings)
+		if entry.jpeg == nil || entry.seq != seq {
+			for i := 0; i < halvings; i++ {
+				img = videox.HalveYCbCr(img)
+			}
+			buf, err := videox.CompressYCbCrJPEG(img, f.Quality, f.Stats)
+			if err != nil {
+				f.Decoder.Log.Errorf("Failed to compress image: %v", err)
+				return
+			}
+			entry.jpeg = buf
+			entry.seq = seq
+		}
+		entry.lastUsed = time.Now()
+		jpeg = entry.jpeg
+	})
+	return jpeg
+}
+
+// Find or create the entry for the given size.
+// If we are full, the least recently used size is recycled.
+// You must be holding lock.
+func (f *FrameCache) entry(halvings int) *frameCacheEntry {
+	var oldest *frameCacheEntry
+	for _, e := range f.entries {
+		if e.halvings == halvings {
+			return e
+		}
+		if oldest == nil || e.lastUsed.Before(oldest.lastUsed) {
+			oldest = e
+		}
+	}
+	if len(f.entries) < frameCacheMaxSizes {
+		e := &frameCacheEntry{halvings: halvings}
+		f.entries = append(f.entries, e)
+		return e
+	}
+	*oldest = frameCacheEntry{halvings: halvings}
+	return oldest
+}
@@ -0,0 +1,148 @@
+package camera
+
+import (
+	"context"
+	"image"
+	"sync"
+	"sync/atomic"
+
+	"github.com/bmharper/cyclops/server/videox"
+)
+
+// Maximum number of frames that frameSlots will allocate.
+// We need three for triple buffering (latest, being written, and one held by a slow reader),
+// and a few more give readers that hold onto a frame for a long time some headroom.
+const frameSlotsMax = 6
+
+// frameSlots holds the most recent decoded frame, for any number of readers, without ever making the
+// decoder wait for a reader (or vice versa).
+// The decoder writes each new frame into a slot that is neither the latest frame nor held by a reader,
+// and then publishes it with an atomic swap. Readers take a reference to the latest slot, which
+// keeps the decoder away from it until they release it.
+// Only one goroutine (the decoder) may call publish at a time.
+type frameSlots struct {
+	slots  []*frameSlot // Only touched by publish
+	latest atomic.Pointer[frameSlot]
+	seq    int64 // Sequence number of the most recent publish. Only touched by publish.
+
+	notifyLock sync.Mutex
+	notify     chan struct{} // Closed on the next wake(). nil if nobody is waiting.
+}
+
+type frameSlot struct {
+	img  *image.YCbCr
+	seq  int64
+	refs atomic.Int32
+}
+
+// Frame is a reference to a decoded frame. The frame will not change until you call Release.
+type Frame struct {
+	Image *image.YCbCr
+	Seq   int64 // Incremented with every decoded frame
+	slot  *frameSlot
+}
+
+// Release the frame, so that its memory can be reused for a later frame.
+// After this, you must not touch Image.
+func (f *Frame) Release() {
+	if f.slot != nil {
+		f.slot.refs.Add(-1)
+		f.slot = nil
+	}
+}
+
+// Copy img into a free slot, and make it the latest frame.
+// Returns false if all slots are held by readers, in which case the frame is dropped.
+func (s *frameSlots) publish(img *image.YCbCr) bool {
+	latest := s.latest.Load()
+	var slot *frameSlot
+	for _, candidate := range s.slots {
+		if candidate != latest && candidate.refs.Load() == 0 {
+			slot = candidate
+			break
+		}
+	}
+	if slot == nil {
+		if len(s.slots) >= frameSlotsMax {
+			return false
+		}
+		slot = &frameSlot{}
+		s.slots = append(s.slots, slot)
+	}
+	// A reader can still take a reference to slot here, if it loaded latest before slot stopped
+	// being the latest, but acquire() will notice that slot isn't the latest anymore, and let go.
+	s.seq++
+	slot.img = videox.CloneYCbCr(slot.img, img)
+	slot.seq = s.seq
+	s.latest.Store(slot)
+	s.wake()
+	return true
+}
+
+// Returns the latest frame, or nil if there is none yet. You must Release the frame when you're done.
+func (s *frameSlots) acquire() *Frame {
+	for {
+		slot := s.latest.Load()
+		if slot == nil {
+			return nil
+		}
+		slot.refs.Add(1)
+		if s.latest.Load() == slot {
+			return &Frame{Image: slot.img, Seq: slot.seq, slot: slot}
+		}
+		// The decoder published another frame in between, so it might be writing into slot now
+		slot.refs.Add(-1)
+	}
+}
+
+// Returns the sequence number of the latest frame, or 0 if there is none yet
+func (s *frameSlots) latestSeq() int64 {
+	if slot := s.latest.Load(); slot != nil {
+		return slot.seq
+	}
+	return 0
+}
+
+// Returns a channel that is closed on the next wake()
+func (s *frameSlots) changed() <-chan struct{} {
+	s.notifyLock.Lock()
+	defer s.notifyLock.Unlock()
+	if s.notify == nil {
+		s.notify = make(chan struct{})
+	}
+	return s.notify
+}
+
+// Wake up everybody waiting on changed(). This is cheap if nobody is waiting.
+func (s *frameSlots) wake() {
+	s.notifyLock.Lock()
+	if s.notify != nil {
+		close(s.notify)
+		s.notify = nil
+	}
+	s.notifyLock.Unlock()
+}
+
+// Wait until a frame newer than afterSeq has been published, and return it.
+// If poll is not nil, it is called before every check, which lets a lazy decoder decode on demand.
+func (s *frameSlots) waitForNext(ctx context.Context, afterSeq int64, poll func()) (*Frame, error) {
+	for {
+		// Grab the channel before checking, so that we can't miss a wake() in between
+		changed := s.changed()
+		if poll != nil {
+			poll()
+		}
+		if s.latestSeq() > afterSeq {
+			if f := s.acquire(); f != nil && f.Seq > afterSeq {
+				return f, nil
+			} else if f != nil {
+				f.Release()
+			}
+		}
+		select {
+		case <-changed:
+		case <-ctx.Done():
+			return nil, ctx.Err()
+		}
+	}
+}
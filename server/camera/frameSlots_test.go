@@ -0,0 +1,117 @@
+package camera
+
+import (
+	"context"
+	"fmt"
+	"image"
+	"sync"
+	"testing"
+	"time"
+
+	"github.com/stretchr/testify/require"
+)
+
+// Make a frame whose pixels are all v
+func testFrame(v byte) *image.YCbCr {
+	img := image.NewYCbCr(image.Rect(0, 0, 16, 8), image.YCbCrSubsampleRatio420)
+	for _, p := range [][]byte{img.Y, img.Cb, img.Cr} {
+		for i := range p {
+			p[i] = v
+		}
+	}
+	return img
+}
+
+func TestFrameSlots(t *testing.T) {
+	s := frameSlots{}
+	require.Nil(t, s.acquire())
+
+	require.True(t, s.publish(testFrame(1)))
+	f1 := s.acquire()
+	require.Equal(t, int64(1), f1.Seq)
+
+	// A held frame must never be overwritten, no matter how many frames follow it
+	for i := 2; i < 20; i++ {
+		s.publish(testFrame(byte(i)))
+	}
+	for _, p := range [][]byte{f1.Image.Y, f1.Image.Cb, f1.Image.Cr} {
+		for _, v := range p {
+			require.Equal(t, byte(1), v)
+		}
+	}
+	f1.Release()
+	latest := s.acquire()
+	require.Equal(t, int64(19), latest.Seq)
+	require.Equal(t, byte(19), latest.Image.Y[0])
+
+	// When readers hold every slot, new frames are dropped, and readers see the latest one that fit
+	held := []*Frame{latest}
+	for i := 20; len(held) < frameSlotsMax; i++ {
+		require.True(t, s.publish(testFrame(byte(i))))
+		held = append(held, s.acquire())
+	}
+	require.False(t, s.publish(testFrame(100)))
+	require.Equal(t, held[len(held)-1].Seq, s.latestSeq())
+	for _, f := range held {
+		f.Release()
+	}
+	require.True(t, s.publish(testFrame(101)))
+	require.LessOrEqual(t, len(s.slots), frameSlotsMax)
+}
+
+func TestFrameSlotsWait(t *testing.T) {
+	s := frameSlots{}
+	ctx, cancel := context.WithTimeout(context.Background(), time.Millisecond)
+	_, err := s.waitForNext(ctx, 0, nil)
+	cancel()
+	require.ErrorIs(t, err, context.DeadlineExceeded)
+
+	// Readers racing against the decoder must always see whole frames, in order.
+	// require may only be used on the test goroutine, so the readers report failures through errs.
+	wg := sync.WaitGroup{}
+	errs := make(chan error, 4)
+	for r := 0; r < 4; r++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			errs <- readFrameSlots(&s, 200)
+		}()
+	}
+	for i := 1; i <= 200; i++ {
+		for !s.publish(testFrame(byte(i))) {
+			time.Sleep(time.Microsecond)
+		}
+	}
+	wg.Wait()
+	close(errs)
+	for err := range errs {
+		require.NoError(t, err)
+	}
+}
+
+// Wait for frames until we've seen lastSeq, and check that each one is whole, and newer than the previous
+func readFrameSlots(s *frameSlots, lastSeq int64) error {
+	seq := int64(0)
+	for seq < lastSeq {
+		f, err := s.waitForNext(context.Background(), seq, nil)
+		if err != nil {
+			return err
+		}
+		if f.Seq <= seq {
+			f.Release()
+			return fmt.Errorf("Frame %v arrived after frame %v", f.Seq, seq)
+		}
+		v := f.Image.Y[0]
+		for _, p := range [][]byte{f.Image.Y, f.Image.Cb, f.Image.Cr} {
+			for _, x := range p {
+				if x != v {
+					f.Release()
+					return fmt.Errorf("Frame %v is torn (%v != %v)", f.Seq, x, v)
+				}
+			}
+		}
+		seq = f.Seq
+		f.Release()
+	}
+	return nil
+}
@@ -0,0 +1,190 @@
+package camera
+
+import (
+	"encoding/base64"
+	"strings"
+	"time"
+
+	"github.com/aler9/gortsplib"
+	"github.com/bmharper/cyclops/server/videox"
+)
+
+// If an access unit grows beyond this, then we've lost its marker packet, and we give up on it
+const maxH265AccessUnitSize = 16 * 1024 * 1024
+
+// If track is H265, returns the parameter sets from its SDP (any of which may be nil, if the camera
+// doesn't send sprop-vps, sprop-sps or sprop-pps). gortsplib doesn't know H265, so these are TrackGeneric.
+func h265TrackParams(track gortsplib.Track) (videox.ParameterSets, bool) {
+	params := videox.ParameterSets{}
+	md := track.MediaDescription()
+	if md == nil {
+		return params, false
+	}
+	// a=rtpmap:96 H265/90000
+	rtpmap, _ := md.Attribute("rtpmap")
+	_, encoding, _ := strings.Cut(rtpmap, " ")
+	codec, _, _ := strings.Cut(encoding, "/")
+	if !strings.EqualFold(codec, "H265") {
+		return params, false
+	}
+	// a=fmtp:96 sprop-vps=QAEMAf//...; sprop-sps=QgEBAWAA...; sprop-pps=RAHA8vA8kA==
+	fmtp, _ := md.Attribute("fmtp")
+	_, fmtp, _ = strings.Cut(fmtp, " ")
+	for _, kv := range strings.Split(fmtp, ";") {
+		key, value, _ := strings.Cut(strings.TrimSpace(kv), "=")
+		// A parameter may hold several comma separated NALUs, but cameras only send one
+		value, _, _ = strings.Cut(value, ",")
+		raw, err := base64.StdEncoding.DecodeString(value)
+		if err != nil || len(raw) == 0 {
+			continue
+		}
+		switch strings.ToLower(key) {
+		case "sprop-vps":
+			params.VPS = raw
+		case "sprop-sps":
+			params.SPS = raw
+		case "sprop-pps":
+			params.PPS = raw
+		}
+	}
+	return params, true
+}
+
+// h265Depacketizer reassembles H265 access units from RTP packets (RFC 7798).
+// gortsplib only does this for H264, so an H265 track reaches us as raw RTP.
+// We support single NALU packets, aggregation packets, and fragmentation units, without DONL
+// (ie sprop-max-don-diff = 0, which is what cameras send). PACI packets are ignored.
+// Like gortsplib, the NALUs that we return are only valid until the next call to decode.
+type h265Depacketizer struct {
+	clockRate int
+
+	au        []byte   // NALUs of the current access unit, back to back. Reused for every access unit.
+	ends      []int    // End offset in au of every complete NALU
+	fragStart int      // Offset in au of the fragmented NALU that we're reassembling, or -1
+	auTS      uint32   // RTP timestamp of the current access unit
+	nalus     [][]byte // Returned by decode
+
+	started bool
+	nextSeq uint16
+	lastTS  uint32 // RTP timestamp of the last access unit that we returned
+	ticks   int64  // RTP clock ticks from the first access unit to lastTS
+}
+
+func newH265Depacketizer(clockRate int) *h265Depacketizer {
+	if clockRate <= 0 {
+		clockRate = 90000 // RFC 7798 mandates 90 kHz
+	}
+	return &h265Depacketizer{
+		clockRate: clockRate,
+		fragStart: -1,
+	}
+}
+
+// Feed in one RTP packet. When the packet completes an access unit, that access unit is returned,
+// along with its PTS, which is relative to the first access unit.
+func (d *h265Depacketizer) decode(seq uint16, timestamp uint32, marker bool, payload []byte) ([][]byte, time.Duration, bool) {
+	if !d.started {
+		d.started = true
+		d.nextSeq = seq
+		d.lastTS = timestamp
+	}
+	if seq != d.nextSeq || (d.inProgress() && timestamp != d.auTS) {
+		// We lost packets, so the access unit that we're busy with is incomplete
+		d.reset()
+	}
+	d.nextSeq = seq + 1
+	d.auTS = timestamp
+
+	if len(payload) < 2 {
+		return nil, 0, false
+	}
+	switch (payload[0] >> 1) & 63 {
+	case 48: // Aggregation packet: 16 bit size, then NALU, repeated
+		p := payload[2:]
+		for len(p) >= 2 {
+			size := int(p[0])<<8 | int(p[1])
+			if size == 0 || 2+size > len(p) {
+				d.reset()
+				return nil, 0, false
+			}
+			d.appendNALU(p[2 : 2+size])
+			p = p[2+size:]
+		}
+	case 49: // Fragmentation unit: 2 byte payload header, then the FU header
+		if len(payload) < 3 {
+			d.reset()
+			return nil, 0, false
+		}
+		fu := payload[2]
+		if fu&0x80 != 0 {
+			// Start of a fragmented NALU. Rebuild its header from the payload header and the FU type.
+			d.dropFragment()
+			d.fragStart = len(d.au)
+			d.au = append(d.au, payload[0]&0x81|(fu&63)<<1, payload[1])
+		} else if d.fragStart == -1 {
+			// We missed the start of this NALU
+			return nil, 0, false
+		}
+		d.au = append(d.au, payload[3:]...)
+		if fu&0x40 != 0 {
+			d.ends = append(d.ends, len(d.au))
+			d.fragStart = -1
+		}
+	case 50: // PACI
+		return nil, 0, false
+	default:
+		d.appendNALU(payload)
+	}
+
+	if len(d.au) > maxH265AccessUnitSize {
+		d.reset()
+		return nil, 0, false
+	}
+	if !marker {
+		return nil, 0, false
+	}
+	d.dropFragment()
+	if len(d.ends) == 0 {
+		return nil, 0, false
+	}
+	d.nalus = d.nalus[:0]
+	start := 0
+	for _, end := range d.ends {
+		d.nalus = append(d.nalus, d.au[start:end])
+		start = end
+	}
+	// The difference is signed, so that the 32 bit RTP clock can wrap around
+	d.ticks += int64(int32(timestamp - d.lastTS))
+	d.lastTS = timestamp
+	rate := int64(d.clockRate)
+	pts := time.Duration(d.ticks/rate)*time.Second + time.Duration(d.ticks%rate)*time.Second/time.Duration(rate)
+	// The NALUs still point into au, which is only overwritten by the next decode
+	d.au = d.au[:0]
+	d.ends = d.ends[:0]
+	return d.nalus, pts, true
+}
+
+func (d *h265Depacketizer) inProgress() bool {
+	return len(d.au) != 0
+}
+
+func (d *h265Depacketizer) appendNALU(nalu []byte) {
+	d.dropFragment()
+	d.au = append(d.au, nalu...)
+	d.ends = append(d.ends, len(d.au))
+}
+
+// Discard a fragmented NALU whose end we never saw
+func (d *h265Depacketizer) dropFragment() {
+	if d.fragStart != -1 {
+		d.au = d.au[:d.fragStart]
+		d.fragStart = -1
+	}
+}
+
+// Discard the current access unit
+func (d *h265Depacketizer) reset() {
+	d.au = d.au[:0]
+	d.ends = d.ends[:0]
+	d.fragStart = -1
+}
@@ -0,0 +1,72 @@
+package camera
+
+import (
+	"testing"
+	"time"
+
+	"github.com/stretchr/testify/require"
+)
+
+func TestH265Depacketizer(t *testing.T) {
+	d := newH265Depacketizer(90000)
+	seq := uint16(65530) // wraps around during the test
+	ts := uint32(0xffffff00)
+	send := func(marker bool, payload []byte) ([][]byte, time.Duration, bool) {
+		nalus, pts, ok := d.decode(seq, ts, marker, payload)
+		seq++
+		return nalus, pts, ok
+	}
+	vps := []byte{32 << 1, 1, 0xa}
+	sps := []byte{33 << 1, 1, 0xb}
+	pps := []byte{34 << 1, 1, 0xc}
+	idr := []byte{19 << 1, 1, 1, 2, 3, 4, 5, 6}
+
+	// Parameter sets as single NALU packets, then an IDR in three fragments
+	for _, n := range [][]byte{vps, sps, pps} {
+		_, _, ok := send(false, n)
+		require.False(t, ok)
+	}
+	fuHeader := func(start, end bool) []byte {
+		h := []byte{49 << 1, 1, 19}
+		if start {
+			h[2] |= 0x80
+		}
+		if end {
+			h[2] |= 0x40
+		}
+		return h
+	}
+	send(false, append(fuHeader(true, false), idr[2:4]...))
+	send(false, append(fuHeader(false, false), idr[4:6]...))
+	nalus, pts, ok := send(true, append(fuHeader(false, true), idr[6:]...))
+	require.True(t, ok)
+	require.Equal(t, time.Duration(0), pts)
+	require.Equal(t, [][]byte{vps, sps, pps, idr}, nalus)
+
+	// An aggregation packet, one frame later, across the wrap of the RTP clock
+	ts += 3000
+	trail1 := []byte{1 << 1, 1, 7}
+	trail2 := []byte{1 << 1, 1, 8, 9}
+	ap := []byte{48 << 1, 1, 0, 3}
+	ap = append(ap, trail1...)
+	ap = append(ap, 0, 4)
+	ap = append(ap, trail2...)
+	nalus, pts, ok = send(true, ap)
+	require.True(t, ok)
+	require.Equal(t, time.Second/30, pts)
+	require.Equal(t, [][]byte{trail1, trail2}, nalus)
+
+	// Losing the middle of a fragmented NALU discards the access unit
+	ts += 3000
+	send(false, append(fuHeader(true, false), 1, 2))
+	seq++
+	_, _, ok = send(true, append(fuHeader(false, true), 3, 4))
+	require.False(t, ok)
+
+	// The next access unit is fine, and its PTS accounts for the one that we lost
+	ts += 3000
+	nalus, pts, ok = send(true, trail1)
+	require.True(t, ok)
+	require.Equal(t, time.Second/10, pts)
+	require.Equal(t, [][]byte{trail1}, nalus)
+}
@@ -0,0 +1,215 @@
+package camera
+
+import (
+	"bytes"
+	"fmt"
+	"math"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/bmharper/cyclops/server/log"
+	"github.com/bmharper/cyclops/server/videox"
+)
+
+// HLSPackager cuts a stream into MPEG-TS segments as packets arrive, and keeps the most recent ones in memory,
+// so that any number of HTTP clients can watch the stream with HLS, from a single packaging pass.
+// Segments are cut on the first keyframe after TargetDuration, so each segment can be played on its own.
+// H265 is carried in MPEG-TS too, which ffmpeg, VLC and hls.js play, although Apple's players want fMP4 for H265.
+// Packaging only runs while somebody is watching. After IdleTimeout without a request, we stop
+// and discard our segments, and the next request starts a new session.
+type HLSPackager struct {
+	Log            log.Log
+	TargetDuration time.Duration // Minimum duration of a segment
+	WindowSize     int           // Number of segments in the playlist
+	IdleTimeout    time.Duration // Stop packaging if there have been no requests for this long
+
+	lastRequest atomic.Int64 // UnixNano of the most recent request
+
+	lock     sync.Mutex
+	session  int64         // Identifies this run of the packager, so that segment names are never reused
+	segments []*HLSSegment // Finished segments, oldest first
+	current  *HLSSegment   // Segment being written
+	nextSeq  int64         // Sequence number of the next segment
+	encoder  *videox.MPGTSEncoder
+	changed  chan struct{}        // Closed (and replaced) whenever a segment is finished
+	codec    videox.Codec         // Codec of the stream
+	params   videox.ParameterSets // From the SDP, for cameras that only send parameter sets there
+}
+
+// HLSSegment is a finished (and therefore immutable) segment
+type HLSSegment struct {
+	Seq      int64
+	Name     string
+	Duration time.Duration
+	Data     []byte
+
+	start time.Duration // PTS of the first packet
+	buf   bytes.Buffer  // Only used while the segment is being written
+}
+
+func NewHLSPackager() *HLSPackager {
+	return &HLSPackager{
+		TargetDuration: 2 * time.Second,
+		WindowSize:     4,
+		IdleTimeout:    30 * time.Second,
+		changed:        make(chan struct{}),
+	}
+}
+
+func (p *HLSPackager) OnConnect(stream *Stream) error {
+	p.Log = stream.Log
+	p.lock.Lock()
+	p.codec = stream.Codec
+	p.params = stream.ParameterSets()
+	p.lock.Unlock()
+	return nil
+}
+
+func (p *HLSPackager) Close() {
+	p.lock.Lock()
+	p.reset()
+	p.lock.Unlock()
+}
+
+func (p *HLSPackager) OnPacket(packet *videox.DecodedPacket) {
+	p.lock.Lock()
+	defer p.lock.Unlock()
+
+	if time.Since(time.Unix(0, p.lastRequest.Load())) > p.IdleTimeout {
+		if p.encoder != nil {
+			p.Log.Infof("HLS idle, stopping")
+			p.reset()
+		}
+		return
+	}
+
+	if packet.IsKeyframe() && (p.current == nil || packet.H264PTS-p.current.start >= p.TargetDuration) {
+		if err := p.startSegment(packet.H264PTS); err != nil {
+			p.Log.Errorf("HLS failed to start segment: %v", err)
+			p.reset()
+			return
+		}
+	}
+	if p.current == nil {
+		// wait for a keyframe
+		return
+	}
+	if err := p.encoder.Encode(packet.H264NALUs, packet.H264PTS); err != nil {
+		p.Log.Errorf("HLS failed to encode packet: %v", err)
+		p.reset()
+	}
+}
+
+// Finish the current segment (if any), and start a new one at pts.
+// You must be holding lock.
+func (p *HLSPackager) startSegment(pts time.Duration) error {
+	next := &HLSSegment{
+		Seq:   p.nextSeq,
+		start: pts,
+	}
+	if p.encoder == nil {
+		encoder, err := videox.NewMPEGTSEncoder(p.Log, &next.buf, p.codec, p.params)
+		if err != nil {
+			return err
+		}
+		p.encoder = encoder
+		p.session = time.Now().Unix()
+		p.Log.Infof("HLS starting")
+	} else if err := p.encoder.SetOutput(&next.buf); err != nil {
+		return err
+	}
+	next.Name = fmt.Sprintf("%v-%v.ts", p.session, next.Seq)
+	p.nextSeq++
+
+	if prev := p.current; prev != nil {
+		prev.Duration = pts - prev.start
+		prev.Data = prev.buf.Bytes()
+		p.segments = append(p.segments, prev)
+		// Keep a couple more segments than the playlist shows, for clients that are slow to fetch them
+		if len(p.segments) > p.WindowSize+2 {
+			p.segments = p.segments[1:]
+		}
+		close(p.changed)
+		p.changed = make(chan struct{})
+	}
+	p.current = next
+	return nil
+}
+
+// Discard all segments. You must be holding lock.
+func (p *HLSPackager) reset() {
+	if p.encoder != nil {
+		p.encoder.Close()
+		p.encoder = nil
+	}
+	p.segments = nil
+	p.current = nil
+	p.nextSeq = 0
+}
+
+// Record a request, so that we start (or keep) packaging
+func (p *HLSPackager) touch() {
+	p.lastRequest.Store(time.Now().UnixNano())
+}
+
+// Returns the playlist.
+// If minSeq is not -1, we wait (up to timeout) until segment minSeq is available, which is the
+// blocking playlist reload of LL-HLS. Otherwise we wait until there is at least one segment.
+// Returns nil if there is nothing to serve yet.
+func (p *HLSPackager) Playlist(minSeq int64, timeout time.Duration) []byte {
+	p.touch()
+	deadline := time.After(timeout)
+	for {
+		p.lock.Lock()
+		ready := len(p.segments) != 0 && (minSeq == -1 || p.segments[len(p.segments)-1].Seq >= minSeq)
+		changed := p.changed
+		if ready {
+			playlist := p.playlist()
+			p.lock.Unlock()
+			return playlist
+		}
+		p.lock.Unlock()
+		select {
+		case <-changed:
+		case <-deadline:
+			return nil
+		}
+	}
+}
+
+// You must be holding lock
+func (p *HLSPackager) playlist() []byte {
+	segments := p.segments
+	if len(segments) > p.WindowSize {
+		segments = segments[len(segments)-p.WindowSize:]
+	}
+	maxDuration := p.TargetDuration
+	for _, s := range segments {
+		maxDuration = max(maxDuration, s.Duration)
+	}
+	b := strings.Builder{}
+	b.WriteString("#EXTM3U\n")
+	b.WriteString("#EXT-X-VERSION:3\n")
+	fmt.Fprintf(&b, "#EXT-X-TARGETDURATION:%v\n", int(math.Ceil(maxDuration.Seconds())))
+	fmt.Fprintf(&b, "#EXT-X-MEDIA-SEQUENCE:%v\n", segments[0].Seq)
+	for _, s := range segments {
+		fmt.Fprintf(&b, "#EXTINF:%.3f,\n", s.Duration.Seconds())
+		b.WriteString(s.Name + "\n")
+	}
+	return []byte(b.String())
+}
+
+// Returns the segment with the given name, or nil if it doesn't exist (or has expired)
+func (p *HLSPackager) Segment(name string) *HLSSegment {
+	p.touch()
+	p.lock.Lock()
+	defer p.lock.Unlock()
+	for _, s := range p.segments {
+		if s.Name == name {
+			return s
+		}
+	}
+	return nil
+}
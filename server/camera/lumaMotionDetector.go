@@ -0,0 +1,182 @@
+package camera
+
+import (
+	"context"
+	"errors"
+	"fmt"
+	"strconv"
+	"strings"
+	"time"
+
+	"github.com/bmharper/cyclops/server/log"
+	"github.com/bmharper/cyclops/server/videox"
+)
+
+// LumaMotionDetector confirms the events of MotionDetector, by looking for motion in the decoded pixels
+// of the low res stream. It sleeps until Confirm is called, and then pulls frames out of a VideoDecodeReader
+// at a modest rate for ConfirmWindow, and runs them through videox.LumaMotion, so it only ever sees the
+// Y plane, and never converts anything to RGB.
+// Because we only ask for frames while confirming, a camera that nobody is watching, and in which nothing
+// is moving, still decodes nothing in DecodeModeLazy.
+// OnMotion is called if MinFrames consecutive analyzed frames have a cell that changed by at least CellThreshold.
+type LumaMotionDetector struct {
+	Log           log.Log
+	Options       videox.LumaMotionOptions
+	Exclusions    []videox.ExclusionRect // Areas of the frame to ignore. Must be set before Start().
+	CellThreshold float64                // Minimum fraction of changed pixels in a cell to count as motion
+	MinFrames     int                    // Number of consecutive analyzed frames that must contain motion
+	Interval      time.Duration          // Analyze at most one frame per Interval
+	ConfirmWindow time.Duration          // How long we look for motion after Confirm
+	Stats         *videox.PipelineStats  // May be nil
+
+	// OnMotion is called from our own goroutine, with the pts that was given to Confirm. It must not block.
+	OnMotion func(pts time.Duration)
+
+	analyzer *videox.LumaMotion
+	confirm  chan time.Duration
+	cancel   context.CancelFunc
+	done     chan bool
+}
+
+func NewLumaMotionDetector() *LumaMotionDetector {
+	return &LumaMotionDetector{
+		Options: videox.LumaMotionOptions{
+			GridWidth:       16,
+			GridHeight:      9,
+			MaxWidth:        200,
+			PixelThreshold:  25,
+			BackgroundShift: 4,
+			WarmupFrames:    3, // The background is relearned for every confirmation, so this must be short
+		},
+		CellThreshold: 0.3,
+		MinFrames:     2,
+		Interval:      200 * time.Millisecond,
+		ConfirmWindow: 4 * time.Second,
+	}
+}
+
+// Start waiting for Confirm, on a new goroutine
+func (d *LumaMotionDetector) Start(logger log.Log, decoder *VideoDecodeReader) error {
+	analyzer, err := videox.NewLumaMotion(d.Options)
+	if err != nil {
+		return fmt.Errorf("Failed to start luma motion detector: %w", err)
+	}
+	d.Log = logger
+	d.analyzer = analyzer
+	d.confirm = make(chan time.Duration, 1)
+	ctx, cancel := context.WithCancel(context.Background())
+	d.cancel = cancel
+	d.done = make(chan bool)
+	go d.loop(ctx, decoder)
+	return nil
+}
+
+func (d *LumaMotionDetector) Close() {
+	if d.cancel == nil {
+		return
+	}
+	d.cancel()
+	<-d.done
+	d.cancel = nil
+	d.analyzer.Close()
+	d.analyzer = nil
+}
+
+// Look for pixel motion over the next ConfirmWindow, and call OnMotion(pts) if we find it.
+// This does not block. If we're already busy confirming an earlier event, the request is dropped,
+// because the earlier confirmation covers it.
+func (d *LumaMotionDetector) Confirm(pts time.Duration) {
+	select {
+	case d.confirm <- pts:
+	default:
+	}
+}
+
+func (d *LumaMotionDetector) loop(ctx context.Context, decoder *VideoDecodeReader) {
+	defer close(d.done)
+	for {
+		select {
+		case <-ctx.Done():
+			return
+		case pts := <-d.confirm:
+			confirmed, err := d.look(ctx, decoder)
+			if err != nil {
+				return
+			}
+			if confirmed {
+				if d.OnMotion != nil {
+					d.OnMotion(pts)
+				}
+			} else {
+				d.Log.Debugf("Motion was not confirmed by the pixels")
+			}
+		}
+	}
+}
+
+// Analyze frames until we see MinFrames consecutive frames of motion, or ConfirmWindow elapses
+func (d *LumaMotionDetector) look(ctx context.Context, decoder *VideoDecodeReader) (bool, error) {
+	// The background is stale by now, so start learning it again
+	d.analyzer.SetExclusions(d.Exclusions)
+	ctx, cancel := context.WithTimeout(ctx, d.ConfirmWindow)
+	defer cancel()
+	seq := decoder.frames.latestSeq()
+	run := 0
+	for {
+		// We don't count as a viewer, so under load, the decode scheduler may shed some of our frames
+		frame, err := decoder.waitForNextFrame(ctx, seq, false)
+		if errors.Is(err, context.DeadlineExceeded) {
+			return false, nil
+		} else if err != nil {
+			return false, err
+		}
+		seq = frame.Seq
+		result, ok := d.analyzer.Process(frame.Image, d.Stats)
+		frame.Release()
+		if ok {
+			if result.GlobalChange {
+				d.Log.Infof("Most of the frame changed at once, so restarting the motion background")
+			}
+			if result.WarmingUp || result.GlobalChange || result.MaxCell < d.CellThreshold {
+				run = 0
+			} else if run++; run >= d.MinFrames {
+				d.Log.Infof("Pixel motion confirmed (busiest cell %.2f, %.1f%% of the frame changed)", result.MaxCell, result.Changed*100)
+				return true, nil
+			}
+		}
+		select {
+		case <-ctx.Done():
+			return false, nil
+		case <-time.After(d.Interval):
+		}
+	}
+}
+
+// Parse exclusion zones of the form "x0,y0,x1,y1; x0,y0,x1,y1; ...", where the coordinates are
+// fractions of the frame size (0..1), with (0,0) at the top left. An empty string is no zones.
+func ParseExclusionRects(s string) ([]videox.ExclusionRect, error) {
+	rects := []videox.ExclusionRect{}
+	for _, part := range strings.Split(s, ";") {
+		part = strings.TrimSpace(part)
+		if part == "" {
+			continue
+		}
+		fields := strings.Split(part, ",")
+		if len(fields) != 4 {
+			return nil, fmt.Errorf("Invalid exclusion zone '%v'. Expected x0,y0,x1,y1", part)
+		}
+		v := [4]float64{}
+		for i, f := range fields {
+			var err error
+			v[i], err = strconv.ParseFloat(strings.TrimSpace(f), 64)
+			if err != nil || v[i] < 0 || v[i] > 1 {
+				return nil, fmt.Errorf("Invalid exclusion zone '%v'. Coordinates must be between 0 and 1", part)
+			}
+		}
+		if v[2] <= v[0] || v[3] <= v[1] {
+			return nil, fmt.Errorf("Invalid exclusion zone '%v'. x1,y1 must be below and to the right of x0,y0", part)
+		}
+		rects = append(rects, videox.ExclusionRect{X0: v[0], Y0: v[1], X1: v[2], Y1: v[3]})
+	}
+	return rects, nil
+}
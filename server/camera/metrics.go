@@ -0,0 +1,68 @@
+package camera
+
+import (
+	"sync/atomic"
+
+	"github.com/bmharper/cyclops/server/metrics"
+	"github.com/bmharper/cyclops/server/videox"
+)
+
+// StreamMetrics are the counters and timings of a Stream.
+// Everything here is updated with atomics, so it can be read at any time.
+type StreamMetrics struct {
+	Packets          atomic.Uint64     // Packets received from the camera
+	Bytes            atomic.Uint64     // NALU bytes received from the camera
+	Dispatch         metrics.Histogram // Time from receiving a packet over RTP, until a sink reads it
+	SinkDropped      atomic.Uint64     // Packets that sinks skipped, because they fell behind
+	WebSocketSent    atomic.Uint64     // Packets sent to all websocket viewers
+	WebSocketDropped atomic.Uint64     // Packets not sent to websocket viewers, because they couldn't keep up
+}
+
+func (m *StreamMetrics) countPacket(nalus [][]byte) {
+	n := 0
+	for _, nalu := range nalus {
+		n += len(nalu)
+	}
+	m.Packets.Add(1)
+	m.Bytes.Add(uint64(n))
+}
+
+func (m *StreamMetrics) write(e *metrics.Exposition, labels metrics.Labels) {
+	e.Counter("cyclops_stream_packets_total", "Packets received from the camera", labels, float64(m.Packets.Load()))
+	e.Counter("cyclops_stream_bytes_total", "Bytes of video received from the camera", labels, float64(m.Bytes.Load()))
+	e.Histogram("cyclops_stream_dispatch_seconds", "Time from RTP arrival until a sink reads the packet", labels, m.Dispatch.Snapshot())
+	e.Counter("cyclops_stream_sink_dropped_total", "Packets skipped by sinks that fell behind", labels, float64(m.SinkDropped.Load()))
+	e.Counter("cyclops_websocket_sent_total", "Packets sent to websocket viewers", labels, float64(m.WebSocketSent.Load()))
+	e.Counter("cyclops_websocket_dropped_total", "Packets dropped because a websocket viewer was too slow", labels, float64(m.WebSocketDropped.Load()))
+}
+
+func writeDumperMetrics(e *metrics.Exposition, labels metrics.Labels, d *VideoDumpReader) {
+	bytes, capacity, packets, spillBytes, spillCapacity := d.BufferStats()
+	e.Gauge("cyclops_ring_bytes", "Bytes of video in the ring buffer (RAM and spill file)", labels, float64(bytes))
+	e.Gauge("cyclops_ring_capacity_bytes", "Size of the ring buffer (RAM and spill file)", labels, float64(capacity))
+	e.Gauge("cyclops_ring_packets", "Packets in the ring buffer", labels, float64(packets))
+	e.Gauge("cyclops_ring_spill_bytes", "Bytes of video in the ring buffer's spill file", labels, float64(spillBytes))
+	e.Gauge("cyclops_ring_spill_capacity_bytes", "Size of the ring buffer's spill file", labels, float64(spillCapacity))
+	e.Histogram("cyclops_ring_lock_hold_seconds", "Time that the ring buffer lock is held for", labels, d.LockHold.Snapshot())
+}
+
+func writePipelineMetrics(e *metrics.Exposition, labels metrics.Labels, stats *videox.PipelineStats) {
+	s := stats.Snapshot()
+	e.Histogram("cyclops_decode_seconds", "Time spent inside the decoder, per frame", labels, s.Decode)
+	e.Histogram("cyclops_scale_seconds", "Time spent in sws_scale, per frame", labels, s.Scale)
+	e.Histogram("cyclops_jpeg_seconds", "Time spent compressing a JPEG", labels, s.JPEG)
+	e.Histogram("cyclops_encoder_write_seconds", "Time spent muxing a frame into a video file", labels, s.EncoderWrite)
+	e.Histogram("cyclops_motion_seconds", "Time spent detecting motion in a decoded frame", labels, s.Motion)
+}
+
+// Add this camera's metrics to e
+func (c *Camera) WriteMetrics(e *metrics.Exposition) {
+	for _, s := range []*Stream{c.LowStream, c.HighStream} {
+		if s != nil {
+			s.Metrics.write(e, metrics.Labels{"camera": c.Name, "stream": s.StreamName})
+		}
+	}
+	writeDumperMetrics(e, metrics.Labels{"camera": c.Name, "stream": "high"}, c.HighDumper)
+	writeDumperMetrics(e, metrics.Labels{"camera": c.Name, "stream": "low"}, c.LowDumper)
+	writePipelineMetrics(e, metrics.Labels{"camera": c.Name}, c.Stats)
+}
@@ -0,0 +1,111 @@
+package camera
+
+import (
+	"fmt"
+	"time"
+
+	"github.com/bmharper/cyclops/server/log"
+	"github.com/bmharper/cyclops/server/videox"
+)
+
+// MotionDetector is a cheap pre-filter for events, which works on the compressed stream, so that we never
+// need to decode the high res stream (or convert anything to RGB) just to notice that something is moving.
+// It's expected to produce false positives (eg wind in trees, or a change in lighting), so anything it
+// triggers should be confirmed by a full decode later.
+// We consider a frame to contain motion if its motion vectors point to a busy cell, or if the encoder
+// spent far more bytes on it than usual. OnMotion is called after MinFrames consecutive frames of motion.
+type MotionDetector struct {
+	Log             log.Log
+	Options         videox.MotionOptions
+	EnergyThreshold float64       // Minimum MotionFrame.MaxCell to count as motion
+	SizeThreshold   float64       // Minimum MotionFrame.SizeScore to count as motion
+	MinFrames       int           // Number of consecutive frames that must contain motion
+	Cooldown        time.Duration // Minimum time between calls to OnMotion
+
+	// OnMotion is called from the stream's goroutine, so it must not block.
+	// pts is the PTS of the frame that triggered the event.
+	OnMotion func(pts time.Duration)
+
+	// If Busy is not nil, and returns true, then we don't trigger, because whoever consumes our
+	// events can't keep up. This is backpressure from the export queue of the event DB.
+	Busy func() bool
+
+	analyzer    *videox.MotionAnalyzer
+	run         int // Number of consecutive frames with motion
+	lastTrigger time.Time
+}
+
+func NewMotionDetector() *MotionDetector {
+	return &MotionDetector{
+		Options: videox.MotionOptions{
+			GridWidth:     16,
+			GridHeight:    9,
+			MotionVectors: true,
+		},
+		EnergyThreshold: 0.5,
+		SizeThreshold:   2.5,
+		MinFrames:       3,
+		Cooldown:        15 * time.Second,
+	}
+}
+
+func (m *MotionDetector) OnConnect(stream *Stream) error {
+	m.Log = stream.Log
+	options := m.Options
+	options.Codec = stream.Codec
+	if options.Codec != videox.CodecH264 && options.MotionVectors {
+		// We can't get motion vectors out of ffmpeg's HEVC decoder, so we only have frame sizes
+		m.Log.Infof("Motion vectors are not available for %v, so motion detection only uses frame sizes", options.Codec)
+		options.MotionVectors = false
+	}
+	analyzer, err := videox.NewMotionAnalyzer(options)
+	if err != nil {
+		return fmt.Errorf("Failed to start motion analyzer: %w", err)
+	}
+
+	// if present, send the parameter sets from the SDP to the decoder
+	params := &videox.DecodedPacket{Codec: stream.Codec}
+	sdp := stream.ParameterSets()
+	for _, ps := range sdp.NALUs(stream.Codec) {
+		if ps != nil {
+			params.H264NALUs = append(params.H264NALUs, videox.WrapRawNALU(ps))
+		}
+	}
+	analyzer.Analyze(params)
+
+	m.analyzer = analyzer
+	return nil
+}
+
+func (m *MotionDetector) OnPacket(packet *videox.DecodedPacket) {
+	frame, ok := m.analyzer.Analyze(packet)
+	if !ok {
+		return
+	}
+	motion := (frame.HaveVectors && frame.MaxCell >= m.EnergyThreshold) || frame.SizeScore >= m.SizeThreshold
+	if !motion {
+		m.run = 0
+		return
+	}
+	m.run++
+	if m.run < m.MinFrames || time.Since(m.lastTrigger) < m.Cooldown {
+		return
+	}
+	if m.Busy != nil && m.Busy() {
+		m.Log.Debugf("Motion detected, but ignored because the event exporter is busy")
+		m.run = 0
+		return
+	}
+	m.lastTrigger = time.Now()
+	m.Log.Infof("Motion detected (busiest cell %.2f, size score %.2f)", frame.MaxCell, frame.SizeScore)
+	if m.OnMotion != nil {
+		m.OnMotion(packet.H264PTS)
+	}
+}
+
+func (m *MotionDetector) Close() {
+	if m.analyzer != nil {
+		m.analyzer.Close()
+		m.analyzer = nil
+	}
+}
@@ -5,6 +5,7 @@ import (
 	"fmt"
 	"math"
 	"sync"
+	"sync/atomic"
 	"time"
 
 	"github.com/bmharper/cyclops/server/gen"
@@ -13,52 +14,27 @@ import (
 	"github.com/bmharper/ringbuffer"
 
 	"github.com/aler9/gortsplib"
-	"github.com/aler9/gortsplib/pkg/h264"
 	"github.com/aler9/gortsplib/pkg/url"
 )
 
-// StreamSink receives packets from the stream on its channel
+// StreamSink receives packets from the stream via a StreamReader
 // There can be multiple StreamSinks connected to a Stream
 type StreamSink interface {
-	OnConnect(stream *Stream) (StreamSinkChan, error) // Called by Stream.ConnectSink()
+	OnConnect(stream *Stream) error // Called by Stream.ConnectSink()
 }
 
 // StandardStreamSink allows you to run the stream with RunStandardStream()
 type StandardStreamSink interface {
 	StreamSink
-	OnPacketRTP(ctx *gortsplib.ClientOnPacketRTPCtx)
+	OnPacket(packet *videox.DecodedPacket) // packet is shared with other sinks, so it must not be modified
 	Close()
 }
 
-type StreamMsgType int
-
-const (
-	StreamMsgTypePacket StreamMsgType = iota // New camera packet
-	StreamMsgTypeClose                       // Close yourself. There will be no further packets.
-)
-
-// StreamMsg is sent on a channel from the stream to a sink
-type StreamMsg struct {
-	Type   StreamMsgType
-	Stream *Stream
-	Packet *gortsplib.ClientOnPacketRTPCtx
-}
-
-// Once a sink is connected to a stream, all messages to the sink are sent via this channel
-type StreamSinkChan chan StreamMsg
-
-// There isn't much rhyme or reason behind this number
-const StreamSinkChanDefaultBufferSize = 2
-
-// Internal sink data structure of Stream
-type sinkObj struct {
-	sink StreamSink
-	ch   StreamSinkChan
-}
-
 type StreamInfo struct {
-	Width  int
-	Height int
+	Width     int
+	Height    int
+	FrameRate float64         // From the SPS, or 0 if the camera doesn't specify it
+	SPS       *videox.SPSInfo // Needed to parse slice headers. Always nil for H265.
 }
 
 type Stream struct {
@@ -68,12 +44,21 @@ type Stream struct {
 	CameraName string // Just for logs
 	StreamName string // Just for logs
 
-	// These are read at the start of Listen(), and will be populated before Listen() returns
-	H264TrackID int                  // 0-based track index
-	H264Track   *gortsplib.TrackH264 // track object
+	// These are read by Describe(), and will be populated before Describe() or Listen() returns
+	TrackID   int                  // 0-based index of the video track
+	Codec     videox.Codec         // Codec of the video track
+	H264Track *gortsplib.TrackH264 // nil if the stream is H265. See ParameterSets().
+
+	tracks     gortsplib.Tracks // From Describe(), consumed by Play()
+	baseURL    *url.URL
+	camHost    string
+	h265Params videox.ParameterSets // From the SDP of an H265 track
 
+	// Packets from the video track are cloned once into ring, and every sink reads them from there.
+	// The packet callback only reads readers, so it never takes a lock. readers is copy-on-write, guarded by sinksLock.
+	ring      *packetFanout
 	sinksLock sync.Mutex
-	sinks     []sinkObj
+	readers   atomic.Pointer[[]*StreamReader]
 
 	infoLock sync.Mutex
 	info     *StreamInfo // With Go 1.19 one could use atomic.Pointer[T] here
@@ -81,11 +66,14 @@ type Stream struct {
 	recentFramesLock sync.Mutex
 	recentFrames     ringbuffer.RingP[time.Duration]
 	loggedFPS        bool
+
+	Metrics StreamMetrics
 }
 
 func NewStream(logger log.Log, cameraName, streamName string) *Stream {
 	return &Stream{
 		Log:          log.NewPrefixLogger(logger, "Stream "+cameraName+"."+streamName),
+		ring:         newPacketFanout(StreamRingSize),
 		recentFrames: ringbuffer.NewRingP[time.Duration](64),
 		CameraName:   cameraName,
 		StreamName:   streamName,
@@ -93,7 +81,19 @@ func NewStream(logger log.Log, cameraName, streamName string) *Stream {
 	}
 }
 
+// Connect to the camera and start streaming. This is Describe() followed by Play().
 func (s *Stream) Listen(address string) error {
+	if err := s.Describe(address); err != nil {
+		return err
+	}
+	return s.Play()
+}
+
+// Connect to the camera and read its SDP, but don't start streaming yet.
+// If the SDP has sprop-parameter-sets, then Info() is populated from its SPS by the time we return,
+// so that sinks can be set up for the stream's size before any packets arrive. This is just one
+// round trip, so it is cheap to do for many cameras at once (see ProbeCameras).
+func (s *Stream) Describe(address string) error {
 	s.Client = gortsplib.Client{}
 	client := &s.Client
 
@@ -114,57 +114,119 @@ func (s *Stream) Listen(address string) error {
 	// find published tracks
 	tracks, baseURL, _, err := client.Describe(u)
 	if err != nil {
-		panic(err)
+		client.Close()
+		return fmt.Errorf("Stream Describe failed: %w", err)
 	}
 
-	// find the H264 track
-	h264TrackID, h264track := func() (int, *gortsplib.TrackH264) {
-		for i, track := range tracks {
-			if h264track, ok := track.(*gortsplib.TrackH264); ok {
-				return i, h264track
-			}
+	// find the H264 or H265 track
+	s.TrackID = -1
+	s.H264Track = nil
+	s.h265Params = videox.ParameterSets{}
+	for i, track := range tracks {
+		if h264track, ok := track.(*gortsplib.TrackH264); ok {
+			s.TrackID = i
+			s.Codec = videox.CodecH264
+			s.H264Track = h264track
+			break
 		}
-		return -1, nil
-	}()
-	if h264TrackID < 0 {
-		return fmt.Errorf("H264 track not found")
+		if params, ok := h265TrackParams(track); ok {
+			s.TrackID = i
+			s.Codec = videox.CodecH265
+			s.h265Params = params
+			break
+		}
+	}
+	if s.TrackID < 0 {
+		client.Close()
+		return fmt.Errorf("H264 or H265 track not found")
+	}
+	s.tracks = tracks
+	s.baseURL = baseURL
+	s.camHost = camHost
+	s.Log.Infof("Connected to %v, track %v (%v)", camHost, s.TrackID, s.Codec)
+
+	// Populate width & height from the SDP, if the camera sent sprop-parameter-sets (or sprop-sps for H265)
+	if sps := s.ParameterSets().SPS; sps != nil {
+		s.infoLock.Lock()
+		s.setInfoNoLock(s.extractSPSInfo([][]byte{sps}))
+		s.infoLock.Unlock()
+	}
+	return nil
+}
+
+// Returns the parameter sets that the camera announced in its SDP.
+// Any of them may be nil, in which case sinks must wait for them to arrive in-band.
+func (s *Stream) ParameterSets() videox.ParameterSets {
+	if s.Codec == videox.CodecH265 {
+		return s.h265Params
+	}
+	if s.H264Track == nil {
+		return videox.ParameterSets{}
+	}
+	return videox.ParameterSets{
+		SPS: s.H264Track.SPS(),
+		PPS: s.H264Track.PPS(),
+	}
+}
+
+// Start streaming, after Describe()
+func (s *Stream) Play() error {
+	client := &s.Client
+
+	var h265 *h265Depacketizer
+	if s.Codec == videox.CodecH265 {
+		h265 = newH265Depacketizer(s.tracks[s.TrackID].ClockRate())
 	}
-	s.H264TrackID = h264TrackID
-	s.H264Track = h264track
-	s.Log.Infof("Connected to %v, track %v", camHost, h264TrackID)
 
 	client.OnPacketRTP = func(ctx *gortsplib.ClientOnPacketRTPCtx) {
-		// Copy the sinks out, to be safe during stream Close()
-		s.sinksLock.Lock()
-		sinks := gen.CopySlice(s.sinks)
-		s.sinksLock.Unlock()
+		if ctx.TrackID != s.TrackID {
+			return
+		}
+		nalus, pts, ptsEqualsDTS := ctx.H264NALUs, ctx.H264PTS, ctx.PTSEqualsDTS
+		if h265 != nil {
+			var ok bool
+			if nalus, pts, ok = h265.decode(ctx.Packet.SequenceNumber, ctx.Packet.Timestamp, ctx.Packet.Marker, ctx.Packet.Payload); !ok {
+				return
+			}
+			// We have no DTS extractor for H265 (see MPGTSEncoder), so only keyframes are known to have PTS = DTS
+			ptsEqualsDTS = false
+			for _, n := range nalus {
+				ptsEqualsDTS = ptsEqualsDTS || videox.NALUKindOf(s.Codec, n) == videox.NALUKindKeyframe
+			}
+		}
+		if nalus == nil {
+			return
+		}
 
-		// Populate width & height.
+		// Populate width & height, if the SDP didn't give them to us
 		s.infoLock.Lock()
 		if s.info == nil {
-			if inf := s.extractSPSInfo(ctx.H264NALUs); inf != nil {
-				s.info = inf
-				s.Log.Infof("Size: %v x %v", inf.Width, inf.Height)
-			}
+			s.setInfoNoLock(s.extractSPSInfo(nalus))
 		}
 		s.infoLock.Unlock()
 
-		s.countFrames(ctx)
+		s.countFrames(nalus, pts)
+		s.Metrics.countPacket(nalus)
 
-		//s.Log.Infof("Packet %v", ctx.H264PTS)
-		for _, sink := range sinks {
-			//sink.OnPacketRTP(ctx)
-			s.sendSinkMsg(sink.ch, StreamMsgTypePacket, ctx)
+		//s.Log.Infof("Packet %v", pts)
+		readers := s.loadReaders()
+		if len(readers) == 0 {
+			return
+		}
+		// gortsplib (and h265Depacketizer) re-use buffers, so this is the one and only copy of the packet, shared by all sinks
+		s.ring.publish(videox.CloneRawPacket(s.Codec, nalus, pts, ptsEqualsDTS))
+		for _, r := range readers {
+			r.wake()
 		}
 	}
 
 	// start reading tracks
-	err = client.SetupAndPlay(tracks, baseURL)
+	err := client.SetupAndPlay(s.tracks, s.baseURL)
 	if err != nil {
 		return fmt.Errorf("Stream SetupAndPlay failed: %w", err)
 	}
 
-	s.Log.Infof("Connection to %v success", camHost)
+	s.Log.Infof("Connection to %v success", s.camHost)
 
 	// wait until a fatal error
 	//panic(c.Wait())
@@ -177,35 +239,59 @@ func (s *Stream) Close() {
 	s.Client.Close()
 
 	s.sinksLock.Lock()
-	sinks := gen.CopySlice(s.sinks)
-	s.sinks = []sinkObj{}
+	readers := s.loadReaders()
+	s.readers.Store(nil)
 	s.sinksLock.Unlock()
 
-	//s.Log.Infof("Closing stream - sending StreamMsgTypeClose")
-	for _, sink := range sinks {
-		s.sendSinkMsg(sink.ch, StreamMsgTypeClose, nil)
+	for _, r := range readers {
+		r.close()
 	}
 }
 
 func (s *Stream) extractSPSInfo(nalus [][]byte) *StreamInfo {
 	for _, nalu := range nalus {
-		if len(nalu) == 0 {
+		if videox.NALUKindOf(s.Codec, nalu) != videox.NALUKindSPS {
 			continue
 		}
-		if h264.NALUType(nalu[0]&31) == h264.NALUTypeSPS {
-			width, height, err := videox.ParseSPS(nalu)
+		if s.Codec == videox.CodecH265 {
+			width, height, err := videox.ParseH265SPS(nalu)
 			if err != nil {
 				s.Log.Errorf("Failed to decode SPS: %v", err)
+				return &StreamInfo{}
 			}
 			return &StreamInfo{
 				Width:  width,
 				Height: height,
 			}
 		}
+		sps, err := videox.ParseSPSInfo(nalu)
+		if err != nil {
+			s.Log.Errorf("Failed to decode SPS: %v", err)
+			return &StreamInfo{}
+		}
+		return &StreamInfo{
+			Width:     sps.Width,
+			Height:    sps.Height,
+			FrameRate: sps.FrameRate,
+			SPS:       sps,
+		}
 	}
 	return nil
 }
 
+// inf may be nil. You must be holding infoLock.
+func (s *Stream) setInfoNoLock(inf *StreamInfo) {
+	if inf == nil {
+		return
+	}
+	s.info = inf
+	if inf.SPS != nil {
+		s.Log.Infof("Size: %v x %v, profile %v, level %v, SPS frame rate: %.2f", inf.Width, inf.Height, inf.SPS.Profile, inf.SPS.Level, inf.FrameRate)
+	} else if inf.Width != 0 {
+		s.Log.Infof("Size: %v x %v (%v)", inf.Width, inf.Height, s.Codec)
+	}
+}
+
 // Return the stream info, or nil if we have not yet encountered the necessary NALUs
 func (s *Stream) Info() *StreamInfo {
 	s.infoLock.Lock()
@@ -241,73 +327,72 @@ func (s *Stream) fpsNoMutexLock() float64 {
 // If runStandardHandler is true, then we cast sink to StandardStreamSink, and
 // start a new goroutine that runs RunStandardStream() on this stream.
 // If runStandardHandler is false, then you must run a message loop like
-// RunStandardStream yourself.
-func (s *Stream) ConnectSink(sink StreamSink, runStandardHandler bool) error {
-	sinkChan, err := sink.OnConnect(s)
-	if err != nil {
-		return err
+// RunStandardStream yourself, using the returned StreamReader.
+func (s *Stream) ConnectSink(sink StreamSink, runStandardHandler bool) (*StreamReader, error) {
+	var standard StandardStreamSink
+	if runStandardHandler {
+		var ok bool
+		if standard, ok = sink.(StandardStreamSink); !ok {
+			return nil, errors.New("sink does not implement StandardStreamSink, so you can't use runStandardHandler = true")
+		}
+	}
+
+	if err := sink.OnConnect(s); err != nil {
+		return nil, err
 	}
 
+	reader := newStreamReader(s, sink)
 	s.sinksLock.Lock()
-	s.sinks = append(s.sinks, sinkObj{
-		sink: sink,
-		ch:   sinkChan,
-	})
+	readers := append(gen.CopySlice(s.loadReaders()), reader)
+	s.readers.Store(&readers)
 	s.sinksLock.Unlock()
 
-	if runStandardHandler {
-		if standard, ok := sink.(StandardStreamSink); ok {
-			go RunStandardStream(sinkChan, standard)
-		} else {
-			return errors.New("sink does not implement StandardStreamSink, so you can't use runStandardHandler = true")
-		}
+	if standard != nil {
+		go RunStandardStream(reader, standard)
 	}
 
-	return nil
+	return reader, nil
 }
 
 // This is just an explicitly typed wrapper around ConnectSink(sink, true)
 func (s *Stream) ConnectSinkAndRun(sink StandardStreamSink) error {
-	return s.ConnectSink(sink, true)
+	_, err := s.ConnectSink(sink, true)
+	return err
 }
 
+// Disconnect a sink. Its StreamReader is closed, so a standard sink will receive Close().
 func (s *Stream) RemoveSink(sink StreamSink) {
 	s.sinksLock.Lock()
-	idx := s.sinkIndex(sink)
+	readers := s.loadReaders()
+	idx := -1
+	for i, r := range readers {
+		if r.sink == sink {
+			idx = i
+			break
+		}
+	}
 	if idx != -1 {
-		s.sinks = append(s.sinks[0:idx], s.sinks[idx+1:]...)
+		remain := append(gen.CopySlice(readers[:idx]), readers[idx+1:]...)
+		s.readers.Store(&remain)
+		readers[idx].close()
 	}
 	s.sinksLock.Unlock()
 }
 
-func (s *Stream) sendSinkMsg(sink StreamSinkChan, msgType StreamMsgType, packet *gortsplib.ClientOnPacketRTPCtx) {
-	sink <- StreamMsg{
-		Type:   msgType,
-		Stream: s,
-		Packet: packet,
-	}
-}
-
-// NOTE: This function does not take sinksLock, but assumes you have already done so
-func (s *Stream) sinkIndex(sink StreamSink) int {
-	for i := 0; i < len(s.sinks); i++ {
-		if s.sinks[i].sink == sink {
-			return i
-		}
+func (s *Stream) loadReaders() []*StreamReader {
+	if r := s.readers.Load(); r != nil {
+		return *r
 	}
-	return -1
+	return nil
 }
 
-func (s *Stream) countFrames(ctx *gortsplib.ClientOnPacketRTPCtx) {
+func (s *Stream) countFrames(nalus [][]byte, pts time.Duration) {
 	s.recentFramesLock.Lock()
 	defer s.recentFramesLock.Unlock()
 
-	for _, nalu := range ctx.H264NALUs {
-		if len(nalu) > 0 {
-			t := h264.NALUType(nalu[0] & 31)
-			if videox.IsVisualPacket(t) {
-				s.recentFrames.Add(ctx.H264PTS)
-			}
+	for _, nalu := range nalus {
+		if videox.NALUKindOf(s.Codec, nalu).IsVisual() {
+			s.recentFrames.Add(pts)
 		}
 	}
 
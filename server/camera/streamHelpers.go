@@ -1,22 +1,16 @@
 package camera
 
 // A generic message loop that should cater for most streams
-func RunStandardStream(ch StreamSinkChan, sink StandardStreamSink) {
-	closed := false
-	for !closed {
-	outerloop:
-		select {
-		case msg := <-ch:
-			switch msg.Type {
-			case StreamMsgTypeClose:
-				//fmt.Printf("RunStandardStream StreamMsgTypeClose (enter)\n")
-				sink.Close()
-				closed = true
-				break outerloop
-			case StreamMsgTypePacket:
-				//fmt.Printf("RunStandardStream StreamMsgTypePacket\n")
-				sink.OnPacketRTP(msg.Packet)
-			}
+func RunStandardStream(reader *StreamReader, sink StandardStreamSink) {
+	for range reader.Wake() {
+		// Read closed before draining, so that we don't miss packets that were published just before the close
+		closed := reader.Closed()
+		for packet := reader.Next(); packet != nil; packet = reader.Next() {
+			sink.OnPacket(packet)
+		}
+		if closed {
+			sink.Close()
+			return
 		}
 	}
 }
@@ -0,0 +1,157 @@
+package camera
+
+import (
+	"sync/atomic"
+
+	"github.com/bmharper/cyclops/server/videox"
+)
+
+// Number of packets that a Stream keeps in its fan-out ring.
+// A sink that falls further behind than this will lose packets (see StreamReader).
+// Must be a power of 2.
+const StreamRingSize = 64
+
+// packetFanout is a single-producer, multi-consumer ring of packets.
+// Each packet is cloned once by the producer, and then shared (read-only) by all sinks.
+// The producer never waits for a consumer. If a consumer is too slow, its packets get overwritten.
+type packetFanout struct {
+	slots        []atomic.Pointer[fanoutEntry]
+	written      atomic.Int64 // Number of packets ever published
+	lastKeyframe atomic.Int64 // Sequence number of the newest packet containing an IDR (-1 if none)
+}
+
+type fanoutEntry struct {
+	seq      int64
+	keyframe bool
+	packet   *videox.DecodedPacket
+}
+
+func newPacketFanout(size int) *packetFanout {
+	f := &packetFanout{
+		slots: make([]atomic.Pointer[fanoutEntry], size),
+	}
+	f.lastKeyframe.Store(-1)
+	return f
+}
+
+// Publish a packet. Only one goroutine may call this.
+func (f *packetFanout) publish(packet *videox.DecodedPacket) {
+	seq := f.written.Load()
+	e := &fanoutEntry{
+		seq:      seq,
+		keyframe: packet.IsKeyframe(),
+		packet:   packet,
+	}
+	f.slots[seq&int64(len(f.slots)-1)].Store(e)
+	if e.keyframe {
+		f.lastKeyframe.Store(seq)
+	}
+	// The slot must be visible before the new count
+	f.written.Store(seq + 1)
+}
+
+// Returns the entry with the given sequence number, or nil if it has been overwritten
+func (f *packetFanout) entry(seq int64) *fanoutEntry {
+	e := f.slots[seq&int64(len(f.slots)-1)].Load()
+	if e == nil || e.seq != seq {
+		return nil
+	}
+	return e
+}
+
+// StreamReader is a sink's read cursor into the packet ring of a Stream.
+// When a sink falls so far behind that its next packet has been overwritten, we apply our lag policy:
+// resume from the newest keyframe that is still in the ring, or if there is none, skip packets until
+// the next keyframe arrives. Either way the sink only ever sees a decodable sequence of packets.
+// A StreamReader must only be used by a single goroutine.
+type StreamReader struct {
+	sink    StreamSink
+	stream  *Stream
+	ring    *packetFanout
+	next    int64 // Sequence number of the next packet we will return
+	waitKey bool  // Discard packets until we see a keyframe
+	dropped int64 // Number of packets lost due to lag
+	notify  chan struct{}
+	closed  atomic.Bool
+}
+
+func newStreamReader(stream *Stream, sink StreamSink) *StreamReader {
+	return &StreamReader{
+		sink:   sink,
+		stream: stream,
+		ring:   stream.ring,
+		next:   stream.ring.written.Load(),
+		notify: make(chan struct{}, 1),
+	}
+}
+
+// Wake returns a channel that receives a value when there may be new packets, or when the reader is closed.
+// After waking, call Next() until it returns nil, and then check Closed().
+func (r *StreamReader) Wake() <-chan struct{} {
+	return r.notify
+}
+
+// Returns the next packet, or nil if there are no new packets.
+// The packet is shared with other sinks, so it must not be modified.
+func (r *StreamReader) Next() *videox.DecodedPacket {
+	for {
+		written := r.ring.written.Load()
+		if r.next >= written {
+			return nil
+		}
+		e := r.ring.entry(r.next)
+		if e == nil {
+			r.skipLag(written)
+			continue
+		}
+		r.next++
+		if r.waitKey {
+			if !e.keyframe {
+				r.dropped++
+				r.stream.Metrics.SinkDropped.Add(1)
+				continue
+			}
+			r.waitKey = false
+		}
+		if !e.packet.RecvTime.IsZero() {
+			r.stream.Metrics.Dispatch.Since(e.packet.RecvTime)
+		}
+		return e.packet
+	}
+}
+
+// Returns true once the stream has closed, or the sink has been removed.
+// There may still be packets that were published before the close, so drain Next() before acting on this.
+func (r *StreamReader) Closed() bool {
+	return r.closed.Load()
+}
+
+// Returns the number of packets that this reader has skipped, because it was too slow
+func (r *StreamReader) Dropped() int64 {
+	return r.dropped
+}
+
+func (r *StreamReader) skipLag(written int64) {
+	from := r.next
+	if k := r.ring.lastKeyframe.Load(); k > r.next && r.ring.entry(k) != nil {
+		r.next = k
+	} else {
+		r.next = written
+		r.waitKey = true
+	}
+	r.dropped += r.next - from
+	r.stream.Metrics.SinkDropped.Add(uint64(r.next - from))
+	r.stream.Log.Warnf("Sink is too slow, skipped %v packets (%v total)", r.next-from, r.dropped)
+}
+
+func (r *StreamReader) wake() {
+	select {
+	case r.notify <- struct{}{}:
+	default:
+	}
+}
+
+func (r *StreamReader) close() {
+	r.closed.Store(true)
+	r.wake()
+}
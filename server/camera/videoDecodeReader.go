@@ -1,146 +1,335 @@
 package camera
 
 import (
+	"context"
 	"fmt"
 	"image"
 	"sync"
+	"sync/atomic"
+	"time"
 
-	"github.com/aler9/gortsplib"
-	"github.com/aler9/gortsplib/pkg/h264"
 	"github.com/bmharper/cyclops/server/log"
 	"github.com/bmharper/cyclops/server/videox"
 )
 
+type DecodeMode int
+
+const (
+	DecodeModeAll       DecodeMode = iota // Decode every frame as it arrives
+	DecodeModeLazy                        // Buffer the NALUs since the last keyframe, and only decode them when somebody asks for a frame
+	DecodeModeKeyframes                   // Decode only keyframes (H264 IDR, or H265 IRAP), and no more often than KeyframeInterval
+)
+
 // VideoDecodeReader decodes the video stream and emits frames
-// NOTE: Our lastImg is a copy of the most recent frame.
-// This memcpy might be a substantial waste if you're decoding
-// a high res stream, and only need access to the latest frame
-// occasionally. Such a scenario might be better suited by
-// a blocking call which waits for a new frame to be decoded.
+// NOTE: The frames returned by the decoder are only valid until the next decode, so
+// every frame that we publish (see frameSlots) is copied once, with one memcpy per plane.
+// That might be a substantial waste if you're decoding a high res stream, and only need
+// access to the latest frame occasionally. In that case, use DecodeModeLazy, which only
+// decodes (and copies) when somebody asks for a frame (LastImage, LastFrame, WithLastImage,
+// or while waiting in WaitForNextFrame). If nobody asks, nothing is decoded.
 type VideoDecodeReader struct {
-	Log     log.Log
-	TrackID int
-	Track   *gortsplib.TrackH264
-	Decoder *videox.H264Decoder
+	Log              log.Log
+	TrackID          int
+	Codec            videox.Codec        // Codec of the stream, from OnConnect
+	Decoder          *videox.H264Decoder // Guarded by decodeLock
+	Mode             DecodeMode
+	KeyframeInterval time.Duration         // Only applicable to DecodeModeKeyframes
+	DecoderOptions   videox.DecoderOptions // Used when creating Decoder in OnConnect
+	Scheduler        *DecodeScheduler      // If not nil, decodes run on the scheduler's workers. Must be set before OnConnect.
 
-	incoming StreamSinkChan
-	nPackets int64
-	ready    bool
+	nPackets       int64
+	ready          bool
+	decoderBackend string // Cached from Decoder, so that it's safe to read after Close()
 
-	lastImgLock sync.Mutex
-	lastImg     image.Image
+	decodeLock     sync.Mutex
+	pending        []videox.NALU // DecodeModeLazy: NALUs since the last keyframe
+	pendingDecoded int           // DecodeModeLazy: Number of NALUs in pending that have already been sent to the decoder
+	lastKeyframe   time.Time     // DecodeModeKeyframes: Time when we last decoded a keyframe
+	lastWatched    atomic.Int64  // UnixNano of the most recent LastImage or WithLastImage
+
+	frames frameSlots // The most recent decoded frame
 }
 
-func NewVideoDecodeReader() *VideoDecodeReader {
+func NewVideoDecodeReader(mode DecodeMode) *VideoDecodeReader {
 	return &VideoDecodeReader{
-		incoming: make(StreamSinkChan, StreamSinkChanDefaultBufferSize),
+		Mode:             mode,
+		KeyframeInterval: time.Second,
+		DecoderOptions:   videox.DecoderOptions{AllowHardware: true},
 	}
 }
 
-func (r *VideoDecodeReader) OnConnect(stream *Stream) (StreamSinkChan, error) {
+func (r *VideoDecodeReader) OnConnect(stream *Stream) error {
 	r.Log = stream.Log
-	r.TrackID = stream.H264TrackID
-	r.Track = stream.H264Track
+	r.TrackID = stream.TrackID
+	r.Codec = stream.Codec
 
-	decoder, err := videox.NewH264Decoder()
+	options := r.DecoderOptions
+	options.Codec = stream.Codec
+	decoder, err := videox.NewH264DecoderWithOptions(options)
 	if err != nil {
-		return nil, fmt.Errorf("Failed to start H264 decoder: %w", err)
+		return fmt.Errorf("Failed to start %v decoder: %w", stream.Codec, err)
 	}
 
-	// if present, send SPS and PPS from the SDP to the decoder
-	//var sps *videox.NALU
-	//var pps *videox.NALU
-	sps := r.Track.SPS()
-	pps := r.Track.PPS()
-	if sps != nil {
-		wrapped := videox.WrapRawNALU(sps)
-		//r.sps = &wrapped
-		decoder.Decode(wrapped)
-	}
-	if pps != nil {
-		wrapped := videox.WrapRawNALU(pps)
-		//r.pps = &wrapped
-		decoder.Decode(wrapped)
+	// if present, send the parameter sets from the SDP to the decoder
+	params := stream.ParameterSets()
+	for _, ps := range params.NALUs(stream.Codec) {
+		if ps != nil {
+			decoder.Decode(videox.WrapRawNALU(ps))
+		}
 	}
 
+	r.decoderBackend = decoder.Backend()
+	r.Log.Infof("Using %v %v decoder", r.decoderBackend, stream.Codec)
+
 	r.Decoder = decoder
-	return r.incoming, nil
+	if r.Scheduler != nil {
+		r.Scheduler.add(r)
+	}
+	return nil
 }
 
-func (r *VideoDecodeReader) LastImage() image.Image {
-	r.lastImgLock.Lock()
-	defer r.lastImgLock.Unlock()
-	return r.lastImg
+// Returns the name of the decoder backend, or an empty string if we're not connected
+func (r *VideoDecodeReader) DecoderBackend() string {
+	return r.decoderBackend
+}
+
+// Returns a private copy of the most recent frame, or nil if no frame has been decoded yet.
+// In DecodeModeLazy, this decodes all the frames that have arrived since the previous call
+func (r *VideoDecodeReader) LastImage() *image.YCbCr {
+	f := r.LastFrame()
+	if f == nil {
+		return nil
+	}
+	defer f.Release()
+	return videox.CloneYCbCr(nil, f.Image)
+}
+
+// Returns the most recent frame, or nil if no frame has been decoded yet.
+// The decoder won't touch the frame until you Release it, but it doesn't wait for you either,
+// so hold onto it only as long as you need to.
+// In DecodeModeLazy, this decodes all the frames that have arrived since the previous call
+func (r *VideoDecodeReader) LastFrame() *Frame {
+	r.lastWatched.Store(time.Now().UnixNano())
+	if r.Mode == DecodeModeLazy {
+		r.decodePending()
+	}
+	return r.frames.acquire()
+}
+
+// Wait until a frame with a sequence number greater than afterSeq is decoded, and return it.
+// Pass afterSeq = 0 to wait for the first frame. You must Release the frame.
+// In DecodeModeLazy, this decodes as soon as new packets arrive, for as long as we're waiting.
+func (r *VideoDecodeReader) WaitForNextFrame(ctx context.Context, afterSeq int64) (*Frame, error) {
+	return r.waitForNextFrame(ctx, afterSeq, true)
+}
+
+// If watch is false, then we don't count as somebody watching the stream (see DecodeScheduler)
+func (r *VideoDecodeReader) waitForNextFrame(ctx context.Context, afterSeq int64, watch bool) (*Frame, error) {
+	return r.frames.waitForNext(ctx, afterSeq, func() {
+		if watch {
+			// Keep counting as watched, so that the scheduler doesn't shed our frames while we wait
+			r.lastWatched.Store(time.Now().UnixNano())
+		}
+		if r.Mode == DecodeModeLazy {
+			r.decodePending()
+		}
+	})
+}
+
+// Run fn on the most recent frame and its sequence number, while preventing the decoder from overwriting the frame.
+// img is nil if no frame has been decoded yet. fn must not retain img.
+// In DecodeModeLazy, this decodes all the frames that have arrived since the previous call
+func (r *VideoDecodeReader) WithLastImage(fn func(img *image.YCbCr, seq int64)) {
+	f := r.LastFrame()
+	if f == nil {
+		fn(nil, 0)
+		return
+	}
+	defer f.Release()
+	fn(f.Image, f.Seq)
 }
 
 func (r *VideoDecodeReader) Close() {
 	r.Log.Infof("VideoDecodeReader closed")
+	r.decodeLock.Lock()
+	defer r.decodeLock.Unlock()
+	if r.Scheduler != nil {
+		r.Scheduler.remove(r)
+	}
 	if r.Decoder != nil {
 		r.Decoder.Close()
 		r.Decoder = nil
 	}
 }
 
-func (r *VideoDecodeReader) OnPacketRTP(ctx *gortsplib.ClientOnPacketRTPCtx) {
+func (r *VideoDecodeReader) OnPacket(packet *videox.DecodedPacket) {
 	r.nPackets++
 	//r.Log.Infof("[Packet %v] VideoDecodeReader", r.nPackets)
 
-	if ctx.TrackID != r.TrackID || ctx.H264NALUs == nil {
-		return
-	}
+	for _, nalu := range packet.H264NALUs {
+		kind := nalu.Kind(r.Codec)
 
-	for _, rawNalu := range ctx.H264NALUs {
-		nalu := videox.WrapRawNALU(rawNalu)
-		ntype := nalu.Type()
-		//switch ntype {
-		//case h264.NALUTypeSPS:
-		//	r.sps = &nalu
-		//case h264.NALUTypePPS:
-		//	r.pps = &nalu
-		//}
-
-		if ntype == h264.NALUTypeIDR {
-			// we'll assume that we've seen SPS and PPS by now... but should perhaps wait for them too
+		if kind == videox.NALUKindKeyframe {
+			// we'll assume that we've seen the parameter sets by now... but should perhaps wait for them too
 			r.ready = true
 		}
 
-		if !r.ready && videox.IsVisualPacket(ntype) {
-			//r.Log.Infof("NALU %v (discard)", ntype)
+		if !r.ready && kind.IsVisual() {
+			//r.Log.Infof("NALU %v (discard)", kind)
 			continue
 		}
-		//r.Log.Infof("NALU %v", ntype)
-
-		// NOTE: To avoid the "no frame!" warnings on stdout/stderr, which ffmpeg emits, we must not send SPS
-		// and PPS refresh NALUs to the decoder alone. Instead, we must join them into the next IDR, and
-		// send SPS+PPS+IDR as a single packet. I HAVE NOT TESTED THIS THEORY!
+		//r.Log.Infof("NALU %v", kind)
 
-		// convert H264 NALUs to RGBA frames
-		img, err := r.Decoder.Decode(nalu)
-		if err != nil {
-			r.Log.Errorf("Failed to decode H264 NALU: %v", err)
-			continue
+		switch r.Mode {
+		case DecodeModeAll:
+			r.decodeNow(nalu)
+		case DecodeModeLazy:
+			r.addPending(nalu)
+		case DecodeModeKeyframes:
+			if kind.IsVisual() {
+				if kind != videox.NALUKindKeyframe || time.Since(r.lastKeyframe) < r.KeyframeInterval {
+					continue
+				}
+				r.lastKeyframe = time.Now()
+			}
+			r.decodeNow(nalu)
 		}
+	}
+}
 
-		if img == nil {
-			continue
+// Decode a NALU on this goroutine, or queue it on our scheduler
+func (r *VideoDecodeReader) decodeNow(nalu videox.NALU) {
+	if r.Scheduler != nil {
+		r.Scheduler.decode(r, nalu)
+		return
+	}
+	r.decodeLock.Lock()
+	r.decodeAndKeep(nalu)
+	r.decodeLock.Unlock()
+}
+
+// Returns true if somebody has asked for our latest frame recently
+func (r *VideoDecodeReader) watched() bool {
+	period := 10 * time.Second
+	if r.Scheduler != nil {
+		period = r.Scheduler.WatchedPeriod
+	}
+	return time.Since(time.Unix(0, r.lastWatched.Load())) < period
+}
+
+// Run jobs from our scheduler. If the scheduler fell behind, we'll get many frames at once,
+// and only the final one is kept.
+func (r *VideoDecodeReader) runJobs(jobs []decodeJob) {
+	r.decodeLock.Lock()
+	defer r.decodeLock.Unlock()
+
+	var last *image.YCbCr
+	for _, j := range jobs {
+		if j.flush != nil {
+			if last != nil {
+				r.publishFrame(last)
+				last = nil
+			}
+			r.decodePendingNoLock()
+			close(j.flush)
+		} else if img := r.decode(j.nalu); img != nil {
+			last = img
 		}
+	}
+	if last != nil {
+		r.publishFrame(last)
+	}
+}
 
+// Decode a NALU, and if it produces a frame, publish a copy of it.
+// You must be holding decodeLock.
+func (r *VideoDecodeReader) decodeAndKeep(nalu videox.NALU) {
+	img := r.decode(nalu)
+	if img != nil {
 		// The 'img' returned by Decode is transient, so we need make a copy of it.
-		r.cloneIntoLastImg(img)
-		//r.Log.Infof("[Packet %v] Decoded frame with size %v", r.nPackets, img.Bounds().Max)
+		r.publishFrame(img)
 	}
 }
 
-func (r *VideoDecodeReader) cloneIntoLastImg(latest image.Image) {
-	r.lastImgLock.Lock()
-	if r.lastImg == nil || !r.lastImg.Bounds().Eq(latest.Bounds()) {
-		r.lastImg = image.NewRGBA(latest.Bounds())
+// You must be holding decodeLock.
+func (r *VideoDecodeReader) decode(nalu videox.NALU) *image.YCbCr {
+	if r.Decoder == nil {
+		return nil
 	}
-	src := latest.(*image.RGBA)
-	dst := r.lastImg.(*image.RGBA)
-	h := src.Rect.Dy()
-	for i := 0; i < h; i++ {
-		copy(dst.Pix[i*dst.Stride:(i+1)*dst.Stride], src.Pix[i*src.Stride:(i+1)*src.Stride])
+
+	// NOTE: To avoid the "no frame!" warnings on stdout/stderr, which ffmpeg emits, we must not send SPS
+	// and PPS refresh NALUs to the decoder alone. Instead, we must join them into the next IDR, and
+	// send SPS+PPS+IDR as a single packet. I HAVE NOT TESTED THIS THEORY!
+
+	// We keep the decoder's native YUV planes. Converting to RGB would only be undone by the JPEG encoder.
+	img, err := r.Decoder.DecodeYCbCr(nalu)
+	if err != nil {
+		r.Log.Errorf("Failed to decode %v NALU: %v", r.Codec, err)
+		return nil
 	}
-	r.lastImgLock.Unlock()
+	//r.Log.Infof("[Packet %v] Decoded frame with size %v", r.nPackets, img.Bounds().Max)
+	return img
+}
+
+// Add a NALU to the pending list.
+// When a keyframe arrives, all of the frames before it are discarded, because the keyframe does not depend on them.
+// We keep whatever followed the last frame (eg SPS + PPS), because that belongs with the keyframe.
+func (r *VideoDecodeReader) addPending(nalu videox.NALU) {
+	r.decodeLock.Lock()
+	defer r.decodeLock.Unlock()
+
+	kind := nalu.Kind(r.Codec)
+	if kind == videox.NALUKindKeyframe {
+		keepFrom := 0
+		for i := len(r.pending) - 1; i >= 0; i-- {
+			if r.pending[i].Kind(r.Codec).IsVisual() {
+				keepFrom = i + 1
+				break
+			}
+		}
+		n := copy(r.pending, r.pending[keepFrom:])
+		r.pending = r.pending[:n]
+		r.pendingDecoded = 0
+	}
+	// Nothing depends on a non-reference frame, so when the decoders are saturated, and nobody is watching
+	// us, we can skip it. It would only ever have been shown if it were the very last frame before a LastImage().
+	if r.Scheduler != nil && kind.IsVisual() && nalu.IsNonReference(r.Codec) && !r.watched() && r.Scheduler.Saturated() {
+		r.Scheduler.Shed.Add(1)
+		return
+	}
+	// The NALU belongs to a packet that is shared by all sinks, and never modified, so we can keep a reference to it
+	r.pending = append(r.pending, nalu)
+	if kind.IsVisual() {
+		// Anybody in WaitForNextFrame can decode this now
+		r.frames.wake()
+	}
+}
+
+// Send all pending NALUs to the decoder, and keep only the final frame.
+// If we have a scheduler, this runs on one of its workers.
+func (r *VideoDecodeReader) decodePending() {
+	if r.Scheduler != nil && r.Scheduler.flush(r) {
+		return
+	}
+	r.decodeLock.Lock()
+	defer r.decodeLock.Unlock()
+	r.decodePendingNoLock()
+}
+
+// You must be holding decodeLock
+func (r *VideoDecodeReader) decodePendingNoLock() {
+	var last *image.YCbCr
+	for ; r.pendingDecoded < len(r.pending); r.pendingDecoded++ {
+		if img := r.decode(r.pending[r.pendingDecoded]); img != nil {
+			last = img
+		}
+	}
+	if last != nil {
+		r.publishFrame(last)
+	}
+}
+
+func (r *VideoDecodeReader) publishFrame(latest *image.YCbCr) {
+	// If every slot is held by a reader, the frame is dropped, and readers just see an older frame
+	r.frames.publish(latest)
 }
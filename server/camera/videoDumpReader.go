@@ -2,14 +2,17 @@ package camera
 
 import (
 	"fmt"
+	"os"
+	"path/filepath"
+	"strconv"
 	"sync"
+	"sync/atomic"
+	"syscall"
 	"time"
 
-	"github.com/aler9/gortsplib"
-	"github.com/aler9/gortsplib/pkg/h264"
 	"github.com/bmharper/cyclops/server/log"
+	"github.com/bmharper/cyclops/server/metrics"
 	"github.com/bmharper/cyclops/server/videox"
-	"github.com/bmharper/ringbuffer"
 )
 
 type ExtractMethod int
@@ -24,151 +27,273 @@ const (
 type VideoDumpReader struct {
 	Log     log.Log
 	TrackID int
-	Track   *gortsplib.TrackH264
 
-	BufferLock sync.Mutex // Guards all access to Buffer
-	Buffer     ringbuffer.WeightedRingT[videox.DecodedPacket]
+	BufferLock sync.Mutex         // Guards all access to Buffer. Prefer LockBuffer/UnlockBuffer, which measure the hold time.
+	Buffer     *videox.TieredRing // NALU payloads live in a single arena, so storing packets creates no garbage
+	LockHold   metrics.Histogram  // How long BufferLock is held for
 
-	incoming StreamSinkChan
+	// Spill file that we'll create once the RAM ring is full (see EnableSpillFor). Guarded by BufferLock.
+	spillFilename string
+	spillPreRoll  time.Duration
+	closed        bool
+
+	// Recording of the stream into a capture file (see StartCapture).
+	// This has its own lock, so that disk writes never extend the hold time of BufferLock.
+	captureLock      sync.Mutex
+	capture          *videox.CaptureWriter
+	captureWaitIDR   bool
+	captureIsRunning atomic.Bool
 }
 
 func NewVideoDumpReader(maxRingBufferBytes int) *VideoDumpReader {
 	return &VideoDumpReader{
-		Buffer:   ringbuffer.NewWeightedRingT[videox.DecodedPacket](maxRingBufferBytes),
-		incoming: make(StreamSinkChan, StreamSinkChanDefaultBufferSize),
+		Buffer: videox.NewTieredRing(maxRingBufferBytes),
 	}
 }
 
-func (r *VideoDumpReader) OnConnect(stream *Stream) (StreamSinkChan, error) {
+func (r *VideoDumpReader) OnConnect(stream *Stream) error {
 	r.Log = stream.Log
-	r.TrackID = stream.H264TrackID
-	r.Track = stream.H264Track
-	r.initializeBuffer()
-	return r.incoming, nil
+	r.TrackID = stream.TrackID
+	r.initializeBuffer(stream.Codec)
+	return nil
+}
+
+// Acquire BufferLock, and return the time at which we got it, for UnlockBuffer.
+// Use it as 'defer r.UnlockBuffer(r.LockBuffer())'
+func (r *VideoDumpReader) LockBuffer() time.Time {
+	r.BufferLock.Lock()
+	return time.Now()
+}
+
+// Release BufferLock, recording how long it was held for.
+// locked is the value returned by LockBuffer.
+func (r *VideoDumpReader) UnlockBuffer(locked time.Time) {
+	r.LockHold.Since(locked)
+	r.BufferLock.Unlock()
+}
+
+// Keep older video in a memory mapped file of spillBytes, once it no longer fits into RAM.
+// This extends the pre-roll by spillBytes, without using any more RAM (see TieredRing).
+func (r *VideoDumpReader) EnableSpill(filename string, spillBytes int) error {
+	defer r.UnlockBuffer(r.LockBuffer())
+	return r.Buffer.EnableSpill(filename, spillBytes)
 }
 
-func (r *VideoDumpReader) initializeBuffer() {
-	r.Buffer = ringbuffer.NewWeightedRingT[videox.DecodedPacket](r.Buffer.MaxWeight)
+// Keep preRoll of older video in a spill file, once it no longer fits into RAM (see EnableSpill).
+// The file is only created when the RAM ring first fills up, because that's when we start to need it,
+// and by then we know the bitrate of the stream, which the file's size is computed from.
+// The file is limited to half of the free space on its disk, so it can't fill the disk.
+func (r *VideoDumpReader) EnableSpillFor(filename string, preRoll time.Duration) {
+	defer r.UnlockBuffer(r.LockBuffer())
+	r.spillFilename = filename
+	r.spillPreRoll = preRoll
+}
+
+// Create the spill file that was requested by EnableSpillFor.
+// bytes is the amount of video that arrived during duration.
+func (r *VideoDumpReader) startSpill(filename string, preRoll time.Duration, bytes int, duration time.Duration) {
+	size, err := spillFileSize(filename, preRoll, bytes, duration)
+	var mmap []byte
+	if err == nil {
+		r.Log.Infof("Creating %v MB spill file for %.0f seconds of pre-roll", size/(1024*1024), preRoll.Seconds())
+		mmap, err = videox.MapSpillFile(filename, size)
+	}
+	if err == nil {
+		locked := r.LockBuffer()
+		if r.closed {
+			err = syscall.Munmap(mmap)
+		} else {
+			err = r.Buffer.AttachSpill(mmap)
+		}
+		r.UnlockBuffer(locked)
+	}
+	if err != nil {
+		// Not fatal. We only lose the longer pre-roll.
+		r.Log.Errorf("Failed to create ring buffer spill file %v: %v", filename, err)
+	}
+}
+
+// Returns the size of a spill file that holds preRoll of a stream which produced bytes in duration,
+// limited by the free space on the disk of filename, and on 32-bit systems, by the address space.
+func spillFileSize(filename string, preRoll time.Duration, bytes int, duration time.Duration) (int, error) {
+	if duration <= 0 {
+		return 0, fmt.Errorf("Unable to measure the bitrate")
+	}
+	if err := os.MkdirAll(filepath.Dir(filename), 0770); err != nil {
+		return 0, err
+	}
+	st := syscall.Statfs_t{}
+	if err := syscall.Statfs(filepath.Dir(filename), &st); err != nil {
+		return 0, err
+	}
+	free := float64(st.Bavail) * float64(st.Bsize)
+	if existing, err := os.Stat(filename); err == nil {
+		// We'll reuse this space
+		free += float64(existing.Size())
+	}
+	// 10% extra, for the slack at the end of the ring when a GOP doesn't fit
+	size := 1.1 * float64(bytes) * preRoll.Seconds() / duration.Seconds()
+	// Leave the other half of the disk for recordings
+	size = min(size, free/2)
+	if strconv.IntSize == 32 {
+		// The whole file is mapped, so a large file would use up the address space
+		size = min(size, 256*1024*1024)
+	}
+	if size < 1024*1024 {
+		return 0, fmt.Errorf("Not enough free disk space (%.0f MB)", free/(1024*1024))
+	}
+	return int(size), nil
+}
+
+// Returns the number of bytes in the ring buffer, the size of the ring buffer, and the number of packets in it.
+// The sizes include the spill file, which is also returned separately.
+func (r *VideoDumpReader) BufferStats() (bytes, capacity, packets, spillBytes, spillCapacity int) {
+	defer r.UnlockBuffer(r.LockBuffer())
+	return r.Buffer.Bytes(), r.Buffer.Capacity(), r.Buffer.Len(), r.Buffer.SpillBytes(), r.Buffer.SpillCapacity()
+}
+
+func (r *VideoDumpReader) initializeBuffer(codec videox.Codec) {
+	locked := r.LockBuffer()
+	r.Buffer.Clear()
+	r.Buffer.SetCodec(codec)
+	r.UnlockBuffer(locked)
 }
 
 func (r *VideoDumpReader) Close() {
+	if err := r.StopCapture(); err != nil {
+		r.Log.Errorf("Failed to finish capture: %v", err)
+	}
+	locked := r.LockBuffer()
+	r.closed = true
+	err := r.Buffer.DisableSpill()
+	r.UnlockBuffer(locked)
+	if err != nil {
+		r.Log.Errorf("Failed to unmap spill file: %v", err)
+	}
 	r.Log.Infof("VideoDumpReader closed")
 }
 
-func (r *VideoDumpReader) OnPacketRTP(ctx *gortsplib.ClientOnPacketRTPCtx) {
+func (r *VideoDumpReader) OnPacket(packet *videox.DecodedPacket) {
 	//r.Log.Infof("[Packet %v] VideoDumpReader", 0)
-	if ctx.TrackID != r.TrackID || ctx.H264NALUs == nil {
-		return
+	if r.captureIsRunning.Load() {
+		r.writeCapture(packet)
 	}
 
-	clone := videox.ClonePacket(ctx)
+	defer r.UnlockBuffer(r.LockBuffer())
 
-	r.BufferLock.Lock()
-	defer r.BufferLock.Unlock()
+	if r.spillFilename != "" && r.Buffer.Len() >= 2 && r.Buffer.Bytes()+packet.PayloadBytes() > r.Buffer.Capacity() {
+		// The RAM ring is about to evict its first GOP. Creating the file can be slow, so don't do it on the stream's goroutine.
+		go r.startSpill(r.spillFilename, r.spillPreRoll, r.Buffer.Bytes(), r.Buffer.PTS(r.Buffer.Len()-1)-r.Buffer.PTS(0))
+		r.spillFilename = ""
+	}
+
+	// The packet is shared with other sinks, so AddPacket copies the NALUs into the ring's arena
+	if !r.Buffer.AddPacket(packet) {
+		r.Log.Warnf("VideoDumpReader dropped packet, because it is larger than the entire ring buffer")
+	}
+}
+
+// Start recording the stream into a single capture file, which the tools in debug/ can stream and seek.
+// The capture begins at the next keyframe, so that it is decodable from the first packet.
+func (r *VideoDumpReader) StartCapture(filename string) error {
+	locked := r.LockBuffer()
+	codec := r.Buffer.Codec()
+	r.UnlockBuffer(locked)
 
-	r.Buffer.Add(clone.PayloadBytes(), clone)
+	r.captureLock.Lock()
+	defer r.captureLock.Unlock()
+	if r.capture != nil {
+		return fmt.Errorf("A capture is already running")
+	}
+	w, err := videox.NewCaptureWriter(filename, codec)
+	if err != nil {
+		return err
+	}
+	r.capture = w
+	r.captureWaitIDR = true
+	r.captureIsRunning.Store(true)
+	r.Log.Infof("Capturing stream to %v", filename)
+	return nil
+}
+
+// Stop recording the capture, and write its index. Does nothing if no capture is running.
+func (r *VideoDumpReader) StopCapture() error {
+	r.captureLock.Lock()
+	defer r.captureLock.Unlock()
+	if r.capture == nil {
+		return nil
+	}
+	r.captureIsRunning.Store(false)
+	err := r.capture.Close()
+	r.capture = nil
+	return err
+}
+
+func (r *VideoDumpReader) writeCapture(packet *videox.DecodedPacket) {
+	r.captureLock.Lock()
+	defer r.captureLock.Unlock()
+	if r.capture == nil {
+		return
+	}
+	if r.captureWaitIDR {
+		if !packet.IsKeyframe() {
+			return
+		}
+		r.captureWaitIDR = false
+	}
+	if err := r.capture.WritePacket(packet); err != nil {
+		r.Log.Errorf("Capture stopped, because writing failed: %v", err)
+		r.captureIsRunning.Store(false)
+		r.capture.Close()
+		r.capture = nil
+	}
 }
 
 // Extract from <now - duration> until <now>.
 // duration is a positive number.
 func (r *VideoDumpReader) ExtractRawBuffer(method ExtractMethod, duration time.Duration) (*videox.RawBuffer, error) {
-	r.BufferLock.Lock()
-	defer r.BufferLock.Unlock()
+	defer r.UnlockBuffer(r.LockBuffer())
 
 	bufLen := r.Buffer.Len()
 	if bufLen == 0 {
 		return nil, fmt.Errorf("No video available")
 	}
 
-	// Compute the starting packet for extraction
-	firstPacket := 0
-	{
-		_, lastPacket, _ := r.Buffer.Peek(bufLen - 1)
-		presentTime := lastPacket.H264PTS
-		// Keep going until all 3 are satisfied, with the extra condition that SPS and PPS must precede IDR.
-		// This just happens to work, because cameras will send SPS and PPS before every IDR, to allow a listener
-		// to join the stream at any time.
-		haveIDR := false
-		haveSPS := false
-		havePPS := false
-		for i := bufLen - 1; i >= 0; i-- {
-			_, packet, _ := r.Buffer.Peek(i)
-			timeDelta := presentTime - packet.H264PTS
-			//r.Log.Infof("%v < %v ?", timeDelta, duration)
-			if timeDelta < duration {
-				continue
-			}
-			if !haveIDR && packet.HasType(h264.NALUTypeIDR) {
-				haveIDR = true
-				//r.Log.Infof("haveIDR")
-			}
-			if haveIDR && !havePPS && packet.HasType(h264.NALUTypePPS) {
-				havePPS = true
-				//r.Log.Infof("havePPS")
-			}
-			if haveIDR && !haveSPS && packet.HasType(h264.NALUTypeSPS) {
-				haveSPS = true
-				//r.Log.Infof("haveSPS")
-			}
-			if haveIDR && haveSPS && havePPS {
-				firstPacket = i
-				break
-			}
-		}
-		//if firstPacket == 0 {
-		//	r.Log.Infof("Failed to find appropriate starting point for extraction")
-		//} else {
-		//	r.Log.Infof("Starting extraction at packet %v (len %v)", firstPacket, bufLen)
-		//}
-		// In the case where this loop ends without ever assigning firstPacket, we fall back
-		// to just emitting the entire buffer, regardless of how useful it is.
+	// Compute the starting packet for extraction.
+	// We want the newest keyframe that is at least 'duration' old, along with the parameter sets that precede it.
+	// This just happens to work, because cameras will send parameter sets before every keyframe, to allow a listener
+	// to join the stream at any time.
+	// If there is no such keyframe, we fall back to just emitting the entire buffer, regardless of how useful it is.
+	presentTime := r.Buffer.PTS(bufLen - 1)
+	firstPacket := r.Buffer.FindKeyframeStart(presentTime - duration)
+	if firstPacket == -1 {
+		firstPacket = 0
 	}
 
 	out := &videox.RawBuffer{
-		// little race condition here if Track.SPS and Track.PPS don't agree.
-		//SPS:     util.CopySlice(r.Track.SPS()),
-		//PPS:     util.CopySlice(r.Track.PPS()),
-		Packets: make([]*videox.DecodedPacket, bufLen-firstPacket),
-	}
-
-	switch method {
-	case ExtractMethodClone:
-		// We might be holding the lock for too long here. 100 MB copy on RPi4 is 25ms (4GB/s memory bandwidth)
-		// It would be possible to incrementally lock and unlock r.BufferLock in order to reduce the duration of our lock.
-		for i := firstPacket; i < bufLen; i++ {
-			_, packet, _ := r.Buffer.Peek(i)
-			out.Packets[i-firstPacket] = packet.Clone()
-		}
-	case ExtractMethodDrain:
+		Codec: r.Buffer.Codec(),
+	}
+
+	// We might be holding the lock for too long here. 100 MB copy on RPi4 is 25ms (4GB/s memory bandwidth)
+	// It would be possible to incrementally lock and unlock r.BufferLock in order to reduce the duration of our lock.
+	// Extract produces all the packets from a single allocation.
+	out.Packets = r.Buffer.Extract(firstPacket, bufLen)
+	out.KeyframeIndex = r.Buffer.KeyframesIn(firstPacket, bufLen)
+
+	if method == ExtractMethodDrain {
 		// Discard earlier history from the ring buffer.
 		// In practice this is OK, because it means we've had a detection event, but the fact that
 		// we didn't have a detection event prior to this implies that all older footage is
 		// uninteresting, so discarding the old history is fine.
-		// Using Drain instead of Clone is nice because we don't need to copy the memory.
-		for i := 0; i < firstPacket; i++ {
-			r.Buffer.Next()
-		}
-		for i := firstPacket; i < bufLen; i++ {
-			_, packet, _ := r.Buffer.Next()
-			out.Packets[i-firstPacket] = packet
-		}
-		if r.Buffer.Len() != 0 {
-			panic("Buffer should be empty")
-		}
+		// Draining still requires a copy, because the arena gets reused.
+		r.Buffer.Clear()
 	}
 	return out, nil
 }
 
-// Scan back in the ring buffer to find the first packet containing an IDR frame
+// Find the most recent packet containing an IDR frame
 // Assumes that you are holding BufferLock
 // Returns the index in the buffer, or -1 if none found
 func (r *VideoDumpReader) FindLatestIDRPacketNoLock() int {
-	i := r.Buffer.Len() - 1
-	for ; i >= 0; i-- {
-		_, packet, _ := r.Buffer.Peek(i)
-		if packet.HasType(h264.NALUTypeIDR) {
-			return i
-		}
-	}
-	return -1
+	return r.Buffer.LatestKeyframe()
 }
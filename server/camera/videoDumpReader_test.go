@@ -0,0 +1,21 @@
+package camera
+
+import (
+	"path/filepath"
+	"testing"
+	"time"
+
+	"github.com/stretchr/testify/require"
+)
+
+func TestSpillFileSize(t *testing.T) {
+	filename := filepath.Join(t.TempDir(), "spill", "1.ring")
+
+	// 1 MB/s, for a minute of pre-roll, with 10% slack. It may be less if the disk is nearly full.
+	size, err := spillFileSize(filename, time.Minute, 10*1024*1024, 10*time.Second)
+	require.NoError(t, err)
+	require.LessOrEqual(t, size, 66*1024*1024+1)
+
+	_, err = spillFileSize(filename, time.Minute, 1024, 0)
+	require.Error(t, err)
+}
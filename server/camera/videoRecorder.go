@@ -0,0 +1,89 @@
+package camera
+
+import (
+	"os"
+	"path/filepath"
+	"time"
+
+	"github.com/bmharper/cyclops/server/log"
+	"github.com/bmharper/cyclops/server/videox"
+)
+
+// VideoRecorder writes a stream continuously to disk, as a sequence of fragmented MP4 files.
+// A new file is started on the first keyframe after SegmentDuration has elapsed.
+// The video is not decoded or re-encoded.
+type VideoRecorder struct {
+	Log             log.Log
+	TrackID         int
+	Root            string                // Directory where we write our files
+	SegmentDuration time.Duration         // Approximate length of each file
+	Stats           *videox.PipelineStats // May be nil
+
+	recorder     *videox.Recorder
+	haveSegment  bool
+	segmentStart time.Duration           // PTS of the first packet in the current file
+	packets      []*videox.DecodedPacket // Scratch space for WritePackets
+}
+
+func NewVideoRecorder(root string, segmentDuration time.Duration) *VideoRecorder {
+	return &VideoRecorder{
+		Root:            root,
+		SegmentDuration: segmentDuration,
+		packets:         make([]*videox.DecodedPacket, 1),
+	}
+}
+
+func (r *VideoRecorder) OnConnect(stream *Stream) error {
+	recorder, err := videox.NewRecorder("mp4", stream.Codec, 5*time.Second)
+	if err != nil {
+		return err
+	}
+	r.Log = stream.Log
+	r.TrackID = stream.TrackID
+	recorder.SetStats(r.Stats)
+	r.recorder = recorder
+	return nil
+}
+
+func (r *VideoRecorder) Close() {
+	if r.recorder != nil {
+		if err := r.recorder.Close(); err != nil {
+			r.Log.Errorf("VideoRecorder close failed: %v", err)
+		}
+		r.recorder = nil
+	}
+	r.Log.Infof("VideoRecorder closed")
+}
+
+func (r *VideoRecorder) OnPacket(packet *videox.DecodedPacket) {
+	if packet.IsKeyframe() && (!r.haveSegment || packet.H264PTS-r.segmentStart >= r.SegmentDuration) {
+		if err := r.startSegment(packet.H264PTS); err != nil {
+			r.Log.Errorf("VideoRecorder failed to start new file: %v", err)
+			r.haveSegment = false
+			return
+		}
+	}
+	if !r.haveSegment {
+		return
+	}
+
+	r.packets[0] = packet
+	if err := r.recorder.WritePackets(r.packets, r.segmentStart); err != nil {
+		r.Log.Errorf("VideoRecorder write failed: %v", err)
+	}
+	r.packets[0] = nil
+}
+
+func (r *VideoRecorder) startSegment(pts time.Duration) error {
+	filename := filepath.Join(r.Root, time.Now().Format("2006-01/02/15-04-05")+".mp4")
+	if err := os.MkdirAll(filepath.Dir(filename), 0777); err != nil {
+		return err
+	}
+	if err := r.recorder.StartSegment(filename); err != nil {
+		return err
+	}
+	r.Log.Infof("VideoRecorder started %v", filename)
+	r.haveSegment = true
+	r.segmentStart = pts
+	return nil
+}
@@ -1,14 +1,11 @@
 package camera
 
 import (
-	"bytes"
 	"encoding/binary"
 	"fmt"
 	"sync/atomic"
 	"time"
 
-	"github.com/aler9/gortsplib"
-	"github.com/aler9/gortsplib/pkg/h264"
 	"github.com/bmharper/cyclops/server/log"
 	"github.com/bmharper/cyclops/server/videox"
 	"github.com/gorilla/websocket"
@@ -22,19 +19,24 @@ const (
 
 // Number of packets (should be closely correlated with number of frames) that we will buffer
 // on the send side, before dropping packets to the sender.
-// NOTE: If a camera's IDR interval is greater than this number, then sendBacklog will often fail.
+// The backlog is not sent via this queue, so it doesn't limit the length of the backlog.
 const WebSocketSendBufferSize = 50
 
+// Once the send queue is this full, we start dropping non-reference frames
+const WebSocketDropNonRefThreshold = WebSocketSendBufferSize / 2
+
 var nextWebSocketStreamerID int64
 
 type VideoWebSocketStreamer struct {
 	log             log.Log
 	streamerID      int64 // Intended to aid in logging/debugging
-	incoming        StreamSinkChan
+	incoming        *StreamReader
 	trackID         int
 	closed          bool
 	fromWebSocket   chan webSocketMsg
 	sendQueue       chan *videox.DecodedPacket
+	backlog         []*videox.DecodedPacket // The current GOP from the dumper, which webSocketWriter sends before sendQueue
+	waitForIDR      bool                    // We were forced to drop a reference frame, so we must drop everything until the next IDR
 	lastDropMsg     time.Time
 	nPacketsDropped int64
 	nPacketsSent    int64
@@ -45,7 +47,6 @@ type VideoWebSocketStreamer struct {
 func NewVideoWebSocketStreamer(logger log.Log) *VideoWebSocketStreamer {
 	streamerID := atomic.AddInt64(&nextWebSocketStreamerID, 1)
 	return &VideoWebSocketStreamer{
-		incoming:   make(StreamSinkChan, StreamSinkChanDefaultBufferSize),
 		streamerID: streamerID,
 		log:        log.NewPrefixLogger(logger, fmt.Sprintf("WebSocket %v", streamerID)),
 		sendQueue:  make(chan *videox.DecodedPacket, WebSocketSendBufferSize),
@@ -53,38 +54,63 @@ func NewVideoWebSocketStreamer(logger log.Log) *VideoWebSocketStreamer {
 	}
 }
 
-func (s *VideoWebSocketStreamer) OnConnect(stream *Stream) (StreamSinkChan, error) {
-	s.trackID = stream.H264TrackID
+func (s *VideoWebSocketStreamer) OnConnect(stream *Stream) error {
+	if stream.Codec != videox.CodecH264 {
+		// The browser remuxes our packets with jmuxer, which only understands H264
+		return fmt.Errorf("The websocket player only supports H264, but this stream is %v. Use HLS instead.", stream.Codec)
+	}
+	s.trackID = stream.TrackID
 	if s.debug {
 		s.log.Infof("OnConnect trackID:%v", s.trackID)
 	}
-	return s.incoming, nil
+	return nil
 }
 
-func (s *VideoWebSocketStreamer) onPacketRTP(ctx *gortsplib.ClientOnPacketRTPCtx) {
-	if ctx.TrackID != s.trackID || ctx.H264NALUs == nil {
-		return
-	}
-
+func (s *VideoWebSocketStreamer) onPacket(packet *videox.DecodedPacket) {
 	if s.debug {
-		s.log.Infof("onPacketRTP")
+		s.log.Infof("onPacket")
 	}
 
 	now := time.Now()
-	if len(s.sendQueue) >= WebSocketSendBufferSize {
+	if s.shouldDrop(packet) {
 		s.nPacketsDropped++
+		s.incoming.stream.Metrics.WebSocketDropped.Add(1)
 		if now.Sub(s.lastDropMsg) > 5*time.Second {
 			s.log.Infof("Dropped %v/%v packets", s.nPacketsDropped, s.nPacketsDropped+s.nPacketsSent)
 			s.lastDropMsg = now
 		}
 	} else {
 		s.nPacketsSent++
+		s.incoming.stream.Metrics.WebSocketSent.Add(1)
 		if now.Sub(s.lastLogTime) > 20*time.Second {
 			s.log.Infof("Sent %v/%v packets", s.nPacketsSent, s.nPacketsDropped+s.nPacketsSent)
 			s.lastLogTime = now
 		}
-		s.sendQueue <- videox.ClonePacket(ctx)
+		// The packet is shared with the other sinks, but webSocketWriter only reads it
+		s.sendQueue <- packet
+	}
+}
+
+// Our drop policy, for when the client can't keep up.
+// We drop whole frames that nothing else references, once the queue is partially full.
+// If the queue is completely full, then we have no choice but to drop a reference frame,
+// and then everything until the next IDR must go too, otherwise the client would decode garbage.
+// Packets without frame data (eg SPS and PPS) are tiny, and are only dropped when the queue is full.
+func (s *VideoWebSocketStreamer) shouldDrop(packet *videox.DecodedPacket) bool {
+	queued := len(s.sendQueue)
+	if queued >= WebSocketSendBufferSize {
+		if packet.IsReference() {
+			s.waitForIDR = true
+		}
+		return true
+	}
+	if s.waitForIDR && packet.HasVisual() {
+		if !packet.IsKeyframe() {
+			return true
+		}
+		s.waitForIDR = false
 	}
+	return queued >= WebSocketDropNonRefThreshold && packet.HasVisual() && !packet.IsReference()
 }
 
 func (s *VideoWebSocketStreamer) Run(conn *websocket.Conn, stream *Stream, backlog *VideoDumpReader) {
@@ -92,10 +118,22 @@ func (s *VideoWebSocketStreamer) Run(conn *websocket.Conn, stream *Stream, backl
 		s.log.Infof("Run start")
 	}
 
-	stream.ConnectSink(s, false)
+	incoming, err := stream.ConnectSink(s, false)
+	if err != nil {
+		s.log.Errorf("Failed to connect to stream: %v", err)
+		conn.Close()
+		return
+	}
+	s.incoming = incoming
 	defer stream.RemoveSink(s)
 	defer conn.Close()
 
+	// We've already connected to the stream, so the backlog overlaps with the first live packets.
+	// webSocketWriter skips the overlap.
+	if backlog != nil {
+		s.backlog = s.extractBacklog(backlog)
+	}
+
 	s.fromWebSocket = make(chan webSocketMsg, 1)
 	go s.webSocketReader(conn)
 	go s.webSocketWriter(conn)
@@ -107,20 +145,16 @@ func (s *VideoWebSocketStreamer) Run(conn *websocket.Conn, stream *Stream, backl
 	s.closed = false
 	webSocketClosed := false
 
-	if backlog != nil {
-		s.sendBacklog(backlog)
-	}
-
 	for !s.closed {
 		select {
-		case msg := <-s.incoming:
-			switch msg.Type {
-			case StreamMsgTypeClose:
-				s.log.Infof("Run StreamMsgTypeClose")
+		case <-s.incoming.Wake():
+			closed := s.incoming.Closed()
+			for packet := s.incoming.Next(); packet != nil; packet = s.incoming.Next() {
+				s.onPacket(packet)
+			}
+			if closed {
+				s.log.Infof("Run stream closed")
 				s.closed = true
-				break
-			case StreamMsgTypePacket:
-				s.onPacketRTP(msg.Packet)
 			}
 		case wsMsg := <-s.fromWebSocket:
 			switch wsMsg {
@@ -143,34 +177,27 @@ func (s *VideoWebSocketStreamer) Run(conn *websocket.Conn, stream *Stream, backl
 	}
 }
 
-func (s *VideoWebSocketStreamer) sendBacklog(backlog *VideoDumpReader) {
-	s.log.Infof("Sending backlog of frames")
-	backlog.BufferLock.Lock()
-	defer backlog.BufferLock.Unlock()
-	packetIdx := backlog.FindLatestIDRPacketNoLock()
+// Copy the current GOP out of the dumper, starting at the most recent keyframe (and its SPS and PPS).
+// The packets come from a single allocation, so this is cheap, no matter how long the GOP is.
+func (s *VideoWebSocketStreamer) extractBacklog(backlog *VideoDumpReader) []*videox.DecodedPacket {
+	defer backlog.UnlockBuffer(backlog.LockBuffer())
+	top := backlog.Buffer.Len()
+	if top == 0 {
+		return nil
+	}
+	packetIdx := backlog.Buffer.FindKeyframeStart(backlog.Buffer.PTS(top - 1))
 	if packetIdx == -1 {
-		return
+		packetIdx = backlog.FindLatestIDRPacketNoLock()
 	}
-	top := backlog.Buffer.Len()
-	// send all recent packets, starting at the IDR
-	for i := packetIdx; i < top; i++ {
-		if len(s.sendQueue) >= WebSocketSendBufferSize {
-			// just give up before blocking... haven't really thought what the best thing is to do in a case like this
-			s.log.Infof("sendBacklog giving up, because sendQueue is full")
-			break
-		}
-		if s.debug {
-			s.log.Infof("sendBacklog sending packet %v", i)
-		}
-		_, packet, _ := backlog.Buffer.Peek(i)
-		cloned := packet.Clone()
-		cloned.IsBacklog = true
-		s.sendQueue <- cloned
+	if packetIdx == -1 {
+		return nil
 	}
-
-	if s.debug {
-		s.log.Infof("sendBacklog done")
+	packets := backlog.Buffer.Extract(packetIdx, top)
+	for _, p := range packets {
+		p.IsBacklog = true
 	}
+	s.log.Infof("Sending backlog of %v packets", len(packets))
+	return packets
 }
 
 // Read from the websocket and post to our own channel, so that we can
@@ -195,46 +222,70 @@ func (s *VideoWebSocketStreamer) webSocketReader(conn *websocket.Conn) {
 // and we can detect the blockage.
 func (s *VideoWebSocketStreamer) webSocketWriter(conn *websocket.Conn) {
 	sentIDR := false
+	backlog := s.backlog
+	s.backlog = nil
+	haveBacklog := len(backlog) != 0
+	var backlogEnd time.Duration
+	if haveBacklog {
+		backlogEnd = backlog[len(backlog)-1].H264PTS
+	}
 	for {
-		pkt, more := <-s.sendQueue
-		if !more || s.closed {
-			if s.debug {
-				s.log.Infof("webSocketWriter closing. more:%v, s.closed:%v", more, s.closed)
+		var pkt *videox.DecodedPacket
+		if len(backlog) != 0 {
+			pkt = backlog[0]
+			backlog[0] = nil
+			backlog = backlog[1:]
+		} else {
+			var more bool
+			pkt, more = <-s.sendQueue
+			if !more || s.closed {
+				if s.debug {
+					s.log.Infof("webSocketWriter closing. more:%v, s.closed:%v", more, s.closed)
+				}
+				break
+			}
+			if haveBacklog && pkt.H264PTS <= backlogEnd {
+				// Already sent as part of the backlog
+				continue
 			}
-			break
 		}
 
 		if !sentIDR && pkt.IsIFrame() {
 			// Don't send any IFrames until we've sent a keyframe
 			continue
 		}
-		if pkt.HasType(h264.NALUTypeIDR) {
+		if pkt.IsKeyframe() {
 			sentIDR = true
 		}
 
-		buf := bytes.Buffer{}
-		//pts := float64(pkt.H264PTS.Microseconds())
-		//binary.Write(&buf, binary.LittleEndian, pts)
-		//foo1 := uint32(123)
-		//foo2 := uint32(456)
-		//binary.Write(&buf, binary.LittleEndian, foo1)
-		//binary.Write(&buf, binary.LittleEndian, foo2)
-		flags := uint32(0)
-		if pkt.IsBacklog {
-			flags |= 1
+		if err := s.writePacket(conn, pkt); err != nil {
+			s.log.Infof("Error writing to websocket: %v", err)
+			break
 		}
+	}
+}
 
-		binary.Write(&buf, binary.LittleEndian, flags)
-		for _, n := range pkt.H264NALUs {
-			if n.PrefixLen == 0 {
-				buf.Write([]byte{0, 0, 1})
-			}
-			buf.Write(n.Payload)
-		}
-		final := buf.Bytes()
-		//s.log.Infof("Sending packet: %v", final[:5])
-		if err := conn.WriteMessage(websocket.BinaryMessage, final); err != nil {
-			s.log.Infof("Error writing to websocket %v: %v", err)
+// Write a packet as a single websocket message: a 4 byte flags header, followed by the annex-b NALUs.
+// Everything is written straight into the connection's write buffer (pooled by the Upgrader),
+// so we never assemble a copy of the message.
+func (s *VideoWebSocketStreamer) writePacket(conn *websocket.Conn, pkt *videox.DecodedPacket) error {
+	w, err := conn.NextWriter(websocket.BinaryMessage)
+	if err != nil {
+		return err
+	}
+	flags := uint32(0)
+	if pkt.IsBacklog {
+		flags |= 1
+	}
+	var header [4]byte
+	binary.LittleEndian.PutUint32(header[:], flags)
+	w.Write(header[:])
+	for _, n := range pkt.H264NALUs {
+		if n.PrefixLen == 0 {
+			w.Write(videox.NALUPrefix)
 		}
+		w.Write(n.Payload)
 	}
+	// An error from any of the above writes is returned by Close
+	return w.Close()
 }
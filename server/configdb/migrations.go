@@ -47,5 +47,16 @@ func Migrations(log log.Log) []migration.Migrator {
 
 		`))
 
+	migs = append(migs, dbh.MakeMigrationFromSQL(log, &idx,
+		`
+		ALTER TABLE camera ADD COLUMN decode_threads INT;
+		ALTER TABLE camera ADD COLUMN decode_thread_type TEXT;
+		`))
+
+	migs = append(migs, dbh.MakeMigrationFromSQL(log, &idx,
+		`
+		ALTER TABLE camera ADD COLUMN motion_exclusions TEXT;
+		`))
+
 	return migs
 }
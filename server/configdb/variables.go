@@ -7,6 +7,8 @@ const (
 	VarPermanentStoragePath   VariableKey = "PermanentStoragePath"
 	VarRecentEventStoragePath VariableKey = "RecentEventStoragePath"
 	VarTempFilePath           VariableKey = "TempFilePath"
+	VarContinuousRecording    VariableKey = "ContinuousRecording" // "1" to record the high res stream of every camera, all the time
+	VarSpillPreRollSeconds    VariableKey = "SpillPreRollSeconds" // Seconds of high res pre-roll per camera to keep in a spill file beside the recent events, once it no longer fits in RAM. Blank or 0 = no spill file.
 )
 
 // If true, then the system must be restarted after setting this variable
@@ -6,6 +6,7 @@ import (
 	"fmt"
 	"os"
 	"path/filepath"
+	"sync"
 	"time"
 
 	"github.com/bmharper/cimg/v2"
@@ -20,9 +21,10 @@ import (
 // One for recent recordings, which may or may not be of interest.
 // One for permanent recordings, which form part of the training set (or a user wants to keep for whatever reason).
 type EventDB struct {
-	log  log.Log
-	db   *gorm.DB
-	root string // Where we store our videos (also directory where sqlite DB is stored)
+	log      log.Log
+	db       *gorm.DB
+	root     string    // Where we store our videos (also directory where sqlite DB is stored)
+	exporter *exporter // Runs Export jobs
 }
 
 // Open or create an event DB
@@ -36,18 +38,48 @@ func Open(log log.Log, root string) (*EventDB, error) {
 	dbPath := filepath.Join(root, "events.sqlite")
 	eventDB, err := dbh.OpenDB(log, dbh.DriverSqlite, dbPath, Migrations(log), 0)
 	if err == nil {
-		return &EventDB{
+		e := &EventDB{
 			log:  log,
 			db:   eventDB,
 			root: root,
-		}, nil
+		}
+		e.exporter = newExporter(log, DefaultExportWorkers, DefaultExportQueue, e.Save)
+		return e, nil
 	} else {
 		err = fmt.Errorf("Failed to open database %v: %w", dbPath, err)
 	}
 	return nil, err
 }
 
-// Save a new recording to disk
+// Return the directory where we store our videos
+func (e *EventDB) Root() string {
+	return e.root
+}
+
+// Finish any queued exports, and stop the export workers
+func (e *EventDB) Close() {
+	e.exporter.close()
+}
+
+// Export queues a new recording to be saved on a background worker (see Save).
+// done, if not nil, is called from the worker when the recording has been saved (or has failed).
+// Returns ErrExportQueueFull if too many exports are pending, unless priority is PriorityUser.
+func (e *EventDB) Export(buf *videox.RawBuffer, priority Priority, done func(err error)) error {
+	return e.exporter.submit(buf, priority, done)
+}
+
+// Returns true if exports are piling up, in which case detectors should hold back low priority events
+func (e *EventDB) ExportOverloaded() bool {
+	return e.exporter.overloaded()
+}
+
+// Returns the number of exports that are queued or busy
+func (e *EventDB) ExportBacklog() int {
+	return e.exporter.backlog()
+}
+
+// Save a new recording to disk.
+// The thumbnail and the MP4 are produced at the same time, because they read the buffer independently.
 func (e *EventDB) Save(buf *videox.RawBuffer) error {
 	rnd := [4]byte{}
 	if _, err := rand.Read(rnd[:]); err != nil {
@@ -62,17 +94,34 @@ func (e *EventDB) Save(buf *videox.RawBuffer) error {
 	thumbnailPath := filepath.Join(e.root, recording.ThumbnailFilename())
 	os.MkdirAll(filepath.Dir(videoPath), 0770)
 	e.log.Infof("Saving recording %v", videoPath)
-	if err := e.saveThumbnail(buf, thumbnailPath); err != nil {
-		return err
-	}
-	if err := buf.SaveToMP4(videoPath); err != nil {
-		return err
+
+	var wg sync.WaitGroup
+	var thumbErr error
+	wg.Add(1)
+	go func() {
+		defer wg.Done()
+		thumbErr = e.saveThumbnail(buf, thumbnailPath)
+	}()
+	videoErr := buf.SaveToMP4(videoPath)
+	wg.Wait()
+
+	if thumbErr != nil || videoErr != nil {
+		// Don't leave half of a recording behind
+		os.Remove(videoPath)
+		os.Remove(thumbnailPath)
+		if thumbErr != nil {
+			return thumbErr
+		}
+		return videoErr
 	}
 	return e.db.Create(recording).Error
 }
 
+// Thumbnails are decoded directly to this width
+const ThumbnailWidth = 320
+
 func (e *EventDB) saveThumbnail(buf *videox.RawBuffer, targetFilename string) error {
-	img, err := buf.ExtractThumbnail()
+	img, err := buf.ExtractThumbnail(ThumbnailWidth)
 	if err != nil {
 		// If thumbnail creation fails, it's a good sign that this video is useless
 		return fmt.Errorf("Failed to decode video while creating thumbnail: %w", err)
@@ -0,0 +1,170 @@
+package eventdb
+
+import (
+	"container/heap"
+	"errors"
+	"sync"
+
+	"github.com/bmharper/cyclops/server/log"
+	"github.com/bmharper/cyclops/server/videox"
+)
+
+// Priority of an export. Higher priorities are exported first.
+type Priority int
+
+const (
+	PriorityMotion Priority = iota // Found by the motion detector. May be rejected if we're overloaded.
+	PriorityUser                   // Explicitly recorded by a user. Never rejected.
+)
+
+var ErrExportQueueFull = errors.New("Export queue is full")
+
+// Defaults for the export pool of an EventDB
+const (
+	DefaultExportWorkers = 2
+	DefaultExportQueue   = 8
+)
+
+// exporter turns RawBuffers into recordings on a bounded pool of workers, so that a burst of events
+// from several cameras doesn't stall the goroutines that found them.
+// Within a priority, jobs are exported in the order that they were submitted.
+type exporter struct {
+	log      log.Log
+	export   func(buf *videox.RawBuffer) error
+	maxQueue int
+
+	lock    sync.Mutex
+	cond    *sync.Cond
+	queue   exportQueue
+	nextSeq int64
+	active  int // Number of jobs being exported right now
+	closed  bool
+	wg      sync.WaitGroup
+}
+
+type exportJob struct {
+	buf      *videox.RawBuffer
+	priority Priority
+	seq      int64
+	done     func(err error)
+}
+
+func newExporter(log log.Log, workers, maxQueue int, export func(buf *videox.RawBuffer) error) *exporter {
+	x := &exporter{
+		log:      log,
+		export:   export,
+		maxQueue: maxQueue,
+	}
+	x.cond = sync.NewCond(&x.lock)
+	for i := 0; i < workers; i++ {
+		x.wg.Add(1)
+		go x.worker()
+	}
+	return x
+}
+
+// Queue buf for export. done, if not nil, is called from a worker goroutine when the export finishes.
+// Returns ErrExportQueueFull if the queue is full, unless priority is PriorityUser.
+func (x *exporter) submit(buf *videox.RawBuffer, priority Priority, done func(err error)) error {
+	x.lock.Lock()
+	defer x.lock.Unlock()
+	if x.closed {
+		return errors.New("EventDB is closed")
+	}
+	if priority < PriorityUser && x.queue.Len() >= x.maxQueue {
+		return ErrExportQueueFull
+	}
+	heap.Push(&x.queue, &exportJob{
+		buf:      buf,
+		priority: priority,
+		seq:      x.nextSeq,
+		done:     done,
+	})
+	x.nextSeq++
+	x.cond.Signal()
+	return nil
+}
+
+// Returns true if the queue is at least half full.
+// Detectors should treat this as a signal to stop producing low value events.
+func (x *exporter) overloaded() bool {
+	x.lock.Lock()
+	defer x.lock.Unlock()
+	return x.queue.Len()*2 >= x.maxQueue
+}
+
+// Returns the number of jobs that are queued or busy exporting
+func (x *exporter) backlog() int {
+	x.lock.Lock()
+	defer x.lock.Unlock()
+	return x.queue.Len() + x.active
+}
+
+// Finish all queued jobs, and stop the workers
+func (x *exporter) close() {
+	x.lock.Lock()
+	x.closed = true
+	x.cond.Broadcast()
+	x.lock.Unlock()
+	x.wg.Wait()
+}
+
+func (x *exporter) worker() {
+	defer x.wg.Done()
+	for {
+		x.lock.Lock()
+		for x.queue.Len() == 0 && !x.closed {
+			x.cond.Wait()
+		}
+		if x.queue.Len() == 0 {
+			x.lock.Unlock()
+			return
+		}
+		job := heap.Pop(&x.queue).(*exportJob)
+		x.active++
+		x.lock.Unlock()
+
+		err := x.export(job.buf)
+		if err != nil {
+			x.log.Errorf("Export failed: %v", err)
+		}
+		if job.done != nil {
+			job.done(err)
+		}
+
+		x.lock.Lock()
+		x.active--
+		x.lock.Unlock()
+	}
+}
+
+// exportQueue is a container/heap of jobs, ordered by priority, then by submission order
+type exportQueue []*exportJob
+
+func (q exportQueue) Len() int {
+	return len(q)
+}
+
+func (q exportQueue) Less(i, j int) bool {
+	if q[i].priority != q[j].priority {
+		return q[i].priority > q[j].priority
+	}
+	return q[i].seq < q[j].seq
+}
+
+func (q exportQueue) Swap(i, j int) {
+	q[i], q[j] = q[j], q[i]
+}
+
+func (q *exportQueue) Push(x any) {
+	*q = append(*q, x.(*exportJob))
+}
+
+func (q *exportQueue) Pop() any {
+	old := *q
+	n := len(old)
+	job := old[n-1]
+	old[n-1] = nil
+	*q = old[:n-1]
+	return job
+}
@@ -0,0 +1,195 @@
+package metrics
+
+import (
+	"fmt"
+	"io"
+	"math/bits"
+	"sort"
+	"strconv"
+	"strings"
+	"sync/atomic"
+	"time"
+)
+
+// Number of buckets in a Histogram.
+// Bucket i counts samples below 2^i microseconds, and the last bucket counts everything else.
+// This must match STATS_HISTOGRAM_BUCKETS in videox/stats.h, because the C++ side of the pipeline
+// records into the same layout.
+const NumBuckets = 24
+
+// Histogram is a lock free histogram of durations, with power of 2 buckets.
+// Observe costs a few atomic adds, so it's cheap enough to call for every packet.
+// The zero value is ready to use.
+type Histogram struct {
+	count   atomic.Uint64
+	sumNS   atomic.Uint64
+	buckets [NumBuckets]atomic.Uint64
+}
+
+// HistogramSnapshot is a copy of a Histogram at a point in time
+type HistogramSnapshot struct {
+	Count   uint64
+	Sum     time.Duration
+	Buckets [NumBuckets]uint64 // Not cumulative
+}
+
+// Returns the bucket that a duration falls into
+func BucketOf(d time.Duration) int {
+	us := uint64(0)
+	if d > 0 {
+		us = uint64(d / time.Microsecond)
+	}
+	b := bits.Len64(us)
+	if b >= NumBuckets {
+		b = NumBuckets - 1
+	}
+	return b
+}
+
+// Returns the upper bound of bucket i (exclusive), or 0 for the last bucket, which has no upper bound
+func BucketBound(i int) time.Duration {
+	if i >= NumBuckets-1 {
+		return 0
+	}
+	return time.Duration(1<<i) * time.Microsecond
+}
+
+func (h *Histogram) Observe(d time.Duration) {
+	h.count.Add(1)
+	if d > 0 {
+		h.sumNS.Add(uint64(d))
+	}
+	h.buckets[BucketOf(d)].Add(1)
+}
+
+// Observe the time since start
+func (h *Histogram) Since(start time.Time) {
+	h.Observe(time.Since(start))
+}
+
+func (h *Histogram) Snapshot() HistogramSnapshot {
+	s := HistogramSnapshot{
+		Count: h.count.Load(),
+		Sum:   time.Duration(h.sumNS.Load()),
+	}
+	for i := range h.buckets {
+		s.Buckets[i] = h.buckets[i].Load()
+	}
+	return s
+}
+
+// Labels of a sample, such as {"camera": "driveway"}
+type Labels map[string]string
+
+type sample struct {
+	labels string // Already formatted, eg {camera="driveway"}
+	value  any    // float64 or HistogramSnapshot
+}
+
+type family struct {
+	name    string
+	help    string
+	kind    string // counter, gauge, histogram
+	samples []sample
+}
+
+// Exposition collects samples, and writes them out in the Prometheus text format.
+// Samples of the same metric may be added in any order (eg camera by camera), and they are grouped
+// by metric when written, because Prometheus requires each metric family to be contiguous.
+type Exposition struct {
+	families []*family
+	byName   map[string]*family
+}
+
+func (e *Exposition) add(name, help, kind string, labels Labels, value any) {
+	if e.byName == nil {
+		e.byName = map[string]*family{}
+	}
+	f := e.byName[name]
+	if f == nil {
+		f = &family{name: name, help: help, kind: kind}
+		e.byName[name] = f
+		e.families = append(e.families, f)
+	}
+	f.samples = append(f.samples, sample{labels: formatLabels(labels), value: value})
+}
+
+func (e *Exposition) Counter(name, help string, labels Labels, value float64) {
+	e.add(name, help, "counter", labels, value)
+}
+
+func (e *Exposition) Gauge(name, help string, labels Labels, value float64) {
+	e.add(name, help, "gauge", labels, value)
+}
+
+// Add a histogram. The values are exported in seconds, so name should end in _seconds.
+func (e *Exposition) Histogram(name, help string, labels Labels, h HistogramSnapshot) {
+	e.add(name, help, "histogram", labels, h)
+}
+
+func (e *Exposition) WriteTo(w io.Writer) (int64, error) {
+	b := strings.Builder{}
+	for _, f := range e.families {
+		fmt.Fprintf(&b, "# HELP %v %v\n", f.name, f.help)
+		fmt.Fprintf(&b, "# TYPE %v %v\n", f.name, f.kind)
+		for _, s := range f.samples {
+			switch v := s.value.(type) {
+			case float64:
+				fmt.Fprintf(&b, "%v%v %v\n", f.name, s.labels, formatFloat(v))
+			case HistogramSnapshot:
+				writeHistogram(&b, f.name, s.labels, v)
+			}
+		}
+	}
+	n, err := io.WriteString(w, b.String())
+	return int64(n), err
+}
+
+func writeHistogram(b *strings.Builder, name, labels string, h HistogramSnapshot) {
+	cumulative := uint64(0)
+	for i := 0; i < NumBuckets-1; i++ {
+		cumulative += h.Buckets[i]
+		le := formatFloat(BucketBound(i).Seconds())
+		fmt.Fprintf(b, "%v_bucket%v %v\n", name, withLabel(labels, "le", le), cumulative)
+	}
+	// Count and the buckets are loaded separately, so make sure that +Inf is never below the finite buckets
+	cumulative += h.Buckets[NumBuckets-1]
+	if h.Count > cumulative {
+		cumulative = h.Count
+	}
+	fmt.Fprintf(b, "%v_bucket%v %v\n", name, withLabel(labels, "le", "+Inf"), cumulative)
+	fmt.Fprintf(b, "%v_sum%v %v\n", name, labels, formatFloat(h.Sum.Seconds()))
+	fmt.Fprintf(b, "%v_count%v %v\n", name, labels, cumulative)
+}
+
+func formatFloat(v float64) string {
+	return strconv.FormatFloat(v, 'g', -1, 64)
+}
+
+// Prometheus only understands these three escapes in label values
+var labelEscaper = strings.NewReplacer("\\", "\\\\", "\"", "\\\"", "\n", "\\n")
+
+func formatLabels(labels Labels) string {
+	if len(labels) == 0 {
+		return ""
+	}
+	keys := make([]string, 0, len(labels))
+	for k := range labels {
+		keys = append(keys, k)
+	}
+	sort.Strings(keys)
+	parts := make([]string, 0, len(keys))
+	for _, k := range keys {
+		parts = append(parts, k+"=\""+labelEscaper.Replace(labels[k])+"\"")
+	}
+	return "{" + strings.Join(parts, ",") + "}"
+}
+
+// Add a label to an already formatted set of labels
+func withLabel(labels, key, value string) string {
+	l := key + "=\"" + labelEscaper.Replace(value) + "\""
+	if labels == "" {
+		return "{" + l + "}"
+	}
+	return labels[:len(labels)-1] + "," + l + "}"
+}
@@ -0,0 +1,47 @@
+package metrics
+
+import (
+	"strings"
+	"testing"
+	"time"
+
+	"github.com/stretchr/testify/require"
+)
+
+func TestBuckets(t *testing.T) {
+	require.Equal(t, 0, BucketOf(0))
+	require.Equal(t, 0, BucketOf(999*time.Nanosecond))
+	require.Equal(t, 1, BucketOf(time.Microsecond))
+	require.Equal(t, 2, BucketOf(3*time.Microsecond))
+	require.Equal(t, 3, BucketOf(4*time.Microsecond))
+	require.Equal(t, NumBuckets-1, BucketOf(time.Hour))
+	for i := 0; i < NumBuckets-1; i++ {
+		// Every bucket's samples are below its bound
+		require.Equal(t, i+1, BucketOf(BucketBound(i)))
+	}
+}
+
+func TestExposition(t *testing.T) {
+	h1 := Histogram{}
+	h1.Observe(500 * time.Nanosecond)
+	h1.Observe(3 * time.Microsecond)
+	h1.Observe(time.Hour)
+	h2 := Histogram{}
+
+	e := Exposition{}
+	e.Histogram("x_seconds", "X", Labels{"camera": "a"}, h1.Snapshot())
+	e.Gauge("y", "Y", Labels{"camera": "a"}, 5)
+	e.Histogram("x_seconds", "X", Labels{"camera": "b\"c"}, h2.Snapshot())
+	b := strings.Builder{}
+	e.WriteTo(&b)
+	out := b.String()
+
+	// Both histograms are grouped under a single header
+	require.Equal(t, 1, strings.Count(out, "# TYPE x_seconds histogram"))
+	require.Less(t, strings.Index(out, `x_seconds_count{camera="b\"c"} 0`), strings.Index(out, "# TYPE y gauge"))
+	require.Contains(t, out, `x_seconds_bucket{camera="a",le="1e-06"} 1`)
+	require.Contains(t, out, `x_seconds_bucket{camera="a",le="4e-06"} 2`)
+	require.Contains(t, out, `x_seconds_bucket{camera="a",le="+Inf"} 3`)
+	require.Contains(t, out, `x_seconds_count{camera="a"} 3`)
+	require.Contains(t, out, `y{camera="a"} 5`)
+}
@@ -6,6 +6,8 @@ import (
 	"net/http"
 	"os"
 	"os/signal"
+	"path/filepath"
+	"runtime"
 	"sync"
 	"sync/atomic"
 	"time"
@@ -16,6 +18,7 @@ import (
 	"github.com/bmharper/cyclops/server/gen"
 	"github.com/bmharper/cyclops/server/log"
 	"github.com/bmharper/cyclops/server/util"
+	"github.com/bmharper/cyclops/server/videox"
 	"github.com/gorilla/websocket"
 	"github.com/julienschmidt/httprouter"
 )
@@ -24,8 +27,9 @@ type Server struct {
 	Log              log.Log
 	TempFiles        *util.TempFiles
 	RingBufferSize   int
-	IsShutdownV      int32 // 1 if we were shutdown with an explicit call to Shutdown. Use IsShutdown() for a thread-safe check if IsShutdownV is true.
-	MustRestart      bool  // Value of the 'restart' parameter to Shutdown()
+	SpillPreRoll     time.Duration // Pre-roll to keep in each high res ring buffer's spill file, in the recent events path. 0 = no spill.
+	IsShutdownV      int32         // 1 if we were shutdown with an explicit call to Shutdown. Use IsShutdown() for a thread-safe check if IsShutdownV is true.
+	MustRestart      bool          // Value of the 'restart' parameter to Shutdown()
 	ShutdownComplete chan error
 
 	camerasLock  sync.Mutex
@@ -37,8 +41,10 @@ type Server struct {
 	httpRouter      *httprouter.Router
 	configDB        *configdb.ConfigDB
 	permanentEvents *eventdb.EventDB // Where we store our permanent videos
+	continuousRec   bool             // If true, then record the high res stream of all cameras into permanentEvents/continuous
 	recentEvents    *eventdb.EventDB // Where we store our recent event videos
 	wsUpgrader      websocket.Upgrader
+	decodeScheduler *camera.DecodeScheduler // Runs the decoders of all cameras
 
 	recorderStartStopLock sync.Mutex
 	recorderStop          chan bool // Sent to recorder to tell it to stop
@@ -59,7 +65,10 @@ func NewServer(configDBFilename string) (*Server, error) {
 		RingBufferSize:   200 * 1024 * 1024,
 		ShutdownComplete: make(chan error, 1),
 		cameraFromID:     map[int64]*camera.Camera{},
+		// Share write buffers between websockets, instead of holding one per connection
+		wsUpgrader: websocket.Upgrader{WriteBufferPool: &sync.Pool{}},
 	}
+	s.decodeScheduler = camera.NewDecodeScheduler(s.Log, runtime.NumCPU())
 	if cfg, err := configdb.NewConfigDB(s.Log, configDBFilename); err != nil {
 		return nil, err
 	} else {
@@ -132,6 +141,15 @@ func (s *Server) Shutdown(restart bool) {
 	// connections (this is explicit in the http server docs).
 	// NOTE: there is also RegisterOnShutdown.. which might be useful
 	s.CloseAllCameras()
+	s.decodeScheduler.Close()
+
+	// Wait for any queued exports to finish
+	if s.recentEvents != nil {
+		s.recentEvents.Close()
+	}
+	if s.permanentEvents != nil {
+		s.permanentEvents.Close()
+	}
 
 	ctx, cancel := context.WithTimeout(context.Background(), time.Second)
 	err := s.httpServer.Shutdown(ctx)
@@ -204,6 +222,10 @@ func (s *Server) LoadConfigVariables() error {
 			err = s.SetRecentEventStoragePath(v.Value)
 		case configdb.VarTempFilePath:
 			err = s.SetTempFilePath(v.Value)
+		case configdb.VarContinuousRecording:
+			s.continuousRec = v.Value == "1"
+		case configdb.VarSpillPreRollSeconds:
+			err = s.SetSpillPreRoll(v.Value)
 		default:
 			s.Log.Errorf("Config variable '%v' not recognized", v.Key)
 		}
@@ -222,7 +244,7 @@ func (s *Server) LoadCamerasFromConfig() error {
 		return err
 	}
 	for _, cam := range cams {
-		if camera, err := camera.NewCamera(s.Log, cam, s.RingBufferSize); err != nil {
+		if camera, err := camera.NewCamera(s.Log, cam, s.RingBufferSize, s.decodeScheduler); err != nil {
 			return err
 		} else {
 			camera.ID = cam.ID
@@ -236,12 +258,52 @@ func (s *Server) LoadCamerasFromConfig() error {
 // If a camera fails to start, it is skipped, and other cameras are tried
 // Returns the first error
 func (s *Server) StartAllCameras() error {
+	// Do the slow part (the RTSP handshakes) for all cameras at once. startCamera() below reports any errors.
+	start := time.Now()
+	camera.ProbeCameras(s.cameras, 16)
+	s.Log.Infof("Probed %v cameras in %.1f seconds", len(s.cameras), time.Since(start).Seconds())
+
 	var firstErr error
 	for _, cam := range s.cameras {
-		if err := cam.Start(); err != nil {
-			s.Log.Errorf("Error starting camera %v: %v", cam.Name, err)
+		if err := s.startCamera(cam); err != nil {
 			firstErr = err
 		}
 	}
 	return firstErr
 }
+
+// Connect a camera to the rest of the system (motion recordings, spill, continuous recording), and start it.
+// Every path that starts a camera must come through here, so that none of them miss a piece.
+// If the camera fails to start, the error is logged and returned. cam.ID must be set.
+func (s *Server) startCamera(cam *camera.Camera) error {
+	if s.recentEvents != nil {
+		cam.OnMotionRecording = s.saveMotionRecording
+		cam.Motion.Busy = s.recentEvents.ExportOverloaded
+		if s.SpillPreRoll > 0 {
+			cam.HighDumper.EnableSpillFor(filepath.Join(s.recentEvents.Root(), "spill", fmt.Sprintf("%v.ring", cam.ID)), s.SpillPreRoll)
+		}
+	}
+	if err := cam.Start(); err != nil {
+		s.Log.Errorf("Error starting camera %v: %v", cam.Name, err)
+		return err
+	}
+	if s.continuousRec && s.permanentEvents != nil {
+		root := filepath.Join(s.permanentEvents.Root(), "continuous", cam.Name)
+		if err := cam.StartContinuousRecording(root, 5*time.Minute); err != nil {
+			s.Log.Errorf("Error starting continuous recording of camera %v: %v", cam.Name, err)
+			return err
+		}
+	}
+	return nil
+}
+
+// Save the video of a motion event into recentEvents
+func (s *Server) saveMotionRecording(cam *camera.Camera, raw *videox.RawBuffer) {
+	if s.IsShutdown() {
+		return
+	}
+	// The export runs in the background, and logs its own errors
+	if err := s.recentEvents.Export(raw, eventdb.PriorityMotion, nil); err != nil {
+		s.Log.Warnf("Dropped motion recording from %v: %v", cam.Name, err)
+	}
+}
@@ -1,6 +1,11 @@
 package server
 
 import (
+	"fmt"
+	"strconv"
+	"time"
+
+	"github.com/bmharper/cyclops/server/configdb"
 	"github.com/bmharper/cyclops/server/eventdb"
 	"github.com/bmharper/cyclops/server/log"
 	"github.com/bmharper/cyclops/server/util"
@@ -10,6 +15,9 @@ func (s *Server) SetPermanentStoragePath(root string) error {
 	if db, err := eventdb.Open(log.NewPrefixLogger(s.Log, "PermEventDB"), root); err != nil {
 		return err
 	} else {
+		if s.permanentEvents != nil {
+			s.permanentEvents.Close()
+		}
 		s.permanentEvents = db
 		return nil
 	}
@@ -19,6 +27,9 @@ func (s *Server) SetRecentEventStoragePath(root string) error {
 	if db, err := eventdb.Open(log.NewPrefixLogger(s.Log, "RecentEventDB"), root); err != nil {
 		return err
 	} else {
+		if s.recentEvents != nil {
+			s.recentEvents.Close()
+		}
 		s.recentEvents = db
 		return nil
 	}
@@ -37,3 +48,18 @@ func (s *Server) SetTempFilePath(tempFilePath string) error {
 	}
 	return nil
 }
+
+// The spill file extends the pre-roll of the high res ring buffers onto the recent events disk.
+// It's sized from the bitrate of each camera, so we only ask for the number of seconds.
+func (s *Server) SetSpillPreRoll(seconds string) error {
+	if seconds == "" {
+		s.SpillPreRoll = 0
+		return nil
+	}
+	n, err := strconv.Atoi(seconds)
+	if err != nil || n < 0 {
+		return fmt.Errorf("Invalid %v '%v'. Must be a whole number of seconds", configdb.VarSpillPreRollSeconds, seconds)
+	}
+	s.SpillPreRoll = time.Duration(n) * time.Second
+	return nil
+}
@@ -0,0 +1,84 @@
+#include <stddef.h>
+#include <stdint.h>
+
+// BitReader reads an RBSP (raw byte sequence payload) out of a NALU.
+// Bits are consumed from a 64-bit cache, which is refilled a byte at a time, and that is also where we
+// strip the emulation prevention bytes (00 00 03 -> 00 00). Reading past the end yields zeros, and sets Overrun().
+class BitReader {
+public:
+	BitReader(const uint8_t* buf, size_t len) : Pos(buf), End(buf + len) {}
+
+	// Read n bits, where n <= 32
+	uint32_t ReadBits(int n) {
+		if (n == 0)
+			return 0;
+		if (CacheBits < n)
+			Refill();
+		uint32_t v = (uint32_t) (Cache >> (64 - n));
+		Cache <<= n;
+		CacheBits -= n;
+		return v;
+	}
+
+	uint32_t ReadBit() { return ReadBits(1); }
+
+	void SkipBits(int n) {
+		for (; n > 32; n -= 32)
+			ReadBits(32);
+		ReadBits(n);
+	}
+
+	// Unsigned Exp-Golomb code, ue(v)
+	uint32_t ReadUE() {
+		if (CacheBits < 32)
+			Refill();
+		uint32_t top = (uint32_t) (Cache >> 32);
+		if (top == 0) {
+			// More than 31 leading zeros is not a valid code in any syntax element we parse
+			Invalid = true;
+			return 0;
+		}
+		int zeros = __builtin_clz(top);
+		Cache <<= zeros;
+		CacheBits -= zeros;
+		return ReadBits(zeros + 1) - 1;
+	}
+
+	// Signed Exp-Golomb code, se(v)
+	int32_t ReadSE() {
+		uint32_t k = ReadUE();
+		if (k & 1)
+			return (int32_t) ((k + 1) / 2);
+		return -(int32_t) (k / 2);
+	}
+
+	// Returns true if we have read past the end of the buffer, or encountered garbage
+	bool Overrun() const { return Invalid || Padding > CacheBits; }
+
+private:
+	const uint8_t* Pos;
+	const uint8_t* End;
+	uint64_t       Cache     = 0; // Next bit is the MSB
+	int            CacheBits = 0; // Number of valid bits in Cache (including Padding)
+	int            Padding   = 0; // Number of zero bits that we have appended after the end of the buffer
+	int            Zeros     = 0; // Number of consecutive zero bytes, for detecting emulation prevention
+	bool           Invalid   = false;
+
+	void Refill() {
+		while (CacheBits <= 56) {
+			if (Pos == End) {
+				Padding += 64 - CacheBits;
+				CacheBits = 64;
+				return;
+			}
+			uint8_t b = *Pos++;
+			if (Zeros >= 2 && b == 3) {
+				Zeros = 0;
+				continue;
+			}
+			Zeros = b == 0 ? Zeros + 1 : 0;
+			Cache |= (uint64_t) b << (56 - CacheBits);
+			CacheBits += 8;
+		}
+	}
+};
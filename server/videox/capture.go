@@ -0,0 +1,382 @@
+package videox
+
+import (
+	"bufio"
+	"bytes"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io"
+	"os"
+	"sort"
+	"time"
+)
+
+// A capture is a single append-only file that holds a recorded stream, with a keyframe index at the end.
+// The layout is described in debug/capture.hpp, which is what the offline tools use to read it.
+// Unlike DumpBin, which writes one file per NALU, a capture can be streamed with constant memory,
+// and seeked to any PTS.
+
+const (
+	captureVersion      = 2
+	captureHeaderSize   = 24
+	captureRecordSize   = 16
+	captureTrailerSize  = 16
+	captureFlagKeyframe = 1
+	captureFlagIndex    = 2
+)
+
+var captureMagic = []byte{'c', 'y', 'c', 'c', 'a', 'p', 0, 0}
+var captureTrailerMagic = []byte("cycindex")
+
+// ErrNotCapture is returned when a file is not a capture, or is a capture from a newer version
+var ErrNotCapture = errors.New("Not a capture file")
+
+// CaptureKeyframe is an entry in a capture's keyframe index
+type CaptureKeyframe struct {
+	PTS    time.Duration
+	Offset int64 // File offset of the keyframe's record
+}
+
+func capturePadding(size int) int {
+	return (8 - size&7) & 7
+}
+
+// CaptureWriter records packets into a capture file.
+// The index is written by Close, so a capture that is cut short is still readable, but seeking into it
+// requires a scan of the record headers.
+type CaptureWriter struct {
+	file      *os.File
+	buf       *bufio.Writer
+	codec     Codec
+	offset    int64
+	keyframes []CaptureKeyframe
+}
+
+// Create a capture file, for packets of the given codec
+func NewCaptureWriter(filename string, codec Codec) (*CaptureWriter, error) {
+	f, err := os.Create(filename)
+	if err != nil {
+		return nil, err
+	}
+	w := &CaptureWriter{
+		file:  f,
+		buf:   bufio.NewWriterSize(f, 1024*1024),
+		codec: codec,
+	}
+	header := [captureHeaderSize]byte{}
+	copy(header[:], captureMagic)
+	binary.LittleEndian.PutUint32(header[8:], captureVersion)
+	binary.LittleEndian.PutUint32(header[12:], uint32(codec))
+	if _, err := w.buf.Write(header[:]); err != nil {
+		f.Close()
+		return nil, err
+	}
+	w.offset = captureHeaderSize
+	return w, nil
+}
+
+// Append a packet, as a single annex-b access unit
+func (w *CaptureWriter) WritePacket(packet *DecodedPacket) error {
+	size := 0
+	for i := range packet.H264NALUs {
+		size += len(NALUPrefix) + len(packet.H264NALUs[i].RawPayload())
+	}
+	flags := uint32(0)
+	isKeyframe := false
+	for i := range packet.H264NALUs {
+		isKeyframe = isKeyframe || packet.H264NALUs[i].Kind(w.codec) == NALUKindKeyframe
+	}
+	if isKeyframe {
+		flags = captureFlagKeyframe
+		w.keyframes = append(w.keyframes, CaptureKeyframe{PTS: packet.H264PTS, Offset: w.offset})
+	}
+	if err := w.writeRecordHeader(packet.H264PTS, size, flags); err != nil {
+		return err
+	}
+	for i := range packet.H264NALUs {
+		w.buf.Write(NALUPrefix)
+		w.buf.Write(packet.H264NALUs[i].RawPayload())
+	}
+	return w.finishRecord(size)
+}
+
+// Flush buffered packets to the file
+func (w *CaptureWriter) Flush() error {
+	return w.buf.Flush()
+}
+
+// Write the keyframe index and the trailer, and close the file
+func (w *CaptureWriter) Close() error {
+	if w.file == nil {
+		return nil
+	}
+	indexOffset := w.offset
+	err := w.writeRecordHeader(0, len(w.keyframes)*16, captureFlagIndex)
+	entry := [16]byte{}
+	for _, k := range w.keyframes {
+		binary.LittleEndian.PutUint64(entry[0:], uint64(k.PTS.Nanoseconds()))
+		binary.LittleEndian.PutUint64(entry[8:], uint64(k.Offset))
+		w.buf.Write(entry[:])
+	}
+	trailer := [captureTrailerSize]byte{}
+	binary.LittleEndian.PutUint64(trailer[0:], uint64(indexOffset))
+	copy(trailer[8:], captureTrailerMagic)
+	w.buf.Write(trailer[:])
+	if err == nil {
+		err = w.buf.Flush()
+	}
+	if cerr := w.file.Close(); err == nil {
+		err = cerr
+	}
+	w.file = nil
+	return err
+}
+
+func (w *CaptureWriter) writeRecordHeader(pts time.Duration, size int, flags uint32) error {
+	rec := [captureRecordSize]byte{}
+	binary.LittleEndian.PutUint64(rec[0:], uint64(pts.Nanoseconds()))
+	binary.LittleEndian.PutUint32(rec[8:], uint32(size))
+	binary.LittleEndian.PutUint32(rec[12:], flags)
+	_, err := w.buf.Write(rec[:])
+	w.offset += int64(captureRecordSize + size + capturePadding(size))
+	return err
+}
+
+func (w *CaptureWriter) finishRecord(size int) error {
+	zeros := [8]byte{}
+	// bufio.Writer remembers the first error, so this catches failures during the payload too
+	_, err := w.buf.Write(zeros[:capturePadding(size)])
+	return err
+}
+
+// CaptureReader streams packets out of a capture file, one at a time
+type CaptureReader struct {
+	Codec     Codec
+	Keyframes []CaptureKeyframe // In ascending PTS order
+
+	file *os.File
+	buf  *bufio.Reader
+	pos  int64 // Offset of the next record
+	end  int64 // Offset of the index, or the file size if there is no index
+}
+
+func OpenCaptureReader(filename string) (*CaptureReader, error) {
+	f, err := os.Open(filename)
+	if err != nil {
+		return nil, err
+	}
+	r := &CaptureReader{
+		file: f,
+		buf:  bufio.NewReaderSize(f, 1024*1024),
+	}
+	header := [captureHeaderSize]byte{}
+	st, err := f.Stat()
+	if err == nil {
+		_, err = io.ReadFull(f, header[:])
+	}
+	if err != nil {
+		f.Close()
+		return nil, err
+	}
+	version := binary.LittleEndian.Uint32(header[8:])
+	if !bytes.Equal(header[:8], captureMagic) || version < 1 || version > captureVersion {
+		f.Close()
+		return nil, fmt.Errorf("%w: %v", ErrNotCapture, filename)
+	}
+	r.Codec = Codec(binary.LittleEndian.Uint32(header[12:]))
+	r.end = st.Size()
+	if !r.loadIndex() {
+		r.scanIndex()
+	}
+	r.seekTo(captureHeaderSize)
+	return r, nil
+}
+
+func (r *CaptureReader) Close() error {
+	if r.file == nil {
+		return nil
+	}
+	err := r.file.Close()
+	r.file = nil
+	return err
+}
+
+// Position the reader at the last keyframe whose PTS is <= pts, or at the first keyframe if there is none.
+// Returns false if the capture has no keyframes.
+func (r *CaptureReader) SeekPTS(pts time.Duration) (bool, error) {
+	if len(r.Keyframes) == 0 {
+		return false, nil
+	}
+	i := sort.Search(len(r.Keyframes), func(i int) bool { return r.Keyframes[i].PTS > pts })
+	if i > 0 {
+		i--
+	}
+	return true, r.seekTo(r.Keyframes[i].Offset)
+}
+
+// Read the next packet. The packet owns its memory.
+// Returns io.EOF at the end of the capture, or at a truncated final record.
+func (r *CaptureReader) Next() (*DecodedPacket, error) {
+	rec := [captureRecordSize]byte{}
+	if r.pos+captureRecordSize > r.end {
+		return nil, io.EOF
+	}
+	if _, err := io.ReadFull(r.buf, rec[:]); err != nil {
+		return nil, eofIfTruncated(err)
+	}
+	pts := time.Duration(binary.LittleEndian.Uint64(rec[0:]))
+	size := int(binary.LittleEndian.Uint32(rec[8:]))
+	flags := binary.LittleEndian.Uint32(rec[12:])
+	if flags&captureFlagIndex != 0 || r.pos+captureRecordSize+int64(size) > r.end {
+		return nil, io.EOF
+	}
+	payload := make([]byte, size)
+	if _, err := io.ReadFull(r.buf, payload); err != nil {
+		return nil, eofIfTruncated(err)
+	}
+	// The final record of a capture that was cut short may be missing its padding
+	r.buf.Discard(capturePadding(size))
+	r.pos += int64(captureRecordSize + size + capturePadding(size))
+	return &DecodedPacket{
+		H264NALUs:    splitAnnexB(payload),
+		H264PTS:      pts,
+		Codec:        r.Codec,
+		PTSEqualsDTS: true,
+	}, nil
+}
+
+func eofIfTruncated(err error) error {
+	if err == io.ErrUnexpectedEOF {
+		return io.EOF
+	}
+	return err
+}
+
+func (r *CaptureReader) seekTo(offset int64) error {
+	if _, err := r.file.Seek(offset, io.SeekStart); err != nil {
+		return err
+	}
+	r.buf.Reset(r.file)
+	r.pos = offset
+	return nil
+}
+
+// Read the index that CaptureWriter.Close appends. Returns false if it's missing or damaged.
+func (r *CaptureReader) loadIndex() bool {
+	trailer := [captureTrailerSize]byte{}
+	rec := [captureRecordSize]byte{}
+	if r.end < captureHeaderSize+captureRecordSize+captureTrailerSize {
+		return false
+	}
+	if _, err := r.file.ReadAt(trailer[:], r.end-captureTrailerSize); err != nil || !bytes.Equal(trailer[8:], captureTrailerMagic) {
+		return false
+	}
+	indexOffset := int64(binary.LittleEndian.Uint64(trailer[0:]))
+	if indexOffset < captureHeaderSize || indexOffset > r.end-captureTrailerSize-captureRecordSize {
+		return false
+	}
+	if _, err := r.file.ReadAt(rec[:], indexOffset); err != nil {
+		return false
+	}
+	size := int(binary.LittleEndian.Uint32(rec[8:]))
+	if binary.LittleEndian.Uint32(rec[12:]) != captureFlagIndex || size%16 != 0 || indexOffset+int64(captureRecordSize+size+capturePadding(size)+captureTrailerSize) != r.end {
+		return false
+	}
+	entries := make([]byte, size)
+	if _, err := r.file.ReadAt(entries, indexOffset+captureRecordSize); err != nil {
+		return false
+	}
+	r.Keyframes = make([]CaptureKeyframe, size/16)
+	for i := range r.Keyframes {
+		r.Keyframes[i].PTS = time.Duration(binary.LittleEndian.Uint64(entries[i*16:]))
+		r.Keyframes[i].Offset = int64(binary.LittleEndian.Uint64(entries[i*16+8:]))
+	}
+	r.end = indexOffset
+	return true
+}
+
+// Find the keyframes by hopping over the payloads
+func (r *CaptureReader) scanIndex() {
+	r.Keyframes = nil
+	rec := [captureRecordSize]byte{}
+	for pos := int64(captureHeaderSize); pos+captureRecordSize <= r.end; {
+		if _, err := r.file.ReadAt(rec[:], pos); err != nil {
+			return
+		}
+		size := int(binary.LittleEndian.Uint32(rec[8:]))
+		flags := binary.LittleEndian.Uint32(rec[12:])
+		if flags&captureFlagIndex != 0 || pos+captureRecordSize+int64(size) > r.end {
+			return
+		}
+		if flags&captureFlagKeyframe != 0 {
+			r.Keyframes = append(r.Keyframes, CaptureKeyframe{PTS: time.Duration(binary.LittleEndian.Uint64(rec[0:])), Offset: pos})
+		}
+		pos += int64(captureRecordSize + size + capturePadding(size))
+	}
+}
+
+// Split an annex-b access unit into NALUs, which point into au, and keep their 3 byte prefix
+func splitAnnexB(au []byte) []NALU {
+	nalus := []NALU{}
+	start := -1
+	for i := 0; i+3 <= len(au); i++ {
+		if au[i] == 0 && au[i+1] == 0 && au[i+2] == 1 {
+			if start != -1 {
+				nalus = append(nalus, NALU{PrefixLen: 3, Payload: au[start:i]})
+			}
+			start = i
+			i += 2
+		}
+	}
+	if start != -1 {
+		nalus = append(nalus, NALU{PrefixLen: 3, Payload: au[start:]})
+	}
+	return nalus
+}
+
+// Write the whole buffer into a capture file
+func (r *RawBuffer) SaveCapture(filename string) error {
+	w, err := NewCaptureWriter(filename, r.Codec)
+	if err != nil {
+		return err
+	}
+	for _, packet := range r.Packets {
+		if err := w.WritePacket(packet); err != nil {
+			w.Close()
+			return err
+		}
+	}
+	return w.Close()
+}
+
+// Load the packets of a capture file, from the keyframe at or before 'from', until the end.
+// Pass a negative 'from' to load everything.
+func LoadCapture(filename string, from time.Duration) (*RawBuffer, error) {
+	r, err := OpenCaptureReader(filename)
+	if err != nil {
+		return nil, err
+	}
+	defer r.Close()
+	if r.Codec != CodecH264 && r.Codec != CodecH265 {
+		return nil, fmt.Errorf("Capture %v has an unknown codec (%v)", filename, int(r.Codec))
+	}
+	if from >= 0 {
+		if _, err := r.SeekPTS(from); err != nil {
+			return nil, err
+		}
+	}
+	buf := &RawBuffer{
+		Packets: []*DecodedPacket{},
+		Codec:   r.Codec,
+	}
+	for {
+		packet, err := r.Next()
+		if err == io.EOF {
+			return buf, nil
+		} else if err != nil {
+			return nil, err
+		}
+		buf.Packets = append(buf.Packets, packet)
+	}
+}
@@ -0,0 +1,125 @@
+package videox
+
+import (
+	"io"
+	"os"
+	"path/filepath"
+	"testing"
+	"time"
+
+	"github.com/aler9/gortsplib/pkg/h264"
+	"github.com/stretchr/testify/require"
+)
+
+func TestCapture(t *testing.T) {
+	filename := filepath.Join(t.TempDir(), "test.cap")
+
+	// An IDR packet (with SPS and PPS) every 10 packets, and odd payload sizes, to exercise the padding
+	src := &RawBuffer{}
+	for i := 0; i < 50; i++ {
+		p := &DecodedPacket{H264PTS: time.Duration(i) * 100 * time.Millisecond}
+		if i%10 == 0 {
+			p.H264NALUs = append(p.H264NALUs, WrapRawNALU([]byte{0x67, 1, 2}), WrapRawNALU([]byte{0x68, 3}), WrapRawNALU([]byte{0x65, byte(i), 9, 9}))
+		} else {
+			p.H264NALUs = append(p.H264NALUs, CloneNALUWithPrefix(make([]byte, i+1)))
+			p.H264NALUs[0].Payload[3] = 0x41
+		}
+		src.Packets = append(src.Packets, p)
+	}
+	require.NoError(t, src.SaveCapture(filename))
+
+	verify := func(expectPackets int) {
+		r, err := OpenCaptureReader(filename)
+		require.NoError(t, err)
+		defer r.Close()
+		require.Equal(t, CodecH264, r.Codec)
+		require.Equal(t, (expectPackets+9)/10, len(r.Keyframes))
+
+		n := 0
+		for {
+			p, err := r.Next()
+			if err == io.EOF {
+				break
+			}
+			require.NoError(t, err)
+			require.Equal(t, src.Packets[n].H264PTS, p.H264PTS)
+			require.Equal(t, len(src.Packets[n].H264NALUs), len(p.H264NALUs))
+			for j := range p.H264NALUs {
+				require.Equal(t, src.Packets[n].H264NALUs[j].RawPayload(), p.H264NALUs[j].RawPayload())
+			}
+			n++
+		}
+		require.Equal(t, expectPackets, n)
+
+		// Seek into the middle of the second GOP
+		ok, err := r.SeekPTS(1550 * time.Millisecond)
+		require.True(t, ok)
+		require.NoError(t, err)
+		p, err := r.Next()
+		require.NoError(t, err)
+		require.Equal(t, time.Second, p.H264PTS)
+
+		// Before the start
+		ok, err = r.SeekPTS(-time.Second)
+		require.True(t, ok)
+		require.NoError(t, err)
+		p, err = r.Next()
+		require.NoError(t, err)
+		require.Equal(t, time.Duration(0), p.H264PTS)
+	}
+	verify(50)
+
+	loaded, err := LoadCapture(filename, 2*time.Second)
+	require.NoError(t, err)
+	require.Equal(t, 30, len(loaded.Packets))
+	require.True(t, loaded.Packets[0].HasType(h264.NALUTypeIDR))
+
+	// A capture that was cut short has no index, so the reader scans for the keyframes
+	st, err := os.Stat(filename)
+	require.NoError(t, err)
+	require.NoError(t, os.Truncate(filename, st.Size()/2))
+	r, err := OpenCaptureReader(filename)
+	require.NoError(t, err)
+	n := 0
+	for ; ; n++ {
+		if _, err := r.Next(); err == io.EOF {
+			break
+		}
+		require.NoError(t, err)
+	}
+	r.Close()
+	require.Greater(t, n, 20)
+	require.Less(t, n, 50)
+	verify(n)
+}
+
+func TestCaptureH265(t *testing.T) {
+	filename := filepath.Join(t.TempDir(), "test.cap")
+	src := &RawBuffer{Codec: CodecH265}
+	for i := 0; i < 20; i++ {
+		p := &DecodedPacket{H264PTS: time.Duration(i) * 100 * time.Millisecond, Codec: CodecH265}
+		if i%10 == 0 {
+			// VPS, SPS, PPS, IDR_W_RADL
+			p.H264NALUs = append(p.H264NALUs, WrapRawNALU([]byte{0x40, 1, 2}), WrapRawNALU([]byte{0x42, 1, 3}), WrapRawNALU([]byte{0x44, 1, 4}), WrapRawNALU([]byte{0x26, 1, byte(i)}))
+		} else {
+			// TRAIL_R
+			p.H264NALUs = append(p.H264NALUs, WrapRawNALU([]byte{0x02, 1, byte(i)}))
+		}
+		src.Packets = append(src.Packets, p)
+	}
+	require.NoError(t, src.SaveCapture(filename))
+
+	r, err := OpenCaptureReader(filename)
+	require.NoError(t, err)
+	require.Equal(t, CodecH265, r.Codec)
+	require.Equal(t, 2, len(r.Keyframes))
+	r.Close()
+
+	loaded, err := LoadCapture(filename, 1500*time.Millisecond)
+	require.NoError(t, err)
+	require.Equal(t, CodecH265, loaded.Codec)
+	require.Equal(t, 10, len(loaded.Packets))
+	require.True(t, loaded.Packets[0].IsKeyframe())
+	require.Equal(t, CodecH265, loaded.Packets[0].Codec)
+	require.Equal(t, []int{0}, loaded.Keyframes())
+}
@@ -0,0 +1,22 @@
+package videox
+
+// #include "nalu.h"
+import "C"
+
+// Codec identifies the video codec of a stream
+type Codec int
+
+const (
+	CodecH264 Codec = C.VideoCodecH264
+	CodecH265 Codec = C.VideoCodecH265
+)
+
+func (c Codec) String() string {
+	switch c {
+	case CodecH264:
+		return "H264"
+	case CodecH265:
+		return "H265"
+	}
+	return "Unknown"
+}
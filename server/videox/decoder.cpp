@@ -0,0 +1,302 @@
+#include <stdint.h>
+#include <mutex>
+#include "decoder.h"
+#include "tsf.hpp"
+
+struct Decoder {
+	AVCodecContext*    CodecCtx = nullptr;
+	AVBufferRef*       HWDevice = nullptr;
+	AVPacket*          Packet   = nullptr; // Reused for every packet that we send
+	AVFrame*           HWFrame  = nullptr; // Frame in GPU memory (VAAPI only)
+	AVFrame*           Frame    = nullptr; // Frame in system memory. This is what we hand out.
+	enum AVPixelFormat HWFormat = AV_PIX_FMT_NONE;
+	DecoderBackend     Backend  = DecoderBackendSoftware;
+	DecoderOptions     Options  = {};
+	AVFrame*           Discard  = nullptr; // Frames that nobody received in time (see Decoder_OnAccessUnit)
+	int64_t            SendNS   = 0;       // Time spent sending packets since the last frame came out (see PipelineStats.Decode)
+
+	// Decoder_OnAccessUnit runs on the ingest thread, while frames are received on another thread.
+	// Only the send and receive functions take this lock.
+	std::mutex Lock;
+};
+
+struct DecoderCleanup {
+	Decoder* D;
+	DecoderCleanup(Decoder* d) {
+		D = d;
+	}
+	~DecoderCleanup() {
+		if (!D)
+			return;
+		if (D->CodecCtx)
+			avcodec_free_context(&D->CodecCtx);
+		if (D->HWDevice)
+			av_buffer_unref(&D->HWDevice);
+		if (D->Packet)
+			av_packet_free(&D->Packet);
+		if (D->HWFrame)
+			av_frame_free(&D->HWFrame);
+		if (D->Frame)
+			av_frame_free(&D->Frame);
+		if (D->Discard)
+			av_frame_free(&D->Discard);
+		delete D;
+	}
+};
+
+static const char* BackendName(DecoderBackend b) {
+	switch (b) {
+	case DecoderBackendV4L2M2M: return "v4l2m2m";
+	case DecoderBackendVAAPI: return "vaapi";
+	case DecoderBackendSoftware: return "software";
+	}
+	return "unknown";
+}
+
+// Open codec into decoder->CodecCtx. On failure, CodecCtx is freed, so that the next backend can be tried.
+static bool OpenCodec(Decoder* decoder, const AVCodec* codec) {
+	if (decoder->CodecCtx == nullptr) {
+		decoder->CodecCtx = avcodec_alloc_context3(codec);
+		if (decoder->CodecCtx == nullptr)
+			return false;
+	}
+	if (decoder->Options.Fast) {
+		// The H264 decoder has no lowres support (max_lowres = 0), so skipping the deblocking
+		// filter is the biggest saving available. Hardware decoders ignore these.
+		decoder->CodecCtx->skip_loop_filter = AVDISCARD_ALL;
+		decoder->CodecCtx->flags2 |= AV_CODEC_FLAG2_FAST;
+	}
+	if (decoder->Options.ThreadCount > 0)
+		decoder->CodecCtx->thread_count = decoder->Options.ThreadCount;
+	switch (decoder->Options.ThreadType) {
+	case DecoderThreadTypeFrame: decoder->CodecCtx->thread_type = FF_THREAD_FRAME; break;
+	case DecoderThreadTypeSlice: decoder->CodecCtx->thread_type = FF_THREAD_SLICE; break;
+	}
+	if (decoder->Options.LowDelay) {
+		// Frame threading holds back one frame per thread, so it's incompatible with low delay
+		decoder->CodecCtx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+		decoder->CodecCtx->thread_type &= ~FF_THREAD_FRAME;
+	}
+	if (avcodec_open2(decoder->CodecCtx, codec, nullptr) < 0) {
+		avcodec_free_context(&decoder->CodecCtx);
+		return false;
+	}
+	return true;
+}
+
+static AVCodecID CodecID(Decoder* decoder) {
+	return decoder->Options.Codec == VideoCodecH265 ? AV_CODEC_ID_HEVC : AV_CODEC_ID_H264;
+}
+
+// The v4l2m2m decoder fails to open if there is no V4L2 device that can decode the codec,
+// so a successful open is enough to know that we have hardware decode.
+// Frames come out in system memory.
+static bool OpenV4L2M2M(Decoder* decoder) {
+	auto codec = avcodec_find_decoder_by_name(decoder->Options.Codec == VideoCodecH265 ? "hevc_v4l2m2m" : "h264_v4l2m2m");
+	if (codec == nullptr)
+		return false;
+	return OpenCodec(decoder, codec);
+}
+
+static enum AVPixelFormat GetHWFormat(AVCodecContext* ctx, const enum AVPixelFormat* formats) {
+	auto decoder = (Decoder*) ctx->opaque;
+	for (const enum AVPixelFormat* f = formats; *f != AV_PIX_FMT_NONE; f++) {
+		if (*f == decoder->HWFormat)
+			return *f;
+	}
+	// The hardware can't decode this stream, so fall back to the first software format.
+	// Decoder_ReceiveFrame notices this, because the frames it receives are not in HWFormat.
+	return formats[0];
+}
+
+// VAAPI is a hwaccel of the regular software decoder. Frames come out in GPU memory, and must be transferred back.
+static bool OpenVAAPI(Decoder* decoder) {
+	auto codec = avcodec_find_decoder(CodecID(decoder));
+	if (codec == nullptr)
+		return false;
+
+	bool supported = false;
+	for (int i = 0;; i++) {
+		auto config = avcodec_get_hw_config(codec, i);
+		if (config == nullptr)
+			break;
+		if ((config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX) && config->device_type == AV_HWDEVICE_TYPE_VAAPI) {
+			decoder->HWFormat = config->pix_fmt;
+			supported         = true;
+			break;
+		}
+	}
+	if (!supported)
+		return false;
+
+	if (av_hwdevice_ctx_create(&decoder->HWDevice, AV_HWDEVICE_TYPE_VAAPI, nullptr, nullptr, 0) < 0)
+		return false;
+
+	decoder->HWFrame  = av_frame_alloc();
+	decoder->CodecCtx = avcodec_alloc_context3(codec);
+	if (decoder->HWFrame != nullptr && decoder->CodecCtx != nullptr) {
+		decoder->CodecCtx->opaque        = decoder;
+		decoder->CodecCtx->get_format    = GetHWFormat;
+		decoder->CodecCtx->hw_device_ctx = av_buffer_ref(decoder->HWDevice);
+		if (OpenCodec(decoder, codec))
+			return true;
+	}
+
+	// Leave decoder clean, for the software fallback
+	if (decoder->CodecCtx)
+		avcodec_free_context(&decoder->CodecCtx);
+	av_buffer_unref(&decoder->HWDevice);
+	av_frame_free(&decoder->HWFrame);
+	decoder->HWFormat = AV_PIX_FMT_NONE;
+	return false;
+}
+
+static bool OpenSoftware(Decoder* decoder) {
+	auto codec = avcodec_find_decoder(CodecID(decoder));
+	if (codec == nullptr)
+		return false;
+	return OpenCodec(decoder, codec);
+}
+
+extern "C" {
+
+// Create a new H264 or H265 decoder.
+// If options->AllowHardware is true, then we try v4l2m2m, then VAAPI, before falling back to software.
+void* MakeDecoder(char** err, const DecoderOptions* options) {
+	auto           decoder = new Decoder();
+	DecoderCleanup cleanup(decoder);
+
+	decoder->Options   = *options;
+	bool allowHardware = options->AllowHardware != 0;
+	if (options->Codec != VideoCodecH264 && options->Codec != VideoCodecH265) {
+		*err = strdup("Unsupported codec");
+		return nullptr;
+	}
+
+	decoder->Packet = av_packet_alloc();
+	decoder->Frame  = av_frame_alloc();
+	if (decoder->Packet == nullptr || decoder->Frame == nullptr) {
+		*err = strdup("Failed to allocate packet or frame");
+		return nullptr;
+	}
+
+	if (allowHardware && OpenV4L2M2M(decoder)) {
+		decoder->Backend = DecoderBackendV4L2M2M;
+	} else if (allowHardware && OpenVAAPI(decoder)) {
+		decoder->Backend = DecoderBackendVAAPI;
+	} else if (OpenSoftware(decoder)) {
+		decoder->Backend = DecoderBackendSoftware;
+	} else {
+		*err = strdup(options->Codec == VideoCodecH265 ? "Failed to open H265 decoder" : "Failed to open H264 decoder");
+		return nullptr;
+	}
+
+	cleanup.D = nullptr; // allow Decoder to survive
+	return decoder;
+}
+
+void Decoder_Close(void* _decoder) {
+	// when DecoderCleanup goes out of scope, it will clean up
+	DecoderCleanup cleanup((Decoder*) _decoder);
+}
+
+int Decoder_Backend(void* _decoder) {
+	return ((Decoder*) _decoder)->Backend;
+}
+
+const char* Decoder_BackendName(void* _decoder) {
+	return BackendName(((Decoder*) _decoder)->Backend);
+}
+
+int Decoder_Width(void* _decoder) {
+	return ((Decoder*) _decoder)->CodecCtx->width;
+}
+
+int Decoder_Height(void* _decoder) {
+	return ((Decoder*) _decoder)->CodecCtx->height;
+}
+
+// buf must contain an annex-b NALU.
+// Returns the result of avcodec_send_packet.
+static int SendPacket(Decoder* decoder, const void* buf, size_t bufLen) {
+	int64_t start = decoder->Options.Stats ? StatsNow() : 0;
+	auto    pkt   = decoder->Packet;
+	pkt->data     = (uint8_t*) buf;
+	pkt->size     = (int) bufLen;
+	int res       = avcodec_send_packet(decoder->CodecCtx, pkt);
+	pkt->data     = nullptr;
+	pkt->size     = 0;
+	if (decoder->Options.Stats)
+		decoder->SendNS += StatsNow() - start;
+	return res;
+}
+
+// A frame has come out of the decoder, so record the time that it took to produce
+static void RecordFrame(Decoder* decoder, int64_t receiveStart) {
+	if (!decoder->Options.Stats)
+		return;
+	StatsHistogram_Add(&decoder->Options.Stats->Decode, decoder->SendNS + StatsNow() - receiveStart);
+	decoder->SendNS = 0;
+}
+
+int Decoder_SendPacket(void* _decoder, const void* buf, size_t bufLen) {
+	auto                        decoder = (Decoder*) _decoder;
+	std::lock_guard<std::mutex> lock(decoder->Lock);
+	return SendPacket(decoder, buf, bufLen);
+}
+
+// Send an annex-b access unit from the ingest engine (this is an IngestSinkFunc, see rtsp/ingest.h).
+// If the decoder is full, because nobody has been receiving frames, then the oldest frame is discarded,
+// so that whoever calls Decoder_ReceiveFrame always gets recent frames.
+void Decoder_OnAccessUnit(void* _decoder, const uint8_t* accessUnit, size_t size, int64_t pts, int keyframe) {
+	auto                        decoder = (Decoder*) _decoder;
+	std::lock_guard<std::mutex> lock(decoder->Lock);
+	if (SendPacket(decoder, accessUnit, size) != AVERROR(EAGAIN))
+		return;
+	if (decoder->Discard == nullptr)
+		decoder->Discard = av_frame_alloc();
+	int64_t start = decoder->Options.Stats ? StatsNow() : 0;
+	if (decoder->Discard == nullptr || avcodec_receive_frame(decoder->CodecCtx, decoder->Discard) < 0)
+		return;
+	RecordFrame(decoder, start); // nobody wanted the frame, but it still cost us to decode
+	av_frame_unref(decoder->Discard);
+	SendPacket(decoder, accessUnit, size);
+}
+
+// Receive the next decoded frame, in system memory.
+// Returns AVERROR(EAGAIN) if no frame is ready yet. This is normal for hardware decoders,
+// which often have a few frames of latency.
+// The frame is owned by the decoder, and is only valid until the next call to Decoder_ReceiveFrame.
+int Decoder_ReceiveFrame(void* _decoder, AVFrame** frame) {
+	auto                        decoder = (Decoder*) _decoder;
+	std::lock_guard<std::mutex> lock(decoder->Lock);
+	int64_t                     start = decoder->Options.Stats ? StatsNow() : 0;
+	*frame                            = nullptr;
+	if (decoder->HWFrame == nullptr) {
+		int res = avcodec_receive_frame(decoder->CodecCtx, decoder->Frame);
+		if (res < 0)
+			return res;
+		*frame = decoder->Frame;
+		RecordFrame(decoder, start);
+		return 0;
+	}
+
+	int res = avcodec_receive_frame(decoder->CodecCtx, decoder->HWFrame);
+	if (res < 0)
+		return res;
+	if (decoder->HWFrame->format != decoder->HWFormat) {
+		// ffmpeg fell back to software decoding inside GetHWFormat
+		*frame = decoder->HWFrame;
+		RecordFrame(decoder, start);
+		return 0;
+	}
+	av_frame_unref(decoder->Frame);
+	res = av_hwframe_transfer_data(decoder->Frame, decoder->HWFrame, 0);
+	av_frame_unref(decoder->HWFrame);
+	if (res < 0)
+		return res;
+	*frame = decoder->Frame;
+	RecordFrame(decoder, start);
+	return 0;
+}
+}
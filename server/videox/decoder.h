@@ -0,0 +1,50 @@
+#include <string.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/hwcontext.h>
+
+#include "nalu.h"
+#include "stats.h"
+
+// Decoder backends, in the order that we probe them
+enum DecoderBackend {
+	DecoderBackendV4L2M2M  = 0, // Stateful hardware decoder (eg Raspberry Pi 4)
+	DecoderBackendVAAPI    = 1, // Intel/AMD GPU
+	DecoderBackendSoftware = 2, // ffmpeg's built-in H264/H265 decoder
+};
+
+enum DecoderThreadType {
+	DecoderThreadTypeDefault = 0, // Let ffmpeg decide
+	DecoderThreadTypeFrame   = 1, // Decode multiple frames in parallel. Best throughput, but adds one frame of latency per thread.
+	DecoderThreadTypeSlice   = 2, // Decode the slices of a frame in parallel. No added latency, but only useful if the camera emits multiple slices.
+};
+
+typedef struct DecoderOptions {
+	int Codec;         // VideoCodec
+	int AllowHardware; // Probe for v4l2m2m and VAAPI before falling back to software
+	int Fast;          // Trade quality for speed (skip the loop filter, and allow non spec compliant speedups)
+	int ThreadCount;   // 0 = let ffmpeg decide
+	int ThreadType;    // DecoderThreadType
+	int LowDelay;      // Emit frames as soon as possible (AV_CODEC_FLAG_LOW_DELAY). Disables frame threading.
+
+	PipelineStats* Stats; // If not NULL, decode times are recorded here. Must outlive the decoder.
+} DecoderOptions;
+
+void*       MakeDecoder(char** err, const DecoderOptions* options);
+void        Decoder_Close(void* decoder);
+int         Decoder_Backend(void* decoder);
+const char* Decoder_BackendName(void* decoder);
+int         Decoder_Width(void* decoder);
+int         Decoder_Height(void* decoder);
+int         Decoder_SendPacket(void* decoder, const void* buf, size_t bufLen);
+void        Decoder_OnAccessUnit(void* decoder, const uint8_t* accessUnit, size_t size, int64_t pts, int keyframe);
+int         Decoder_ReceiveFrame(void* decoder, AVFrame** frame);
+
+#ifdef __cplusplus
+}
+#endif
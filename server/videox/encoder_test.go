@@ -11,7 +11,7 @@ import (
 func TestEncoder(t *testing.T) {
 	root := "/home/ben/dev/cyclops"
 
-	enc, err := NewVideoEncoder("mp4", root+"/dump/test-go.mp4", 2048, 1536)
+	enc, err := NewVideoEncoder("mp4", CodecH264, root+"/dump/test-go.mp4")
 	require.Nil(t, err)
 	defer enc.Close()
 
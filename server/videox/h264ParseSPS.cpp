@@ -2,175 +2,255 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include "h264ParseSPS.h"
+#include "bitReader.h"
 
-// Courtesy of https://stackoverflow.com/questions/12018535/get-the-width-height-of-the-video-from-h-264-nalu
+// The SPS layout was originally courtesy of https://stackoverflow.com/questions/12018535/get-the-width-height-of-the-video-from-h-264-nalu
+// Everything else follows the syntax tables in section 7.3 of the H.264 spec.
 
-struct SPSParser {
-	// Output parameters
-	int Width  = 0;
-	int Height = 0;
-
-	// Internal state
-	const unsigned char* m_pStart       = nullptr;
-	unsigned             m_nLengthBytes = 0;
-	unsigned             m_nLengthBits  = 0;
-	unsigned             m_nCurrentBit  = 0;
+static void SkipScalingList(BitReader& r, int size) {
+	int lastScale = 8;
+	int nextScale = 8;
+	for (int j = 0; j < size; j++) {
+		if (nextScale != 0) {
+			int delta_scale = r.ReadSE();
+			nextScale       = (lastScale + delta_scale + 256) % 256;
+		}
+		lastScale = (nextScale == 0) ? lastScale : nextScale;
+	}
+}
 
-	unsigned ReadBit() {
-		//assert(m_nCurrentBit <= m_nLengthBits);
-		if (m_nCurrentBit > m_nLengthBits) {
-			// error
-			return 0;
+// Parse as much of the VUI as we need for the frame rate (everything up to and including timing_info)
+static void ParseVUI(BitReader& r, H264SPSInfo* info) {
+	if (r.ReadBit()) { // aspect_ratio_info_present_flag
+		int aspect_ratio_idc = r.ReadBits(8);
+		if (aspect_ratio_idc == 255) { // Extended_SAR
+			r.ReadBits(16);            // sar_width
+			r.ReadBits(16);            // sar_height
+		}
+	}
+	if (r.ReadBit()) // overscan_info_present_flag
+		r.ReadBit(); // overscan_appropriate_flag
+	if (r.ReadBit()) { // video_signal_type_present_flag
+		r.ReadBits(3); // video_format
+		r.ReadBit();   // video_full_range_flag
+		if (r.ReadBit()) {
+			r.ReadBits(8); // colour_primaries
+			r.ReadBits(8); // transfer_characteristics
+			r.ReadBits(8); // matrix_coefficients
 		}
+	}
+	if (r.ReadBit()) { // chroma_loc_info_present_flag
+		r.ReadUE();    // chroma_sample_loc_type_top_field
+		r.ReadUE();    // chroma_sample_loc_type_bottom_field
+	}
+	info->TimingInfoPresent = r.ReadBit();
+	if (info->TimingInfoPresent) {
+		info->NumUnitsInTick = r.ReadBits(32);
+		info->TimeScale      = r.ReadBits(32);
+		info->FixedFrameRate = r.ReadBit();
+	}
+}
 
-		unsigned nIndex  = m_nCurrentBit / 8;
-		unsigned nOffset = (m_nCurrentBit % 8) + 1;
+static bool ParseSPSInternal(const uint8_t* buf, size_t len, H264SPSInfo* info) {
+	memset(info, 0, sizeof(*info));
+	if (len < 2)
+		return false;
 
-		m_nCurrentBit++;
-		return (m_pStart[nIndex] >> (8 - nOffset)) & 0x01;
-	}
+	BitReader r(buf + 1, len - 1); // skip header byte (eg 67 or 27)
+
+	info->ProfileIDC      = r.ReadBits(8);
+	info->ConstraintFlags = r.ReadBits(8); // constraint_set0_flag..constraint_set5_flag, reserved_zero_2bits
+	info->LevelIDC        = r.ReadBits(8);
+	info->SPSID           = r.ReadUE();
+	info->ChromaFormatIDC = 1;
 
-	unsigned ReadBits(int n) {
-		int r = 0;
-		int i;
-		for (i = 0; i < n; i++) {
-			r |= (ReadBit() << (n - i - 1));
+	int p = info->ProfileIDC;
+	if (p == 100 || p == 110 || p == 122 || p == 244 || p == 44 || p == 83 || p == 86 || p == 118 ||
+	    p == 128 || p == 138 || p == 139 || p == 134 || p == 135) {
+		info->ChromaFormatIDC = r.ReadUE();
+		if (info->ChromaFormatIDC == 3)
+			info->SeparateColourPlane = r.ReadBit();
+		r.ReadUE();  // bit_depth_luma_minus8
+		r.ReadUE();  // bit_depth_chroma_minus8
+		r.ReadBit(); // qpprime_y_zero_transform_bypass_flag
+		if (r.ReadBit()) { // seq_scaling_matrix_present_flag
+			int nLists = info->ChromaFormatIDC != 3 ? 8 : 12;
+			for (int i = 0; i < nLists; i++) {
+				if (r.ReadBit()) // seq_scaling_list_present_flag
+					SkipScalingList(r, i < 6 ? 16 : 64);
+			}
 		}
-		return r;
 	}
 
-	unsigned ReadExponentialGolombCode() {
-		int r = 0;
-		int i = 0;
+	info->Log2MaxFrameNum = r.ReadUE() + 4;
+	info->PicOrderCntType = r.ReadUE();
+	if (info->PicOrderCntType == 0) {
+		info->Log2MaxPicOrderCntLsb = r.ReadUE() + 4;
+	} else if (info->PicOrderCntType == 1) {
+		r.ReadBit(); // delta_pic_order_always_zero_flag
+		r.ReadSE();  // offset_for_non_ref_pic
+		r.ReadSE();  // offset_for_top_to_bottom_field
+		uint32_t num_ref_frames_in_pic_order_cnt_cycle = r.ReadUE();
+		if (num_ref_frames_in_pic_order_cnt_cycle > 255)
+			return false;
+		for (uint32_t i = 0; i < num_ref_frames_in_pic_order_cnt_cycle; i++)
+			r.ReadSE(); // offset_for_ref_frame[i]
+	}
+	info->MaxNumRefFrames = r.ReadUE();
+	r.ReadBit(); // gaps_in_frame_num_value_allowed_flag
+	int pic_width_in_mbs_minus1        = r.ReadUE();
+	int pic_height_in_map_units_minus1 = r.ReadUE();
+	info->FrameMBSOnly                 = r.ReadBit();
+	if (!info->FrameMBSOnly)
+		r.ReadBit(); // mb_adaptive_frame_field_flag
+	r.ReadBit();     // direct_8x8_inference_flag
 
-		while ((ReadBit() == 0) && (i < 32)) {
-			i++;
-		}
+	int crop_left   = 0;
+	int crop_right  = 0;
+	int crop_top    = 0;
+	int crop_bottom = 0;
+	if (r.ReadBit()) { // frame_cropping_flag
+		crop_left   = r.ReadUE();
+		crop_right  = r.ReadUE();
+		crop_top    = r.ReadUE();
+		crop_bottom = r.ReadUE();
+	}
+	if (r.Overrun() || info->Log2MaxFrameNum > 16 || info->Log2MaxPicOrderCntLsb > 16)
+		return false;
 
-		r = ReadBits(i);
-		r += (1 << i) - 1;
-		return r;
+	// Crop offsets are in units of chroma samples (section 7.4.2.1.1)
+	int chromaArrayType = info->SeparateColourPlane ? 0 : info->ChromaFormatIDC;
+	int cropUnitX       = 1;
+	int cropUnitY       = 2 - info->FrameMBSOnly;
+	if (chromaArrayType != 0) {
+		int subWidthC  = info->ChromaFormatIDC == 3 ? 1 : 2;
+		int subHeightC = info->ChromaFormatIDC == 1 ? 2 : 1;
+		cropUnitX      = subWidthC;
+		cropUnitY *= subHeightC;
 	}
+	info->Width  = (pic_width_in_mbs_minus1 + 1) * 16 - cropUnitX * (crop_left + crop_right);
+	info->Height = (2 - info->FrameMBSOnly) * (pic_height_in_map_units_minus1 + 1) * 16 - cropUnitY * (crop_top + crop_bottom);
 
-	unsigned ReadSE() {
-		int r = ReadExponentialGolombCode();
-		if (r & 0x01) {
-			r = (r + 1) / 2;
-		} else {
-			r = -(r / 2);
-		}
-		return r;
+	if (r.ReadBit()) { // vui_parameters_present_flag
+		ParseVUI(r, info);
+		// Some cameras send a truncated VUI. That's no reason to reject the dimensions.
+		if (r.Overrun())
+			info->TimingInfoPresent = 0;
 	}
+	return true;
+}
 
-	void ParseSPS(const unsigned char* pStart, size_t nLen) {
-		m_pStart       = pStart;
-		m_nLengthBytes = (unsigned) nLen;
-		m_nLengthBits  = (unsigned) nLen * 8;
-		m_nCurrentBit  = 0;
-
-		m_pStart++; // skip header bytes (eg 67 or 27)
-
-		int frame_crop_left_offset   = 0;
-		int frame_crop_right_offset  = 0;
-		int frame_crop_top_offset    = 0;
-		int frame_crop_bottom_offset = 0;
-
-		int profile_idc          = ReadBits(8);
-		int constraint_set0_flag = ReadBit();
-		int constraint_set1_flag = ReadBit();
-		int constraint_set2_flag = ReadBit();
-		int constraint_set3_flag = ReadBit();
-		int constraint_set4_flag = ReadBit();
-		int constraint_set5_flag = ReadBit();
-		int reserved_zero_2bits  = ReadBits(2);
-		int level_idc            = ReadBits(8);
-		int seq_parameter_set_id = ReadExponentialGolombCode();
-
-		if (profile_idc == 100 || profile_idc == 110 ||
-		    profile_idc == 122 || profile_idc == 244 ||
-		    profile_idc == 44 || profile_idc == 83 ||
-		    profile_idc == 86 || profile_idc == 118) {
-			int chroma_format_idc = ReadExponentialGolombCode();
-
-			if (chroma_format_idc == 3) {
-				int residual_colour_transform_flag = ReadBit();
-			}
-			int bit_depth_luma_minus8                = ReadExponentialGolombCode();
-			int bit_depth_chroma_minus8              = ReadExponentialGolombCode();
-			int qpprime_y_zero_transform_bypass_flag = ReadBit();
-			int seq_scaling_matrix_present_flag      = ReadBit();
-
-			if (seq_scaling_matrix_present_flag) {
-				int i = 0;
-				for (i = 0; i < 8; i++) {
-					int seq_scaling_list_present_flag = ReadBit();
-					if (seq_scaling_list_present_flag) {
-						int sizeOfScalingList = (i < 6) ? 16 : 64;
-						int lastScale         = 8;
-						int nextScale         = 8;
-						int j                 = 0;
-						for (j = 0; j < sizeOfScalingList; j++) {
-							if (nextScale != 0) {
-								int delta_scale = ReadSE();
-								nextScale       = (lastScale + delta_scale + 256) % 256;
-							}
-							lastScale = (nextScale == 0) ? lastScale : nextScale;
-						}
-					}
-				}
-			}
-		}
+static bool ParsePPSInternal(const uint8_t* buf, size_t len, H264PPSInfo* info) {
+	memset(info, 0, sizeof(*info));
+	if (len < 2)
+		return false;
+
+	BitReader r(buf + 1, len - 1);
 
-		int log2_max_frame_num_minus4 = ReadExponentialGolombCode();
-		int pic_order_cnt_type        = ReadExponentialGolombCode();
-		if (pic_order_cnt_type == 0) {
-			int log2_max_pic_order_cnt_lsb_minus4 = ReadExponentialGolombCode();
-		} else if (pic_order_cnt_type == 1) {
-			int delta_pic_order_always_zero_flag      = ReadBit();
-			int offset_for_non_ref_pic                = ReadSE();
-			int offset_for_top_to_bottom_field        = ReadSE();
-			int num_ref_frames_in_pic_order_cnt_cycle = ReadExponentialGolombCode();
-			int i;
-			for (i = 0; i < num_ref_frames_in_pic_order_cnt_cycle; i++) {
-				ReadSE();
-				//sps->offset_for_ref_frame[ i ] = ReadSE();
+	info->PPSID                             = r.ReadUE();
+	info->SPSID                             = r.ReadUE();
+	info->EntropyCodingMode                 = r.ReadBit();
+	info->BottomFieldPicOrderInFramePresent = r.ReadBit();
+	info->NumSliceGroups                    = r.ReadUE() + 1;
+	if (info->NumSliceGroups > 8)
+		return false;
+	if (info->NumSliceGroups > 1) {
+		int slice_group_map_type = r.ReadUE();
+		if (slice_group_map_type == 0) {
+			for (int i = 0; i < info->NumSliceGroups; i++)
+				r.ReadUE(); // run_length_minus1
+		} else if (slice_group_map_type == 2) {
+			for (int i = 0; i < info->NumSliceGroups - 1; i++) {
+				r.ReadUE(); // top_left
+				r.ReadUE(); // bottom_right
 			}
+		} else if (slice_group_map_type >= 3 && slice_group_map_type <= 5) {
+			r.ReadBit(); // slice_group_change_direction_flag
+			r.ReadUE();  // slice_group_change_rate_minus1
+		} else if (slice_group_map_type == 6) {
+			uint32_t pic_size_in_map_units = r.ReadUE() + 1;
+			int      bits                  = 32 - __builtin_clz((uint32_t) (info->NumSliceGroups - 1));
+			if (pic_size_in_map_units > 139264) // MaxFS of level 6.2
+				return false;
+			for (uint32_t i = 0; i < pic_size_in_map_units; i++)
+				r.ReadBits(bits); // slice_group_id
 		}
-		int max_num_ref_frames                   = ReadExponentialGolombCode();
-		int gaps_in_frame_num_value_allowed_flag = ReadBit();
-		int pic_width_in_mbs_minus1              = ReadExponentialGolombCode();
-		int pic_height_in_map_units_minus1       = ReadExponentialGolombCode();
-		int frame_mbs_only_flag                  = ReadBit();
-		if (!frame_mbs_only_flag) {
-			int mb_adaptive_frame_field_flag = ReadBit();
-		}
-		int direct_8x8_inference_flag = ReadBit();
-		int frame_cropping_flag       = ReadBit();
-		if (frame_cropping_flag) {
-			frame_crop_left_offset   = ReadExponentialGolombCode();
-			frame_crop_right_offset  = ReadExponentialGolombCode();
-			frame_crop_top_offset    = ReadExponentialGolombCode();
-			frame_crop_bottom_offset = ReadExponentialGolombCode();
-		}
-		int vui_parameters_present_flag = ReadBit();
-		pStart++;
+	}
+	info->NumRefIdxL0DefaultActive       = r.ReadUE() + 1;
+	info->NumRefIdxL1DefaultActive       = r.ReadUE() + 1;
+	info->WeightedPred                   = r.ReadBit();
+	info->WeightedBipred                 = r.ReadBits(2);
+	info->PicInitQP                      = 26 + r.ReadSE();
+	r.ReadSE();                          // pic_init_qs_minus26
+	r.ReadSE();                          // chroma_qp_index_offset
+	info->DeblockingFilterControlPresent = r.ReadBit();
+	r.ReadBit();                         // constrained_intra_pred_flag
+	info->RedundantPicCntPresent         = r.ReadBit();
+	return !r.Overrun();
+}
+
+static bool ParseSliceHeaderInternal(const uint8_t* buf, size_t len, const H264SPSInfo* sps, H264SliceInfo* info) {
+	memset(info, 0, sizeof(*info));
+	info->FrameNum       = -1;
+	info->IDRPicID       = -1;
+	info->PicOrderCntLsb = -1;
+	if (len < 2)
+		return false;
+
+	info->NALRefIDC = (buf[0] >> 5) & 3;
+	info->NALType   = buf[0] & 31;
+	if (info->NALType != 1 && info->NALType != 5)
+		return false;
 
-		//int Width  = ((pic_width_in_mbs_minus1 + 1) * 16) - frame_crop_bottom_offset * 2 - frame_crop_top_offset * 2;
-		//int Height = ((2 - frame_mbs_only_flag) * (pic_height_in_map_units_minus1 + 1) * 16) - (frame_crop_right_offset * 2) - (frame_crop_left_offset * 2);
-		Width  = ((pic_width_in_mbs_minus1 + 1) * 16) - frame_crop_right_offset * 2 - frame_crop_left_offset * 2;
-		Height = ((2 - frame_mbs_only_flag) * (pic_height_in_map_units_minus1 + 1) * 16) - (frame_crop_bottom_offset * 2) - (frame_crop_top_offset * 2);
+	BitReader r(buf + 1, len - 1);
+
+	info->FirstMB   = r.ReadUE();
+	info->SliceType = r.ReadUE();
+	info->PPSID     = r.ReadUE();
+	if (info->SliceType > 9)
+		return false;
+	// Values 5..9 mean that all slices in the picture have the same type
+	info->SliceType %= 5;
+	if (sps == nullptr)
+		return !r.Overrun();
+
+	if (sps->SeparateColourPlane)
+		r.ReadBits(2); // colour_plane_id
+	info->FrameNum = r.ReadBits(sps->Log2MaxFrameNum);
+	if (!sps->FrameMBSOnly) {
+		info->FieldPic = r.ReadBit();
+		if (info->FieldPic)
+			info->BottomField = r.ReadBit();
 	}
-};
+	if (info->NALType == 5)
+		info->IDRPicID = r.ReadUE();
+	if (sps->PicOrderCntType == 0)
+		info->PicOrderCntLsb = r.ReadBits(sps->Log2MaxPicOrderCntLsb);
+	return !r.Overrun();
+}
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 void ParseSPS(const void* buf, size_t len, int* width, int* height) {
-	SPSParser p;
-	p.ParseSPS((const unsigned char*) buf, len);
-	*width  = p.Width;
-	*height = p.Height;
+	H264SPSInfo info;
+	ParseSPSInternal((const uint8_t*) buf, len, &info);
+	*width  = info.Width;
+	*height = info.Height;
+}
+
+int ParseSPSInfo(const void* buf, size_t len, H264SPSInfo* info) {
+	return ParseSPSInternal((const uint8_t*) buf, len, info) ? 1 : 0;
+}
+
+int ParsePPSInfo(const void* buf, size_t len, H264PPSInfo* info) {
+	return ParsePPSInternal((const uint8_t*) buf, len, info) ? 1 : 0;
+}
+
+int ParseSliceHeader(const void* buf, size_t len, const H264SPSInfo* sps, H264SliceInfo* info) {
+	return ParseSliceHeaderInternal((const uint8_t*) buf, len, sps, info) ? 1 : 0;
 }
 
 #ifdef __cplusplus
@@ -1,17 +1,120 @@
 package videox
 
-import "unsafe"
+import (
+	"errors"
+	"unsafe"
+)
 
 // #include "h264ParseSPS.h"
 import "C"
 
+var errInvalidNALU = errors.New("Invalid or truncated NALU")
+
+// SliceType is the slice_type of an H264 slice header, reduced to 0..4
+type SliceType int
+
+const (
+	SliceTypeP  SliceType = 0
+	SliceTypeB  SliceType = 1
+	SliceTypeI  SliceType = 2
+	SliceTypeSP SliceType = 3
+	SliceTypeSI SliceType = 4
+)
+
+// SPSInfo is the information we extract from an SPS
+type SPSInfo struct {
+	Width     int
+	Height    int
+	Profile   int     // profile_idc, eg 66 = Baseline, 77 = Main, 100 = High
+	Level     int     // level_idc, eg 31 = level 3.1
+	FrameRate float64 // From the VUI timing info, or 0 if the camera doesn't tell us
+
+	raw C.H264SPSInfo // Needed to parse slice headers
+}
+
+// PPSInfo is the information we extract from a PPS
+type PPSInfo struct {
+	ID    int
+	SPSID int
+	CABAC bool
+}
+
+// SliceHeader is the start of an H264 slice header
+type SliceHeader struct {
+	Type      SliceType
+	IDR       bool
+	Reference bool // False if no other frame depends on this one (nal_ref_idc = 0)
+	FirstMB   int
+	PPSID     int
+	FrameNum  int // -1 if no SPS was given
+}
+
 // Parse a raw SPS NALU (not annex-b)
 func ParseSPS(nalu []byte) (width, height int, err error) {
-	var cwidth C.int
-	var cheight C.int
-	C.ParseSPS(unsafe.Pointer(&nalu[0]), C.ulong(len(nalu)), &cwidth, &cheight)
-	width = int(cwidth)
-	height = int(cheight)
-	return
+	info, err := ParseSPSInfo(nalu)
+	if err != nil {
+		return 0, 0, err
+	}
+	return info.Width, info.Height, nil
+}
+
+// Parse a raw SPS NALU (not annex-b)
+func ParseSPSInfo(nalu []byte) (*SPSInfo, error) {
+	if len(nalu) == 0 {
+		return nil, errInvalidNALU
+	}
+	info := &SPSInfo{}
+	if C.ParseSPSInfo(unsafe.Pointer(&nalu[0]), C.size_t(len(nalu)), &info.raw) == 0 {
+		return nil, errInvalidNALU
+	}
+	info.Width = int(info.raw.Width)
+	info.Height = int(info.raw.Height)
+	info.Profile = int(info.raw.ProfileIDC)
+	info.Level = int(info.raw.LevelIDC)
+	if info.raw.TimingInfoPresent != 0 && info.raw.NumUnitsInTick != 0 {
+		// A frame is two fields, and time_scale counts fields
+		info.FrameRate = float64(info.raw.TimeScale) / float64(2*info.raw.NumUnitsInTick)
+	}
+	return info, nil
+}
+
+// Parse a raw PPS NALU (not annex-b)
+func ParsePPS(nalu []byte) (*PPSInfo, error) {
+	if len(nalu) == 0 {
+		return nil, errInvalidNALU
+	}
+	var raw C.H264PPSInfo
+	if C.ParsePPSInfo(unsafe.Pointer(&nalu[0]), C.size_t(len(nalu)), &raw) == 0 {
+		return nil, errInvalidNALU
+	}
+	return &PPSInfo{
+		ID:    int(raw.PPSID),
+		SPSID: int(raw.SPSID),
+		CABAC: raw.EntropyCodingMode != 0,
+	}, nil
+}
 
+// Parse the start of the slice header of a raw IDR or non-IDR slice NALU (not annex-b).
+// sps may be nil, in which case FrameNum is -1.
+// This only touches the first few bytes of the NALU, so it's a cheap way to classify frames without decoding them.
+func ParseSliceHeader(nalu []byte, sps *SPSInfo) (*SliceHeader, error) {
+	if len(nalu) == 0 {
+		return nil, errInvalidNALU
+	}
+	var rawSPS *C.H264SPSInfo
+	if sps != nil {
+		rawSPS = &sps.raw
+	}
+	var raw C.H264SliceInfo
+	if C.ParseSliceHeader(unsafe.Pointer(&nalu[0]), C.size_t(len(nalu)), rawSPS, &raw) == 0 {
+		return nil, errInvalidNALU
+	}
+	return &SliceHeader{
+		Type:      SliceType(raw.SliceType),
+		IDR:       raw.NALType == 5,
+		Reference: raw.NALRefIDC != 0,
+		FirstMB:   int(raw.FirstMB),
+		PPSID:     int(raw.PPSID),
+		FrameNum:  int(raw.FrameNum),
+	}, nil
 }
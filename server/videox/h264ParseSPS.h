@@ -5,8 +5,72 @@
 extern "C" {
 #endif
 
+typedef struct H264SPSInfo {
+	int      Width;
+	int      Height;
+	int      ProfileIDC;      // eg 66 = Baseline, 77 = Main, 100 = High
+	int      ConstraintFlags; // The byte after profile_idc (constraint_set0_flag is the MSB)
+	int      LevelIDC;        // eg 31 = level 3.1
+	int      SPSID;
+	int      ChromaFormatIDC; // 1 = 4:2:0
+	int      SeparateColourPlane;
+	int      Log2MaxFrameNum;
+	int      PicOrderCntType;
+	int      Log2MaxPicOrderCntLsb; // Only valid when PicOrderCntType == 0
+	int      MaxNumRefFrames;
+	int      FrameMBSOnly; // 0 = interlaced
+	int      TimingInfoPresent;
+	uint32_t NumUnitsInTick;
+	uint32_t TimeScale;
+	int      FixedFrameRate;
+} H264SPSInfo;
+
+typedef struct H264PPSInfo {
+	int PPSID;
+	int SPSID;
+	int EntropyCodingMode; // 0 = CAVLC, 1 = CABAC
+	int BottomFieldPicOrderInFramePresent;
+	int NumSliceGroups;
+	int NumRefIdxL0DefaultActive;
+	int NumRefIdxL1DefaultActive;
+	int WeightedPred;
+	int WeightedBipred;
+	int PicInitQP;
+	int DeblockingFilterControlPresent;
+	int RedundantPicCntPresent;
+} H264PPSInfo;
+
+typedef struct H264SliceInfo {
+	int NALType;        // 1 = non-IDR, 5 = IDR
+	int NALRefIDC;      // 0 = nobody references this slice, so it can be dropped without harming other frames
+	int FirstMB;        // first_mb_in_slice
+	int SliceType;      // 0 = P, 1 = B, 2 = I, 3 = SP, 4 = SI
+	int PPSID;          // pic_parameter_set_id
+	int FrameNum;       // -1 if no SPS was given
+	int FieldPic;       // field_pic_flag
+	int BottomField;    // bottom_field_flag
+	int IDRPicID;       // -1 if not an IDR
+	int PicOrderCntLsb; // -1 if not present
+} H264SliceInfo;
+
+// All of these functions take a raw NALU (not annex-b), which starts with the NALU header byte.
+// Emulation prevention bytes are handled internally.
+
+// Returns zero width and height if the SPS is invalid
 void ParseSPS(const void* buf, size_t len, int* width, int* height);
 
+// Returns 1 on success, or 0 if the SPS is invalid or truncated
+int ParseSPSInfo(const void* buf, size_t len, H264SPSInfo* info);
+
+// Returns 1 on success, or 0 if the PPS is invalid or truncated
+int ParsePPSInfo(const void* buf, size_t len, H264PPSInfo* info);
+
+// Parse the start of a slice header, from a NALU of type 1 or 5.
+// sps may be NULL, in which case we stop after PPSID (which is all you need to know the slice type).
+// We only read the first few bytes of the slice, so this is cheap even for huge IDRs.
+// Returns 1 on success, or 0 if this is not a slice, or the header is invalid.
+int ParseSliceHeader(const void* buf, size_t len, const H264SPSInfo* sps, H264SliceInfo* info);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -4,6 +4,7 @@ import (
 	"errors"
 	"fmt"
 	"image"
+	"time"
 	"unsafe"
 
 	"github.com/aler9/gortsplib/pkg/h264"
@@ -13,7 +14,9 @@ import (
 // #include <libavcodec/avcodec.h>
 // #include <libavutil/imgutils.h>
 // #include <libswscale/swscale.h>
+// #include <errno.h>
 // #include "helper.h"
+// #include "decoder.h"
 import "C"
 
 func frameData(frame *C.AVFrame) **C.uint8_t {
@@ -24,6 +27,7 @@ func frameLineSize(frame *C.AVFrame) *C.int {
 	return (*C.int)(unsafe.Pointer(&frame.linesize[0]))
 }
 
+// Returns true if t is an H264 slice. See NALUKind.IsVisual for a check that works for any codec.
 func IsVisualPacket(t h264.NALUType) bool {
 	return int(t) >= 1 && int(t) <= 5
 }
@@ -41,64 +45,126 @@ func WrapAvErr(err C.int) error {
 	return errors.New(C.GoString(C.GetAvErrorStr(err)))
 }
 
-// H264Decoder is a wrapper around ffmpeg's H264 decoder.
+// H264Decoder is a wrapper around ffmpeg's H264 or H265 decoder (see DecoderOptions.Codec).
+// The actual decoder may be hardware (v4l2m2m or VAAPI) or software. See decoder.cpp.
 type H264Decoder struct {
-	codecCtx    *C.AVCodecContext
-	srcFrame    *C.AVFrame
-	swsCtx      *C.struct_SwsContext
-	dstFrame    *C.AVFrame
-	dstFramePtr []uint8
+	decoder  unsafe.Pointer
+	codec    Codec
+	srcFrame *C.AVFrame                    // Owned by decoder
+	scalers  map[scalerTarget]*frameScaler // Cached sws contexts, one for each output size and format
+	stats    *PipelineStats                // May be nil
 }
 
-// NewH264Decoder allocates a new H264Decoder.
-func NewH264Decoder() (*H264Decoder, error) {
-	// I tried this on Rpi4, to make sure I'm getting hardware decode.. but:
-	// This doesn't work.. I just get "avcodec_receive_frame error Resource temporarily unavailable"
-	// Perhaps it could work, I didn't try harder.
-	//codecName := C.CString("h264_v4l2m2m")
-	//defer C.free(unsafe.Pointer(codecName))
-	//codec := C.avcodec_find_decoder_by_name(codecName)
+// DecoderThreadType selects how a software decoder uses multiple threads
+type DecoderThreadType int
 
-	codec := C.avcodec_find_decoder(C.AV_CODEC_ID_H264)
-	if codec == nil {
-		return nil, fmt.Errorf("avcodec_find_decoder() failed")
-	}
+const (
+	DecoderThreadTypeDefault DecoderThreadType = C.DecoderThreadTypeDefault // Let ffmpeg decide
+	DecoderThreadTypeFrame   DecoderThreadType = C.DecoderThreadTypeFrame   // Decode multiple frames in parallel. Adds latency.
+	DecoderThreadTypeSlice   DecoderThreadType = C.DecoderThreadTypeSlice   // Decode the slices of a frame in parallel
+)
 
-	codecCtx := C.avcodec_alloc_context3(codec)
-	if codecCtx == nil {
-		return nil, fmt.Errorf("avcodec_alloc_context3() failed")
+// Parse a DecoderThreadType from config ("", "frame", or "slice")
+func ParseDecoderThreadType(s string) (DecoderThreadType, error) {
+	switch s {
+	case "":
+		return DecoderThreadTypeDefault, nil
+	case "frame":
+		return DecoderThreadTypeFrame, nil
+	case "slice":
+		return DecoderThreadTypeSlice, nil
 	}
+	return DecoderThreadTypeDefault, fmt.Errorf("Invalid decoder thread type '%v' (must be frame or slice)", s)
+}
 
-	res := C.avcodec_open2(codecCtx, codec, nil)
-	if res < 0 {
-		C.avcodec_close(codecCtx)
-		return nil, fmt.Errorf("avcodec_open2() failed: %v", res)
+// DecoderOptions control how an H264Decoder is created
+type DecoderOptions struct {
+	Codec         Codec             // H264 (the default) or H265
+	AllowHardware bool              // Probe for v4l2m2m and VAAPI before falling back to software
+	Fast          bool              // Lower quality, faster decode (skip the loop filter). Useful for thumbnails.
+	Threads       int               // 0 = let ffmpeg decide. Use 1 for many small streams, to avoid oversubscribing the CPU.
+	ThreadType    DecoderThreadType // Frame or slice threading
+	LowDelay      bool              // Emit frames as soon as possible, for live view. Disables frame threading.
+	Stats         *PipelineStats    // If not nil, decode and scale times are recorded here
+}
+
+// Output size and format of a frameScaler
+type scalerTarget struct {
+	width  int
+	height int
+	format C.int
+}
+
+// frameScaler converts decoded frames to a fixed output size and format
+type frameScaler struct {
+	srcWidth  C.int
+	srcHeight C.int
+	srcFormat C.int
+	swsCtx    *C.struct_SwsContext
+	dstFrame  *C.AVFrame
+}
+
+func (s *frameScaler) free() {
+	if s.dstFrame != nil {
+		C.av_frame_free(&s.dstFrame)
+	}
+	if s.swsCtx != nil {
+		C.sws_freeContext(s.swsCtx)
+		s.swsCtx = nil
 	}
+}
+
+// NewH264Decoder allocates a new H264Decoder.
+// We use a hardware decoder if one is available.
+func NewH264Decoder() (*H264Decoder, error) {
+	return NewH264DecoderWithOptions(DecoderOptions{AllowHardware: true})
+}
 
-	srcFrame := C.av_frame_alloc()
-	if srcFrame == nil {
-		C.avcodec_close(codecCtx)
-		return nil, fmt.Errorf("av_frame_alloc() failed")
+// NewH264DecoderWithOptions allocates a new H264Decoder.
+func NewH264DecoderWithOptions(options DecoderOptions) (*H264Decoder, error) {
+	copts := C.DecoderOptions{
+		Codec: C.int(options.Codec),
+	}
+	if options.AllowHardware {
+		copts.AllowHardware = 1
+	}
+	if options.Fast {
+		copts.Fast = 1
+	}
+	copts.ThreadCount = C.int(options.Threads)
+	copts.ThreadType = C.int(options.ThreadType)
+	if options.LowDelay {
+		copts.LowDelay = 1
+	}
+	copts.Stats = options.Stats.cptr()
+	var cerr *C.char
+	decoder := C.MakeDecoder(&cerr, &copts)
+	if err := takeCErr(cerr); err != nil {
+		return nil, err
 	}
 
 	return &H264Decoder{
-		codecCtx: codecCtx,
-		srcFrame: srcFrame,
+		decoder: decoder,
+		codec:   options.Codec,
+		scalers: map[scalerTarget]*frameScaler{},
+		stats:   options.Stats,
 	}, nil
 }
 
+// Backend returns the name of the decoder backend that is in use ("v4l2m2m", "vaapi", or "software")
+func (d *H264Decoder) Backend() string {
+	return C.GoString(C.Decoder_BackendName(d.decoder))
+}
+
 // close closes the decoder.
 func (d *H264Decoder) Close() {
-	if d.dstFrame != nil {
-		C.av_frame_free(&d.dstFrame)
-	}
-
-	if d.swsCtx != nil {
-		C.sws_freeContext(d.swsCtx)
+	for _, s := range d.scalers {
+		s.free()
 	}
+	d.scalers = nil
 
-	C.av_frame_free(&d.srcFrame)
-	C.avcodec_close(d.codecCtx)
+	C.Decoder_Close(d.decoder)
+	d.srcFrame = nil
 }
 
 // Send the packet to the decoder, but don't retrieve the next frame
@@ -109,23 +175,27 @@ func (d *H264Decoder) DecodeAndDiscard(nalu NALU) error {
 	return d.sendPacket(nalu)
 }
 
-// WARNING: The image returned is only valid while the decoder is still alive,
-// and it will be clobbered by the subsequent Decode()
-func (d *H264Decoder) Decode(nalu NALU) (image.Image, error) {
+// Send the NALU to the decoder, and receive the next frame into d.srcFrame.
+// Returns false if no frame is available yet.
+func (d *H264Decoder) receiveFrame(nalu NALU) (bool, error) {
 	if err := d.sendPacket(nalu); err != nil {
 		// sendPacket failure is not fatal
 		// We should log it or something.
 		// But it occurs normally during start of a stream, before first IDR has been seen.
 	}
 
-	if !IsVisualPacket(nalu.Type()) {
+	if !nalu.Kind(d.codec).IsVisual() {
 		// avcodec_receive_frame will return an error if we try to decode a frame when
 		// sending a non-visual NALU
-		return nil, nil
+		return false, nil
 	}
 
 	// receive frame if available
-	res := C.avcodec_receive_frame(d.codecCtx, d.srcFrame)
+	res := C.Decoder_ReceiveFrame(d.decoder, &d.srcFrame)
+	if res == -C.EAGAIN {
+		// Hardware decoders have a few frames of latency, so this is normal
+		return false, nil
+	}
 	if res < 0 {
 		// This special code path should no longer be necessary. We were decoding before SPS+PPS,
 		// and we were trying to extract a frame when sending future SPS+PPS.. so both those paths
@@ -135,64 +205,164 @@ func (d *H264Decoder) Decode(nalu NALU) (image.Image, error) {
 		//	// is this missing SPS + PPS prefixed to IDR?
 		//	return nil, nil
 		//}
-		return nil, fmt.Errorf("avcodec_receive_frame error %w", WrapAvErr(res))
+		return false, fmt.Errorf("avcodec_receive_frame error %w", WrapAvErr(res))
 	}
+	return true, nil
+}
 
-	// if frame size has changed, allocate needed objects
-	if d.dstFrame == nil || d.dstFrame.width != d.srcFrame.width || d.dstFrame.height != d.srcFrame.height {
-		if d.dstFrame != nil {
-			C.av_frame_free(&d.dstFrame)
-		}
+// WARNING: The image returned is only valid while the decoder is still alive,
+// and it will be clobbered by the subsequent Decode()
+func (d *H264Decoder) Decode(nalu NALU) (image.Image, error) {
+	img, err := d.DecodeScaled(nalu, 0, 0)
+	if img == nil {
+		// Don't return a typed nil inside a non-nil interface
+		return nil, err
+	}
+	return img, err
+}
 
-		if d.swsCtx != nil {
-			C.sws_freeContext(d.swsCtx)
-		}
+// DecodeScaled is like Decode, but the frame is scaled to width x height.
+// If width or height is zero, then it is computed from the other and the aspect ratio.
+// If both are zero, then the frame is not scaled.
+// Scaling during the YUV -> RGBA conversion means we never produce a full resolution RGBA frame.
+// WARNING: The image returned is only valid while the decoder is still alive,
+// and it will be clobbered by the subsequent Decode()
+func (d *H264Decoder) DecodeScaled(nalu NALU, width, height int) (*image.RGBA, error) {
+	if ok, err := d.receiveFrame(nalu); !ok {
+		return nil, err
+	}
+
+	width, height = scaledSize(int(d.srcFrame.width), int(d.srcFrame.height), width, height)
+	dst, err := d.scale(scalerTarget{width, height, C.AV_PIX_FMT_RGBA})
+	if err != nil {
+		return nil, err
+	}
+
+	//fmt.Printf("Got frame %v x %v\n", dst.width, dst.height)
+
+	// embed frame into an image.Image
+	stride := int(dst.linesize[0])
+	return &image.RGBA{
+		Pix:    unsafe.Slice((*uint8)(unsafe.Pointer(dst.data[0])), stride*height),
+		Stride: stride,
+		Rect: image.Rectangle{
+			Max: image.Point{width, height},
+		},
+	}, nil
+}
+
+// DecodeYCbCr is like Decode, but returns the decoder's native YUV 4:2:0 planes, without converting to RGB.
+// If the decoder produces some other YUV layout (eg NV12 from VAAPI), then we convert to YUV420P.
+// WARNING: The image returned is only valid while the decoder is still alive,
+// and it will be clobbered by the subsequent Decode() or DecodeYCbCr()
+func (d *H264Decoder) DecodeYCbCr(nalu NALU) (*image.YCbCr, error) {
+	if ok, err := d.receiveFrame(nalu); !ok {
+		return nil, err
+	}
+
+	if d.srcFrame.format == C.AV_PIX_FMT_YUV420P || d.srcFrame.format == C.AV_PIX_FMT_YUVJ420P {
+		return wrapYUV420Frame(d.srcFrame), nil
+	}
+
+	dst, err := d.scale(scalerTarget{int(d.srcFrame.width), int(d.srcFrame.height), C.AV_PIX_FMT_YUV420P})
+	if err != nil {
+		return nil, err
+	}
+	return wrapYUV420Frame(dst), nil
+}
+
+// Convert d.srcFrame to the given size and format, using a cached sws context
+func (d *H264Decoder) scale(target scalerTarget) (*C.AVFrame, error) {
+	s := d.scalers[target]
+	if s == nil {
+		s = &frameScaler{}
+		d.scalers[target] = s
+	}
 
-		d.dstFrame = C.av_frame_alloc()
-		d.dstFrame.format = C.AV_PIX_FMT_RGBA
-		d.dstFrame.width = d.srcFrame.width
-		d.dstFrame.height = d.srcFrame.height
-		d.dstFrame.color_range = C.AVCOL_RANGE_JPEG
-		res = C.av_frame_get_buffer(d.dstFrame, 1)
+	// if source frame size or format has changed, allocate needed objects
+	if s.swsCtx == nil || s.srcWidth != d.srcFrame.width || s.srcHeight != d.srcFrame.height || s.srcFormat != d.srcFrame.format {
+		s.free()
+
+		s.dstFrame = C.av_frame_alloc()
+		s.dstFrame.format = target.format
+		s.dstFrame.width = C.int(target.width)
+		s.dstFrame.height = C.int(target.height)
+		if target.format == C.AV_PIX_FMT_RGBA {
+			s.dstFrame.color_range = C.AVCOL_RANGE_JPEG
+		}
+		res := C.av_frame_get_buffer(s.dstFrame, 1)
 		if res < 0 {
+			s.free()
 			return nil, fmt.Errorf("av_frame_get_buffer() error %v", res)
 		}
 
-		d.swsCtx = C.sws_getContext(d.srcFrame.width, d.srcFrame.height, C.AV_PIX_FMT_YUV420P,
-			d.dstFrame.width, d.dstFrame.height, (int32)(d.dstFrame.format), C.SWS_BILINEAR, nil, nil, nil)
-		if d.swsCtx == nil {
+		// The source format depends on the backend (eg YUV420P for software, NV12 for VAAPI)
+		s.swsCtx = C.sws_getContext(d.srcFrame.width, d.srcFrame.height, int32(d.srcFrame.format),
+			s.dstFrame.width, s.dstFrame.height, (int32)(s.dstFrame.format), C.SWS_BILINEAR, nil, nil, nil)
+		if s.swsCtx == nil {
+			s.free()
 			return nil, fmt.Errorf("sws_getContext() error")
 		}
-
-		dstFrameSize := C.av_image_get_buffer_size((int32)(d.dstFrame.format), d.dstFrame.width, d.dstFrame.height, 1)
-		d.dstFramePtr = (*[1 << 30]uint8)(unsafe.Pointer(d.dstFrame.data[0]))[:dstFrameSize:dstFrameSize]
+		s.srcWidth = d.srcFrame.width
+		s.srcHeight = d.srcFrame.height
+		s.srcFormat = d.srcFrame.format
 	}
 
-	// convert frame from YUV420 to RGB
-	res = C.sws_scale(d.swsCtx, frameData(d.srcFrame), frameLineSize(d.srcFrame),
-		0, d.srcFrame.height, frameData(d.dstFrame), frameLineSize(d.dstFrame))
+	start := time.Now()
+	res := C.sws_scale(s.swsCtx, frameData(d.srcFrame), frameLineSize(d.srcFrame),
+		0, d.srcFrame.height, frameData(s.dstFrame), frameLineSize(s.dstFrame))
+	if d.stats != nil {
+		d.stats.observeScale(time.Since(start))
+	}
 	if res < 0 {
 		return nil, fmt.Errorf("sws_scale() error %v", res)
 	}
+	return s.dstFrame, nil
+}
 
-	//fmt.Printf("Got frame %v x %v\n", d.dstFrame.width, d.dstFrame.width)
+// Compute the output size for DecodeScaled
+func scaledSize(srcWidth, srcHeight, width, height int) (int, int) {
+	if width <= 0 && height <= 0 {
+		return srcWidth, srcHeight
+	}
+	if width <= 0 {
+		width = (srcWidth*height + srcHeight/2) / srcHeight
+	} else if height <= 0 {
+		height = (srcHeight*width + srcWidth/2) / srcWidth
+	}
+	if width < 1 {
+		width = 1
+	}
+	if height < 1 {
+		height = 1
+	}
+	return width, height
+}
 
-	// embed frame into an image.Image
-	return &image.RGBA{
-		Pix:    d.dstFramePtr,
-		Stride: 4 * (int)(d.dstFrame.width),
-		Rect: image.Rectangle{
-			Max: image.Point{(int)(d.dstFrame.width), (int)(d.dstFrame.height)},
-		},
-	}, nil
+// Wrap the planes of a YUV420P frame in an image.YCbCr, without copying
+func wrapYUV420Frame(frame *C.AVFrame) *image.YCbCr {
+	width := int(frame.width)
+	height := int(frame.height)
+	strideY := int(frame.linesize[0])
+	strideC := int(frame.linesize[1])
+	chromaHeight := (height + 1) / 2
+	return &image.YCbCr{
+		Y:              unsafe.Slice((*uint8)(unsafe.Pointer(frame.data[0])), strideY*height),
+		Cb:             unsafe.Slice((*uint8)(unsafe.Pointer(frame.data[1])), strideC*chromaHeight),
+		Cr:             unsafe.Slice((*uint8)(unsafe.Pointer(frame.data[2])), strideC*chromaHeight),
+		YStride:        strideY,
+		CStride:        strideC,
+		SubsampleRatio: image.YCbCrSubsampleRatio420,
+		Rect:           image.Rect(0, 0, width, height),
+	}
 }
 
 func (d *H264Decoder) Width() int {
-	return int(d.codecCtx.width)
+	return int(C.Decoder_Width(d.decoder))
 }
 
 func (d *H264Decoder) Height() int {
-	return int(d.codecCtx.height)
+	return int(C.Decoder_Height(d.decoder))
 }
 
 func (d *H264Decoder) sendPacket(nalu NALU) error {
@@ -204,12 +374,12 @@ func (d *H264Decoder) sendPacket(nalu NALU) error {
 	// and then passing that C struct to a C function. So to fix this, we need to define
 	// a helper function in C.
 	// d.avPacket.data = (*C.uint8_t)(unsafe.Pointer(&nalu.Payload[0]))
-	// This is why I created AvCodecSendPacket.
+	// This is why I created AvCodecSendPacket (and now Decoder_SendPacket).
 	// Using a Go struct for the C struct is anyway not future compatible, because the avcodec
 	// API is deprecating the fixed struct size, and rather moving to requiring the use of
 	// an alloc function to create a packet.
 
-	res := C.AvCodecSendPacket(d.codecCtx, unsafe.Pointer(&nalu.Payload[0]), C.ulong(len(nalu.Payload)))
+	res := C.Decoder_SendPacket(d.decoder, unsafe.Pointer(&nalu.Payload[0]), C.ulong(len(nalu.Payload)))
 	if res < 0 {
 		return fmt.Errorf("avcodec_send_packet failed: %v", res)
 	}
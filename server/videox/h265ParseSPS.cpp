@@ -0,0 +1,84 @@
+#include <string.h>
+#include "h265ParseSPS.h"
+#include "bitReader.h"
+
+// This follows the syntax tables in section 7.3 of the H.265 spec.
+// We only parse as far as the bit depths, which is all that the remuxer needs.
+
+static bool ParseH265SPSInternal(const uint8_t* buf, size_t len, H265SPSInfo* info) {
+	memset(info, 0, sizeof(*info));
+	if (len < 3)
+		return false;
+
+	BitReader r(buf + 2, len - 2); // skip the 2 byte NALU header (eg 42 01)
+
+	r.ReadBits(4); // sps_video_parameter_set_id
+	int maxSubLayersMinus1 = r.ReadBits(3);
+	r.ReadBit(); // sps_temporal_id_nesting_flag
+	info->MaxSubLayers = maxSubLayersMinus1 + 1;
+
+	// profile_tier_level(1, sps_max_sub_layers_minus1)
+	r.ReadBits(2); // general_profile_space
+	info->Tier       = r.ReadBit();
+	info->ProfileIDC = r.ReadBits(5);
+	r.ReadBits(32); // general_profile_compatibility_flag[32]
+	r.SkipBits(48); // progressive, interlaced, non_packed, frame_only, and 44 bits of constraint flags
+	info->LevelIDC = r.ReadBits(8);
+	bool subLayerProfile[8] = {};
+	bool subLayerLevel[8]   = {};
+	for (int i = 0; i < maxSubLayersMinus1; i++) {
+		subLayerProfile[i] = r.ReadBit();
+		subLayerLevel[i]   = r.ReadBit();
+	}
+	if (maxSubLayersMinus1 > 0) {
+		for (int i = maxSubLayersMinus1; i < 8; i++)
+			r.ReadBits(2); // reserved_zero_2bits
+	}
+	for (int i = 0; i < maxSubLayersMinus1; i++) {
+		if (subLayerProfile[i])
+			r.SkipBits(88);
+		if (subLayerLevel[i])
+			r.ReadBits(8); // sub_layer_level_idc
+	}
+
+	r.ReadUE(); // sps_seq_parameter_set_id
+	info->ChromaFormatIDC   = r.ReadUE();
+	int separateColourPlane = 0;
+	if (info->ChromaFormatIDC == 3)
+		separateColourPlane = r.ReadBit();
+	int width  = r.ReadUE(); // pic_width_in_luma_samples
+	int height = r.ReadUE(); // pic_height_in_luma_samples
+
+	int crop_left   = 0;
+	int crop_right  = 0;
+	int crop_top    = 0;
+	int crop_bottom = 0;
+	if (r.ReadBit()) { // conformance_window_flag
+		crop_left   = r.ReadUE();
+		crop_right  = r.ReadUE();
+		crop_top    = r.ReadUE();
+		crop_bottom = r.ReadUE();
+	}
+	info->BitDepthLuma   = r.ReadUE() + 8;
+	info->BitDepthChroma = r.ReadUE() + 8;
+	if (r.Overrun() || info->ChromaFormatIDC > 3)
+		return false;
+
+	// Conformance window offsets are in units of chroma samples (section 7.4.3.2.1)
+	int cropUnitX = 1;
+	int cropUnitY = 1;
+	if (!separateColourPlane && info->ChromaFormatIDC != 0) {
+		cropUnitX = info->ChromaFormatIDC == 3 ? 1 : 2;
+		cropUnitY = info->ChromaFormatIDC == 1 ? 2 : 1;
+	}
+	info->Width  = width - cropUnitX * (crop_left + crop_right);
+	info->Height = height - cropUnitY * (crop_top + crop_bottom);
+	return true;
+}
+
+extern "C" {
+
+int ParseH265SPSInfo(const void* buf, size_t len, H265SPSInfo* info) {
+	return ParseH265SPSInternal((const uint8_t*) buf, len, info) ? 1 : 0;
+}
+}
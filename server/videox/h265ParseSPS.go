@@ -0,0 +1,26 @@
+package videox
+
+import "unsafe"
+
+// #include "h265ParseSPS.h"
+import "C"
+
+// Parse a raw H265 SPS NALU (not annex-b)
+func ParseH265SPS(nalu []byte) (width, height int, err error) {
+	if len(nalu) == 0 {
+		return 0, 0, errInvalidNALU
+	}
+	var info C.H265SPSInfo
+	if C.ParseH265SPSInfo(unsafe.Pointer(&nalu[0]), C.size_t(len(nalu)), &info) == 0 {
+		return 0, 0, errInvalidNALU
+	}
+	return int(info.Width), int(info.Height), nil
+}
+
+// Parse a raw SPS NALU of the given codec (not annex-b)
+func ParseSPSOf(codec Codec, nalu []byte) (width, height int, err error) {
+	if codec == CodecH265 {
+		return ParseH265SPS(nalu)
+	}
+	return ParseSPS(nalu)
+}
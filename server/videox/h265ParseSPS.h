@@ -0,0 +1,26 @@
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct H265SPSInfo {
+	int Width;
+	int Height;
+	int ProfileIDC; // general_profile_idc, eg 1 = Main, 2 = Main 10
+	int Tier;       // general_tier_flag (0 = Main, 1 = High)
+	int LevelIDC;   // general_level_idc, which is 30 times the level (eg 93 = level 3.1)
+	int ChromaFormatIDC;
+	int BitDepthLuma;
+	int BitDepthChroma;
+	int MaxSubLayers;
+} H265SPSInfo;
+
+// buf is a raw H265 SPS NALU (not annex-b), starting with the 2 byte NALU header.
+// Returns 1 on success, or 0 if the SPS is invalid or truncated.
+int ParseH265SPSInfo(const void* buf, size_t len, H265SPSInfo* info);
+
+#ifdef __cplusplus
+}
+#endif
\ No newline at end of file
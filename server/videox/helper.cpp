@@ -5,22 +5,50 @@
 //}
 
 #include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include "helper.h"
+#include "h264ParseSPS.h"
+#include "h265ParseSPS.h"
 #include "tsf.hpp"
 
+using namespace tsf::literals;
+
 struct Encoder {
 	AVFormatContext* OutFormatCtx = nullptr;
 	AVOutputFormat*  Format       = nullptr;
-	AVCodec*         Codec        = nullptr;
-	AVCodecContext*  CodecCtx     = nullptr;
 	AVStream*        OutStream    = nullptr;
+	AVPacket*        Packet       = nullptr; // Reused for every packet that we write
 
-	//bool SeenSPS = false;
-	//bool SeenPPS = false;
+	std::string Filename;        // Only used by av_dump_format
+	int         FD         = -1; // If not -1, then we own the file, and write to it via custom IO (see OpenFileIO)
+	bool        Fragmented = false;
+	std::string Output; // Used by memory IO (see OpenMemoryIO). Drained by Encoder_Output + Encoder_ClearOutput.
 
+	VideoCodec  Codec      = VideoCodecH264;
 	bool        SentHeader = false;
-	std::string SPS;
-	std::string PPS;
+	std::string VPS; // Raw VPS (no annex-b prefix). H265 only.
+	std::string SPS; // Raw SPS (no annex-b prefix)
+	std::string PPS; // Raw PPS (no annex-b prefix)
+
+	// The sample (one access unit) that we're busy building up.
+	// For H264 this is in AVCC form (ie each NALU is preceded by a 4 byte length).
+	// For H265 it is annex-b, because the extradata is annex-b (see WriteHeader).
+	// This buffer is reused for every sample, so once it has grown to the size of the largest IDR, we stop allocating memory.
+	std::string Sample;
+	int64_t     SampleDTS = 0;
+	int64_t     SamplePTS = 0;
+	bool        SampleKey = false;
+
+	PipelineStats* Stats = nullptr; // If not null, write times are recorded here (see Encoder_SetStats)
 };
 
 struct EncoderCleanup {
@@ -31,10 +59,22 @@ struct EncoderCleanup {
 	~EncoderCleanup() {
 		if (!E)
 			return;
-		if (E->OutFormatCtx)
-			avformat_free_context(E->OutFormatCtx);
-		if (E->CodecCtx)
-			avcodec_free_context(&E->CodecCtx);
+		if (E->OutFormatCtx) {
+			auto ctx = E->OutFormatCtx;
+			if (ctx->flags & AVFMT_FLAG_CUSTOM_IO) {
+				if (ctx->pb) {
+					av_freep(&ctx->pb->buffer);
+					avio_context_free(&ctx->pb);
+				}
+			} else if (ctx->pb) {
+				avio_closep(&ctx->pb);
+			}
+			avformat_free_context(ctx);
+		}
+		if (E->FD != -1)
+			close(E->FD);
+		if (E->Packet)
+			av_packet_free(&E->Packet);
 		delete E;
 	}
 };
@@ -57,52 +97,6 @@ std::string AvErr(int e) {
 	return msg;
 }
 
-std::string WithPrefix(const void* nalu, size_t size) {
-	std::string s;
-	s.resize(size + 3);
-	s[0] = (char) 0;
-	s[1] = (char) 0;
-	s[2] = (char) 1;
-	memcpy(&s[3], nalu, size);
-	return s;
-}
-
-enum class H264PacketTypes {
-	// From nalutype.go in gortsplib
-	Unknown                       = 0,
-	NonIDR                        = 1,
-	DataPartitionA                = 2,
-	DataPartitionB                = 3,
-	DataPartitionC                = 4,
-	IDR                           = 5,
-	SEI                           = 6,
-	SPS                           = 7,
-	PPS                           = 8,
-	AccessUnitDelimiter           = 9,
-	EndOfSequence                 = 10,
-	EndOfStream                   = 11,
-	FillerData                    = 12,
-	SPSExtension                  = 13,
-	Prefix                        = 14,
-	SubsetSPS                     = 15,
-	Reserved16                    = 16,
-	Reserved17                    = 17,
-	Reserved18                    = 18,
-	SliceLayerWithoutPartitioning = 19,
-	SliceExtension                = 20,
-	SliceExtensionDepth           = 21,
-	Reserved22                    = 22,
-	Reserved23                    = 23,
-};
-
-bool IsVisualPacket(H264PacketTypes t) {
-	return (int) t >= 1 && (int) t <= 5;
-}
-
-H264PacketTypes GetH264PacketType(const uint8_t* buf) {
-	return (H264PacketTypes) (buf[0] & 31);
-}
-
 void AppendNalu(std::string& buf, const void* nalu, size_t size) {
 	buf += (char) 0;
 	buf += (char) 0;
@@ -110,15 +104,285 @@ void AppendNalu(std::string& buf, const void* nalu, size_t size) {
 	buf.append((const char*) nalu, size);
 }
 
-extern "C" {
+// Append a 4 byte big endian length, followed by the NALU
+void AppendAVCC(std::string& buf, const void* nalu, size_t size) {
+	buf += (char) (size >> 24);
+	buf += (char) (size >> 16);
+	buf += (char) (size >> 8);
+	buf += (char) size;
+	buf.append((const char*) nalu, size);
+}
+
+// Build an AVCDecoderConfigurationRecord (aka 'avcC') from a raw SPS and PPS.
+// This is the codec extradata that MP4 expects, and it's what allows us to write
+// the frames in AVCC form, without any SPS or PPS inside the frames.
+bool MakeAVCC(char** err, const std::string& sps, const std::string& pps, std::string& avcc) {
+	if (sps.size() < 4 || sps.size() > 0xffff || pps.size() > 0xffff) {
+		*err = strdup(tsf::fmt("Invalid SPS/PPS size (%v, %v)"_tsf, sps.size(), pps.size()).c_str());
+		return false;
+	}
+	avcc.clear();
+	avcc += (char) 1;    // configurationVersion
+	avcc += sps[1];      // AVCProfileIndication
+	avcc += sps[2];      // profile_compatibility
+	avcc += sps[3];      // AVCLevelIndication
+	avcc += (char) 0xff; // 6 bits reserved, 2 bits lengthSizeMinusOne (3, so our lengths are 4 bytes)
+	avcc += (char) 0xe1; // 3 bits reserved, 5 bits numOfSequenceParameterSets (1)
+	avcc += (char) (sps.size() >> 8);
+	avcc += (char) sps.size();
+	avcc += sps;
+	avcc += (char) 1; // numOfPictureParameterSets
+	avcc += (char) (pps.size() >> 8);
+	avcc += (char) pps.size();
+	avcc += pps;
+	return true;
+}
+
+// Populate codecpar from the parameter sets of an H264 stream
+bool SetH264Params(char** err, Encoder* encoder, std::string& extradata) {
+	if (!MakeAVCC(err, encoder->SPS, encoder->PPS, extradata))
+		return false;
+
+	int width = 0, height = 0;
+	ParseSPS(encoder->SPS.data(), encoder->SPS.size(), &width, &height);
+	if (width <= 0 || height <= 0) {
+		*err = strdup("Failed to parse width and height from SPS");
+		return false;
+	}
+
+	auto par     = encoder->OutStream->codecpar;
+	par->width   = width;
+	par->height  = height;
+	par->profile = (uint8_t) encoder->SPS[1]; // profile_idc
+	par->level   = (uint8_t) encoder->SPS[3]; // level_idc
+	return true;
+}
+
+// Populate codecpar from the parameter sets of an H265 stream.
+// Rather than building the hvcC box ourselves, we give the muxer annex-b VPS + SPS + PPS. The mov muxer knows how
+// to turn that into an hvcC, and once it sees annex-b extradata, it also converts every sample from annex-b.
+bool SetH265Params(char** err, Encoder* encoder, std::string& extradata) {
+	H265SPSInfo info;
+	if (!ParseH265SPSInfo(encoder->SPS.data(), encoder->SPS.size(), &info) || info.Width <= 0 || info.Height <= 0) {
+		*err = strdup("Failed to parse width and height from H265 SPS");
+		return false;
+	}
+	extradata.clear();
+	AppendNalu(extradata, encoder->VPS.data(), encoder->VPS.size());
+	AppendNalu(extradata, encoder->SPS.data(), encoder->SPS.size());
+	AppendNalu(extradata, encoder->PPS.data(), encoder->PPS.size());
+
+	auto par       = encoder->OutStream->codecpar;
+	par->width     = info.Width;
+	par->height    = info.Height;
+	par->profile   = info.ProfileIDC;
+	par->level     = info.LevelIDC;
+	par->codec_tag = MKTAG('h', 'v', 'c', '1'); // Parameter sets only in the hvcC, which is what Safari requires
+	return true;
+}
+
+// Populate codecpar from the parameter sets, and write the file header.
+// We can only do this once we've seen the parameter sets, which is why this doesn't happen inside MakeEncoder.
+bool WriteHeader(char** err, Encoder* encoder) {
+	std::string extradata;
+	bool        ok = encoder->Codec == VideoCodecH265 ? SetH265Params(err, encoder, extradata) : SetH264Params(err, encoder, extradata);
+	if (!ok)
+		return false;
+
+	auto par       = encoder->OutStream->codecpar;
+	par->extradata = (uint8_t*) av_mallocz(extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+	if (par->extradata == nullptr) {
+		*err = strdup("Failed to allocate extradata");
+		return false;
+	}
+	memcpy(par->extradata, extradata.data(), extradata.size());
+	par->extradata_size = (int) extradata.size();
+
+	AVDictionary* opts = nullptr;
+	if (encoder->Fragmented) {
+		// Every IDR starts a new fragment. The muxer writes out a fragment when it sees the IDR
+		// that follows it, so a crash will lose at most one fragment.
+		av_dict_set(&opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+	}
+	int e = avformat_write_header(encoder->OutFormatCtx, &opts);
+	av_dict_free(&opts);
+	if (e < 0) {
+		*err = strdup(tsf::fmt("avformat_write_header failed: %v"_tsf, AvErr(e)).c_str());
+		return false;
+	}
+
+	av_dump_format(encoder->OutFormatCtx, 0, encoder->Filename.c_str(), 1);
+
+	encoder->SentHeader = true;
+	return true;
+}
+
+// Write the sample that we've been building up, if any
+bool FlushSample(char** err, Encoder* encoder) {
+	if (encoder->Sample.size() == 0)
+		return true;
+
+	AVRational timeBase = encoder->OutStream->time_base;
+	auto       pkt      = encoder->Packet;
+	pkt->dts            = av_rescale_q(encoder->SampleDTS, AVRational{1, 1000000000}, timeBase);
+	pkt->pts            = av_rescale_q(encoder->SamplePTS, AVRational{1, 1000000000}, timeBase);
+	pkt->stream_index   = encoder->OutStream->id;
+	pkt->flags          = encoder->SampleKey ? AV_PKT_FLAG_KEY : 0;
+	pkt->data           = (uint8_t*) encoder->Sample.data();
+	pkt->size           = (int) encoder->Sample.size();
+
+	// We have only one stream, so there's nothing to interleave. av_write_frame is important here,
+	// because av_interleaved_write_frame will make an internal copy of our non-refcounted packet.
+	int64_t start = encoder->Stats ? StatsNow() : 0;
+	int     e     = av_write_frame(encoder->OutFormatCtx, pkt);
+	if (encoder->Stats)
+		StatsHistogram_Since(&encoder->Stats->EncoderWrite, start);
+
+	// clear() retains capacity, so we don't reallocate for the next sample
+	size_t size = encoder->Sample.size();
+	encoder->Sample.clear();
+	encoder->SampleKey = false;
+
+	if (e < 0) {
+		*err = strdup(tsf::fmt("Failed to write packet (len: %v), error: %v"_tsf, size, AvErr(e)).c_str());
+		return false;
+	}
+	return true;
+}
+
+// Add a NALU to the current sample.
+// Consecutive NALUs with the same DTS are joined into a single sample.
+// If naluPrefixLen is 3 or 4, then the annex-b prefix is stripped.
+// Returns false, and populates err, if the write failed
+bool AddNALU(char** err, Encoder* encoder, int64_t dts, int64_t pts, int naluPrefixLen, const void* _nalu, size_t naluLen) {
+	if (naluPrefixLen != 0 && naluPrefixLen != 3 && naluPrefixLen != 4) {
+		*err = strdup(tsf::fmt("Invalid naluPrefixLen %v. May only be one of: [0, 3, 4]"_tsf, naluPrefixLen).c_str());
+		return false;
+	}
+	if (naluLen <= (size_t) naluPrefixLen)
+		return true;
+
+	auto payload    = (const uint8_t*) _nalu + naluPrefixLen;
+	auto payloadLen = naluLen - naluPrefixLen;
+	if (payloadLen < NALUHeaderSize(encoder->Codec))
+		return true;
+	auto kind = NALUKindOf(encoder->Codec, payload);
+
+	// Parameter sets live in the codec extradata, so we don't need them inside the stream.
+	// assign() reuses our existing capacity, so this doesn't allocate when the camera re-sends them.
+	switch (kind) {
+	case NALUKindVPS: encoder->VPS.assign((const char*) payload, payloadLen); return true;
+	case NALUKindSPS: encoder->SPS.assign((const char*) payload, payloadLen); return true;
+	case NALUKindPPS: encoder->PPS.assign((const char*) payload, payloadLen); return true;
+	case NALUKindAUD: return true;
+	}
+
+	if (!encoder->SentHeader) {
+		// The file must start with the parameter sets and a keyframe. Anything before that is undecodable.
+		if (kind != NALUKindKeyframe || encoder->SPS.size() == 0 || encoder->PPS.size() == 0)
+			return true;
+		if (encoder->Codec == VideoCodecH265 && encoder->VPS.size() == 0)
+			return true;
+		if (!WriteHeader(err, encoder))
+			return false;
+	}
 
-// 2048 x 1536
-void* MakeEncoder(char** err, const char* format, const char* filename, int width, int height) {
-	//av_register_all();
-	//avcodec_register_all();
+	if (encoder->Sample.size() != 0 && dts != encoder->SampleDTS) {
+		if (!FlushSample(err, encoder))
+			return false;
+	}
 
-	int  e     = 0;
-	auto codec = AV_CODEC_ID_H264;
+	if (encoder->Sample.size() == 0) {
+		encoder->SampleDTS = dts;
+		encoder->SamplePTS = pts;
+	}
+	if (kind == NALUKindKeyframe)
+		encoder->SampleKey = true;
+
+	if (encoder->Codec == VideoCodecH265)
+		AppendNalu(encoder->Sample, payload, payloadLen);
+	else
+		AppendAVCC(encoder->Sample, payload, payloadLen);
+	return true;
+}
+
+// avio write callback for an Encoder that owns its file descriptor
+int WriteToFD(void* opaque, uint8_t* buf, int size) {
+	auto encoder = (Encoder*) opaque;
+	int  remain  = size;
+	while (remain > 0) {
+		ssize_t n = write(encoder->FD, buf, remain);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return AVERROR(errno);
+		}
+		buf += n;
+		remain -= (int) n;
+	}
+	return size;
+}
+
+// Open filename ourselves, instead of via avio_open2, so that we have the file descriptor, and can fsync it.
+bool OpenFileIO(char** err, Encoder* encoder, const char* filename) {
+	encoder->FD = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0660);
+	if (encoder->FD == -1) {
+		*err = strdup(tsf::fmt("Failed to open %v: %v"_tsf, filename, strerror(errno)).c_str());
+		return false;
+	}
+	const int bufSize = 64 * 1024;
+	auto      buf     = (uint8_t*) av_malloc(bufSize);
+	if (buf == nullptr) {
+		*err = strdup("Failed to allocate IO buffer");
+		return false;
+	}
+	auto pb = avio_alloc_context(buf, bufSize, 1, encoder, nullptr, WriteToFD, nullptr);
+	if (pb == nullptr) {
+		av_free(buf);
+		*err = strdup("Failed to allocate IO context");
+		return false;
+	}
+	encoder->OutFormatCtx->pb = pb;
+	encoder->OutFormatCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
+	encoder->Filename = filename;
+	return true;
+}
+
+// avio write callback for an Encoder that writes into memory
+int WriteToMemory(void* opaque, uint8_t* buf, int size) {
+	auto encoder = (Encoder*) opaque;
+	encoder->Output.append((const char*) buf, size);
+	return size;
+}
+
+// Write into encoder->Output, which the caller drains as it fills up.
+// The output is not seekable, so this should only be used with fragmented MP4.
+bool OpenMemoryIO(char** err, Encoder* encoder) {
+	const int bufSize = 64 * 1024;
+	auto      buf     = (uint8_t*) av_malloc(bufSize);
+	if (buf == nullptr) {
+		*err = strdup("Failed to allocate IO buffer");
+		return false;
+	}
+	auto pb = avio_alloc_context(buf, bufSize, 1, encoder, nullptr, WriteToMemory, nullptr);
+	if (pb == nullptr) {
+		av_free(buf);
+		*err = strdup("Failed to allocate IO context");
+		return false;
+	}
+	encoder->OutFormatCtx->pb = pb;
+	encoder->OutFormatCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
+	encoder->Filename = "memory";
+	return true;
+}
+
+// Create an Encoder that only remuxes.
+// The packets are already encoded, so there's no need for an AVCodecContext. Instead, we populate codecpar directly,
+// and the stream parameters (width, height, profile, level) are filled in from the SPS when we write the header.
+// The caller must still setup the output IO.
+Encoder* NewRemuxer(char** err, const char* format, int codec) {
+	if (codec != VideoCodecH264 && codec != VideoCodecH265)
+		RETURN_STR(tsf::fmt("Invalid codec %v"_tsf, codec));
 
 	auto           encoder = new Encoder();
 	EncoderCleanup cleanup(encoder);
@@ -130,190 +394,268 @@ void* MakeEncoder(char** err, const char* format, const char* filename, int widt
 	if (avformat_alloc_output_context2(&encoder->OutFormatCtx, encoder->Format, nullptr, nullptr) < 0)
 		RETURN_ERROR("Failed to allocate output context");
 
-	encoder->Codec = avcodec_find_encoder(codec);
-	if (encoder->Codec == nullptr)
-		RETURN_ERROR("Failed to find codec");
-
-	encoder->CodecCtx = avcodec_alloc_context3(encoder->Codec);
-	if (encoder->CodecCtx == nullptr)
-		RETURN_ERROR("Failed to allocate codec context");
+	encoder->Packet = av_packet_alloc();
+	if (encoder->Packet == nullptr)
+		RETURN_ERROR("Failed to allocate packet");
 
-	encoder->OutStream = avformat_new_stream(encoder->OutFormatCtx, encoder->Codec);
+	encoder->OutStream = avformat_new_stream(encoder->OutFormatCtx, nullptr);
 	if (encoder->OutStream == nullptr)
 		RETURN_ERROR("Failed to allocate output format stream");
 
-	encoder->OutStream->codecpar->codec_id   = codec;
+	encoder->Codec                           = (VideoCodec) codec;
+	encoder->OutStream->codecpar->codec_id   = codec == VideoCodecH265 ? AV_CODEC_ID_HEVC : AV_CODEC_ID_H264;
 	encoder->OutStream->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
-	encoder->OutStream->codecpar->width      = width;
-	encoder->OutStream->codecpar->height     = height;
 	encoder->OutStream->codecpar->format     = AV_PIX_FMT_YUV420P;
-	encoder->OutStream->codecpar->bit_rate   = 400000;
 	encoder->OutStream->time_base            = AVRational{1, 1000000};
-	encoder->CodecCtx->time_base             = AVRational{1, 1000000};
 
-	if (avcodec_parameters_to_context(encoder->CodecCtx, encoder->OutStream->codecpar) < 0)
-		RETURN_ERROR("avcodec_parameters_to_context failed");
+	cleanup.E = nullptr;
+	return encoder;
+}
+
+// Syncer runs fdatasync on a background thread, so that a slow disk doesn't stall the stream.
+// Every fd that we're given is dup'ed, so the caller is free to close their copy immediately.
+struct Syncer {
+	std::mutex              Lock;
+	std::condition_variable CV;
+	std::vector<int>        Queue;
+	bool                    Exit = false;
+	std::thread             Thread;
+
+	Syncer() {
+		Thread = std::thread([this]() { Run(); });
+	}
+
+	~Syncer() {
+		{
+			std::lock_guard<std::mutex> lock(Lock);
+			Exit = true;
+		}
+		CV.notify_one();
+		Thread.join();
+	}
+
+	void Sync(int fd) {
+		int dupped = dup(fd);
+		if (dupped == -1)
+			return;
+		{
+			std::lock_guard<std::mutex> lock(Lock);
+			Queue.push_back(dupped);
+		}
+		CV.notify_one();
+	}
+
+	void Run() {
+		std::vector<int> work;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(Lock);
+				CV.wait(lock, [this]() { return Exit || Queue.size() != 0; });
+				if (Queue.size() == 0 && Exit)
+					return;
+				work.swap(Queue);
+			}
+			for (int fd : work) {
+				fdatasync(fd);
+				close(fd);
+			}
+			work.clear();
+		}
+	}
+};
+
+// Recorder writes a continuous stream into a sequence of fragmented MP4 files.
+// Parameter sets are carried over from one segment to the next, so a new segment can begin on any keyframe.
+struct Recorder {
+	std::string                           Format;
+	int                                   Codec   = VideoCodecH264;
+	Encoder*                              Current = nullptr; // Segment that we're busy writing
+	Syncer                                Sync;
+	std::chrono::steady_clock::duration   SyncInterval;
+	std::chrono::steady_clock::time_point LastSync;
+	PipelineStats*                        Stats = nullptr; // Given to every segment's encoder
+
+	// Only used by Recorder_OnAccessUnit
+	std::string              SegmentRoot;
+	int64_t                  SegmentDuration = 0; // Nanoseconds
+	int64_t                  SegmentStart    = 0; // PTS of the first access unit in the current segment
+	bool                     HaveSegment     = false;
+	std::vector<EncoderNALU> NALUs;     // Scratch space for the NALUs of one access unit
+	std::mutex               ErrorLock; // Guards LastError, because Recorder_OnAccessUnit runs on the ingest thread
+	std::string              LastError;
+};
+
+// Split an annex-b buffer into NALUs, all with the given pts
+static void SplitAnnexB(const uint8_t* buf, size_t size, int64_t pts, std::vector<EncoderNALU>& nalus) {
+	nalus.clear();
+	size_t i = 0;
+	while (i + 3 <= size) {
+		// Find the next start code, which is either 00 00 01 or 00 00 00 01
+		size_t prefix = 0;
+		if (buf[i] == 0 && buf[i + 1] == 0 && buf[i + 2] == 1)
+			prefix = 3;
+		else if (i + 4 <= size && buf[i] == 0 && buf[i + 1] == 0 && buf[i + 2] == 0 && buf[i + 3] == 1)
+			prefix = 4;
+		if (prefix == 0) {
+			i++;
+			continue;
+		}
+		if (!nalus.empty())
+			nalus.back().Size = i - ((const uint8_t*) nalus.back().Data - buf);
+		nalus.push_back({buf + i, 0, (int) prefix, pts, pts});
+		i += prefix;
+	}
+	if (!nalus.empty())
+		nalus.back().Size = size - ((const uint8_t*) nalus.back().Data - buf);
+}
+
+// Create dir and all of its parents
+static bool MakeDirs(const std::string& dir) {
+	for (size_t i = 1; i <= dir.size(); i++) {
+		if (i == dir.size() || dir[i] == '/') {
+			if (mkdir(dir.substr(0, i).c_str(), 0777) != 0 && errno != EEXIST)
+				return false;
+		}
+	}
+	return true;
+}
 
-	encoder->CodecCtx->profile = FF_PROFILE_H264_HIGH;
-	if (encoder->OutFormatCtx->oformat->flags & AVFMT_GLOBALHEADER)
-		encoder->CodecCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+// Same naming scheme as camera.VideoRecorder
+static std::string SegmentFilename(const std::string& root) {
+	time_t    now = time(nullptr);
+	struct tm t;
+	localtime_r(&now, &t);
+	char name[64];
+	strftime(name, sizeof(name), "%Y-%m/%d/%H-%M-%S.mp4", &t);
+	return root + "/" + name;
+}
 
-	if (avcodec_parameters_from_context(encoder->OutStream->codecpar, encoder->CodecCtx) < 0)
-		RETURN_ERROR("avcodec_parameters_from_context failed");
+// Finish the current segment, if any
+bool FinishSegment(char** err, Recorder* recorder) {
+	if (recorder->Current == nullptr)
+		return true;
+	EncoderCleanup cleanup(recorder->Current);
+	recorder->Current = nullptr;
+	if (!cleanup.E->SentHeader) {
+		// Nothing was written, so there's no point in keeping the file
+		unlink(cleanup.E->Filename.c_str());
+		return true;
+	}
+	if (!FlushSample(err, cleanup.E))
+		return false;
+	int e = av_write_trailer(cleanup.E->OutFormatCtx);
+	if (e < 0) {
+		*err = strdup(tsf::fmt("av_write_trailer failed: %v"_tsf, AvErr(e)).c_str());
+		return false;
+	}
+	recorder->Sync.Sync(cleanup.E->FD);
+	return true;
+}
 
-	if (avcodec_open2(encoder->CodecCtx, encoder->Codec, nullptr) < 0)
-		RETURN_ERROR("avcodec_open2 failed");
+extern "C" {
 
-	if (!!(encoder->CodecCtx->flags & AVFMT_NOFILE))
-		RETURN_ERROR("codec does not write to a file");
+// Create an Encoder that remuxes H264 or H265 packets (see VideoCodec) into filename.
+// No codec is opened, because the packets are already encoded.
+void* MakeEncoder(char** err, const char* format, int codec, const char* filename) {
+	auto encoder = NewRemuxer(err, format, codec);
+	if (encoder == nullptr)
+		return nullptr;
+	EncoderCleanup cleanup(encoder);
 
-	e = avio_open2(&encoder->OutFormatCtx->pb, filename, AVIO_FLAG_WRITE, nullptr, nullptr);
+	int e = avio_open2(&encoder->OutFormatCtx->pb, filename, AVIO_FLAG_WRITE, nullptr, nullptr);
 	if (e < 0)
-		RETURN_STR(tsf::fmt("avio_open2(%v) failed: %v", filename, AvErr(e)));
+		RETURN_STR(tsf::fmt("avio_open2(%v) failed: %v"_tsf, filename, AvErr(e)));
 
-	if (avformat_write_header(encoder->OutFormatCtx, nullptr) < 0)
-		RETURN_ERROR("Error avformat_write_header");
+	// We only write the header once we've seen the parameter sets (see WriteHeader)
+	encoder->Filename = filename;
 
-	av_dump_format(encoder->OutFormatCtx, 0, filename, 1);
+	cleanup.E = nullptr; // allow Encoder to survive
+	return encoder;
+}
+
+// Create an Encoder that remuxes H264 or H265 packets into fragmented MP4 in memory.
+// Use Encoder_Output and Encoder_ClearOutput to drain the output as you write packets.
+void* MakeMemoryEncoder(char** err, const char* format, int codec) {
+	auto encoder = NewRemuxer(err, format, codec);
+	if (encoder == nullptr)
+		return nullptr;
+	EncoderCleanup cleanup(encoder);
+
+	if (!OpenMemoryIO(err, encoder))
+		return nullptr;
+	encoder->Fragmented = true;
 
 	cleanup.E = nullptr; // allow Encoder to survive
 	return encoder;
 }
 
+// Return the output of a memory encoder that has not yet been cleared.
+// Any bytes still sitting in the avio buffer are flushed out first.
+// The returned pointer is valid until the next call into the encoder.
+const void* Encoder_Output(void* _encoder, size_t* size) {
+	auto encoder = (Encoder*) _encoder;
+	if (encoder->SentHeader)
+		avio_flush(encoder->OutFormatCtx->pb);
+	*size = encoder->Output.size();
+	return encoder->Output.data();
+}
+
+// Discard the output of a memory encoder. The buffer's memory is retained for reuse.
+void Encoder_ClearOutput(void* _encoder) {
+	auto encoder = (Encoder*) _encoder;
+	encoder->Output.clear();
+}
+
 void Encoder_Close(void* _encoder) {
 	// when EncoderCleanup goes out of scope, it will clean up
 	EncoderCleanup cleanup((Encoder*) _encoder);
 }
 
-// Iff naluPrefixLen == 0, then we prepend 00 00 01 to the nalu
+// naluPrefixLen may be 0, 3, or 4. Any annex-b prefix is stripped, because we write the MP4 frames in AVCC form
+// (or with a consistent 3 byte prefix, in the case of H265).
+// Every call produces a new frame, so if you have multiple NALUs in an access unit,
+// prefer Encoder_WritePackets, which will join them into a single frame.
 void Encoder_WritePacket(char** err, void* _encoder, int64_t dts, int64_t pts, int naluPrefixLen, const void* _nalu, size_t naluLen) {
-	auto encoder    = (Encoder*) _encoder;
-	auto nalu       = (const uint8_t*) _nalu;
-	auto payload    = nalu + naluPrefixLen;
-	auto packetType = GetH264PacketType(payload);
-	//if (packetType == H264PacketTypes::SPS && encoder->SeenSPS)
-	//	return;
-	//if (packetType == H264PacketTypes::PPS && encoder->SeenPPS)
-	//	return;
-	if (naluPrefixLen != 0 && naluPrefixLen != 3 && naluPrefixLen != 4) {
-		*err = strdup(tsf::fmt("Invalid naluPrefixLen %v. May only be one of: [0, 3, 4]", naluPrefixLen).c_str());
-		return;
-	}
-
-	if (packetType == H264PacketTypes::SPS) {
-		if (naluPrefixLen)
-			encoder->SPS.assign((const char*) _nalu, naluLen);
-		else
-			encoder->SPS = WithPrefix(_nalu, naluLen);
-		return;
-	}
-	if (packetType == H264PacketTypes::PPS) {
-		if (naluPrefixLen)
-			encoder->PPS.assign((const char*) _nalu, naluLen);
-		else
-			encoder->PPS = WithPrefix(_nalu, naluLen);
-		return;
-	}
-	if ((encoder->SPS.size() == 0 || encoder->PPS.size() == 0) && IsVisualPacket(packetType)) {
-		// The codec/format needs SPS and PPS before any frames, so we can't write frames yet
+	auto encoder = (Encoder*) _encoder;
+	if (!AddNALU(err, encoder, dts, pts, naluPrefixLen, _nalu, naluLen))
 		return;
-	}
+	FlushSample(err, encoder);
+}
 
-	AVRational timeBase = encoder->OutStream->time_base;
-	auto       pkt      = av_packet_alloc();
-	pkt->dts            = av_rescale_q(dts, AVRational{1, 1000000000}, timeBase);
-	pkt->pts            = av_rescale_q(pts, AVRational{1, 1000000000}, timeBase);
-	//tsf::print("dts: %v, pts: %v\n", pkt->dts, pkt->pts);
-	//pkt->data         = nalu;
-	//pkt->size         = (int) naluLen + 3;
-	pkt->stream_index = encoder->OutStream->id;
-	if (packetType == H264PacketTypes::IDR)
-		pkt->flags |= AV_PKT_FLAG_KEY;
-
-	// copy is our temporary buffer, should we need it
-	std::string copy;
-
-	if (packetType == H264PacketTypes::IDR && !encoder->SentHeader) {
-		const auto& sps = encoder->SPS;
-		const auto& pps = encoder->PPS;
-
-		// I don't yet know why, but this is the only way I can get ffmpeg to produce a valid
-		// mp4 file. The first packet we send it must be SPS + PPS + Keyframe.
-		// It is not sufficient to merely send SPS, then PPS, then Keyframe.
-		// I suspect this is something to do with the fact that MP4 stores this information not in the stream,
-		// but inside a once-off header in the file. However, I can't find an explicit ffmpeg
-		// API call to "write SPS + PPS". Perhaps this is just idomatic... or perhaps it's
-		// a hack that just works. But whatever the case, it's the first magic combination that
-		// I could find which just worked.
-
-		//uint8_t* side = av_packet_new_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, sps.size() + pps.size());
-		//memcpy(side, sps.data(), sps.size());
-		//memcpy(side + sps.size(), pps.data(), pps.size());
-		int extraBytes = 0;
-		if (naluPrefixLen == 0)
-			extraBytes = 3;
-		copy.resize(sps.size() + encoder->PPS.size() + extraBytes + naluLen);
-		size_t offset = 0;
-
-		memcpy(&copy[offset], sps.data(), sps.size());
-		offset += sps.size();
-
-		memcpy(&copy[offset], pps.data(), pps.size());
-		offset += pps.size();
-
-		if (naluPrefixLen == 0) {
-			memcpy(&copy[offset], "\x00\x00\x01", 3);
-			offset += 3;
-		}
-		memcpy(&copy[offset], _nalu, naluLen);
-
-		pkt->data           = (uint8_t*) copy.data();
-		pkt->size           = (int) copy.size();
-		encoder->SentHeader = true;
-	} else {
-		if (naluPrefixLen == 0) {
-			copy.resize(3 + naluLen);
-			memcpy(&copy[0], "\x00\x00\x01", 3);
-			memcpy(&copy[3], _nalu, naluLen);
-			pkt->data = (uint8_t*) copy.data();
-			pkt->size = (int) copy.size();
-			//tsf::print("slow path\n");
-		} else {
-			// We want this to be our most common code path, where we don't need any memcpy
-			pkt->data = (uint8_t*) _nalu;
-			pkt->size = (int) naluLen;
-			//tsf::print("fast path\n");
-		}
+// Write many NALUs with a single call, to avoid the overhead of crossing the cgo boundary for every NALU.
+// Consecutive NALUs with the same DTS are joined into a single frame.
+// We stop at the first error.
+void Encoder_WritePackets(char** err, void* _encoder, const EncoderNALU* nalus, size_t nNALUs) {
+	auto encoder = (Encoder*) _encoder;
+	for (size_t i = 0; i < nNALUs; i++) {
+		const auto& n = nalus[i];
+		if (!AddNALU(err, encoder, n.DTS, n.PTS, n.PrefixLen, n.Data, n.Size))
+			return;
 	}
+	FlushSample(err, encoder);
+}
 
-	//int e = av_write_frame(encoder->OutFormatCtx, pkt);
-	int e = av_interleaved_write_frame(encoder->OutFormatCtx, pkt);
-	av_packet_free(&pkt);
-	if (e < 0) {
-		uint8_t bytes[4];
-		int     i = 0;
-		for (i = 0; i < sizeof(bytes) - 1 && nalu[i]; i++)
-			bytes[i] = nalu[i];
-		bytes[i] = 0;
-		*err     = strdup(tsf::fmt("Failed to write packet (%02x %02x %02x %02x ...) len: %v, error: %v", bytes[0], bytes[1], bytes[2], bytes[3], naluLen, AvErr(e)).c_str());
-	}
-	//free(buf);
-	//if (packetType == H264PacketTypes::SPS)
-	//	encoder->SeenSPS = true;
-	//if (packetType == H264PacketTypes::PPS)
-	//	encoder->SeenPPS = true;
+// Record the time spent writing packets into stats, which must outlive the encoder. stats may be NULL.
+void Encoder_SetStats(void* _encoder, PipelineStats* stats) {
+	((Encoder*) _encoder)->Stats = stats;
 }
 
 void Encoder_WriteTrailer(char** err, void* _encoder) {
 	auto encoder = (Encoder*) _encoder;
-	int  e       = av_write_trailer(encoder->OutFormatCtx);
+	if (!FlushSample(err, encoder))
+		return;
+	if (!encoder->SentHeader) {
+		*err = strdup("No keyframe was written");
+		return;
+	}
+	int e = av_write_trailer(encoder->OutFormatCtx);
 	if (e < 0) {
-		*err = strdup(tsf::fmt("av_write_trailer failed: %v", AvErr(e)).c_str());
+		*err = strdup(tsf::fmt("av_write_trailer failed: %v"_tsf, AvErr(e)).c_str());
 	}
 }
 
 void SetPacketDataPointer(void* _pkt, const void* buf, size_t bufLen) {
-	tsf::print("SetPacketDataPointer %v %v %v\n", _pkt, buf, bufLen);
+	tsf::print("SetPacketDataPointer %v %v %v\n"_tsf, _pkt, buf, bufLen);
 	AVPacket* pkt = (AVPacket*) _pkt;
 	pkt->data     = (uint8_t*) buf;
 	pkt->size     = (int) bufLen;
@@ -334,4 +676,140 @@ int AvCodecSendPacket(AVCodecContext* ctx, const void* buf, size_t bufLen) {
 	av_packet_free(&pkt);
 	return res;
 }
+
+void* MakeRecorder(char** err, const char* format, int codec, int syncIntervalMS) {
+	if (codec != VideoCodecH264 && codec != VideoCodecH265) {
+		*err = strdup(tsf::fmt("Invalid codec %v"_tsf, codec).c_str());
+		return nullptr;
+	}
+	auto recorder          = new Recorder();
+	recorder->Format       = format;
+	recorder->Codec        = codec;
+	recorder->SyncInterval = std::chrono::milliseconds(syncIntervalMS);
+	recorder->LastSync     = std::chrono::steady_clock::now();
+	return recorder;
+}
+
+// Finish the current segment, and start writing a new segment into filename.
+// The new segment will begin at the next keyframe, so you should call this immediately before
+// writing a packet that contains a keyframe.
+void Recorder_StartSegment(char** err, void* _recorder, const char* filename) {
+	auto recorder = (Recorder*) _recorder;
+
+	std::string vps, sps, pps;
+	if (recorder->Current) {
+		vps = recorder->Current->VPS;
+		sps = recorder->Current->SPS;
+		pps = recorder->Current->PPS;
+	}
+
+	if (!FinishSegment(err, recorder))
+		return;
+
+	auto encoder = NewRemuxer(err, recorder->Format.c_str(), recorder->Codec);
+	if (encoder == nullptr)
+		return;
+	EncoderCleanup cleanup(encoder);
+	if (!OpenFileIO(err, encoder, filename))
+		return;
+	encoder->Fragmented = true;
+	encoder->VPS        = vps;
+	encoder->SPS        = sps;
+	encoder->PPS        = pps;
+	encoder->Stats      = recorder->Stats;
+
+	recorder->Current = encoder;
+	cleanup.E         = nullptr;
+}
+
+// Write packets into the current segment.
+// If there is no current segment, then the packets are discarded.
+void Recorder_WritePackets(char** err, void* _recorder, const EncoderNALU* nalus, size_t nNALUs) {
+	auto recorder = (Recorder*) _recorder;
+	auto encoder  = recorder->Current;
+	if (encoder == nullptr)
+		return;
+
+	bool haveKeyframe = false;
+	for (size_t i = 0; i < nNALUs; i++) {
+		const auto& n = nalus[i];
+		if (n.Size > (size_t) n.PrefixLen && NALUKindOf(recorder->Codec, (const uint8_t*) n.Data + n.PrefixLen) == NALUKindKeyframe)
+			haveKeyframe = true;
+		if (!AddNALU(err, encoder, n.DTS, n.PTS, n.PrefixLen, n.Data, n.Size))
+			return;
+	}
+	if (!FlushSample(err, encoder))
+		return;
+
+	// A keyframe causes the muxer to write out the previous fragment, so this is the moment
+	// to push it out to the OS, and possibly to disk.
+	if (haveKeyframe && encoder->SentHeader) {
+		avio_flush(encoder->OutFormatCtx->pb);
+		auto now = std::chrono::steady_clock::now();
+		if (now - recorder->LastSync >= recorder->SyncInterval) {
+			recorder->Sync.Sync(encoder->FD);
+			recorder->LastSync = now;
+		}
+	}
+}
+
+// Finish the current segment, and destroy the recorder.
+// The recorder is destroyed even if an error is returned.
+void Recorder_Close(char** err, void* _recorder) {
+	auto recorder = (Recorder*) _recorder;
+	FinishSegment(err, recorder);
+	delete recorder;
+}
+
+// Record the time spent writing packets into stats, which must outlive the recorder. stats may be NULL.
+// This takes effect from the next segment.
+void Recorder_SetStats(void* _recorder, PipelineStats* stats) {
+	((Recorder*) _recorder)->Stats = stats;
+}
+
+// Make Recorder_OnAccessUnit write into root, starting a new segment on the first keyframe after segmentDurationMS.
+// Call this before adding the recorder as a sink.
+void Recorder_SetAutoSegment(void* _recorder, const char* root, int segmentDurationMS) {
+	auto recorder             = (Recorder*) _recorder;
+	recorder->SegmentRoot     = root;
+	recorder->SegmentDuration = (int64_t) segmentDurationMS * 1000000;
+}
+
+// Write an annex-b access unit, which is how the ingest engine delivers video (this is an IngestSinkFunc, see rtsp/ingest.h).
+// Segments are started automatically (see Recorder_SetAutoSegment).
+// There is nobody to return an error to, so errors are kept for Recorder_TakeError.
+void Recorder_OnAccessUnit(void* _recorder, const uint8_t* accessUnit, size_t size, int64_t pts, int keyframe) {
+	auto  recorder = (Recorder*) _recorder;
+	char* err      = nullptr;
+	if (keyframe && (!recorder->HaveSegment || pts - recorder->SegmentStart >= recorder->SegmentDuration)) {
+		auto filename = SegmentFilename(recorder->SegmentRoot);
+		if (!MakeDirs(filename.substr(0, filename.rfind('/'))))
+			err = strdup(tsf::fmt("Failed to create directory for %v: %v"_tsf, filename, strerror(errno)).c_str());
+		else
+			Recorder_StartSegment(&err, recorder, filename.c_str());
+		recorder->HaveSegment  = err == nullptr;
+		recorder->SegmentStart = pts;
+	}
+	if (err == nullptr && recorder->HaveSegment) {
+		SplitAnnexB(accessUnit, size, pts - recorder->SegmentStart, recorder->NALUs);
+		Recorder_WritePackets(&err, recorder, recorder->NALUs.data(), recorder->NALUs.size());
+	}
+	if (err != nullptr) {
+		std::lock_guard<std::mutex> lock(recorder->ErrorLock);
+		recorder->LastError = err;
+		free(err);
+	}
+}
+
+// Returns the most recent error from Recorder_OnAccessUnit, or null if there has been none since the last call.
+// The caller must free() the result.
+char* Recorder_TakeError(void* _recorder) {
+	auto                        recorder = (Recorder*) _recorder;
+	std::lock_guard<std::mutex> lock(recorder->ErrorLock);
+	if (recorder->LastError.empty())
+		return nullptr;
+	char* err = strdup(recorder->LastError.c_str());
+	recorder->LastError.clear();
+	return err;
+}
 }
\ No newline at end of file
@@ -9,6 +9,7 @@ import "C"
 import (
 	"errors"
 	"io"
+	"runtime"
 	"time"
 	"unsafe"
 )
@@ -28,16 +29,18 @@ func takeCErr(err *C.char) error {
 }
 
 type VideoEncoder struct {
-	enc unsafe.Pointer
+	enc    unsafe.Pointer
+	output io.Writer // Only used by memory encoders (see NewVideoEncoderWriter)
 }
 
-// NewVideoEncoder creates a new video encoder
+// NewVideoEncoder creates a new video encoder, which remuxes H264 or H265 packets into filename.
+// The stream parameters (eg width and height) are read from the first SPS.
 // You must Close() a video encoder when you are done using it, otherwise you will leak ffmpeg objects
-func NewVideoEncoder(format, filename string, width, height int) (*VideoEncoder, error) {
+func NewVideoEncoder(format string, codec Codec, filename string) (*VideoEncoder, error) {
 	var cerr *C.char
 	cFormat := C.CString(format)
 	cFilename := C.CString(filename)
-	e := C.MakeEncoder(&cerr, cFormat, cFilename, C.int(width), C.int(height))
+	e := C.MakeEncoder(&cerr, cFormat, C.int(codec), cFilename)
 	C.free(unsafe.Pointer(cFormat))
 	C.free(unsafe.Pointer(cFilename))
 	err := takeCErr(cerr)
@@ -49,6 +52,30 @@ func NewVideoEncoder(format, filename string, width, height int) (*VideoEncoder,
 	}, nil
 }
 
+// NewVideoEncoderWriter creates a video encoder that writes fragmented MP4 into output.
+// The muxer writes into a C memory buffer, which we drain into output after every write call,
+// so there's no need for a temporary file. Fragmented MP4 doesn't need a seekable output.
+// You must Close() a video encoder when you are done using it, otherwise you will leak ffmpeg objects
+func NewVideoEncoderWriter(format string, codec Codec, output io.Writer) (*VideoEncoder, error) {
+	var cerr *C.char
+	cFormat := C.CString(format)
+	e := C.MakeMemoryEncoder(&cerr, cFormat, C.int(codec))
+	C.free(unsafe.Pointer(cFormat))
+	err := takeCErr(cerr)
+	if err != nil {
+		return nil, err
+	}
+	return &VideoEncoder{
+		enc:    e,
+		output: output,
+	}, nil
+}
+
+// Record the time spent writing packets into stats
+func (v *VideoEncoder) SetStats(stats *PipelineStats) {
+	C.Encoder_SetStats(v.enc, stats.cptr())
+}
+
 func (v *VideoEncoder) Close() {
 	if v.enc != nil {
 		C.Encoder_Close(v.enc)
@@ -64,11 +91,75 @@ func (v *VideoEncoder) WritePacket(dts, pts time.Duration, nalu NALU) error {
 	if err := takeCErr(cerr); err != nil {
 		return err
 	}
-	return nil
+	return v.drainOutput()
+}
+
+// WritePackets writes a batch of packets with a single cgo call.
+// The DTS and PTS of every NALU is set to packet.H264PTS - baseTime.
+func (v *VideoEncoder) WritePackets(packets []*DecodedPacket, baseTime time.Duration) error {
+	var pinner runtime.Pinner
+	defer pinner.Unpin()
+	nalus := makeEncoderNALUs(&pinner, packets, baseTime)
+	if len(nalus) == 0 {
+		return nil
+	}
+	var cerr *C.char
+	C.Encoder_WritePackets(&cerr, v.enc, &nalus[0], C.size_t(len(nalus)))
+	if err := takeCErr(cerr); err != nil {
+		return err
+	}
+	return v.drainOutput()
+}
+
+// Flatten packets into an array of EncoderNALU, for Encoder_WritePackets and Recorder_WritePackets.
+// The NALU payloads are Go memory, so they're pinned before we store pointers to them.
+// You must keep pinner alive until C is finished with the returned array.
+func makeEncoderNALUs(pinner *runtime.Pinner, packets []*DecodedPacket, baseTime time.Duration) []C.EncoderNALU {
+	n := 0
+	for _, packet := range packets {
+		n += len(packet.H264NALUs)
+	}
+	nalus := make([]C.EncoderNALU, 0, n)
+	for _, packet := range packets {
+		t := C.int64_t((packet.H264PTS - baseTime).Nanoseconds())
+		for _, nalu := range packet.H264NALUs {
+			if len(nalu.Payload) == 0 {
+				continue
+			}
+			pinner.Pin(&nalu.Payload[0])
+			nalus = append(nalus, C.EncoderNALU{
+				Data:      unsafe.Pointer(&nalu.Payload[0]),
+				Size:      C.size_t(len(nalu.Payload)),
+				PrefixLen: C.int(nalu.PrefixLen),
+				DTS:       t,
+				PTS:       t,
+			})
+		}
+	}
+	return nalus
 }
 
 func (v *VideoEncoder) WriteTrailer() error {
 	var cerr *C.char
 	C.Encoder_WriteTrailer(&cerr, v.enc)
-	return takeCErr(cerr)
+	if err := takeCErr(cerr); err != nil {
+		return err
+	}
+	return v.drainOutput()
+}
+
+// Send whatever the muxer has produced so far to our io.Writer
+func (v *VideoEncoder) drainOutput() error {
+	if v.output == nil {
+		return nil
+	}
+	var size C.size_t
+	buf := C.Encoder_Output(v.enc, &size)
+	if size == 0 {
+		return nil
+	}
+	// io.Writer may not retain buf, so it's safe to hand it C memory directly
+	_, err := v.output.Write(unsafe.Slice((*byte)(buf), int(size)))
+	C.Encoder_ClearOutput(v.enc)
+	return err
 }
@@ -9,14 +9,42 @@ extern "C" {
 #include <libavformat/avformat.h>
 #include <libavformat/avio.h>
 
-void* MakeEncoder(char** err, const char* format, const char* filename, int width, int height);
+#include "nalu.h"
+#include "stats.h"
+
+// A single NALU, for use by Encoder_WritePackets.
+// PrefixLen has the same meaning as naluPrefixLen in Encoder_WritePacket.
+typedef struct EncoderNALU {
+	const void* Data;
+	size_t      Size;
+	int         PrefixLen;
+	int64_t     DTS;
+	int64_t     PTS;
+} EncoderNALU;
+
+void* MakeEncoder(char** err, const char* format, int codec, const char* filename);
 void  Encoder_Close(void* encoder);
 void  Encoder_WritePacket(char** err, void* encoder, int64_t dts, int64_t pts, int naluPrefixLen, const void* nalu, size_t naluLen);
+void  Encoder_WritePackets(char** err, void* encoder, const EncoderNALU* nalus, size_t nNALUs);
 void  Encoder_WriteTrailer(char** err, void* encoder);
+void  Encoder_SetStats(void* encoder, PipelineStats* stats);
 void  SetPacketDataPointer(void* pkt, const void* buf, size_t bufLen);
 char* GetAvErrorStr(int averr);
 int   AvCodecSendPacket(AVCodecContext* ctx, const void* buf, size_t bufLen);
 
+void*       MakeMemoryEncoder(char** err, const char* format, int codec);
+const void* Encoder_Output(void* encoder, size_t* size);
+void        Encoder_ClearOutput(void* encoder);
+
+void* MakeRecorder(char** err, const char* format, int codec, int syncIntervalMS);
+void  Recorder_StartSegment(char** err, void* recorder, const char* filename);
+void  Recorder_WritePackets(char** err, void* recorder, const EncoderNALU* nalus, size_t nNALUs);
+void  Recorder_Close(char** err, void* recorder);
+void  Recorder_SetAutoSegment(void* recorder, const char* root, int segmentDurationMS);
+void  Recorder_SetStats(void* recorder, PipelineStats* stats);
+void  Recorder_OnAccessUnit(void* recorder, const uint8_t* accessUnit, size_t size, int64_t pts, int keyframe);
+char* Recorder_TakeError(void* recorder);
+
 #ifdef __cplusplus
 }
 #endif
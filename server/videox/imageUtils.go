@@ -14,3 +14,53 @@ func cloneImage(srcImg image.Image) image.Image {
 	}
 	return dst
 }
+
+// Return a deep copy of a YCbCr image, reusing dst's memory if it has the same layout.
+// The copy has the same strides as src (padding included), so each plane is a single memcpy.
+func CloneYCbCr(dst *image.YCbCr, src *image.YCbCr) *image.YCbCr {
+	if dst == nil || !dst.Rect.Eq(src.Rect) || dst.SubsampleRatio != src.SubsampleRatio ||
+		dst.YStride != src.YStride || dst.CStride != src.CStride ||
+		len(dst.Y) != len(src.Y) || len(dst.Cb) != len(src.Cb) || len(dst.Cr) != len(src.Cr) {
+		dst = &image.YCbCr{
+			Y:              make([]byte, len(src.Y)),
+			Cb:             make([]byte, len(src.Cb)),
+			Cr:             make([]byte, len(src.Cr)),
+			YStride:        src.YStride,
+			CStride:        src.CStride,
+			SubsampleRatio: src.SubsampleRatio,
+			Rect:           src.Rect,
+		}
+	}
+	copy(dst.Y, src.Y)
+	copy(dst.Cb, src.Cb)
+	copy(dst.Cr, src.Cr)
+	return dst
+}
+
+// Return a copy of src that is half the width and height, using a 2x2 box filter.
+// src must be 4:2:0, and its Rect must start at the origin.
+func HalveYCbCr(src *image.YCbCr) *image.YCbCr {
+	sw := src.Rect.Dx()
+	sh := src.Rect.Dy()
+	dst := image.NewYCbCr(image.Rect(0, 0, max(sw/2, 1), max(sh/2, 1)), image.YCbCrSubsampleRatio420)
+	dw := dst.Rect.Dx()
+	dh := dst.Rect.Dy()
+	halvePlane(dst.Y, dst.YStride, dw, dh, src.Y, src.YStride, sw, sh)
+	halvePlane(dst.Cb, dst.CStride, (dw+1)/2, (dh+1)/2, src.Cb, src.CStride, (sw+1)/2, (sh+1)/2)
+	halvePlane(dst.Cr, dst.CStride, (dw+1)/2, (dh+1)/2, src.Cr, src.CStride, (sw+1)/2, (sh+1)/2)
+	return dst
+}
+
+// Average each 2x2 block of src into one pixel of dst. Odd edges are clamped.
+func halvePlane(dst []byte, dstStride, dw, dh int, src []byte, srcStride, sw, sh int) {
+	for y := 0; y < dh; y++ {
+		r0 := src[2*y*srcStride:]
+		r1 := src[min(2*y+1, sh-1)*srcStride:]
+		d := dst[y*dstStride : y*dstStride+dw]
+		for x := range d {
+			x0 := 2 * x
+			x1 := min(x0+1, sw-1)
+			d[x] = byte((int(r0[x0]) + int(r0[x1]) + int(r1[x0]) + int(r1[x1]) + 2) >> 2)
+		}
+	}
+}
@@ -0,0 +1,56 @@
+#include <string.h>
+#include <turbojpeg.h>
+#include "jpeg.h"
+#include "tsf.hpp"
+
+using namespace tsf::literals;
+
+// tjhandle is not thread safe, but it's expensive enough to create that we want to reuse it,
+// so every thread gets its own.
+struct TJCompressor {
+	tjhandle Handle = nullptr;
+	TJCompressor() {
+		Handle = tjInitCompress();
+	}
+	~TJCompressor() {
+		if (Handle)
+			tjDestroy(Handle);
+	}
+};
+
+static thread_local TJCompressor Compressor;
+
+extern "C" {
+
+// Compress YUV 4:2:0 planes directly to JPEG, without any colour space conversion.
+// The output must be freed with FreeJPEG. If stats is not NULL, the compression time is recorded into it.
+void CompressYUV420JPEG(char** err, const YUV420Planes* img, int quality, PipelineStats* stats, void** jpeg, size_t* jpegSize) {
+	*jpeg     = nullptr;
+	*jpegSize = 0;
+	if (Compressor.Handle == nullptr) {
+		*err = strdup("tjInitCompress failed");
+		return;
+	}
+
+	const unsigned char* planes[3]  = {img->Y, img->U, img->V};
+	int                  strides[3] = {img->StrideY, img->StrideUV, img->StrideUV};
+	unsigned char*       buf        = nullptr;
+	unsigned long        size       = 0;
+	int64_t              start      = stats ? StatsNow() : 0;
+	int                  e          = tjCompressFromYUVPlanes(Compressor.Handle, planes, img->Width, strides, img->Height, TJSAMP_420, &buf, &size, quality, 0);
+	if (stats)
+		StatsHistogram_Since(&stats->JPEG, start);
+	if (e != 0) {
+		*err = strdup(tsf::fmt("tjCompressFromYUVPlanes failed: %v"_tsf, tjGetErrorStr2(Compressor.Handle)).c_str());
+		if (buf)
+			tjFree(buf);
+		return;
+	}
+	*jpeg     = buf;
+	*jpegSize = size;
+}
+
+void FreeJPEG(void* jpeg) {
+	tjFree((unsigned char*) jpeg);
+}
+}
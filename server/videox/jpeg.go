@@ -0,0 +1,54 @@
+package videox
+
+// #cgo LDFLAGS: -lturbojpeg
+// #include <stdlib.h>
+// #include "jpeg.h"
+import "C"
+import (
+	"errors"
+	"image"
+	"runtime"
+	"unsafe"
+)
+
+// CompressYCbCrJPEG compresses a YUV 4:2:0 image directly to JPEG.
+// This avoids the YUV -> RGB -> YUV round trip that we'd get from compressing an RGB image.
+// If stats is not nil, the compression time is recorded into it.
+func CompressYCbCrJPEG(img *image.YCbCr, quality int, stats *PipelineStats) ([]byte, error) {
+	if img.SubsampleRatio != image.YCbCrSubsampleRatio420 {
+		return nil, errors.New("CompressYCbCrJPEG only supports 4:2:0 images")
+	}
+	if img.Rect.Min != (image.Point{}) {
+		return nil, errors.New("CompressYCbCrJPEG requires an image with origin (0,0)")
+	}
+	if img.Rect.Empty() {
+		return nil, errors.New("CompressYCbCrJPEG given an empty image")
+	}
+
+	// The planes may be Go memory, so we must pin them before storing their pointers in a C struct
+	var pinner runtime.Pinner
+	defer pinner.Unpin()
+	pinner.Pin(&img.Y[0])
+	pinner.Pin(&img.Cb[0])
+	pinner.Pin(&img.Cr[0])
+
+	planes := C.YUV420Planes{
+		Y:        (*C.uint8_t)(unsafe.Pointer(&img.Y[0])),
+		U:        (*C.uint8_t)(unsafe.Pointer(&img.Cb[0])),
+		V:        (*C.uint8_t)(unsafe.Pointer(&img.Cr[0])),
+		StrideY:  C.int(img.YStride),
+		StrideUV: C.int(img.CStride),
+		Width:    C.int(img.Rect.Dx()),
+		Height:   C.int(img.Rect.Dy()),
+	}
+	var cerr *C.char
+	var jpeg unsafe.Pointer
+	var jpegSize C.size_t
+	C.CompressYUV420JPEG(&cerr, &planes, C.int(quality), stats.cptr(), &jpeg, &jpegSize)
+	if err := takeCErr(cerr); err != nil {
+		return nil, err
+	}
+	out := C.GoBytes(jpeg, C.int(jpegSize))
+	C.FreeJPEG(jpeg)
+	return out, nil
+}
@@ -0,0 +1,25 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "stats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A YUV 4:2:0 image with 3 separate planes
+typedef struct YUV420Planes {
+	const uint8_t* Y;
+	const uint8_t* U;
+	const uint8_t* V;
+	int            StrideY;
+	int            StrideUV;
+	int            Width;
+	int            Height;
+} YUV420Planes;
+
+void CompressYUV420JPEG(char** err, const YUV420Planes* img, int quality, PipelineStats* stats, void** jpeg, size_t* jpegSize);
+void FreeJPEG(void* jpeg);
+
+#ifdef __cplusplus
+}
+#endif
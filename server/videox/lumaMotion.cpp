@@ -0,0 +1,290 @@
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "lumaMotion.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// LumaMotion detects change in the pixels of a decoded frame, by comparing its Y plane to a running
+// average of recent frames (the background). It works on a heavily downsampled copy of the plane,
+// because that's plenty to notice a person walking by, it smooths out sensor noise, and it keeps the
+// whole thing well under a millisecond on a Raspberry Pi.
+// The downsampling and the background comparison are the hot loops, so they have SSE2 and NEON kernels.
+// The background is 16 bits per pixel, in 8.7 fixed point. With 8 bits, small differences would be
+// rounded away, and a slow background (eg 1/32 per frame) would never converge.
+struct LumaMotion {
+	LumaMotionOptions           Options = {};
+	std::vector<LumaMotionRect> Exclusions;
+	int                         Width  = 0; // Size of the downsampled frame
+	int                         Height = 0; //
+	int                         Frames = 0; // Number of frames since the background was seeded
+
+	std::vector<uint8_t> Small;      // Downsampled frame, Width * Height
+	std::vector<uint8_t> Scratch;    // Intermediate halvings
+	std::vector<int16_t> Background; // 8.7 fixed point, Width * Height
+	std::vector<uint8_t> Include;    // 1 if the pixel is not excluded, Width * Height
+	std::vector<uint8_t> Mask;       // 1 if the pixel changed (and is not excluded), Width * Height
+	std::vector<int>     CellOfX;    // Grid column of every pixel column
+	std::vector<int>     CellOfY;    // Grid row of every pixel row
+	std::vector<int>     CellPixels; // Number of non-excluded pixels in each cell
+	std::vector<int>     CellCount;  // Number of changed pixels in each cell
+	std::vector<float>   Grid;       // CellCount / CellPixels
+};
+
+// If more than this fraction of the frame changes at once, we assume that the whole scene changed
+// (eg the lights went on, or the camera switched to IR), and start over.
+static const float GlobalChangeFraction = 0.6f;
+
+// Halve one row. r0 and r1 are two source rows, which are at least 2 * dw wide.
+static void HalveRow(const uint8_t* r0, const uint8_t* r1, uint8_t* dst, int dw) {
+	int x = 0;
+#if defined(__SSE2__)
+	const __m128i lowBytes = _mm_set1_epi16(0x00ff);
+	const __m128i one      = _mm_set1_epi16(1);
+	for (; x + 16 <= dw; x += 16) {
+		__m128i v0   = _mm_avg_epu8(_mm_loadu_si128((const __m128i*) (r0 + 2 * x)), _mm_loadu_si128((const __m128i*) (r1 + 2 * x)));
+		__m128i v1   = _mm_avg_epu8(_mm_loadu_si128((const __m128i*) (r0 + 2 * x + 16)), _mm_loadu_si128((const __m128i*) (r1 + 2 * x + 16)));
+		__m128i h0   = _mm_add_epi16(_mm_and_si128(v0, lowBytes), _mm_srli_epi16(v0, 8));
+		__m128i h1   = _mm_add_epi16(_mm_and_si128(v1, lowBytes), _mm_srli_epi16(v1, 8));
+		h0           = _mm_srli_epi16(_mm_add_epi16(h0, one), 1);
+		h1           = _mm_srli_epi16(_mm_add_epi16(h1, one), 1);
+		__m128i pack = _mm_packus_epi16(h0, h1);
+		_mm_storeu_si128((__m128i*) (dst + x), pack);
+	}
+#elif defined(__ARM_NEON)
+	for (; x + 16 <= dw; x += 16) {
+		uint8x16x2_t a = vld2q_u8(r0 + 2 * x); // de-interleaves even and odd pixels
+		uint8x16x2_t b = vld2q_u8(r1 + 2 * x);
+		vst1q_u8(dst + x, vrhaddq_u8(vrhaddq_u8(a.val[0], a.val[1]), vrhaddq_u8(b.val[0], b.val[1])));
+	}
+#endif
+	for (; x < dw; x++)
+		dst[x] = (uint8_t) ((r0[2 * x] + r0[2 * x + 1] + r1[2 * x] + r1[2 * x + 1] + 2) >> 2);
+}
+
+static void HalvePlane(const uint8_t* src, int sw, int sh, int sstride, uint8_t* dst, int dstride) {
+	int dw = sw / 2;
+	int dh = sh / 2;
+	for (int y = 0; y < dh; y++)
+		HalveRow(src + (2 * y) * sstride, src + (2 * y + 1) * sstride, dst + y * dstride, dw);
+}
+
+// Compare n pixels to the background, and move the background towards them.
+// mask[i] = 1 if pixel i differs from the background by more than threshold, and include[i] is 1.
+static void DiffRow(const uint8_t* cur, int16_t* bg, const uint8_t* include, uint8_t* mask, int n, int threshold, int shift) {
+	int x = 0;
+#if defined(__SSE2__)
+	const __m128i zero   = _mm_setzero_si128();
+	const __m128i thresh = _mm_set1_epi16((int16_t) (threshold << 7));
+	const __m128i count  = _mm_cvtsi32_si128(shift);
+	for (; x + 16 <= n; x += 16) {
+		__m128i c   = _mm_loadu_si128((const __m128i*) (cur + x));
+		__m128i b0  = _mm_loadu_si128((const __m128i*) (bg + x));
+		__m128i b1  = _mm_loadu_si128((const __m128i*) (bg + x + 8));
+		__m128i d0  = _mm_sub_epi16(_mm_slli_epi16(_mm_unpacklo_epi8(c, zero), 7), b0);
+		__m128i d1  = _mm_sub_epi16(_mm_slli_epi16(_mm_unpackhi_epi8(c, zero), 7), b1);
+		__m128i a0  = _mm_max_epi16(d0, _mm_sub_epi16(zero, d0));
+		__m128i a1  = _mm_max_epi16(d1, _mm_sub_epi16(zero, d1));
+		__m128i m   = _mm_packs_epi16(_mm_cmpgt_epi16(a0, thresh), _mm_cmpgt_epi16(a1, thresh));
+		__m128i inc = _mm_loadu_si128((const __m128i*) (include + x));
+		_mm_storeu_si128((__m128i*) (mask + x), _mm_and_si128(m, inc));
+		_mm_storeu_si128((__m128i*) (bg + x), _mm_add_epi16(b0, _mm_sra_epi16(d0, count)));
+		_mm_storeu_si128((__m128i*) (bg + x + 8), _mm_add_epi16(b1, _mm_sra_epi16(d1, count)));
+	}
+#elif defined(__ARM_NEON)
+	const int16x8_t thresh = vdupq_n_s16((int16_t) (threshold << 7));
+	const int16x8_t count  = vdupq_n_s16((int16_t) -shift); // a negative left shift is an arithmetic right shift
+	for (; x + 16 <= n; x += 16) {
+		uint8x16_t c  = vld1q_u8(cur + x);
+		int16x8_t  b0 = vld1q_s16(bg + x);
+		int16x8_t  b1 = vld1q_s16(bg + x + 8);
+		int16x8_t  d0 = vsubq_s16(vreinterpretq_s16_u16(vshll_n_u8(vget_low_u8(c), 7)), b0);
+		int16x8_t  d1 = vsubq_s16(vreinterpretq_s16_u16(vshll_n_u8(vget_high_u8(c), 7)), b1);
+		uint8x16_t m  = vcombine_u8(vmovn_u16(vcgtq_s16(vabsq_s16(d0), thresh)), vmovn_u16(vcgtq_s16(vabsq_s16(d1), thresh)));
+		vst1q_u8(mask + x, vandq_u8(m, vld1q_u8(include + x)));
+		vst1q_s16(bg + x, vaddq_s16(b0, vshlq_s16(d0, count)));
+		vst1q_s16(bg + x + 8, vaddq_s16(b1, vshlq_s16(d1, count)));
+	}
+#endif
+	for (; x < n; x++) {
+		int d   = (cur[x] << 7) - bg[x];
+		mask[x] = (d > (threshold << 7) || -d > (threshold << 7)) ? include[x] : 0;
+		bg[x]   = (int16_t) (bg[x] + (d >> shift));
+	}
+}
+
+// Rebuild everything that depends on the size of the downsampled frame, or on the exclusions
+static void Layout(LumaMotion* m) {
+	int w  = m->Width;
+	int h  = m->Height;
+	int gw = m->Options.GridWidth;
+	int gh = m->Options.GridHeight;
+	m->Include.assign(w * h, 1);
+	for (const auto& r : m->Exclusions) {
+		// Exclude every pixel whose center is inside the rectangle
+		for (int y = 0; y < h; y++) {
+			float fy = (y + 0.5f) / h;
+			if (fy < r.Y0 || fy >= r.Y1)
+				continue;
+			for (int x = 0; x < w; x++) {
+				float fx = (x + 0.5f) / w;
+				if (fx >= r.X0 && fx < r.X1)
+					m->Include[y * w + x] = 0;
+			}
+		}
+	}
+	m->CellOfX.resize(w);
+	m->CellOfY.resize(h);
+	for (int x = 0; x < w; x++)
+		m->CellOfX[x] = x * gw / w;
+	for (int y = 0; y < h; y++)
+		m->CellOfY[y] = y * gh / h;
+	m->CellPixels.assign(gw * gh, 0);
+	for (int y = 0; y < h; y++) {
+		for (int x = 0; x < w; x++)
+			m->CellPixels[m->CellOfY[y] * gw + m->CellOfX[x]] += m->Include[y * w + x];
+	}
+	m->Mask.resize(w * h);
+	m->Background.resize(w * h);
+	m->Frames = 0;
+}
+
+// Start learning the background from scratch, with the current frame as the first estimate
+static void Seed(LumaMotion* m) {
+	for (size_t i = 0; i < m->Small.size(); i++)
+		m->Background[i] = (int16_t) (m->Small[i] << 7);
+	m->Frames = 0;
+}
+
+extern "C" {
+
+void* MakeLumaMotion(char** err, const LumaMotionOptions* options) {
+	if (options->GridWidth <= 0 || options->GridHeight <= 0) {
+		*err = strdup("Motion grid size must be positive");
+		return nullptr;
+	}
+	if (options->MaxWidth < options->GridWidth) {
+		*err = strdup("MaxWidth must be at least GridWidth");
+		return nullptr;
+	}
+	if (options->BackgroundShift < 1 || options->BackgroundShift > 14) {
+		*err = strdup("BackgroundShift must be between 1 and 14");
+		return nullptr;
+	}
+	auto m     = new LumaMotion();
+	m->Options = *options;
+	m->Grid.resize(options->GridWidth * options->GridHeight);
+	m->CellCount.resize(m->Grid.size());
+	return m;
+}
+
+void LumaMotion_Close(void* detector) {
+	delete (LumaMotion*) detector;
+}
+
+void LumaMotion_SetExclusions(void* detector, const LumaMotionRect* rects, int count) {
+	auto m = (LumaMotion*) detector;
+	m->Exclusions.assign(rects, rects + count);
+	if (m->Width != 0)
+		Layout(m);
+}
+
+int LumaMotion_Process(void* detector, const uint8_t* y, int width, int height, int stride, PipelineStats* stats, LumaMotionFrame* result) {
+	int64_t start = StatsNow();
+	auto    m     = (LumaMotion*) detector;
+	memset(result, 0, sizeof(*result));
+
+	// Halve until we're narrow enough, but never so small that a cell is less than a pixel
+	int w = width;
+	int h = height;
+	int n = 0;
+	while (w > m->Options.MaxWidth && w / 2 >= m->Options.GridWidth && h / 2 >= m->Options.GridHeight) {
+		w /= 2;
+		h /= 2;
+		n++;
+	}
+	if (w < m->Options.GridWidth || h < m->Options.GridHeight)
+		return 0;
+
+	if (w != m->Width || h != m->Height) {
+		m->Width  = w;
+		m->Height = h;
+		m->Small.resize(w * h);
+		Layout(m);
+	}
+
+	// Downsample into Small. Each halving reads the previous one, so we ping-pong inside Scratch.
+	if (n == 0) {
+		for (int row = 0; row < h; row++)
+			memcpy(&m->Small[row * w], y + row * stride, w);
+	} else {
+		m->Scratch.resize((width / 2) * (height / 2) + (width / 4) * (height / 4));
+		const uint8_t* src     = y;
+		int            sw      = width;
+		int            sh      = height;
+		int            sstride = stride;
+		for (int i = 0; i < n; i++) {
+			int      dw  = sw / 2;
+			uint8_t* dst = i == n - 1 ? m->Small.data() : (i % 2 == 0 ? m->Scratch.data() : m->Scratch.data() + (width / 2) * (height / 2));
+			HalvePlane(src, sw, sh, sstride, dst, dw);
+			src     = dst;
+			sw      = dw;
+			sh      = sh / 2;
+			sstride = dw;
+		}
+	}
+	result->Width  = w;
+	result->Height = h;
+
+	// First frame after (re)seeding, so there is nothing to compare to yet
+	if (m->Frames == 0)
+		Seed(m);
+	for (int row = 0; row < h; row++)
+		DiffRow(&m->Small[row * w], &m->Background[row * w], &m->Include[row * w], &m->Mask[row * w], w, m->Options.PixelThreshold, m->Options.BackgroundShift);
+	m->Frames++;
+
+	// Count changed pixels per cell
+	int gw = m->Options.GridWidth;
+	std::fill(m->CellCount.begin(), m->CellCount.end(), 0);
+	int changed  = 0;
+	int included = 0;
+	for (int row = 0; row < h; row++) {
+		int*           cells = &m->CellCount[m->CellOfY[row] * gw];
+		const uint8_t* mask  = &m->Mask[row * w];
+		for (int x = 0; x < w; x++)
+			cells[m->CellOfX[x]] += mask[x];
+	}
+	float maxCell = 0;
+	for (size_t i = 0; i < m->Grid.size(); i++) {
+		changed += m->CellCount[i];
+		included += m->CellPixels[i];
+		m->Grid[i] = m->CellPixels[i] == 0 ? 0 : (float) m->CellCount[i] / (float) m->CellPixels[i];
+		maxCell    = std::max(maxCell, m->Grid[i]);
+	}
+	float fraction = included == 0 ? 0 : (float) changed / (float) included;
+
+	if (fraction > GlobalChangeFraction && m->Frames > 1) {
+		result->GlobalChange = 1;
+		Seed(m);
+	} else if (m->Frames <= m->Options.WarmupFrames) {
+		result->WarmingUp = 1;
+	} else {
+		result->Changed = fraction;
+		result->MaxCell = maxCell;
+	}
+	if (result->GlobalChange || result->WarmingUp)
+		std::fill(m->Grid.begin(), m->Grid.end(), 0.0f);
+
+	if (stats != nullptr)
+		StatsHistogram_Since(&stats->Motion, start);
+	return 1;
+}
+
+const float* LumaMotion_Grid(void* detector) {
+	return ((LumaMotion*) detector)->Grid.data();
+}
+}
@@ -0,0 +1,110 @@
+package videox
+
+import (
+	"image"
+	"unsafe"
+)
+
+// #include "lumaMotion.h"
+import "C"
+
+// LumaMotionOptions control a LumaMotion detector. See lumaMotion.h for details.
+type LumaMotionOptions struct {
+	GridWidth       int // Number of cells across the frame
+	GridHeight      int // Number of cells down the frame
+	MaxWidth        int // The Y plane is halved until it is at most this wide
+	PixelThreshold  int // A pixel has changed if it differs from the background by more than this (0..255)
+	BackgroundShift int // Each frame moves the background 1/2^BackgroundShift of the way towards it
+	WarmupFrames    int // Number of frames spent learning the background before we report anything
+}
+
+// ExclusionRect is an area of the frame in which we ignore motion.
+// Coordinates are fractions of the frame size (0..1), with (0,0) at the top left.
+type ExclusionRect struct {
+	X0, Y0, X1, Y1 float64
+}
+
+// LumaMotionFrame is the result of analyzing one frame
+type LumaMotionFrame struct {
+	Width        int       // Size of the downsampled frame
+	Height       int       //
+	WarmingUp    bool      // Still learning the background, so the fields below are zero
+	GlobalChange bool      // Most of the frame changed at once (eg lights), so the background was restarted
+	Changed      float64   // Fraction of (non-excluded) pixels that differ from the background
+	MaxCell      float64   // Fraction of changed pixels in the busiest cell
+	Grid         []float32 // Fraction of changed pixels in each cell, row major. Overwritten by the next Process.
+}
+
+// LumaMotion detects motion in the pixels of decoded frames, by comparing the Y plane to a running
+// background model. Unlike MotionAnalyzer, this needs decoded frames, but it's far less fooled by
+// encoder behaviour, so it's a good way to confirm what MotionAnalyzer suspects.
+// It is not thread safe.
+type LumaMotion struct {
+	Options LumaMotionOptions
+	lm      unsafe.Pointer
+	grid    []float32
+}
+
+func NewLumaMotion(options LumaMotionOptions) (*LumaMotion, error) {
+	copts := C.LumaMotionOptions{
+		GridWidth:       C.int(options.GridWidth),
+		GridHeight:      C.int(options.GridHeight),
+		MaxWidth:        C.int(options.MaxWidth),
+		PixelThreshold:  C.int(options.PixelThreshold),
+		BackgroundShift: C.int(options.BackgroundShift),
+		WarmupFrames:    C.int(options.WarmupFrames),
+	}
+	var cerr *C.char
+	lm := C.MakeLumaMotion(&cerr, &copts)
+	if err := takeCErr(cerr); err != nil {
+		return nil, err
+	}
+	return &LumaMotion{
+		Options: options,
+		lm:      lm,
+		grid:    make([]float32, options.GridWidth*options.GridHeight),
+	}, nil
+}
+
+func (m *LumaMotion) Close() {
+	if m.lm != nil {
+		C.LumaMotion_Close(m.lm)
+		m.lm = nil
+	}
+}
+
+// Ignore motion inside these rectangles. This restarts the background model.
+func (m *LumaMotion) SetExclusions(rects []ExclusionRect) {
+	crects := make([]C.LumaMotionRect, len(rects))
+	for i, r := range rects {
+		crects[i] = C.LumaMotionRect{X0: C.float(r.X0), Y0: C.float(r.Y0), X1: C.float(r.X1), Y1: C.float(r.Y1)}
+	}
+	var p *C.LumaMotionRect
+	if len(crects) != 0 {
+		p = &crects[0]
+	}
+	C.LumaMotion_SetExclusions(m.lm, p, C.int(len(crects)))
+}
+
+// Analyze the Y plane of img, and update the background. Returns false if img is too small.
+// If stats is not nil, the time taken is recorded into it.
+func (m *LumaMotion) Process(img *image.YCbCr, stats *PipelineStats) (LumaMotionFrame, bool) {
+	if len(img.Y) == 0 {
+		return LumaMotionFrame{}, false
+	}
+	var cf C.LumaMotionFrame
+	y := unsafe.Pointer(&img.Y[img.YOffset(img.Rect.Min.X, img.Rect.Min.Y)])
+	if C.LumaMotion_Process(m.lm, (*C.uint8_t)(y), C.int(img.Rect.Dx()), C.int(img.Rect.Dy()), C.int(img.YStride), stats.cptr(), &cf) == 0 {
+		return LumaMotionFrame{}, false
+	}
+	copy(m.grid, unsafe.Slice((*float32)(unsafe.Pointer(C.LumaMotion_Grid(m.lm))), len(m.grid)))
+	return LumaMotionFrame{
+		Width:        int(cf.Width),
+		Height:       int(cf.Height),
+		WarmingUp:    cf.WarmingUp != 0,
+		GlobalChange: cf.GlobalChange != 0,
+		Changed:      float64(cf.Changed),
+		MaxCell:      float64(cf.MaxCell),
+		Grid:         m.grid,
+	}, true
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "stats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct LumaMotionOptions {
+	int GridWidth;       // Number of cells across the frame
+	int GridHeight;      // Number of cells down the frame
+	int MaxWidth;        // The Y plane is halved until it is at most this wide
+	int PixelThreshold;  // A pixel has changed if it differs from the background by more than this (0..255)
+	int BackgroundShift; // Each frame moves the background 1/2^BackgroundShift of the way towards it (1..14)
+	int WarmupFrames;    // Number of frames that we spend learning the background, before reporting anything
+} LumaMotionOptions;
+
+// A rectangle, in fractions of the frame size (0..1), with (0,0) at the top left
+typedef struct LumaMotionRect {
+	float X0;
+	float Y0;
+	float X1;
+	float Y1;
+} LumaMotionRect;
+
+typedef struct LumaMotionFrame {
+	int   Width;        // Size of the downsampled frame
+	int   Height;       //
+	int   WarmingUp;    // We're still learning the background, so the fields below are zero
+	int   GlobalChange; // Most of the frame changed at once (eg lights, or IR mode), so we restarted the background
+	float Changed;      // Fraction of (non-excluded) pixels that differ from the background
+	float MaxCell;      // Fraction of changed pixels in the busiest cell
+} LumaMotionFrame;
+
+void* MakeLumaMotion(char** err, const LumaMotionOptions* options);
+void  LumaMotion_Close(void* detector);
+
+// Pixels inside any of these rectangles are ignored. Replaces any previous exclusions.
+void LumaMotion_SetExclusions(void* detector, const LumaMotionRect* rects, int count);
+
+// Compare a Y plane to the background, and update the background.
+// If stats is not NULL, the time taken is recorded into stats->Motion.
+// Returns 0 if the image is too small to use.
+int LumaMotion_Process(void* detector, const uint8_t* y, int width, int height, int stride, PipelineStats* stats, LumaMotionFrame* result);
+
+// Returns the GridWidth * GridHeight fractions of changed pixels (row major) of the last LumaMotion_Process
+const float* LumaMotion_Grid(void* detector);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,67 @@
+package videox
+
+import (
+	"image"
+	"math/rand"
+	"testing"
+
+	"github.com/stretchr/testify/require"
+)
+
+func TestLumaMotion(t *testing.T) {
+	m, err := NewLumaMotion(LumaMotionOptions{
+		GridWidth:       16,
+		GridHeight:      9,
+		MaxWidth:        160,
+		PixelThreshold:  20,
+		BackgroundShift: 4,
+		WarmupFrames:    5,
+	})
+	require.NoError(t, err)
+	defer m.Close()
+
+	// An odd size, so that the SIMD kernels' scalar tails get exercised
+	rng := rand.New(rand.NewSource(1))
+	img := image.NewYCbCr(image.Rect(0, 0, 641, 361), image.YCbCrSubsampleRatio420)
+	frame := func(boxX int) LumaMotionFrame {
+		for i := range img.Y {
+			img.Y[i] = byte(100 + rng.Intn(8)) // sensor noise
+		}
+		if boxX >= 0 {
+			for y := 40; y < 120; y++ {
+				for x := boxX; x < boxX+80; x++ {
+					img.Y[y*img.YStride+x] = 220
+				}
+			}
+		}
+		f, ok := m.Process(img, nil)
+		require.True(t, ok)
+		return f
+	}
+
+	for i := 0; i < 20; i++ {
+		f := frame(-1)
+		require.Equal(t, 160, f.Width)
+		require.Equal(t, 90, f.Height)
+		require.Equal(t, i < 5, f.WarmingUp)
+		require.Equal(t, 0.0, f.Changed)
+	}
+	f := frame(60)
+	require.Greater(t, f.MaxCell, 0.9)
+	require.Less(t, f.Changed, 0.05)
+
+	// Motion inside an exclusion zone is ignored
+	m.SetExclusions([]ExclusionRect{{X0: 0, Y0: 0, X1: 0.5, Y1: 0.5}})
+	for i := 0; i < 10; i++ {
+		f = frame(60 + i)
+	}
+	require.False(t, f.WarmingUp)
+	require.Equal(t, 0.0, f.MaxCell)
+
+	// The lights go on
+	for i := range img.Y {
+		img.Y[i] = 250
+	}
+	f, _ = m.Process(img, nil)
+	require.True(t, f.GlobalChange)
+}
@@ -0,0 +1,260 @@
+#include <math.h>
+#include <string.h>
+#include <vector>
+#include "motion.h"
+#include "nalu.h"
+#include "h264ParseSPS.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/motion_vector.h>
+}
+
+// MotionAnalyzer is a cheap motion pre-filter, which never produces an image.
+// From the bitstream alone, we track the size of each frame relative to recent frames of the same kind.
+// A camera's encoder spends more bits when there is more change in the scene, so a P frame that is much
+// larger than usual is a strong hint of motion.
+// Optionally, we also run ffmpeg's software decoder with AV_CODEC_FLAG2_EXPORT_MVS, and reduce the motion
+// vectors to a coarse grid. This does decode, but with the loop filter disabled, and we never convert or
+// copy the frame, so it's cheap on a low res stream.
+struct MotionAnalyzer {
+	MotionOptions      Options  = {};
+	AVCodecContext*    CodecCtx = nullptr;
+	AVPacket*          Packet   = nullptr;
+	AVFrame*           Frame    = nullptr;
+	std::vector<float> Grid;
+
+	double AvgKeyBytes = 0; // Running average size of keyframes
+	double AvgRefBytes = 0; // Running average size of reference P frames
+	int    NumKey      = 0;
+	int    NumRef      = 0;
+};
+
+// Averages are cumulative until we have this many samples, and exponential after that
+static const int    WarmupFrames = 30;
+static const double KeyAlpha     = 0.25;
+static const double RefAlpha     = 0.02; // Slow, so that a burst of motion doesn't immediately become the new normal
+
+struct MotionAnalyzerCleanup {
+	MotionAnalyzer* M;
+	MotionAnalyzerCleanup(MotionAnalyzer* m) {
+		M = m;
+	}
+	~MotionAnalyzerCleanup() {
+		if (!M)
+			return;
+		if (M->CodecCtx)
+			avcodec_free_context(&M->CodecCtx);
+		if (M->Packet)
+			av_packet_free(&M->Packet);
+		if (M->Frame)
+			av_frame_free(&M->Frame);
+		delete M;
+	}
+};
+
+static void UpdateAverage(double& avg, int& n, double v, double alpha) {
+	n++;
+	if (n <= WarmupFrames)
+		avg += (v - avg) / n;
+	else
+		avg += (v - avg) * alpha;
+}
+
+// Find the next NALU in an annex-b buffer, starting the search at pos.
+// Returns false if there are no more NALUs.
+static bool NextNALU(const uint8_t* buf, size_t size, size_t& pos, const uint8_t*& nalu, size_t& naluSize) {
+	// skip the start code
+	size_t i = pos;
+	while (i + 3 <= size && !(buf[i] == 0 && buf[i + 1] == 0 && buf[i + 2] == 1))
+		i++;
+	if (i + 3 > size)
+		return false;
+	i += 3;
+	size_t end = i;
+	while (end + 3 <= size && !(buf[end] == 0 && buf[end + 1] == 0 && (buf[end + 2] == 1 || (buf[end + 2] == 0 && end + 3 < size && buf[end + 3] == 1))))
+		end++;
+	if (end + 3 > size)
+		end = size;
+	nalu     = buf + i;
+	naluSize = end - i;
+	pos      = end;
+	return true;
+}
+
+// Reduce the motion vectors of frame into analyzer->Grid
+static void AccumulateVectors(MotionAnalyzer* analyzer, AVFrame* frame, MotionFrame* result) {
+	int gw     = analyzer->Options.GridWidth;
+	int gh     = analyzer->Options.GridHeight;
+	int width  = frame->width;
+	int height = frame->height;
+	if (gw <= 0 || gh <= 0 || width <= 0 || height <= 0)
+		return;
+
+	auto& grid = analyzer->Grid;
+	for (auto& g : grid)
+		g = 0;
+
+	// An I frame has no vectors, so it produces an all-zero grid, which is correct (we know nothing)
+	AVFrameSideData* sd = av_frame_get_side_data(frame, AV_FRAME_DATA_MOTION_VECTORS);
+	if (sd != nullptr) {
+		auto   mvs = (const AVMotionVector*) sd->data;
+		size_t n   = sd->size / sizeof(AVMotionVector);
+		for (size_t i = 0; i < n; i++) {
+			const AVMotionVector& mv = mvs[i];
+			if (mv.motion_scale == 0 || (mv.motion_x == 0 && mv.motion_y == 0))
+				continue;
+			float mag = sqrtf((float) mv.motion_x * mv.motion_x + (float) mv.motion_y * mv.motion_y) / mv.motion_scale;
+			int   cx  = FFMIN(FFMAX(mv.dst_x * gw / width, 0), gw - 1);
+			int   cy  = FFMIN(FFMAX(mv.dst_y * gh / height, 0), gh - 1);
+			grid[cy * gw + cx] += mag * mv.w * mv.h;
+		}
+	}
+
+	// Normalize by cell area, so that the values are independent of resolution and grid size
+	float cellArea = ((float) width / gw) * ((float) height / gh);
+	float sum      = 0;
+	float maxCell  = 0;
+	for (auto& g : grid) {
+		g /= cellArea;
+		sum += g;
+		maxCell = FFMAX(maxCell, g);
+	}
+	result->HaveVectors = 1;
+	result->VectorsPTS  = frame->pts;
+	result->Energy      = sum / (float) grid.size();
+	result->MaxCell     = maxCell;
+}
+
+extern "C" {
+
+void* MakeMotionAnalyzer(char** err, const MotionOptions* options) {
+	auto                  analyzer = new MotionAnalyzer();
+	MotionAnalyzerCleanup cleanup(analyzer);
+
+	analyzer->Options = *options;
+	if (options->GridWidth <= 0 || options->GridHeight <= 0) {
+		*err = strdup("Motion grid size must be positive");
+		return nullptr;
+	}
+	analyzer->Grid.resize(options->GridWidth * options->GridHeight);
+
+	if (options->MotionVectors) {
+		// ffmpeg's HEVC decoder doesn't export motion vectors
+		if (options->Codec != VideoCodecH264) {
+			*err = strdup("Motion vectors are only available for H264");
+			return nullptr;
+		}
+		// Hardware decoders don't export motion vectors, so this is always ffmpeg's software decoder
+		auto codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+		if (codec == nullptr) {
+			*err = strdup("Failed to find H264 decoder");
+			return nullptr;
+		}
+		analyzer->Packet   = av_packet_alloc();
+		analyzer->Frame    = av_frame_alloc();
+		analyzer->CodecCtx = avcodec_alloc_context3(codec);
+		if (analyzer->Packet == nullptr || analyzer->Frame == nullptr || analyzer->CodecCtx == nullptr) {
+			*err = strdup("Failed to allocate decoder");
+			return nullptr;
+		}
+		auto ctx              = analyzer->CodecCtx;
+		ctx->flags2          |= AV_CODEC_FLAG2_EXPORT_MVS | AV_CODEC_FLAG2_FAST;
+		ctx->flags           |= AV_CODEC_FLAG_LOW_DELAY;
+		ctx->skip_loop_filter = AVDISCARD_ALL;
+		ctx->thread_count     = 1; // Frame threading would delay the vectors, and slice threading doesn't help small frames
+		if (avcodec_open2(ctx, codec, nullptr) < 0) {
+			*err = strdup("Failed to open H264 decoder");
+			return nullptr;
+		}
+	}
+
+	cleanup.M = nullptr; // allow MotionAnalyzer to survive
+	return analyzer;
+}
+
+void MotionAnalyzer_Close(void* analyzer) {
+	MotionAnalyzerCleanup cleanup((MotionAnalyzer*) analyzer);
+}
+
+int MotionAnalyzer_Analyze(void* _analyzer, const void* accessUnit, size_t size, int64_t pts, MotionFrame* result) {
+	auto analyzer = (MotionAnalyzer*) _analyzer;
+	memset(result, 0, sizeof(*result));
+	result->PTS = pts;
+
+	// Bitstream statistics
+	auto           buf = (const uint8_t*) accessUnit;
+	size_t         pos = 0;
+	const uint8_t* nalu;
+	size_t         naluSize;
+	while (NextNALU(buf, size, pos, nalu, naluSize)) {
+		if (naluSize < NALUHeaderSize(analyzer->Options.Codec))
+			continue;
+		if (analyzer->Options.Codec == VideoCodecH265) {
+			int kind = NALUKindOf(VideoCodecH265, nalu);
+			if (kind != NALUKindSlice && kind != NALUKindKeyframe)
+				continue;
+			int type = (nalu[0] >> 1) & 0x3f;
+			result->FrameBytes += (int) naluSize;
+			if (kind == NALUKindKeyframe)
+				result->Keyframe = 1;
+			// The even types below 16 are sub-layer non-reference pictures
+			if (kind == NALUKindKeyframe || type > 14 || (type & 1))
+				result->Reference = 1;
+			continue;
+		}
+		int type = nalu[0] & 31;
+		if (type != 1 && type != 5)
+			continue;
+		result->FrameBytes += (int) naluSize;
+		if ((nalu[0] >> 5) & 3)
+			result->Reference = 1;
+		if (type == 5) {
+			result->Keyframe = 1;
+		} else if (!result->Keyframe) {
+			H264SliceInfo slice;
+			if (ParseSliceHeader(nalu, naluSize, nullptr, &slice) && slice.SliceType == 2)
+				result->Keyframe = 1;
+		}
+	}
+
+	bool visual = result->FrameBytes != 0;
+	if (visual) {
+		double bytes = result->FrameBytes;
+		if (result->Keyframe) {
+			UpdateAverage(analyzer->AvgKeyBytes, analyzer->NumKey, bytes, KeyAlpha);
+		} else {
+			if (analyzer->NumKey != 0)
+				result->PIRatio = (float) (bytes / analyzer->AvgKeyBytes);
+			if (result->Reference) {
+				if (analyzer->NumRef >= WarmupFrames)
+					result->SizeScore = (float) (bytes / analyzer->AvgRefBytes);
+				UpdateAverage(analyzer->AvgRefBytes, analyzer->NumRef, bytes, RefAlpha);
+			}
+		}
+	}
+
+	// Motion vectors
+	if (analyzer->CodecCtx != nullptr) {
+		auto pkt  = analyzer->Packet;
+		pkt->data = (uint8_t*) accessUnit;
+		pkt->size = (int) size;
+		pkt->pts  = pts;
+		int res   = avcodec_send_packet(analyzer->CodecCtx, pkt);
+		pkt->data = nullptr;
+		pkt->size = 0;
+		// Errors are normal until the first IDR, so we just carry on
+		(void) res;
+		while (avcodec_receive_frame(analyzer->CodecCtx, analyzer->Frame) == 0) {
+			AccumulateVectors(analyzer, analyzer->Frame, result);
+			av_frame_unref(analyzer->Frame);
+		}
+	}
+
+	return visual ? 1 : 0;
+}
+
+const float* MotionAnalyzer_Grid(void* analyzer) {
+	return ((MotionAnalyzer*) analyzer)->Grid.data();
+}
+}
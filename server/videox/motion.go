@@ -0,0 +1,106 @@
+package videox
+
+import (
+	"time"
+	"unsafe"
+)
+
+// #cgo pkg-config: libavcodec libavutil
+// #include "motion.h"
+import "C"
+
+// MotionOptions control what a MotionAnalyzer computes
+type MotionOptions struct {
+	Codec         Codec // H264 (the default) or H265
+	GridWidth     int   // Number of cells across the frame
+	GridHeight    int   // Number of cells down the frame
+	MotionVectors bool  // Decode the stream to extract motion vectors. Otherwise, we only look at frame sizes. H264 only.
+}
+
+// MotionFrame is the result of analyzing one packet. See motion.h for details.
+type MotionFrame struct {
+	PTS         time.Duration
+	Keyframe    bool
+	Reference   bool
+	FrameBytes  int
+	SizeScore   float64 // Frame size relative to recent reference P frames (0 if unknown)
+	PIRatio     float64 // Frame size relative to recent keyframes (0 if unknown)
+	HaveVectors bool    // True if the fields below, and Grid, are populated
+	VectorsPTS  time.Duration
+	Energy      float64   // Mean motion of all cells
+	MaxCell     float64   // Motion of the busiest cell
+	Grid        []float32 // Cell energies, row major. Owned by the MotionAnalyzer, and overwritten by the next Analyze.
+}
+
+// MotionAnalyzer computes cheap motion statistics from compressed H264 or H265, without producing images.
+// It is not thread safe.
+type MotionAnalyzer struct {
+	Options  MotionOptions
+	analyzer unsafe.Pointer
+	buf      []byte    // Annex-b access unit that we send to C
+	grid     []float32 // Copy of the C grid
+}
+
+func NewMotionAnalyzer(options MotionOptions) (*MotionAnalyzer, error) {
+	copts := C.MotionOptions{
+		Codec:      C.int(options.Codec),
+		GridWidth:  C.int(options.GridWidth),
+		GridHeight: C.int(options.GridHeight),
+	}
+	if options.MotionVectors {
+		copts.MotionVectors = 1
+	}
+	var cerr *C.char
+	analyzer := C.MakeMotionAnalyzer(&cerr, &copts)
+	if err := takeCErr(cerr); err != nil {
+		return nil, err
+	}
+	return &MotionAnalyzer{
+		Options:  options,
+		analyzer: analyzer,
+		grid:     make([]float32, options.GridWidth*options.GridHeight),
+	}, nil
+}
+
+func (m *MotionAnalyzer) Close() {
+	if m.analyzer != nil {
+		C.MotionAnalyzer_Close(m.analyzer)
+		m.analyzer = nil
+	}
+}
+
+// Analyze a packet. Returns false if the packet had no frame data (eg it only contained SPS and PPS).
+// Those packets must still be fed in, because the decoder needs them when MotionVectors is enabled.
+func (m *MotionAnalyzer) Analyze(packet *DecodedPacket) (MotionFrame, bool) {
+	m.buf = m.buf[:0]
+	for _, n := range packet.H264NALUs {
+		if n.PrefixLen == 0 {
+			m.buf = append(m.buf, NALUPrefix...)
+		}
+		m.buf = append(m.buf, n.Payload...)
+	}
+	if len(m.buf) == 0 {
+		return MotionFrame{}, false
+	}
+	var cf C.MotionFrame
+	if C.MotionAnalyzer_Analyze(m.analyzer, unsafe.Pointer(&m.buf[0]), C.size_t(len(m.buf)), C.int64_t(packet.H264PTS), &cf) == 0 {
+		return MotionFrame{}, false
+	}
+	f := MotionFrame{
+		PTS:         time.Duration(cf.PTS),
+		Keyframe:    cf.Keyframe != 0,
+		Reference:   cf.Reference != 0,
+		FrameBytes:  int(cf.FrameBytes),
+		SizeScore:   float64(cf.SizeScore),
+		PIRatio:     float64(cf.PIRatio),
+		HaveVectors: cf.HaveVectors != 0,
+	}
+	if f.HaveVectors {
+		f.VectorsPTS = time.Duration(cf.VectorsPTS)
+		f.Energy = float64(cf.Energy)
+		f.MaxCell = float64(cf.MaxCell)
+		copy(m.grid, unsafe.Slice((*float32)(unsafe.Pointer(C.MotionAnalyzer_Grid(m.analyzer))), len(m.grid)))
+		f.Grid = m.grid
+	}
+	return f, true
+}
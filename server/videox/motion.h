@@ -0,0 +1,44 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct MotionOptions {
+	int Codec;         // VideoCodec
+	int GridWidth;     // Number of cells across the frame
+	int GridHeight;    // Number of cells down the frame
+	int MotionVectors; // Decode with AV_CODEC_FLAG2_EXPORT_MVS to populate the grid. If 0, we only look at the bitstream. H264 only.
+} MotionOptions;
+
+// Statistics of a single access unit
+typedef struct MotionFrame {
+	int64_t PTS;        // Copied from the input
+	int     Keyframe;   // Access unit contains an IDR (or H265 IRAP), or an H264 I slice
+	int     Reference;  // nal_ref_idc of the slices is non-zero (or the H265 slices are not sub-layer non-reference)
+	int     FrameBytes; // Size of the slice NALUs (excluding SPS, PPS, SEI, etc)
+	float   SizeScore;  // FrameBytes relative to the running average size of reference P frames. 0 during warm-up, or if not applicable.
+	float   PIRatio;    // FrameBytes relative to the running average size of keyframes. 0 until we've seen a keyframe.
+
+	// Motion vector results. These belong to the most recently decoded frame, which may lag the input
+	// by a frame or two if the stream has B frames.
+	int     HaveVectors; // 1 if the fields below (and MotionAnalyzer_Grid) were populated by this call
+	int64_t VectorsPTS;  // PTS of the decoded frame
+	float   Energy;      // Mean motion of all cells, in pixels of displacement per pixel of area
+	float   MaxCell;     // Energy of the busiest cell
+} MotionFrame;
+
+void* MakeMotionAnalyzer(char** err, const MotionOptions* options);
+void  MotionAnalyzer_Close(void* analyzer);
+
+// Analyze an annex-b access unit. Non-visual access units (eg SPS + PPS) are passed to the decoder, but produce no result.
+// Returns 1 if frame was populated.
+int MotionAnalyzer_Analyze(void* analyzer, const void* accessUnit, size_t size, int64_t pts, MotionFrame* frame);
+
+// Returns the GridWidth * GridHeight cell energies (row major) of the last frame with HaveVectors = 1
+const float* MotionAnalyzer_Grid(void* analyzer);
+
+#ifdef __cplusplus
+}
+#endif
\ No newline at end of file
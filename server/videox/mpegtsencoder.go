@@ -13,10 +13,10 @@ import (
 	"github.com/asticode/go-astits"
 )
 
-// MPGTSEncoder allows to encode H264 NALUs into MPEG-TS.
+// MPGTSEncoder allows to encode H264 or H265 NALUs into MPEG-TS.
 type MPGTSEncoder struct {
-	sps []byte
-	pps []byte
+	codec  Codec
+	params ParameterSets
 
 	log log.Log
 	//f                *os.File
@@ -28,70 +28,97 @@ type MPGTSEncoder struct {
 }
 
 // NewMPEGTSEncoder allocates a mpegtsEncoder.
-func NewMPEGTSEncoder(log log.Log, output io.Writer, sps []byte, pps []byte) (*MPGTSEncoder, error) {
+func NewMPEGTSEncoder(log log.Log, output io.Writer, codec Codec, params ParameterSets) (*MPGTSEncoder, error) {
 	//f, err := os.Create(filename)
 	//if err != nil {
 	//	return nil, err
 	//}
 	b := bufio.NewWriter(output)
 
+	streamType := astits.StreamTypeH264Video
+	if codec == CodecH265 {
+		streamType = astits.StreamTypeH265Video
+	}
 	mux := astits.NewMuxer(context.Background(), b)
 	mux.AddElementaryStream(astits.PMTElementaryStream{
 		ElementaryPID: 256,
-		StreamType:    astits.StreamTypeH264Video,
+		StreamType:    streamType,
 	})
 	mux.SetPCRPID(256)
 
 	return &MPGTSEncoder{
-		log: log,
-		sps: gen.CopySlice(sps),
-		pps: gen.CopySlice(pps),
+		log:   log,
+		codec: codec,
+		params: ParameterSets{
+			VPS: gen.CopySlice(params.VPS),
+			SPS: gen.CopySlice(params.SPS),
+			PPS: gen.CopySlice(params.PPS),
+		},
 		//f:   f,
 		b:   b,
 		mux: mux,
 	}, nil
 }
 
+// Flush buffered output, and send everything after this to output.
+// The PAT and PMT are written first, so that a player can start reading at the start of output
+// (eg an HLS segment). Timestamps carry on from the previous output.
+func (e *MPGTSEncoder) SetOutput(output io.Writer) error {
+	if err := e.b.Flush(); err != nil {
+		return err
+	}
+	e.b.Reset(output)
+	_, err := e.mux.WriteTables()
+	return err
+}
+
 // close closes all the mpegtsEncoder resources.
 func (e *MPGTSEncoder) Close() error {
 	return e.b.Flush()
 	//e.f.Close()
 }
 
-// encode encodes H264 NALUs into MPEG-TS.
+// encode encodes H264 or H265 NALUs into MPEG-TS.
 func (e *MPGTSEncoder) Encode(nalus []NALU, pts time.Duration) error {
 	// prepend an AUD. This is required by some players
 	filteredNALUs := [][]byte{
 		{byte(h264.NALUTypeAccessUnitDelimiter), 240},
 	}
+	if e.codec == CodecH265 {
+		// type 35, temporal ID 0, pic_type 2 (I, P or B)
+		filteredNALUs[0] = []byte{0x46, 0x01, 0x50}
+	}
 
 	nonIDRPresent := false
 	idrPresent := false
 
 	for _, nalu := range nalus {
 		payload := nalu.RawPayload()
-		typ := h264.NALUType(payload[0] & 0x1F)
-		switch typ {
-		case h264.NALUTypeSPS:
-			e.sps = append([]byte(nil), payload...)
+		switch NALUKindOf(e.codec, payload) {
+		case NALUKindVPS:
+			e.params.VPS = append([]byte(nil), payload...)
 			continue
 
-		case h264.NALUTypePPS:
-			e.pps = append([]byte(nil), payload...)
+		case NALUKindSPS:
+			e.params.SPS = append([]byte(nil), payload...)
 			continue
 
-		case h264.NALUTypeAccessUnitDelimiter:
+		case NALUKindPPS:
+			e.params.PPS = append([]byte(nil), payload...)
 			continue
 
-		case h264.NALUTypeIDR:
+		case NALUKindAUD:
+			continue
+
+		case NALUKindKeyframe:
 			idrPresent = true
 
-			// add SPS and PPS before every IDR
-			if e.sps != nil && e.pps != nil {
-				filteredNALUs = append(filteredNALUs, e.sps, e.pps)
+			// add parameter sets before every IDR
+			if e.params.Complete(e.codec) {
+				filteredNALUs = append(filteredNALUs, e.params.NALUs(e.codec)...)
 			}
 
-		case h264.NALUTypeNonIDR:
+		case NALUKindSlice:
 			nonIDRPresent = true
 		}
 
@@ -111,10 +138,12 @@ func (e *MPGTSEncoder) Encode(nalus []NALU, pts time.Duration) error {
 		}
 
 		e.firstIDRReceived = true
-		e.dtsExtractor = h264.NewDTSExtractor()
+		if e.codec == CodecH264 {
+			e.dtsExtractor = h264.NewDTSExtractor()
+		}
 
 		var err error
-		dts, err = e.dtsExtractor.Extract(filteredNALUs, pts)
+		dts, err = e.extractDTS(filteredNALUs, pts)
 		if err != nil {
 			return err
 		}
@@ -125,7 +154,7 @@ func (e *MPGTSEncoder) Encode(nalus []NALU, pts time.Duration) error {
 
 	} else {
 		var err error
-		dts, err = e.dtsExtractor.Extract(filteredNALUs, pts)
+		dts, err = e.extractDTS(filteredNALUs, pts)
 		if err != nil {
 			return err
 		}
@@ -174,3 +203,12 @@ func (e *MPGTSEncoder) Encode(nalus []NALU, pts time.Duration) error {
 	//e.log.Infof("Wrote TS packet (%v data bytes)", len(annexb))
 	return nil
 }
+
+// gortsplib only has a DTS extractor for H264. The H265 cameras that we've seen don't
+// use B-frames, so their decode order is their presentation order.
+func (e *MPGTSEncoder) extractDTS(nalus [][]byte, pts time.Duration) (time.Duration, error) {
+	if e.dtsExtractor == nil {
+		return pts, nil
+	}
+	return e.dtsExtractor.Extract(nalus, pts)
+}
@@ -0,0 +1,121 @@
+package videox
+
+// #include "nalu.h"
+import "C"
+
+// NALUKind is the role that a NALU plays, independent of the codec
+type NALUKind int
+
+const (
+	NALUKindOther    NALUKind = C.NALUKindOther
+	NALUKindVPS      NALUKind = C.NALUKindVPS // H265 only
+	NALUKindSPS      NALUKind = C.NALUKindSPS
+	NALUKindPPS      NALUKind = C.NALUKindPPS
+	NALUKindAUD      NALUKind = C.NALUKindAUD
+	NALUKindKeyframe NALUKind = C.NALUKindKeyframe // H264 IDR, or H265 IRAP
+	NALUKindSlice    NALUKind = C.NALUKindSlice    // Any other slice
+)
+
+func (k NALUKind) String() string {
+	switch k {
+	case NALUKindVPS:
+		return "VPS"
+	case NALUKindSPS:
+		return "SPS"
+	case NALUKindPPS:
+		return "PPS"
+	case NALUKindAUD:
+		return "AUD"
+	case NALUKindKeyframe:
+		return "Keyframe"
+	case NALUKindSlice:
+		return "Slice"
+	}
+	return "Other"
+}
+
+// Returns the kinds of parameter set that a decoder of codec needs, in the order that it expects them
+func ParameterSetKinds(codec Codec) []NALUKind {
+	if codec == CodecH265 {
+		return []NALUKind{NALUKindVPS, NALUKindSPS, NALUKindPPS}
+	}
+	return []NALUKind{NALUKindSPS, NALUKindPPS}
+}
+
+// Returns true if the NALU contains frame data
+func (k NALUKind) IsVisual() bool {
+	return k == NALUKindKeyframe || k == NALUKindSlice
+}
+
+// Classify a raw NALU (no annex-b prefix). This is the Go twin of NALUKindOf in nalu.h,
+// which we don't call through cgo, because it's on the path of every packet.
+func NALUKindOf(codec Codec, raw []byte) NALUKind {
+	if len(raw) == 0 {
+		return NALUKindOther
+	}
+	if codec == CodecH265 {
+		t := (raw[0] >> 1) & 63
+		switch {
+		case t <= 15:
+			return NALUKindSlice
+		case t <= 23:
+			return NALUKindKeyframe
+		case t == 32:
+			return NALUKindVPS
+		case t == 33:
+			return NALUKindSPS
+		case t == 34:
+			return NALUKindPPS
+		case t == 35:
+			return NALUKindAUD
+		}
+		return NALUKindOther
+	}
+	switch raw[0] & 31 {
+	case 1, 2, 3, 4:
+		return NALUKindSlice
+	case 5:
+		return NALUKindKeyframe
+	case 7:
+		return NALUKindSPS
+	case 8:
+		return NALUKindPPS
+	case 9:
+		return NALUKindAUD
+	}
+	return NALUKindOther
+}
+
+// Returns true if no other picture may use this NALU as a reference.
+// For H264 this is nal_ref_idc == 0. For H265 it is a sub-layer non-reference picture
+// (the even VCL types below 16: TRAIL_N, TSA_N, STSA_N, RADL_N, RASL_N, and the reserved _N types).
+func isNonReferenceNALU(codec Codec, raw []byte) bool {
+	if len(raw) == 0 {
+		return true
+	}
+	if codec == CodecH265 {
+		t := (raw[0] >> 1) & 63
+		return t <= 14 && t%2 == 0
+	}
+	return (raw[0]>>5)&3 == 0
+}
+
+// ParameterSets are the raw (unprefixed) parameter set NALUs that a decoder needs before the first keyframe
+type ParameterSets struct {
+	VPS []byte // H265 only
+	SPS []byte
+	PPS []byte
+}
+
+// Returns true if all of the parameter sets that the codec needs are present
+func (p *ParameterSets) Complete(codec Codec) bool {
+	return p.SPS != nil && p.PPS != nil && (codec != CodecH265 || p.VPS != nil)
+}
+
+// Returns the parameter sets in the order that a decoder expects them
+func (p *ParameterSets) NALUs(codec Codec) [][]byte {
+	if codec == CodecH265 {
+		return [][]byte{p.VPS, p.SPS, p.PPS}
+	}
+	return [][]byte{p.SPS, p.PPS}
+}
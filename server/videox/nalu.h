@@ -0,0 +1,63 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Video codecs that we can remux and decode.
+// The ingest engine in rtsp/ingest.h uses the same values.
+enum VideoCodec {
+	VideoCodecH264 = 0,
+	VideoCodecH265 = 1,
+};
+
+// The roles that a NALU can play, independent of the codec
+enum NALUKind {
+	NALUKindOther    = 0, // SEI, filler, etc
+	NALUKindVPS      = 1, // H265 only
+	NALUKindSPS      = 2,
+	NALUKindPPS      = 3,
+	NALUKindAUD      = 4, // Access unit delimiter
+	NALUKindKeyframe = 5, // A slice that decoding can start from (H264 IDR, or H265 IRAP)
+	NALUKindSlice    = 6, // Any other slice
+};
+
+// Classify a raw NALU (no annex-b prefix). size must be at least 1.
+static inline int NALUKindOf(int codec, const uint8_t* nalu) {
+	if (codec == VideoCodecH265) {
+		int t = (nalu[0] >> 1) & 0x3f;
+		if (t <= 15)
+			return NALUKindSlice;
+		if (t <= 23) // BLA, IDR, CRA, and reserved IRAP types
+			return NALUKindKeyframe;
+		switch (t) {
+		case 32: return NALUKindVPS;
+		case 33: return NALUKindSPS;
+		case 34: return NALUKindPPS;
+		case 35: return NALUKindAUD;
+		}
+		return NALUKindOther;
+	}
+	switch (nalu[0] & 31) {
+	case 1:
+	case 2:
+	case 3:
+	case 4: return NALUKindSlice;
+	case 5: return NALUKindKeyframe;
+	case 7: return NALUKindSPS;
+	case 8: return NALUKindPPS;
+	case 9: return NALUKindAUD;
+	}
+	return NALUKindOther;
+}
+
+// Returns the length of the NALU header (1 for H264, 2 for H265)
+static inline size_t NALUHeaderSize(int codec) {
+	return codec == VideoCodecH265 ? 2 : 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,456 @@
+package videox
+
+import (
+	"sort"
+	"time"
+
+	"github.com/aler9/gortsplib/pkg/h264"
+)
+
+// PacketRing is a FIFO of packets, where all NALU payloads live inside a single preallocated byte arena.
+// This replaces a ring of individually allocated DecodedPackets, which creates a lot of GC churn
+// when the ring holds hundreds of MB of video.
+// When the arena is full, the oldest packets are evicted to make space.
+// All of the NALUs of a packet are stored contiguously, with annex-b prefixes.
+// PacketRing is not thread safe.
+type PacketRing struct {
+	arena   []byte
+	head    int // Where the next packet will be written
+	bytes   int // Sum of packetRecord.size
+	packets fifo[packetRecord]
+	nalus   fifo[naluRecord]
+	naluSeq int64 // Total number of NALUs ever pushed into nalus (so packetRecord.firstNALU is stable across pops)
+	naluPop int64 // Total number of NALUs ever popped from nalus
+	codec   Codec // Codec of every packet in the ring
+
+	// Keyframe index, so that finding a keyframe doesn't need to scan the ring.
+	// Packets are identified by sequence number, in the same way as NALUs.
+	keyframes fifo[keyframeRecord]
+	packetSeq int64 // Total number of packets ever added
+	packetPop int64 // Total number of packets ever popped
+	lastVPS   int64 // Sequence number of the most recent packet containing a VPS (-1 if none, and always -1 for H264)
+	lastSPS   int64 // Sequence number of the most recent packet containing an SPS (-1 if none)
+	lastPPS   int64 // Sequence number of the most recent packet containing a PPS (-1 if none)
+}
+
+type keyframeRecord struct {
+	packet int64 // Sequence number of the packet holding the keyframe (H264 IDR, or H265 IRAP)
+	vps    int64 // Sequence number of the most recent VPS at or before the keyframe (-1 if none)
+	sps    int64 // Sequence number of the most recent SPS at or before the keyframe (-1 if none)
+	pps    int64 // Sequence number of the most recent PPS at or before the keyframe (-1 if none)
+	pts    time.Duration
+}
+
+// Returns the sequence number of the first packet that a decoder needs in order to start at this keyframe,
+// which is the earliest of the keyframe and its parameter sets. Returns -1 if a parameter set was never seen.
+func (k keyframeRecord) start(codec Codec) int64 {
+	if k.sps < 0 || k.pps < 0 || (codec == CodecH265 && k.vps < 0) {
+		return -1
+	}
+	s := min(k.packet, k.sps, k.pps)
+	if codec == CodecH265 {
+		s = min(s, k.vps)
+	}
+	return s
+}
+
+type packetRecord struct {
+	offset       int   // Start of the packet's bytes in the arena
+	size         int   // Total size of the packet's NALUs, including prefixes
+	firstNALU    int64 // Sequence number of the first NALU (see PacketRing.naluSeq)
+	nNALUs       int
+	pts          time.Duration
+	ptsEqualsDTS bool
+}
+
+type naluRecord struct {
+	offset int // in the arena
+	size   int // including prefix
+}
+
+// NewPacketRing allocates an arena of arenaBytes
+func NewPacketRing(arenaBytes int) *PacketRing {
+	return newPacketRingWithArena(make([]byte, arenaBytes))
+}
+
+// Create a ring that stores its packets in arena, which may be a memory mapped file (see TieredRing)
+func newPacketRingWithArena(arena []byte) *PacketRing {
+	return &PacketRing{
+		arena:   arena,
+		lastVPS: -1,
+		lastSPS: -1,
+		lastPPS: -1,
+	}
+}
+
+// Returns the codec of the packets in the ring
+func (r *PacketRing) Codec() Codec {
+	return r.codec
+}
+
+// Set the codec of the packets that will be added.
+// Packets don't record their codec individually, so if the codec changes, the ring is cleared.
+func (r *PacketRing) SetCodec(codec Codec) {
+	if codec != r.codec {
+		r.Clear()
+		r.codec = codec
+		r.lastVPS = -1
+		r.lastSPS = -1
+		r.lastPPS = -1
+	}
+}
+
+// Returns the size of the arena
+func (r *PacketRing) Capacity() int {
+	return len(r.arena)
+}
+
+// Returns the number of packets in the ring
+func (r *PacketRing) Len() int {
+	return r.packets.len()
+}
+
+// Returns the number of bytes used by the packets in the ring (excluding any wasted space at the wrap point)
+func (r *PacketRing) Bytes() int {
+	return r.bytes
+}
+
+// Add a packet, copying the NALUs into the arena, and evicting old packets if necessary.
+// The NALUs must not have an annex-b prefix (this is what gortsplib gives us).
+// Returns false if the packet is larger than the entire arena.
+func (r *PacketRing) Add(nalus [][]byte, pts time.Duration, ptsEqualsDTS bool) bool {
+	return r.add(len(nalus), func(i int) []byte { return nalus[i] }, pts, ptsEqualsDTS)
+}
+
+// AddPacket is like Add, but it reads the NALUs from a DecodedPacket, whose NALUs may or may not have a prefix.
+// The packet is not retained.
+func (r *PacketRing) AddPacket(packet *DecodedPacket) bool {
+	return r.add(len(packet.H264NALUs), func(i int) []byte { return packet.H264NALUs[i].RawPayload() }, packet.H264PTS, packet.PTSEqualsDTS)
+}
+
+// Add a packet of nNALUs NALUs, where nalu(i) returns the raw (unprefixed) bytes of NALU i
+func (r *PacketRing) add(nNALUs int, nalu func(i int) []byte, pts time.Duration, ptsEqualsDTS bool) bool {
+	size := 0
+	for i := 0; i < nNALUs; i++ {
+		size += len(NALUPrefix) + len(nalu(i))
+	}
+	if size > len(r.arena) {
+		return false
+	}
+
+	offset := 0
+	for {
+		var ok bool
+		if offset, ok = r.findSpace(size); ok {
+			break
+		}
+		r.popFront()
+	}
+
+	rec := packetRecord{
+		offset:       offset,
+		size:         size,
+		firstNALU:    r.naluSeq,
+		nNALUs:       nNALUs,
+		pts:          pts,
+		ptsEqualsDTS: ptsEqualsDTS,
+	}
+	pos := offset
+	haveIDR := false
+	for i := 0; i < nNALUs; i++ {
+		n := nalu(i)
+		switch NALUKindOf(r.codec, n) {
+		case NALUKindKeyframe:
+			haveIDR = true
+		case NALUKindVPS:
+			r.lastVPS = r.packetSeq
+		case NALUKindSPS:
+			r.lastSPS = r.packetSeq
+		case NALUKindPPS:
+			r.lastPPS = r.packetSeq
+		}
+		start := pos
+		pos += copy(r.arena[pos:], NALUPrefix)
+		pos += copy(r.arena[pos:], n)
+		r.nalus.push(naluRecord{offset: start, size: pos - start})
+		r.naluSeq++
+	}
+	r.packets.push(rec)
+	r.head = offset + size
+	r.bytes += size
+	if haveIDR {
+		r.keyframes.push(keyframeRecord{
+			packet: r.packetSeq,
+			vps:    r.lastVPS,
+			sps:    r.lastSPS,
+			pps:    r.lastPPS,
+			pts:    pts,
+		})
+	}
+	r.packetSeq++
+	return true
+}
+
+// Returns the index of the newest packet that contains a keyframe, or -1 if there is none.
+func (r *PacketRing) LatestKeyframe() int {
+	if r.keyframes.len() == 0 {
+		return -1
+	}
+	return int(r.keyframes.at(r.keyframes.len()-1).packet - r.packetPop)
+}
+
+// Returns the indices of the packets in [start, end) that contain a keyframe, relative to start.
+// This only reads the keyframe index, so it doesn't touch the packets.
+func (r *PacketRing) KeyframesIn(start, end int) []int {
+	var out []int
+	for i := 0; i < r.keyframes.len(); i++ {
+		idx := int(r.keyframes.at(i).packet - r.packetPop)
+		if idx >= start && idx < end {
+			out = append(out, idx-start)
+		}
+	}
+	return out
+}
+
+// Find the starting point for a video that begins with the newest keyframe whose PTS is at most maxPTS.
+// The returned index also includes the parameter sets (SPS and PPS, and VPS for H265) that precede the keyframe.
+// Returns -1 if there is no such keyframe, or if one of its parameter sets has already been evicted.
+// This is a binary search, so it costs O(log n).
+func (r *PacketRing) FindKeyframeStart(maxPTS time.Duration) int {
+	n := r.keyframes.len()
+	// first keyframe with pts > maxPTS
+	k := sort.Search(n, func(i int) bool {
+		return r.keyframes.at(i).pts > maxPTS
+	})
+	if k == 0 {
+		return -1
+	}
+	start := r.keyframes.at(k - 1).start(r.codec)
+	if start < r.packetPop {
+		return -1
+	}
+	return int(start - r.packetPop)
+}
+
+// Discard the oldest packet
+func (r *PacketRing) Next() {
+	r.popFront()
+}
+
+// Discard all packets
+func (r *PacketRing) Clear() {
+	for r.packets.len() != 0 {
+		r.popFront()
+	}
+}
+
+// Returns the PTS of packet i (0 is the oldest packet)
+func (r *PacketRing) PTS(i int) time.Duration {
+	return r.packets.at(i).pts
+}
+
+// Returns true if packet i contains a NALU of H264 type t. This is always false for H265 (see HasKind).
+func (r *PacketRing) HasType(i int, t h264.NALUType) bool {
+	if r.codec != CodecH264 {
+		return false
+	}
+	p := r.packets.at(i)
+	for j := 0; j < p.nNALUs; j++ {
+		n := r.nalus.at(int(p.firstNALU - r.naluPop + int64(j)))
+		if n.size > len(NALUPrefix) && h264.NALUType(r.arena[n.offset+len(NALUPrefix)]&31) == t {
+			return true
+		}
+	}
+	return false
+}
+
+// Returns true if packet i contains a NALU of kind k
+func (r *PacketRing) HasKind(i int, k NALUKind) bool {
+	p := r.packets.at(i)
+	for j := 0; j < p.nNALUs; j++ {
+		n := r.nalus.at(int(p.firstNALU - r.naluPop + int64(j)))
+		if NALUKindOf(r.codec, r.arena[n.offset+len(NALUPrefix):n.offset+n.size]) == k {
+			return true
+		}
+	}
+	return false
+}
+
+// Returns a deep copy of packet i
+func (r *PacketRing) ClonePacket(i int) *DecodedPacket {
+	p := r.packets.at(i)
+	buf := make([]byte, p.size)
+	copy(buf, r.arena[p.offset:p.offset+p.size])
+	return r.wrapPacket(p, buf, make([]NALU, p.nNALUs))
+}
+
+// Returns a deep copy of packets [start, end).
+// All of the NALU payloads share a single allocation, and the NALU headers share another.
+func (r *PacketRing) Extract(start, end int) []*DecodedPacket {
+	totalBytes := 0
+	totalNALUs := 0
+	for i := start; i < end; i++ {
+		p := r.packets.at(i)
+		totalBytes += p.size
+		totalNALUs += p.nNALUs
+	}
+	buf := make([]byte, totalBytes)
+	nalus := make([]NALU, totalNALUs)
+	packets := make([]DecodedPacket, end-start)
+	out := make([]*DecodedPacket, end-start)
+	for i := start; i < end; i++ {
+		p := r.packets.at(i)
+		copy(buf, r.arena[p.offset:p.offset+p.size])
+		packet := &packets[i-start]
+		*packet = *r.wrapPacket(p, buf[:p.size:p.size], nalus[:p.nNALUs:p.nNALUs])
+		out[i-start] = packet
+		buf = buf[p.size:]
+		nalus = nalus[p.nNALUs:]
+	}
+	return out
+}
+
+// Build a DecodedPacket from p, where buf is a copy of p's bytes
+func (r *PacketRing) wrapPacket(p packetRecord, buf []byte, nalus []NALU) *DecodedPacket {
+	for j := 0; j < p.nNALUs; j++ {
+		n := r.nalus.at(int(p.firstNALU - r.naluPop + int64(j)))
+		start := n.offset - p.offset
+		nalus[j] = NALU{
+			PrefixLen: len(NALUPrefix),
+			Payload:   buf[start : start+n.size : start+n.size],
+		}
+	}
+	return &DecodedPacket{
+		H264NALUs:    nalus,
+		H264PTS:      p.pts,
+		Codec:        r.codec,
+		PTSEqualsDTS: p.ptsEqualsDTS,
+	}
+}
+
+// Returns the number of arena bytes that packet would consume
+func packetSize(packet *DecodedPacket) int {
+	size := 0
+	for _, n := range packet.H264NALUs {
+		size += len(NALUPrefix) + len(n.RawPayload())
+	}
+	return size
+}
+
+// Returns true if a packet of size bytes can be added without evicting anything
+func (r *PacketRing) fits(size int) bool {
+	_, ok := r.findSpace(size)
+	return ok
+}
+
+// Returns true if there is a keyframe with a PTS of at most maxPTS
+func (r *PacketRing) hasKeyframeBefore(maxPTS time.Duration) bool {
+	return r.keyframes.len() != 0 && r.keyframes.at(0).pts <= maxPTS
+}
+
+// Move the oldest GOP (everything up to the parameter sets and keyframe that start the next GOP) into dst.
+// dst must have the same codec as r.
+// If there is only one GOP, then all packets are moved.
+func (r *PacketRing) spillGOP(dst *PacketRing) {
+	end := r.packetSeq
+	for i := 0; i < r.keyframes.len(); i++ {
+		kf := r.keyframes.at(i)
+		start := kf.packet
+		if kf.sps >= r.packetPop {
+			start = min(start, kf.sps)
+		}
+		if kf.pps >= r.packetPop {
+			start = min(start, kf.pps)
+		}
+		if r.codec == CodecH265 && kf.vps >= r.packetPop {
+			start = min(start, kf.vps)
+		}
+		if start > r.packetPop {
+			end = start
+			break
+		}
+	}
+	for r.packetPop < end {
+		p := r.packets.at(0)
+		first := int(p.firstNALU - r.naluPop)
+		dst.add(p.nNALUs, func(j int) []byte {
+			n := r.nalus.at(first + j)
+			return r.arena[n.offset+len(NALUPrefix) : n.offset+n.size]
+		}, p.pts, p.ptsEqualsDTS)
+		r.popFront()
+	}
+}
+
+// Find a contiguous region of size bytes, without evicting anything
+func (r *PacketRing) findSpace(size int) (int, bool) {
+	if r.packets.len() == 0 {
+		return 0, true
+	}
+	tail := r.packets.at(0).offset
+	if r.head > tail {
+		// Used region is [tail, head). Try after head, then wrap around to the start.
+		if len(r.arena)-r.head >= size {
+			return r.head, true
+		}
+		if tail >= size {
+			return 0, true
+		}
+		return 0, false
+	}
+	// Used region has wrapped around, so the only free space is [head, tail)
+	if tail-r.head >= size {
+		return r.head, true
+	}
+	return 0, false
+}
+
+func (r *PacketRing) popFront() {
+	p := r.packets.popFront()
+	for j := 0; j < p.nNALUs; j++ {
+		r.nalus.popFront()
+	}
+	r.naluPop += int64(p.nNALUs)
+	r.bytes -= p.size
+	r.packetPop++
+	for r.keyframes.len() != 0 && r.keyframes.at(0).packet < r.packetPop {
+		r.keyframes.popFront()
+	}
+	if r.packets.len() == 0 {
+		r.head = 0
+	}
+}
+
+// fifo is a growable ring buffer. Once it has reached its steady state size, it stops allocating.
+type fifo[T any] struct {
+	buf   []T
+	start int
+	n     int
+}
+
+func (f *fifo[T]) len() int {
+	return f.n
+}
+
+func (f *fifo[T]) at(i int) T {
+	return f.buf[(f.start+i)%len(f.buf)]
+}
+
+func (f *fifo[T]) push(v T) {
+	if f.n == len(f.buf) {
+		grown := make([]T, max(16, 2*len(f.buf)))
+		for i := 0; i < f.n; i++ {
+			grown[i] = f.at(i)
+		}
+		f.buf = grown
+		f.start = 0
+	}
+	f.buf[(f.start+f.n)%len(f.buf)] = v
+	f.n++
+}
+
+func (f *fifo[T]) popFront() T {
+	v := f.buf[f.start]
+	f.start = (f.start + 1) % len(f.buf)
+	f.n--
+	return v
+}
@@ -0,0 +1,173 @@
+package videox
+
+import (
+	"bytes"
+	"math/rand"
+	"testing"
+	"time"
+
+	"github.com/aler9/gortsplib/pkg/h264"
+	"github.com/stretchr/testify/require"
+)
+
+// Create a NALU of the given type and size, with content that identifies it
+func makeTestNALU(t h264.NALUType, size int, seed int) []byte {
+	n := make([]byte, size)
+	n[0] = byte(t)
+	for i := 1; i < size; i++ {
+		n[i] = byte(seed + i)
+	}
+	return n
+}
+
+func TestPacketRing(t *testing.T) {
+	rng := rand.New(rand.NewSource(1))
+	ring := NewPacketRing(10000)
+
+	// What we expect to be inside the ring, oldest first
+	type expectPacket struct {
+		nalus [][]byte
+		pts   time.Duration
+	}
+	expect := []expectPacket{}
+
+	bytesOf := func(p expectPacket) int {
+		size := 0
+		for _, n := range p.nalus {
+			size += len(NALUPrefix) + len(n)
+		}
+		return size
+	}
+
+	verify := func() {
+		require.Equal(t, len(expect), ring.Len())
+		total := 0
+		for _, e := range expect {
+			total += bytesOf(e)
+		}
+		require.Equal(t, total, ring.Bytes())
+		all := ring.Extract(0, ring.Len())
+		for i, e := range expect {
+			require.Equal(t, e.pts, ring.PTS(i))
+			require.Equal(t, e.pts, all[i].H264PTS)
+			one := ring.ClonePacket(i)
+			for _, p := range []*DecodedPacket{all[i], one} {
+				require.Equal(t, len(e.nalus), len(p.H264NALUs))
+				for j, n := range e.nalus {
+					require.True(t, bytes.Equal(n, p.H264NALUs[j].RawPayload()))
+					require.True(t, bytes.Equal(NALUPrefix, p.H264NALUs[j].Payload[:len(NALUPrefix)]))
+				}
+			}
+			require.Equal(t, len(e.nalus) == 3, ring.HasType(i, h264.NALUTypeIDR))
+		}
+
+		// Compare the keyframe index against a brute force scan
+		latest := -1
+		for i := range expect {
+			if len(expect[i].nalus) == 3 {
+				latest = i
+			}
+		}
+		require.Equal(t, latest, ring.LatestKeyframe())
+		for _, maxPTS := range []time.Duration{-1, 0, 50 * time.Millisecond, 777 * time.Millisecond, time.Hour} {
+			want := -1
+			for i := range expect {
+				if len(expect[i].nalus) == 3 && expect[i].pts <= maxPTS {
+					want = i
+				}
+			}
+			require.Equal(t, want, ring.FindKeyframeStart(maxPTS))
+		}
+	}
+
+	for i := 0; i < 2000; i++ {
+		p := expectPacket{pts: time.Duration(i) * time.Millisecond}
+		if i%20 == 0 {
+			p.nalus = append(p.nalus, makeTestNALU(h264.NALUTypeSPS, 10, i))
+			p.nalus = append(p.nalus, makeTestNALU(h264.NALUTypePPS, 4, i))
+			p.nalus = append(p.nalus, makeTestNALU(h264.NALUTypeIDR, 500+rng.Intn(2000), i))
+		} else {
+			p.nalus = append(p.nalus, makeTestNALU(h264.NALUTypeNonIDR, 1+rng.Intn(300), i))
+		}
+		require.True(t, ring.Add(p.nalus, p.pts, true))
+		expect = append(expect, p)
+
+		// Mirror the FIFO eviction
+		total := 0
+		for _, e := range expect {
+			total += bytesOf(e)
+		}
+		for total > ring.Capacity() {
+			total -= bytesOf(expect[0])
+			expect = expect[1:]
+		}
+		// The ring may evict more than the minimum, because of wasted space at the wrap point
+		for len(expect) > ring.Len() {
+			expect = expect[1:]
+		}
+
+		if i%97 == 0 {
+			verify()
+		}
+		if i%500 == 499 {
+			// Drain
+			ring.Clear()
+			expect = expect[:0]
+			verify()
+		}
+	}
+	verify()
+
+	// A packet larger than the entire arena is rejected
+	require.False(t, ring.Add([][]byte{make([]byte, 10000)}, 0, true))
+}
+
+func TestPacketRingH265(t *testing.T) {
+	// H265 NALU headers are 2 bytes, with the type in bits 1..6 of the first byte
+	h265 := func(naluType byte, size int) []byte {
+		n := make([]byte, size)
+		n[0] = naluType << 1
+		n[1] = 1
+		return n
+	}
+	ring := NewPacketRing(10000)
+	ring.SetCodec(CodecH265)
+	ms := time.Millisecond
+	ring.Add([][]byte{h265(32, 20)}, 0, true)                                  // VPS
+	ring.Add([][]byte{h265(33, 30), h265(34, 8)}, 0, true)                     // SPS, PPS
+	ring.Add([][]byte{h265(19, 500)}, 0, true)                                 // IDR_W_RADL
+	ring.Add([][]byte{h265(1, 100)}, 40*ms, true)                              // TRAIL_R
+	ring.Add([][]byte{h265(0, 100)}, 80*ms, true)                              // TRAIL_N
+	ring.Add([][]byte{h265(33, 30), h265(34, 8), h265(21, 500)}, 120*ms, true) // SPS, PPS, CRA
+
+	require.Equal(t, CodecH265, ring.Codec())
+	require.Equal(t, 5, ring.LatestKeyframe())
+	require.Equal(t, []int{2, 5}, ring.KeyframesIn(0, ring.Len()))
+	// The first keyframe starts at its VPS. The second has no VPS of its own, so it starts at the first VPS.
+	require.Equal(t, 0, ring.FindKeyframeStart(100*ms))
+	require.Equal(t, 0, ring.FindKeyframeStart(time.Hour))
+	require.True(t, ring.HasKind(2, NALUKindKeyframe))
+	require.False(t, ring.HasKind(3, NALUKindKeyframe))
+	// H264 types never match in an H265 ring
+	require.False(t, ring.HasType(2, h264.NALUTypeIDR))
+
+	all := ring.Extract(0, ring.Len())
+	for _, p := range all {
+		require.Equal(t, CodecH265, p.Codec)
+	}
+	require.False(t, all[0].HasVisual())
+	require.True(t, all[2].IsKeyframe())
+	require.True(t, all[5].IsKeyframe())
+	require.False(t, all[3].IsKeyframe())
+	require.True(t, all[3].IsReference())
+	require.False(t, all[4].IsReference())
+
+	// Once the VPS is evicted, we can't start at either keyframe
+	ring.Next()
+	require.Equal(t, -1, ring.FindKeyframeStart(time.Hour))
+
+	// Changing the codec discards the H265 packets
+	ring.SetCodec(CodecH264)
+	require.Equal(t, 0, ring.Len())
+	require.Equal(t, -1, ring.LatestKeyframe())
+}
@@ -29,14 +29,22 @@ type NALU struct {
 // DecodedPacket is what we store in our ring buffer
 // This thing probably wants a better name...
 type DecodedPacket struct {
-	H264NALUs    []NALU
+	H264NALUs    []NALU // Despite the name, these are H265 NALUs if Codec is CodecH265
 	H264PTS      time.Duration
+	Codec        Codec // The zero value is CodecH264
 	PTSEqualsDTS bool
-	IsBacklog    bool // testing...
+	IsBacklog    bool      // testing...
+	RecvTime     time.Time // When we received the packet from the camera (zero if unknown)
 }
 
 type RawBuffer struct {
 	Packets []*DecodedPacket
+	Codec   Codec
+
+	// Indices of the packets that contain an IDR, in ascending order.
+	// This is filled in from the ring buffer's keyframe index when we extract.
+	// If nil, Keyframes() finds them by looking at the NALU types.
+	KeyframeIndex []int
 	//SPS     []byte
 	//PPS     []byte
 }
@@ -90,10 +98,31 @@ func (n *NALU) Type() h264.NALUType {
 	return h264.NALUType(n.Payload[i] & 31)
 }
 
+// Return the role of the NALU, for a stream of the given codec
+func (n *NALU) Kind(codec Codec) NALUKind {
+	return NALUKindOf(codec, n.RawPayload())
+}
+
+// Returns true if no other picture may use this NALU as a reference.
+// This is nal_ref_idc == 0 for H264 (see RefIDC), but H265 encodes it in the NALU type.
+func (n *NALU) IsNonReference(codec Codec) bool {
+	return isNonReferenceNALU(codec, n.RawPayload())
+}
+
+// Return nal_ref_idc, which is zero if no other frame uses this NALU as a reference
+func (n *NALU) RefIDC() int {
+	i := n.PrefixLen
+	if i >= len(n.Payload) {
+		return 0
+	}
+	return int(n.Payload[i]>>5) & 3
+}
+
 // Deep clone of packet buffer
 func (p *DecodedPacket) Clone() *DecodedPacket {
 	c := &DecodedPacket{
 		H264PTS:      p.H264PTS,
+		Codec:        p.Codec,
 		PTSEqualsDTS: p.PTSEqualsDTS,
 		IsBacklog:    p.IsBacklog,
 	}
@@ -104,8 +133,12 @@ func (p *DecodedPacket) Clone() *DecodedPacket {
 	return c
 }
 
-// Return true if this packet has a NALU of type t inside
+// Return true if this packet has a NALU of type t inside.
+// The type is an H264 type, so this is always false for H265 packets. See HasKind.
 func (p *DecodedPacket) HasType(t h264.NALUType) bool {
+	if p.Codec != CodecH264 {
+		return false
+	}
 	for _, n := range p.H264NALUs {
 		if n.Type() == t {
 			return true
@@ -114,9 +147,62 @@ func (p *DecodedPacket) HasType(t h264.NALUType) bool {
 	return false
 }
 
+// Return true if this packet has a NALU of kind k inside
+func (p *DecodedPacket) HasKind(k NALUKind) bool {
+	for _, n := range p.H264NALUs {
+		if n.Kind(p.Codec) == k {
+			return true
+		}
+	}
+	return false
+}
+
+// Return true if decoding can start from this packet (H264 IDR, or H265 IRAP)
+func (p *DecodedPacket) IsKeyframe() bool {
+	return p.HasKind(NALUKindKeyframe)
+}
+
 // Return true if this packet has one NALU which is an intermediate frame
 func (p *DecodedPacket) IsIFrame() bool {
-	return len(p.H264NALUs) == 1 && p.H264NALUs[0].Type() == h264.NALUTypeNonIDR
+	return len(p.H264NALUs) == 1 && p.H264NALUs[0].Kind(p.Codec) == NALUKindSlice
+}
+
+// Return true if this packet contains any frame data (as opposed to only SPS, PPS, SEI, etc)
+func (p *DecodedPacket) HasVisual() bool {
+	for _, n := range p.H264NALUs {
+		if n.Kind(p.Codec).IsVisual() {
+			return true
+		}
+	}
+	return false
+}
+
+// Return true if any frame data in this packet may be referenced by other frames.
+// A packet for which this is false can be dropped without damaging the rest of the stream.
+func (p *DecodedPacket) IsReference() bool {
+	for _, n := range p.H264NALUs {
+		if n.Kind(p.Codec).IsVisual() && !n.IsNonReference(p.Codec) {
+			return true
+		}
+	}
+	return false
+}
+
+// Returns the slice header of the first slice in this packet, or nil if there is no slice.
+// sps may be nil, if you don't need SliceHeader.FrameNum.
+// We only parse H264 slice headers, so this is always nil for H265 packets.
+func (p *DecodedPacket) FirstSliceHeader(sps *SPSInfo) *SliceHeader {
+	if p.Codec != CodecH264 {
+		return nil
+	}
+	for _, n := range p.H264NALUs {
+		t := n.Type()
+		if t == h264.NALUTypeIDR || t == h264.NALUTypeNonIDR {
+			h, _ := ParseSliceHeader(n.RawPayload(), sps)
+			return h
+		}
+	}
+	return nil
 }
 
 // Returns the number of bytes of NALU data.
@@ -131,8 +217,13 @@ func (p *DecodedPacket) PayloadBytes() int {
 
 // Clone a packet of NALUs and return the cloned packet
 func ClonePacket(ctx *gortsplib.ClientOnPacketRTPCtx) *DecodedPacket {
+	return CloneRawPacket(CodecH264, ctx.H264NALUs, ctx.H264PTS, ctx.PTSEqualsDTS)
+}
+
+// Clone raw NALUs (without annex-b prefixes) into a new packet
+func CloneRawPacket(codec Codec, raw [][]byte, pts time.Duration, ptsEqualsDTS bool) *DecodedPacket {
 	nalus := []NALU{}
-	for _, buf := range ctx.H264NALUs {
+	for _, buf := range raw {
 		// gortsplib re-uses buffers, so we need to make a copy here.
 		// while we're doing a memcpy, we might as well append the prefix bytes.
 		// This saves us one additional memcpy before we send the NALUs out for
@@ -141,19 +232,31 @@ func ClonePacket(ctx *gortsplib.ClientOnPacketRTPCtx) *DecodedPacket {
 	}
 	return &DecodedPacket{
 		H264NALUs:    nalus,
-		H264PTS:      ctx.H264PTS,
-		PTSEqualsDTS: ctx.PTSEqualsDTS,
+		H264PTS:      pts,
+		Codec:        codec,
+		PTSEqualsDTS: ptsEqualsDTS,
+		RecvTime:     time.Now(),
 	}
 }
 
 // Extract saved buffer into an MPEGTS stream
 func (r *RawBuffer) SaveToMPEGTS(log log.Log, output io.Writer) error {
-	sps := r.FirstNALUOfType(h264.NALUTypeSPS)
-	pps := r.FirstNALUOfType(h264.NALUTypePPS)
-	if sps == nil || pps == nil {
-		return fmt.Errorf("Stream has no SPS or PPS")
+	params, err := r.firstParameterSets()
+	if err != nil {
+		return fmt.Errorf("Stream has no %w", err)
+	}
+	ps := ParameterSets{}
+	for _, n := range params {
+		switch n.Kind(r.Codec) {
+		case NALUKindVPS:
+			ps.VPS = n.RawPayload()
+		case NALUKindSPS:
+			ps.SPS = n.RawPayload()
+		case NALUKindPPS:
+			ps.PPS = n.RawPayload()
+		}
 	}
-	encoder, err := NewMPEGTSEncoder(log, output, sps.RawPayload(), pps.RawPayload())
+	encoder, err := NewMPEGTSEncoder(log, output, r.Codec, ps)
 	if err != nil {
 		return fmt.Errorf("Failed to start MPEGTS encoder: %w", err)
 	}
@@ -171,7 +274,7 @@ func (r *RawBuffer) SaveToMPEGTS(log log.Log, output io.Writer) error {
 	// ensure that incoming packets don't overwrite the old frames that
 	// we haven't yet written out.
 	for _, packet := range r.Packets {
-		// encode H264 NALUs into MPEG-TS
+		// encode NALUs into MPEG-TS
 		log.Infof("MPGTS encode packet PTS:%v", packet.H264PTS)
 		err := encoder.Encode(packet.H264NALUs, packet.H264PTS)
 		if err != nil {
@@ -184,26 +287,26 @@ func (r *RawBuffer) SaveToMPEGTS(log log.Log, output io.Writer) error {
 
 // Decode SPS and PPS to extract header information
 func (r *RawBuffer) DecodeHeader() (width, height int, err error) {
-	sps := r.FirstNALUOfType(h264.NALUTypeSPS)
+	sps := r.FirstNALUOfKind(NALUKindSPS)
 	if sps == nil {
 		return 0, 0, fmt.Errorf("Failed to find SPS NALU")
 	}
-	return ParseSPS(sps.RawPayload())
+	return ParseSPSOf(r.Codec, sps.RawPayload())
 }
 
-// Returns the first NALU of the given type, or nil if none found
-func (r *RawBuffer) FirstNALUOfType(ofType h264.NALUType) *NALU {
-	i, j := r.IndexOfFirstNALUOfType(ofType)
+// Returns the first NALU of the given kind, or nil if none found
+func (r *RawBuffer) FirstNALUOfKind(kind NALUKind) *NALU {
+	i, j := r.IndexOfFirstNALUOfKind(kind)
 	if i == -1 {
 		return nil
 	}
 	return &r.Packets[i].H264NALUs[j]
 }
 
-func (r *RawBuffer) IndexOfFirstNALUOfType(ofType h264.NALUType) (packetIdx int, indexInPacket int) {
+func (r *RawBuffer) IndexOfFirstNALUOfKind(kind NALUKind) (packetIdx int, indexInPacket int) {
 	for i, packet := range r.Packets {
 		for j := range packet.H264NALUs {
-			if packet.H264NALUs[j].Type() == ofType {
+			if packet.H264NALUs[j].Kind(r.Codec) == kind {
 				return i, j
 			}
 		}
@@ -211,52 +314,67 @@ func (r *RawBuffer) IndexOfFirstNALUOfType(ofType h264.NALUType) (packetIdx int,
 	return -1, -1
 }
 
-func (r *RawBuffer) SaveToMP4(filename string) error {
-	width, height, err := r.DecodeHeader()
-	if err != nil {
-		return err
+// Returns the first NALU of each of the parameter sets that our codec needs, in decoder order.
+// If one is missing, the error names it.
+func (r *RawBuffer) firstParameterSets() ([]*NALU, error) {
+	var out []*NALU
+	for _, kind := range ParameterSetKinds(r.Codec) {
+		n := r.FirstNALUOfKind(kind)
+		if n == nil {
+			return nil, fmt.Errorf("%v", kind)
+		}
+		out = append(out, n)
 	}
+	return out, nil
+}
 
-	firstSPS := r.FirstNALUOfType(h264.NALUTypeSPS)
-	firstPPS := r.FirstNALUOfType(h264.NALUTypePPS)
-	firstIDR_i, _ := r.IndexOfFirstNALUOfType(h264.NALUTypeIDR)
-	if firstSPS == nil {
-		return errors.New("No SPS found")
-	}
-	if firstPPS == nil {
-		return errors.New("No PPS found")
+func (r *RawBuffer) SaveToMP4(filename string) error {
+	return r.saveMP4(func() (*VideoEncoder, error) {
+		return NewVideoEncoder("mp4", r.Codec, filename)
+	}, len(r.Packets))
+}
+
+// Write the buffer out as fragmented MP4, without going through a file.
+// Packets are muxed in small batches, so output is streamed out as we go, instead of
+// accumulating the entire video in memory.
+func (r *RawBuffer) SaveToMP4Writer(output io.Writer) error {
+	return r.saveMP4(func() (*VideoEncoder, error) {
+		return NewVideoEncoderWriter("mp4", r.Codec, output)
+	}, 30)
+}
+
+// newEncoder is only called once we know that the buffer contains a playable video.
+// batchSize is the number of packets that we send to the encoder in a single call.
+func (r *RawBuffer) saveMP4(newEncoder func() (*VideoEncoder, error), batchSize int) error {
+	params, err := r.firstParameterSets()
+	if err != nil {
+		return fmt.Errorf("No %w found", err)
 	}
+	firstIDR_i, _ := r.IndexOfFirstNALUOfKind(NALUKindKeyframe)
 	if firstIDR_i == -1 {
 		return errors.New("No IDR found")
 	}
 	baseTime := r.Packets[firstIDR_i].H264PTS
 
-	enc, err := NewVideoEncoder("mp4", filename, width, height)
+	enc, err := newEncoder()
 	if err != nil {
 		return err
 	}
 	defer enc.Close()
 
-	err = enc.WritePacket(0, 0, *firstSPS)
-	if err != nil {
-		return err
-	}
-	err = enc.WritePacket(0, 0, *firstPPS)
-	if err != nil {
-		return err
+	for _, n := range params {
+		if err = enc.WritePacket(0, 0, *n); err != nil {
+			return err
+		}
 	}
 
-	for _, packet := range r.Packets[firstIDR_i:] {
-		dts := packet.H264PTS - baseTime
-		//pts := dts + time.Nanosecond*1000
-		pts := dts
-		for _, nalu := range packet.H264NALUs {
-			err := enc.WritePacket(dts, pts, nalu)
-			if err != nil {
-				return err
-			}
-			//dts += 10000
-			//pts += 10000
+	for i := firstIDR_i; i < len(r.Packets); i += batchSize {
+		end := i + batchSize
+		if end > len(r.Packets) {
+			end = len(r.Packets)
+		}
+		if err = enc.WritePackets(r.Packets[i:end], baseTime); err != nil {
+			return err
 		}
 	}
 
@@ -268,7 +386,8 @@ func (r *RawBuffer) SaveToMP4(filename string) error {
 	return nil
 }
 
-// Dump each NALU to a .raw file
+// Dump each NALU to a .raw file.
+// SaveCapture writes the same data into a single file, which is much faster to load.
 func (r *RawBuffer) DumpBin(dir string) error {
 	files, _ := filepath.Glob(dir + "/*.raw")
 	for _, file := range files {
@@ -295,9 +414,98 @@ func (r *RawBuffer) ResetPTS() {
 	}
 }
 
-// Pick the middle frame
-func (r *RawBuffer) ExtractThumbnail() (image.Image, error) {
-	decoder, err := NewH264Decoder()
+// Returns the indices of the packets that contain a keyframe (H264 IDR, or H265 IRAP)
+func (r *RawBuffer) Keyframes() []int {
+	if r.KeyframeIndex != nil {
+		return r.KeyframeIndex
+	}
+	var idx []int
+	for i, p := range r.Packets {
+		for _, n := range p.H264NALUs {
+			if n.Kind(r.Codec) == NALUKindKeyframe {
+				idx = append(idx, i)
+				break
+			}
+		}
+	}
+	return idx
+}
+
+// Pick a frame from the middle of the video, scaled to the given width (or full resolution, if width is 0).
+// We decode the keyframe that is closest to the middle, along with the parameter sets before it, which is far
+// cheaper than decoding every frame from the start. If that fails, we fall back to decoding from the start.
+func (r *RawBuffer) ExtractThumbnail(width int) (image.Image, error) {
+	keyframes := r.Keyframes()
+	if len(keyframes) != 0 {
+		mid := len(r.Packets) / 2
+		best := keyframes[0]
+		for _, k := range keyframes {
+			if absInt(k-mid) < absInt(best-mid) {
+				best = k
+			}
+		}
+		if img, err := r.decodeKeyframe(best, width); err == nil {
+			return img, nil
+		}
+	}
+	return r.extractThumbnailFromStart(width)
+}
+
+func absInt(x int) int {
+	if x < 0 {
+		return -x
+	}
+	return x
+}
+
+// Decode the keyframe in packet idx
+func (r *RawBuffer) decodeKeyframe(idx int, width int) (image.Image, error) {
+	// Find the most recent parameter sets at or before the keyframe
+	kinds := ParameterSetKinds(r.Codec)
+	params := make([]*NALU, len(kinds))
+	missing := len(kinds)
+	for i := idx; i >= 0 && missing != 0; i-- {
+		for j := range r.Packets[i].H264NALUs {
+			n := &r.Packets[i].H264NALUs[j]
+			kind := n.Kind(r.Codec)
+			for k := range kinds {
+				if kind == kinds[k] && params[k] == nil {
+					params[k] = n
+					missing--
+				}
+			}
+		}
+	}
+	if missing != 0 {
+		return nil, errors.New("No parameter sets before keyframe")
+	}
+
+	// Software, with low delay, so that the frame comes out as soon as we've sent it.
+	// Hardware decoders have a few frames of latency, and cost more to open than they save on a single frame.
+	decoder, err := NewH264DecoderWithOptions(DecoderOptions{Codec: r.Codec, Fast: true, LowDelay: true, Threads: 1})
+	if err != nil {
+		return nil, err
+	}
+	defer decoder.Close()
+	for _, n := range params {
+		decoder.DecodeAndDiscard(*n)
+	}
+	for _, n := range r.Packets[idx].H264NALUs {
+		switch n.Kind(r.Codec) {
+		case NALUKindVPS, NALUKindSPS, NALUKindPPS:
+			continue
+		}
+		img, _ := decoder.DecodeScaled(n, width, 0)
+		if img != nil {
+			return cloneImage(img), nil
+		}
+	}
+	return nil, errors.New("Keyframe did not decode")
+}
+
+// Decode every frame until we reach the middle of the video
+func (r *RawBuffer) extractThumbnailFromStart(width int) (image.Image, error) {
+	decoder, err := NewH264DecoderWithOptions(DecoderOptions{Codec: r.Codec, AllowHardware: true, Fast: true})
 	if err != nil {
 		return nil, err
 	}
@@ -306,13 +514,12 @@ func (r *RawBuffer) ExtractThumbnail() (image.Image, error) {
 	midPacket := len(r.Packets) - 1
 	for i := 0; i < len(r.Packets); i++ {
 		for _, n := range r.Packets[i].H264NALUs {
-			img, _ := decoder.Decode(n)
+			img, _ := decoder.DecodeScaled(n, width, 0)
 			if img != nil {
 				if firstImgPacket == -1 {
 					// return the frame halfway between the first keyframe and the end,
 					// because there will often be a chunk of unusable packets at the front,
 					// before our first keyframe.
-					// which begs the question: why do we ever record that junk before a keyframe?
 					firstImgPacket = i
 					midPacket = i + (len(r.Packets)-i)/2
 				}
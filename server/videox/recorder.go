@@ -0,0 +1,75 @@
+package videox
+
+// #include "helper.h"
+// #include <stdlib.h>
+import "C"
+import (
+	"runtime"
+	"time"
+	"unsafe"
+)
+
+// Recorder writes a continuous stream into a sequence of fragmented MP4 files.
+// Every IDR starts a new fragment, so if the process dies, we lose at most one fragment.
+// The codec parameters are carried over from one file to the next, so you can start a new
+// file on any IDR.
+type Recorder struct {
+	rec unsafe.Pointer
+}
+
+// NewRecorder creates a new recorder.
+// Files are fsync'ed no more often than syncInterval (the fsync runs on a background thread).
+// You must Close() the recorder when you are done with it.
+func NewRecorder(format string, codec Codec, syncInterval time.Duration) (*Recorder, error) {
+	var cerr *C.char
+	cFormat := C.CString(format)
+	r := C.MakeRecorder(&cerr, cFormat, C.int(codec), C.int(syncInterval.Milliseconds()))
+	C.free(unsafe.Pointer(cFormat))
+	if err := takeCErr(cerr); err != nil {
+		return nil, err
+	}
+	return &Recorder{
+		rec: r,
+	}, nil
+}
+
+// Record the time spent writing packets into stats. This takes effect from the next segment.
+func (r *Recorder) SetStats(stats *PipelineStats) {
+	C.Recorder_SetStats(r.rec, stats.cptr())
+}
+
+// StartSegment finishes the current file, and starts writing to a new file.
+// The new file begins at the next IDR, so call this immediately before writing a packet that contains an IDR.
+func (r *Recorder) StartSegment(filename string) error {
+	var cerr *C.char
+	cFilename := C.CString(filename)
+	C.Recorder_StartSegment(&cerr, r.rec, cFilename)
+	C.free(unsafe.Pointer(cFilename))
+	return takeCErr(cerr)
+}
+
+// WritePackets writes packets into the current file.
+// The DTS and PTS of every NALU is set to packet.H264PTS - baseTime.
+// If StartSegment has not yet been called, then the packets are discarded.
+func (r *Recorder) WritePackets(packets []*DecodedPacket, baseTime time.Duration) error {
+	var pinner runtime.Pinner
+	defer pinner.Unpin()
+	nalus := makeEncoderNALUs(&pinner, packets, baseTime)
+	if len(nalus) == 0 {
+		return nil
+	}
+	var cerr *C.char
+	C.Recorder_WritePackets(&cerr, r.rec, &nalus[0], C.size_t(len(nalus)))
+	return takeCErr(cerr)
+}
+
+// Close finishes the current file, and frees all resources.
+func (r *Recorder) Close() error {
+	if r.rec == nil {
+		return nil
+	}
+	var cerr *C.char
+	C.Recorder_Close(&cerr, r.rec)
+	r.rec = nil
+	return takeCErr(cerr)
+}
@@ -0,0 +1,96 @@
+package videox
+
+// #include <stdlib.h>
+// #include "stats.h"
+import "C"
+import (
+	"sync"
+	"sync/atomic"
+	"time"
+	"unsafe"
+
+	"github.com/bmharper/cyclops/server/metrics"
+)
+
+// PipelineStats holds the timings of the video pipeline of one camera (see stats.h).
+// The struct lives in C memory, so that the C++ decoder, JPEG compressor and muxer can hold a pointer
+// to it, and record into it without calling back into Go.
+type PipelineStats struct {
+	c *C.PipelineStats
+}
+
+// PipelineStatsSnapshot is a copy of PipelineStats at a point in time
+type PipelineStatsSnapshot struct {
+	Decode       metrics.HistogramSnapshot
+	Scale        metrics.HistogramSnapshot
+	JPEG         metrics.HistogramSnapshot
+	EncoderWrite metrics.HistogramSnapshot
+	Motion       metrics.HistogramSnapshot
+}
+
+var (
+	pipelineStatsLock sync.Mutex
+	pipelineStats     = map[string]*PipelineStats{}
+)
+
+func init() {
+	if C.STATS_HISTOGRAM_BUCKETS != metrics.NumBuckets {
+		panic("STATS_HISTOGRAM_BUCKETS does not match metrics.NumBuckets")
+	}
+}
+
+// Returns the stats for the given name (eg a camera name), creating them if necessary.
+// Stats are never freed, because decoders and recorders may still be holding a pointer after
+// their camera has been closed. This also keeps the counters monotonic when a camera is restarted,
+// which is what Prometheus expects.
+func PipelineStatsFor(name string) *PipelineStats {
+	pipelineStatsLock.Lock()
+	defer pipelineStatsLock.Unlock()
+	s := pipelineStats[name]
+	if s == nil {
+		s = &PipelineStats{
+			c: (*C.PipelineStats)(C.calloc(1, C.sizeof_PipelineStats)),
+		}
+		pipelineStats[name] = s
+	}
+	return s
+}
+
+// Returns the C struct, or nil if s is nil
+func (s *PipelineStats) cptr() *C.PipelineStats {
+	if s == nil {
+		return nil
+	}
+	return s.c
+}
+
+// Record a sample into the Scale histogram. This mirrors StatsHistogram_Add, for the one stage that runs in Go.
+func (s *PipelineStats) observeScale(d time.Duration) {
+	h := &s.c.Scale
+	atomic.AddUint64((*uint64)(unsafe.Pointer(&h.Count)), 1)
+	if d > 0 {
+		atomic.AddUint64((*uint64)(unsafe.Pointer(&h.SumNS)), uint64(d))
+	}
+	atomic.AddUint64((*uint64)(unsafe.Pointer(&h.Buckets[metrics.BucketOf(d)])), 1)
+}
+
+func (s *PipelineStats) Snapshot() PipelineStatsSnapshot {
+	return PipelineStatsSnapshot{
+		Decode:       snapshotHistogram(&s.c.Decode),
+		Scale:        snapshotHistogram(&s.c.Scale),
+		JPEG:         snapshotHistogram(&s.c.JPEG),
+		EncoderWrite: snapshotHistogram(&s.c.EncoderWrite),
+		Motion:       snapshotHistogram(&s.c.Motion),
+	}
+}
+
+func snapshotHistogram(h *C.StatsHistogram) metrics.HistogramSnapshot {
+	s := metrics.HistogramSnapshot{
+		Count: atomic.LoadUint64((*uint64)(unsafe.Pointer(&h.Count))),
+		Sum:   time.Duration(atomic.LoadUint64((*uint64)(unsafe.Pointer(&h.SumNS)))),
+	}
+	for i := range s.Buckets {
+		s.Buckets[i] = atomic.LoadUint64((*uint64)(unsafe.Pointer(&h.Buckets[i])))
+	}
+	return s
+}
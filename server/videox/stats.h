@@ -0,0 +1,59 @@
+#pragma once
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Number of buckets in a StatsHistogram.
+// Bucket i counts samples below 2^i microseconds, and the last bucket counts everything else.
+// Must match metrics.NumBuckets in Go.
+#define STATS_HISTOGRAM_BUCKETS 24
+
+typedef struct StatsHistogram {
+	uint64_t Count;
+	uint64_t SumNS;
+	uint64_t Buckets[STATS_HISTOGRAM_BUCKETS];
+} StatsHistogram;
+
+// Timings of the video pipeline of one camera.
+// The C++ code records into this directly, with relaxed atomics, and Go reads it with atomic loads,
+// so recording a sample never costs a cgo call. See PipelineStats in stats.go.
+typedef struct PipelineStats {
+	StatsHistogram Decode;       // Time spent inside the decoder per frame (send + receive, including the download from the GPU)
+	StatsHistogram Scale;        // sws_scale (recorded by Go, around its call into swscale)
+	StatsHistogram JPEG;         // YUV to JPEG compression
+	StatsHistogram EncoderWrite; // Muxing packets into an mp4 or mpegts file
+	StatsHistogram Motion;       // Pixel motion detection on the Y plane (LumaMotion_Process)
+} PipelineStats;
+
+// Monotonic clock, in nanoseconds
+static inline int64_t StatsNow(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// Record a sample of ns nanoseconds. h may be NULL.
+static inline void StatsHistogram_Add(StatsHistogram* h, int64_t ns) {
+	if (h == NULL)
+		return;
+	uint64_t us     = ns > 0 ? (uint64_t) ns / 1000 : 0;
+	int      bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+	if (bucket >= STATS_HISTOGRAM_BUCKETS)
+		bucket = STATS_HISTOGRAM_BUCKETS - 1;
+	__atomic_fetch_add(&h->Count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->SumNS, ns > 0 ? (uint64_t) ns : 0, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->Buckets[bucket], 1, __ATOMIC_RELAXED);
+}
+
+// Record the time since start (from StatsNow). h may be NULL.
+static inline void StatsHistogram_Since(StatsHistogram* h, int64_t start) {
+	if (h != NULL)
+		StatsHistogram_Add(h, StatsNow() - start);
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,230 @@
+package videox
+
+import (
+	"fmt"
+	"os"
+	"path/filepath"
+	"syscall"
+	"time"
+)
+
+// TieredRing is a PacketRing in RAM, with an optional second PacketRing behind it, whose arena is a
+// memory mapped file. When the RAM ring is full, its oldest GOP is moved into the file, instead of being
+// discarded. This lets us keep minutes of pre-roll on a device with little RAM, because the file's pages
+// belong to the OS page cache, which can write them out and drop them whenever it likes.
+// Packets are indexed oldest first, across both tiers, so the file holds indices [0, disk.Len()),
+// and RAM holds the rest.
+// Whole GOPs are moved at a time, so a keyframe is always in the same tier as its parameter sets.
+// TieredRing is not thread safe.
+type TieredRing struct {
+	ram  *PacketRing
+	disk *PacketRing // nil if we have no spill file
+	mmap []byte      // The mapping backing disk.arena
+}
+
+func NewTieredRing(ramBytes int) *TieredRing {
+	return &TieredRing{
+		ram: NewPacketRing(ramBytes),
+	}
+}
+
+// Move evicted GOPs into filename, which is created (or reused) and preallocated to fileBytes.
+// Any packets already in the spill file are discarded.
+func (r *TieredRing) EnableSpill(filename string, fileBytes int) error {
+	mmap, err := MapSpillFile(filename, fileBytes)
+	if err != nil {
+		return err
+	}
+	return r.AttachSpill(mmap)
+}
+
+// Create (or reuse) filename, preallocate it to fileBytes, and map it, for AttachSpill.
+// This can take a while on slow disks, so it's separate from AttachSpill, to let callers do it
+// without holding whatever lock guards the ring.
+func MapSpillFile(filename string, fileBytes int) ([]byte, error) {
+	if err := os.MkdirAll(filepath.Dir(filename), 0770); err != nil {
+		return nil, err
+	}
+	f, err := os.OpenFile(filename, os.O_RDWR|os.O_CREATE, 0660)
+	if err != nil {
+		return nil, err
+	}
+	defer f.Close()
+	// Shrink a larger file from a previous run, so that we don't hold onto disk space we won't use
+	if err := f.Truncate(int64(fileBytes)); err != nil {
+		return nil, err
+	}
+	// Reserve the disk space up front, so that we can't hit ENOSPC halfway through a write to the
+	// mapping (which would be a SIGBUS). The page cache takes care of writing the mapping out.
+	if err := syscall.Fallocate(int(f.Fd()), 0, 0, int64(fileBytes)); err != nil {
+		return nil, fmt.Errorf("Failed to allocate %v bytes for %v: %w", fileBytes, filename, err)
+	}
+	mmap, err := syscall.Mmap(int(f.Fd()), 0, fileBytes, syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_SHARED)
+	if err != nil {
+		return nil, fmt.Errorf("Failed to map %v: %w", filename, err)
+	}
+	return mmap, nil
+}
+
+// Use a mapping from MapSpillFile as the spill tier. The ring takes ownership of mmap.
+func (r *TieredRing) AttachSpill(mmap []byte) error {
+	if err := r.DisableSpill(); err != nil {
+		syscall.Munmap(mmap)
+		return err
+	}
+	r.mmap = mmap
+	r.disk = newPacketRingWithArena(mmap)
+	r.disk.codec = r.ram.codec
+	return nil
+}
+
+// Returns the codec of the packets in the ring
+func (r *TieredRing) Codec() Codec {
+	return r.ram.Codec()
+}
+
+// Set the codec of the packets that will be added. If the codec changes, both tiers are cleared.
+func (r *TieredRing) SetCodec(codec Codec) {
+	r.ram.SetCodec(codec)
+	if r.disk != nil {
+		r.disk.SetCodec(codec)
+	}
+}
+
+// Drop the spill file's packets, and unmap it. The file itself is left on disk, so that its space
+// remains reserved for the next EnableSpill.
+func (r *TieredRing) DisableSpill() error {
+	if r.disk == nil {
+		return nil
+	}
+	r.disk = nil
+	err := syscall.Munmap(r.mmap)
+	r.mmap = nil
+	return err
+}
+
+// Returns the number of packets in the spill file
+func (r *TieredRing) spilled() int {
+	if r.disk == nil {
+		return 0
+	}
+	return r.disk.Len()
+}
+
+// Returns the ring holding packet i, and the index of the packet inside that ring
+func (r *TieredRing) locate(i int) (*PacketRing, int) {
+	d := r.spilled()
+	if i < d {
+		return r.disk, i
+	}
+	return r.ram, i - d
+}
+
+// Returns the total size of both tiers
+func (r *TieredRing) Capacity() int {
+	return r.ram.Capacity() + r.SpillCapacity()
+}
+
+// Returns the size of the spill file, or 0 if there is none
+func (r *TieredRing) SpillCapacity() int {
+	if r.disk == nil {
+		return 0
+	}
+	return r.disk.Capacity()
+}
+
+// Returns the number of packets in both tiers
+func (r *TieredRing) Len() int {
+	return r.spilled() + r.ram.Len()
+}
+
+// Returns the number of bytes used by the packets of both tiers
+func (r *TieredRing) Bytes() int {
+	return r.ram.Bytes() + r.SpillBytes()
+}
+
+// Returns the number of bytes used by the packets in the spill file
+func (r *TieredRing) SpillBytes() int {
+	if r.disk == nil {
+		return 0
+	}
+	return r.disk.Bytes()
+}
+
+// Add a packet to the RAM tier, moving the oldest GOPs into the spill file if necessary.
+// Returns false if the packet is larger than the RAM tier.
+func (r *TieredRing) AddPacket(packet *DecodedPacket) bool {
+	if r.disk != nil {
+		size := packetSize(packet)
+		for size <= r.ram.Capacity() && !r.ram.fits(size) {
+			r.ram.spillGOP(r.disk)
+		}
+	}
+	return r.ram.AddPacket(packet)
+}
+
+// Discard all packets
+func (r *TieredRing) Clear() {
+	r.ram.Clear()
+	if r.disk != nil {
+		r.disk.Clear()
+	}
+}
+
+// Returns the PTS of packet i (0 is the oldest packet)
+func (r *TieredRing) PTS(i int) time.Duration {
+	ring, j := r.locate(i)
+	return ring.PTS(j)
+}
+
+// Returns the index of the newest packet that contains a keyframe, or -1 if there is none.
+func (r *TieredRing) LatestKeyframe() int {
+	if k := r.ram.LatestKeyframe(); k != -1 {
+		return r.spilled() + k
+	}
+	if r.disk != nil {
+		return r.disk.LatestKeyframe()
+	}
+	return -1
+}
+
+// Returns the indices of the packets in [start, end) that contain a keyframe, relative to start.
+func (r *TieredRing) KeyframesIn(start, end int) []int {
+	d := r.spilled()
+	var out []int
+	if r.disk != nil && start < d {
+		out = r.disk.KeyframesIn(start, min(end, d))
+	}
+	if end > d {
+		offset := max(start, d)
+		for _, k := range r.ram.KeyframesIn(offset-d, end-d) {
+			out = append(out, offset-start+k)
+		}
+	}
+	return out
+}
+
+// See PacketRing.FindKeyframeStart
+func (r *TieredRing) FindKeyframeStart(maxPTS time.Duration) int {
+	if r.disk == nil || r.ram.hasKeyframeBefore(maxPTS) {
+		if k := r.ram.FindKeyframeStart(maxPTS); k != -1 {
+			return r.spilled() + k
+		}
+		return -1
+	}
+	return r.disk.FindKeyframeStart(maxPTS)
+}
+
+// Returns a deep copy of packets [start, end), which may span both tiers.
+// Packets in the spill file are read straight out of the mapping.
+func (r *TieredRing) Extract(start, end int) []*DecodedPacket {
+	d := r.spilled()
+	if start >= d {
+		return r.ram.Extract(start-d, end-d)
+	}
+	if end <= d {
+		return r.disk.Extract(start, end)
+	}
+	out := r.disk.Extract(start, d)
+	return append(out, r.ram.Extract(0, end-d)...)
+}
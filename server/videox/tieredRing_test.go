@@ -0,0 +1,89 @@
+package videox
+
+import (
+	"bytes"
+	"math/rand"
+	"path/filepath"
+	"testing"
+	"time"
+
+	"github.com/aler9/gortsplib/pkg/h264"
+	"github.com/stretchr/testify/require"
+)
+
+func TestTieredRing(t *testing.T) {
+	rng := rand.New(rand.NewSource(1))
+	ring := NewTieredRing(10000)
+	require.NoError(t, ring.EnableSpill(filepath.Join(t.TempDir(), "spill.ring"), 100000))
+	defer ring.DisableSpill()
+
+	added := [][][]byte{} // NALUs of every packet that we've added. Packet i has a PTS of i milliseconds.
+
+	// The ring must hold an unbroken run of the most recent packets, and every query must agree with a brute force scan
+	verify := func() {
+		n := ring.Len()
+		first := len(added) - n
+		all := ring.Extract(0, n)
+		require.Equal(t, n, len(all))
+		keyframes := []int{}
+		for i, p := range all {
+			require.Equal(t, time.Duration(first+i)*time.Millisecond, p.H264PTS)
+			require.Equal(t, p.H264PTS, ring.PTS(i))
+			expect := added[first+i]
+			require.Equal(t, len(expect), len(p.H264NALUs))
+			for j := range expect {
+				require.True(t, bytes.Equal(expect[j], p.H264NALUs[j].RawPayload()))
+			}
+			if len(expect) == 3 {
+				keyframes = append(keyframes, i)
+			}
+		}
+		require.Equal(t, keyframes, ring.KeyframesIn(0, n))
+		if len(keyframes) != 0 {
+			require.Equal(t, keyframes[len(keyframes)-1], ring.LatestKeyframe())
+		}
+		for _, ms := range []int{0, first - 1, first + n/3, first + n/2, len(added) - 5, len(added)} {
+			want := -1
+			for _, k := range keyframes {
+				if first+k <= ms {
+					want = k
+				}
+			}
+			require.Equal(t, want, ring.FindKeyframeStart(time.Duration(ms)*time.Millisecond))
+		}
+		// A range that straddles the tiers
+		if n > 10 {
+			mid := ring.Extract(n/2-5, n/2+5)
+			require.Equal(t, all[n/2-5].H264PTS, mid[0].H264PTS)
+			require.Equal(t, all[n/2+4].H264PTS, mid[9].H264PTS)
+		}
+	}
+
+	for i := 0; i < 3000; i++ {
+		var nalus [][]byte
+		if i%20 == 0 {
+			nalus = append(nalus, makeTestNALU(h264.NALUTypeSPS, 10, i))
+			nalus = append(nalus, makeTestNALU(h264.NALUTypePPS, 4, i))
+			nalus = append(nalus, makeTestNALU(h264.NALUTypeIDR, 500+rng.Intn(2000), i))
+		} else {
+			nalus = append(nalus, makeTestNALU(h264.NALUTypeNonIDR, 1+rng.Intn(300), i))
+		}
+		packet := &DecodedPacket{H264PTS: time.Duration(i) * time.Millisecond}
+		for _, n := range nalus {
+			packet.H264NALUs = append(packet.H264NALUs, WrapRawNALU(n))
+		}
+		require.True(t, ring.AddPacket(packet))
+		added = append(added, nalus)
+		if i%97 == 0 {
+			verify()
+		}
+	}
+	verify()
+
+	// The spill file holds far more than RAM alone could
+	require.Greater(t, ring.SpillBytes(), 5*ring.ram.Capacity())
+	require.Greater(t, ring.Len(), 5*ring.ram.Len())
+
+	ring.Clear()
+	require.Equal(t, 0, ring.Len())
+}
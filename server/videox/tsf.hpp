@@ -24,6 +24,7 @@ tsf::fmt("%v", std::wstring("abc"))  -->  "abc"         <== std::wstring
 tsf::fmt("%.3f", 25.5)               -->  "25.500"      <== Use format strings as usual
 tsf::print("%v", "Hello world")      -->  "Hello world" <== Print to stdout
 tsf::print(stderr, "err %v", 5)      -->  "err 5"       <== Print to stderr (or any other FILE*)
+tsf::fmt("%v %d"_tsf, "abc", 123)    -->  "abc 123"     <== Compile time format string (see below)
 
 Known unsupported features:
 * Positional arguments
@@ -33,6 +34,7 @@ API:
 
 fmt           returns std::string.
 fmt_buf       is useful if you want to provide your own buffer to avoid memory allocations.
+              Given a std::string, it appends to the string, so a reused string stops allocating once it has grown.
 print         prints to stdout
 print(FILE*)  prints to any FILE*
 
@@ -45,6 +47,17 @@ implementation that wraps one of the lower level functions, and provides a 'cont
 custom functions defined for Escape_Q and Escape_q. These were originally added in order to provide
 quoting and escaping for SQL identifiers and SQL string literals.
 
+Compile time format strings:
+
+With "using namespace tsf::literals", the _tsf suffix turns a string literal into a type, so that
+fmt, fmt_buf and print can parse the format string, and check it against the argument types, at
+compile time. A mismatch, such as %d with a string, or the wrong number of arguments, is a compile error,
+instead of silently altered output. At runtime we only copy literal text and emit arguments, and plain
+%v, %d, %u and %s of integers and strings never touch snprintf. Tokens with flags or a width (eg %.3f or %08x)
+still go through snprintf, and produce the same output as the runtime path.
+%q and %Q need a context, so they are not available here. The _tsf suffix is a GNU extension
+(GCC and clang), which we use because C++14 cannot take a string literal as a template parameter.
+
 */
 
 #if defined(_MSC_VER)
@@ -61,6 +74,8 @@ typedef SSIZE_T ssize_t;
 #include <string.h>
 #include <assert.h>
 #include <string>
+#include <type_traits>
+#include <utility>
 
 namespace tsf {
 
@@ -656,4 +671,406 @@ inline TSF_FMT_API int fmt_snprintf(char* destination, size_t count, const char*
 
 } // namespace tsf
 
+// Compile time format strings.
+// See "Compile time format strings" at the top of this file.
+namespace tsf {
+
+// A format string that has been lifted into a type by the _tsf literal
+template <char... Cs>
+struct fmtstr {
+	static constexpr char str[] = {Cs..., 0};
+};
+
+template <char... Cs>
+constexpr char fmtstr<Cs...>::str[];
+
+namespace internal {
+
+// Maps an argument type to the fmtarg::Types that it is stored as, by mirroring fmtarg's constructors.
+// Types that only reach fmtarg through a user-defined conversion map to TNull, and are not checked.
+struct type_probe {
+	template <int T>
+	using tag = std::integral_constant<int, T>;
+
+	static tag<fmtarg::TNull> of(const fmtarg& v);
+	static tag<fmtarg::TPtr>  of(const void* v);
+	static tag<fmtarg::TCStr> of(const char* v);
+	static tag<fmtarg::TWStr> of(const wchar_t* v);
+	static tag<fmtarg::TCStr> of(const std::string& v);
+	static tag<fmtarg::TWStr> of(const std::wstring& v);
+#ifdef _MSC_VER
+	static tag<fmtarg::TI32> of(long v);
+	static tag<fmtarg::TU32> of(unsigned long v);
+	static tag<fmtarg::TI32> of(__int32 v);
+	static tag<fmtarg::TU32> of(unsigned __int32 v);
+	static tag<fmtarg::TI64> of(__int64 v);
+	static tag<fmtarg::TU64> of(unsigned __int64 v);
+#else
+	static tag<fmtarg::TI32> of(int v);
+	static tag<fmtarg::TU32> of(unsigned int v);
+#if LONG_MAX == 0x7fffffff
+	static tag<fmtarg::TI32> of(long v);
+	static tag<fmtarg::TU32> of(unsigned long v);
+#else
+	static tag<fmtarg::TI64> of(long v);
+	static tag<fmtarg::TU64> of(unsigned long v);
+#endif
+	static tag<fmtarg::TI64> of(long long v);
+	static tag<fmtarg::TU64> of(unsigned long long v);
+#endif
+	static tag<fmtarg::TDbl> of(double v);
+};
+
+template <typename T>
+constexpr int type_of() {
+	return decltype(type_probe::of(std::declval<const T&>()))::value;
+}
+
+// One token of a compiled format string, along with the literal text that precedes it
+struct fmt_op {
+	size_t LitStart;  // Literal text
+	size_t LitLen;    //
+	size_t SpecStart; // Position of the '%'
+	size_t SpecLen;   // Length of the token, from the '%' up to, but excluding, Type
+	char   Type;      // Conversion character, or '%' for an escaped percent sign, or 0 for the literal text after the final token
+};
+
+template <size_t N>
+struct fmt_program {
+	fmt_op Ops[N];
+	bool   Unterminated; // The format string ends with an incomplete token
+};
+
+enum class fmt_error {
+	None,
+	Unterminated,
+	BadToken,
+	BadSpec,
+	TypeMismatch,
+	TooFewArgs,
+	TooManyArgs,
+};
+
+// These are the characters that end a token in fmt_core
+constexpr bool is_type_char(char c) {
+	switch (c) {
+	case 'a':
+	case 'A':
+	case 'c':
+	case 'C':
+	case 'd':
+	case 'i':
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'g':
+	case 'G':
+	case 'H':
+	case 'o':
+	case 's':
+	case 'S':
+	case 'u':
+	case 'x':
+	case 'X':
+	case 'p':
+	case 'n':
+	case 'v':
+	case 'q':
+	case 'Q':
+		return true;
+	}
+	return false;
+}
+
+// Given the position of a '%', return the position of the character that ends the token (or the null terminator)
+constexpr size_t token_end(const char* fs, size_t i) {
+	for (i++; fs[i] != 0 && fs[i] != '%' && !is_type_char(fs[i]); i++) {
+	}
+	return i;
+}
+
+constexpr size_t count_tokens(const char* fs) {
+	size_t n = 0;
+	for (size_t i = 0; fs[i] != 0; i++) {
+		if (fs[i] != '%')
+			continue;
+		i = token_end(fs, i);
+		if (fs[i] == 0)
+			break;
+		n++;
+	}
+	return n;
+}
+
+template <size_t N>
+constexpr fmt_program<N> compile_format(const char* fs) {
+	fmt_program<N> p{};
+	size_t         nop = 0;
+	size_t         lit = 0;
+	size_t         i   = 0;
+	for (; fs[i] != 0; i++) {
+		if (fs[i] != '%')
+			continue;
+		size_t start = i;
+		i            = token_end(fs, i);
+		if (fs[i] == 0) {
+			p.Unterminated = true;
+			break;
+		}
+		p.Ops[nop++] = fmt_op{lit, start - lit, start, i - start, fs[i]};
+		lit          = i + 1;
+	}
+	p.Ops[nop] = fmt_op{lit, i - lit, 0, 0, 0};
+	return p;
+}
+
+constexpr fmt_error check_token(const char* spec, size_t specLen, char type, int argType) {
+	// Leave space in argbuf for the widest type prefix, the type, and the null terminator (see fmt_settype)
+	if (specLen + 5 > argbuf_arraysize)
+		return fmt_error::BadSpec;
+	for (size_t i = 1; i < specLen; i++) {
+		if (spec[i] == '*')
+			return fmt_error::BadSpec;
+	}
+	bool isStr  = argType == fmtarg::TCStr || argType == fmtarg::TWStr;
+	bool isInt  = argType == fmtarg::TI32 || argType == fmtarg::TU32 || argType == fmtarg::TI64 || argType == fmtarg::TU64;
+	bool isReal = argType == fmtarg::TDbl;
+	bool ok     = false;
+	switch (type) {
+	case 'v':
+		ok = true;
+		break;
+	case 's':
+	case 'S':
+		ok = isStr;
+		break;
+	case 'c':
+	case 'd':
+	case 'i':
+	case 'o':
+	case 'u':
+	case 'x':
+	case 'X':
+		ok = isInt;
+		break;
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A':
+		ok = isReal;
+		break;
+	case 'p':
+		ok = argType == fmtarg::TPtr;
+		break;
+	default:
+		// %n is never allowed, %q and %Q need a context, and %C and %H have no defined meaning
+		return fmt_error::BadToken;
+	}
+	if (argType == fmtarg::TNull)
+		ok = true;
+	return ok ? fmt_error::None : fmt_error::TypeMismatch;
+}
+
+template <size_t N>
+constexpr fmt_error check_format(const char* fs, const fmt_program<N>& p, const int* argTypes, size_t nargs) {
+	if (p.Unterminated)
+		return fmt_error::Unterminated;
+	size_t iarg = 0;
+	for (size_t i = 0; i < N; i++) {
+		const fmt_op& op = p.Ops[i];
+		if (op.Type == 0 || op.Type == '%')
+			continue;
+		if (iarg == nargs)
+			return fmt_error::TooFewArgs;
+		fmt_error e = check_token(fs + op.SpecStart, op.SpecLen, op.Type, argTypes[iarg++]);
+		if (e != fmt_error::None)
+			return e;
+	}
+	return iarg == nargs ? fmt_error::None : fmt_error::TooManyArgs;
+}
+
+// The compiled form of the format string F
+template <typename F>
+struct compiled {
+	static constexpr size_t              NumOps  = count_tokens(F::str) + 1;
+	static constexpr fmt_program<NumOps> Program = compile_format<NumOps>(F::str);
+};
+
+template <typename F>
+constexpr size_t compiled<F>::NumOps;
+
+template <typename F>
+constexpr fmt_program<compiled<F>::NumOps> compiled<F>::Program;
+
+// Append an integer, without going through snprintf
+template <typename TInt>
+void append_integer(std::string& out, TInt v) {
+	size_t pos = out.size();
+	out.resize(pos + 20);
+	out.resize(pos + format_integer<TInt, 10, false>(&out[pos], v));
+}
+
+// Append a single argument to out. If the token has no flags, then integers and strings are emitted directly.
+inline void append_arg(std::string& out, const char* spec, size_t specLen, char type, const fmtarg& arg) {
+	if (specLen == 1) {
+		switch (arg.Type) {
+		case fmtarg::TCStr:
+			if (type == 'v' || type == 's') {
+				out.append(arg.CStr);
+				return;
+			}
+			break;
+		case fmtarg::TI32:
+			if (type == 'v' || type == 'd' || type == 'i') {
+				append_integer<int32_t>(out, arg.I32);
+				return;
+			}
+			break;
+		case fmtarg::TU32:
+			if (type == 'v' || type == 'u') {
+				append_integer<uint32_t>(out, arg.UI32);
+				return;
+			}
+			break;
+		case fmtarg::TI64:
+			if (type == 'v' || type == 'd' || type == 'i') {
+				append_integer<int64_t>(out, arg.I64);
+				return;
+			}
+			break;
+		case fmtarg::TU64:
+			if (type == 'v' || type == 'u') {
+				append_integer<uint64_t>(out, arg.UI64);
+				return;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	// Everything else produces the same output as fmt_core
+	char argbuf[argbuf_arraysize];
+	memcpy(argbuf, spec, specLen);
+	const size_t MaxOutputSize = 1 * 1024 * 1024;
+	size_t       pos           = out.size();
+	size_t       outputSize    = 64;
+	while (true) {
+		out.resize(pos + outputSize);
+		int written = fmt_output_with_snprintf(&out[pos], type, argbuf, specLen, outputSize, &arg);
+		if (written >= 0 && (size_t) written < outputSize) {
+			out.resize(pos + written);
+			return;
+		} else if (outputSize >= MaxOutputSize) {
+			out.resize(pos);
+			return;
+		}
+		outputSize *= 2;
+	}
+}
+
+template <typename F, typename... Args>
+void fmt_compiled(std::string& out, const Args&... args) {
+	using P = compiled<F>;
+
+	const auto          num_args    = sizeof...(Args);
+	constexpr int       arg_types[] = {type_of<Args>()..., fmtarg::TNull}; // +1 for zero args case
+	constexpr fmt_error err         = check_format(F::str, P::Program, arg_types, num_args);
+	static_assert(err != fmt_error::Unterminated, "tsf: format string ends in the middle of a token");
+	static_assert(err != fmt_error::BadToken, "tsf: %n, %q, %Q, %C and %H are not supported in compile time format strings");
+	static_assert(err != fmt_error::BadSpec, "tsf: format token is too long, or uses '*'");
+	static_assert(err != fmt_error::TypeMismatch, "tsf: format token does not match the type of its argument");
+	static_assert(err != fmt_error::TooFewArgs, "tsf: more format tokens than arguments");
+	static_assert(err != fmt_error::TooManyArgs, "tsf: more arguments than format tokens");
+
+	fmtarg pack_array[num_args + 1]; // +1 for zero args case
+	fmt_pack(pack_array, args...);
+	const char* fs   = F::str;
+	size_t      iarg = 0;
+	for (size_t i = 0; i < P::NumOps; i++) {
+		const fmt_op& op = P::Program.Ops[i];
+		out.append(fs + op.LitStart, op.LitLen);
+		if (op.Type == '%')
+			out += '%';
+		else if (op.Type != 0)
+			append_arg(out, fs + op.SpecStart, op.SpecLen, op.Type, pack_array[iarg++]);
+	}
+}
+
+} // namespace internal
+
+// Format and return std::string, with a compile time format string
+template <char... Cs, typename... Args>
+std::string fmt(fmtstr<Cs...>, const Args&... args) {
+	std::string out;
+	internal::fmt_compiled<fmtstr<Cs...>>(out, args...);
+	return out;
+}
+
+// Format and append to out. If out has the capacity, then no memory allocation takes place.
+template <char... Cs, typename... Args>
+void fmt_buf(std::string& out, fmtstr<Cs...>, const Args&... args) {
+	internal::fmt_compiled<fmtstr<Cs...>>(out, args...);
+}
+
+// Format and append to out, with a runtime format string
+template <typename... Args>
+void fmt_buf(std::string& out, const char* fs, const Args&... args) {
+	static const size_t bufsize  = 256;
+	const auto          num_args = sizeof...(Args);
+	fmtarg              pack_array[num_args + 1]; // +1 for zero args case
+	internal::fmt_pack(pack_array, args...);
+	context    cx;
+	char       staticbuf[bufsize];
+	StrLenPair res = fmt_core(cx, fs, (ssize_t) num_args, pack_array, staticbuf, bufsize);
+	out.append(res.Str, res.Len);
+	if (res.Str != staticbuf)
+		delete[] res.Str;
+}
+
+// Format and write to FILE*, with a compile time format string
+template <char... Cs, typename... Args>
+size_t print(FILE* file, fmtstr<Cs...> fs, const Args&... args) {
+	auto res = fmt(fs, args...);
+	if (res.size() == 0)
+		return 0;
+	return fwrite(res.c_str(), 1, res.length(), file);
+}
+
+// Format and write to stdout, with a compile time format string
+template <char... Cs, typename... Args>
+size_t print(fmtstr<Cs...> fs, const Args&... args) {
+	return print(stdout, fs, args...);
+}
+
+namespace literals {
+
+#if defined(__GNUC__)
+// String literal operator templates are a GNU extension (supported by GCC and clang)
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wgnu-string-literal-operator-template"
+#else
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+template <typename CharT, CharT... Cs>
+constexpr fmtstr<Cs...> operator""_tsf() {
+	return {};
+}
+
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#else
+#pragma GCC diagnostic pop
+#endif
+#endif // __GNUC__
+
+} // namespace literals
+} // namespace tsf
+
 #endif // TSF_HPP_INCLUDED
\ No newline at end of file